@@ -7,8 +7,11 @@
 ------------------------------------------------------------------------
 
 local AC = require "avro.c"
+local ARC = require "avro.cache"
 local ACC = require "avro.constants"
 local AS = require "avro.schema"
+local ASD = require "avro.stream"
+local ASO = require "avro.single_object"
 local AW = require "avro.wrapper"
 
 local pairs = pairs
@@ -40,14 +43,41 @@ RecordSchema = AS.RecordSchema
 Schema = AS.Schema
 UnionSchema = AS.UnionSchema
 
+StreamDecoder = ASD.StreamDecoder
+
+SingleObjectDecoder = ASO.SingleObjectDecoder
+encode_single_object = ASO.encode_single_object
+single_object_fingerprint = ASO.fingerprint
+
+ResolverCache = ARC.ResolverCache
+resolver_cache = ARC.default
+
+Buffer = AC.Buffer
 ResolvedReader = AC.ResolvedReader
 ResolvedWriter = AC.ResolvedWriter
+export_arrow = AC.export_arrow
+file_header = AC.file_header
+free_arrow_structs = AC.free_arrow_structs
+new_arrow_structs = AC.new_arrow_structs
 open = AC.open
+open_memory = AC.open_memory
 raw_decode_value = AC.raw_decode_value
 raw_encode_value = AC.raw_encode_value
+raw_string = AC.raw_string
+scan = AC.scan
 raw_value = AC.raw_value
 wrapped_value = AC.wrapped_value
 
+-- Returns a ResolvedWriter or ResolvedReader for the given schemas from
+-- the process-wide resolver cache, creating it if needed.
+function resolved_writer(wschema, rschema)
+   return resolver_cache:writer(wschema, rschema)
+end
+
+function resolved_reader(wschema, rschema)
+   return resolver_cache:reader(wschema, rschema)
+end
+
 get_wrapper_class = AW.get_wrapper_class
 set_wrapper_class = AW.set_wrapper_class
 Wrapper = AW.Wrapper
@@ -0,0 +1,173 @@
+-- -*- coding: utf-8 -*-
+------------------------------------------------------------------------
+-- Copyright © 2011-2015, RedJack, LLC.
+-- All rights reserved.
+--
+-- Please see the COPYING file in this distribution for license details.
+------------------------------------------------------------------------
+
+local AC = require "avro.c"
+
+local error = error
+local setmetatable = setmetatable
+
+module "avro.cache"
+
+-- A ResolverCache holds on to ResolvedWriters and ResolvedReaders, so
+-- that you don't have to resolve the same pair of schemas over and over
+-- again.  Resolvers are keyed by the canonical forms of both schemas,
+-- so two equivalent schema objects share the same resolver.  The cache
+-- holds at most capacity resolvers; once it's full, adding a new
+-- resolver evicts the one that was used least recently.
+--
+--   local cache = ResolverCache:new(100)
+--   local resolver = cache:writer(writer_schema, reader_schema)
+--   resolver:decode(buf, dest)
+--
+-- The resolvers are shared, so you shouldn't hold on to one after
+-- you've finished with the message you needed it for.
+
+ResolverCache = {}
+ResolverCache.__mt = { __index=ResolverCache }
+
+local DEFAULT_CAPACITY = 256
+
+function ResolverCache:new(capacity)
+   capacity = capacity or DEFAULT_CAPACITY
+   if capacity < 1 then
+      error "Cache capacity must be positive"
+   end
+
+   -- The entries form a circular doubly-linked list, ordered from most
+   -- to least recently used, with head as a sentinel.
+   local head = {}
+   head.prev = head
+   head.next = head
+
+   local obj = {
+      capacity = capacity,
+      entries = {},
+      head = head,
+      size = 0,
+      hits = 0,
+      misses = 0,
+      evictions = 0,
+   }
+   return setmetatable(obj, self.__mt)
+end
+
+local function unlink(entry)
+   entry.prev.next = entry.next
+   entry.next.prev = entry.prev
+end
+
+local function push_front(head, entry)
+   entry.prev = head
+   entry.next = head.next
+   head.next.prev = entry
+   head.next = entry
+end
+
+function ResolverCache:evict()
+   local entry = self.head.prev
+   unlink(entry)
+   self.entries[entry.key] = nil
+   self.size = self.size - 1
+   self.evictions = self.evictions + 1
+end
+
+-- Returns the cached resolver for key, creating it with
+-- constructor(wschema, rschema) if we don't have one yet.  If the
+-- schemas can't be resolved, we return nil and an error message, and
+-- don't cache anything.
+function ResolverCache:lookup(key, constructor, wschema, rschema)
+   local entry = self.entries[key]
+   if entry then
+      self.hits = self.hits + 1
+      unlink(entry)
+      push_front(self.head, entry)
+      return entry.resolver
+   end
+
+   self.misses = self.misses + 1
+   local resolver, err = constructor(wschema, rschema)
+   if not resolver then return nil, err end
+
+   if self.size >= self.capacity then
+      self:evict()
+   end
+   entry = { key=key, resolver=resolver }
+   self.entries[key] = entry
+   push_front(self.head, entry)
+   self.size = self.size + 1
+   return resolver
+end
+
+-- Removes the resolver for key from the cache, if it's there.
+function ResolverCache:remove(key)
+   local entry = self.entries[key]
+   if entry then
+      unlink(entry)
+      self.entries[key] = nil
+      self.size = self.size - 1
+   end
+end
+
+local function schema_key(kind, wschema, rschema)
+   return kind.."\0"..wschema:canonical_form()..
+          "\0"..rschema:canonical_form()
+end
+
+-- Returns a ResolvedWriter for the given schemas.
+function ResolverCache:writer(wschema, rschema)
+   rschema = rschema or wschema
+   return self:lookup(schema_key("w", wschema, rschema),
+                      AC.ResolvedWriter, wschema, rschema)
+end
+
+-- Returns a ResolvedReader for the given schemas.
+function ResolverCache:reader(wschema, rschema)
+   rschema = rschema or wschema
+   return self:lookup(schema_key("r", wschema, rschema),
+                      AC.ResolvedReader, wschema, rschema)
+end
+
+-- Returns a table with the number of resolvers in the cache, its
+-- capacity, and the number of hits, misses, and evictions so far.
+function ResolverCache:stats()
+   return {
+      size = self.size,
+      capacity = self.capacity,
+      hits = self.hits,
+      misses = self.misses,
+      evictions = self.evictions,
+   }
+end
+
+-- Changes the capacity of the cache, evicting resolvers if there are
+-- now too many.
+function ResolverCache:set_capacity(capacity)
+   if capacity < 1 then
+      error "Cache capacity must be positive"
+   end
+   self.capacity = capacity
+   while self.size > capacity do
+      self:evict()
+   end
+end
+
+-- Removes all of the resolvers from the cache, and resets its counters.
+function ResolverCache:clear()
+   local head = self.head
+   head.prev = head
+   head.next = head
+   self.entries = {}
+   self.size = 0
+   self.hits = 0
+   self.misses = 0
+   self.evictions = 0
+end
+
+-- A process-wide cache, used by avro.resolved_writer and
+-- avro.resolved_reader.
+default = ResolverCache:new()
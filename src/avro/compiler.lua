@@ -0,0 +1,993 @@
+-- -*- coding: utf-8 -*-
+------------------------------------------------------------------------
+-- Copyright © 2011-2015, RedJack, LLC.
+-- All rights reserved.
+--
+-- Please see the COPYING file in this distribution for license details.
+------------------------------------------------------------------------
+
+local ACC = require "avro.constants"
+
+local error = error
+local ipairs = ipairs
+local loadstring = loadstring
+local math = math
+local next = next
+local pairs = pairs
+local setmetatable = setmetatable
+local string = string
+local table = table
+local tostring = tostring
+local type = type
+
+local ffi_present, ffi = pcall(require, "ffi")
+
+module "avro.compiler"
+
+-- This module compiles an avro.schema schema into specialized Lua
+-- functions that decode and encode the Avro binary encoding of that
+-- schema.  We walk the schema once, generate the source of a function
+-- that reads or writes each field in order, and load it.  The compiled
+-- functions don't go through the Avro C library at all; they convert
+-- directly between Lua strings and plain Lua values, using the same
+-- "AST" representation that Value:set_from_ast() accepts:
+--
+--   boolean, int, long, float, double   Lua booleans and numbers
+--   string, bytes, fixed                Lua strings
+--   null                                nil
+--   enum                                the symbol name
+--   array, map, record                  Lua tables
+--   union                               nil for the null branch, or a
+--                                       single-element table whose key
+--                                       is the name of the branch
+--
+-- Longs are represented as Lua numbers, so they lose precision outside
+-- of ±2^53.
+--
+-- Compiling a decoder gives you a function:
+--
+--   ast, next_pos = decoder(buf, pos)
+--
+-- which decodes one value from buf, starting at the (1-based) offset
+-- pos, which defaults to 1.  It returns the decoded value, and the
+-- offset of the first byte after it.
+--
+-- Compiling an encoder gives you a function:
+--
+--   buf = encoder(ast)
+--
+-- which returns the binary encoding of ast as a Lua string.  The
+-- encoder writes into an internal buffer of string pieces that is
+-- reused from call to call, and raises an error if ast doesn't match
+-- the schema.
+
+local byte = string.byte
+local char = string.char
+local concat = table.concat
+local floor = math.floor
+local format = string.format
+local frexp = math.frexp
+local huge = math.huge
+local ldexp = math.ldexp
+local sub = string.sub
+
+
+------------------------------------------------------------------------
+-- Decoding primitives
+
+local function truncated()
+   error "Truncated Avro binary encoding"
+end
+
+local function read_long(buf, pos)
+   local b = byte(buf, pos)
+   if not b then truncated() end
+
+   -- Fast path for single-byte values
+   if b < 128 then
+      if b % 2 == 0 then
+         return b / 2, pos + 1
+      else
+         return -(b + 1) / 2, pos + 1
+      end
+   end
+
+   local result = b - 128
+   local scale = 128
+   repeat
+      pos = pos + 1
+      b = byte(buf, pos)
+      if not b then truncated() end
+      result = result + (b % 128) * scale
+      scale = scale * 128
+   until b < 128
+
+   -- Undo the zig-zag encoding
+   if result % 2 == 0 then
+      return result / 2, pos + 1
+   else
+      return -(result + 1) / 2, pos + 1
+   end
+end
+
+local function read_boolean(buf, pos)
+   local b = byte(buf, pos)
+   if not b then truncated() end
+   return b ~= 0, pos + 1
+end
+
+local function read_string(buf, pos)
+   local len
+   len, pos = read_long(buf, pos)
+   local next_pos = pos + len
+   if len < 0 or next_pos - 1 > #buf then truncated() end
+   return sub(buf, pos, next_pos - 1), next_pos
+end
+
+local function read_fixed(buf, pos, size)
+   local next_pos = pos + size
+   if next_pos - 1 > #buf then truncated() end
+   return sub(buf, pos, next_pos - 1), next_pos
+end
+
+local function skip_long(buf, pos)
+   local b
+   repeat
+      b = byte(buf, pos)
+      if not b then truncated() end
+      pos = pos + 1
+   until b < 128
+   return pos
+end
+
+local function skip_string(buf, pos)
+   local len
+   len, pos = read_long(buf, pos)
+   if len < 0 then truncated() end
+   return pos + len
+end
+
+local read_float, read_double
+
+if ffi_present and ffi.abi("le") then
+   -- Let the FFI reinterpret the bytes for us.  We copy them into a
+   -- scratch buffer first so that we don't depend on the alignment of
+   -- the string contents.
+   local float_buf = ffi.new("float[1]")
+   local double_buf = ffi.new("double[1]")
+   local char_p = ffi.typeof("const char *")
+
+   function read_float(buf, pos)
+      if pos + 3 > #buf then truncated() end
+      ffi.copy(float_buf, ffi.cast(char_p, buf) + (pos - 1), 4)
+      return float_buf[0], pos + 4
+   end
+
+   function read_double(buf, pos)
+      if pos + 7 > #buf then truncated() end
+      ffi.copy(double_buf, ffi.cast(char_p, buf) + (pos - 1), 8)
+      return double_buf[0], pos + 8
+   end
+
+else
+   -- Otherwise we have to take the IEEE 754 encoding apart by hand.
+
+   function read_float(buf, pos)
+      local b1, b2, b3, b4 = byte(buf, pos, pos + 3)
+      if not b4 then truncated() end
+      local sign = b4 >= 128 and -1 or 1
+      local exponent = (b4 % 128) * 2 + floor(b3 / 128)
+      local mantissa = ((b3 % 128) * 256 + b2) * 256 + b1
+      if exponent == 0 then
+         return sign * ldexp(mantissa, -149), pos + 4
+      elseif exponent == 255 then
+         if mantissa == 0 then
+            return sign * huge, pos + 4
+         else
+            return 0/0, pos + 4
+         end
+      end
+      return sign * ldexp(mantissa + 8388608, exponent - 150), pos + 4
+   end
+
+   function read_double(buf, pos)
+      local b1, b2, b3, b4, b5, b6, b7, b8 = byte(buf, pos, pos + 7)
+      if not b8 then truncated() end
+      local sign = b8 >= 128 and -1 or 1
+      local exponent = (b8 % 128) * 16 + floor(b7 / 16)
+      local mantissa =
+         ((((((b7 % 16) * 256 + b6) * 256 + b5) * 256 + b4)
+             * 256 + b3) * 256 + b2) * 256 + b1
+      if exponent == 0 then
+         return sign * ldexp(mantissa, -1074), pos + 8
+      elseif exponent == 2047 then
+         if mantissa == 0 then
+            return sign * huge, pos + 8
+         else
+            return 0/0, pos + 8
+         end
+      end
+      return sign * ldexp(mantissa + 4503599627370496, exponent - 1075),
+             pos + 8
+   end
+end
+
+
+------------------------------------------------------------------------
+-- Encoding primitives
+
+-- Each of these functions appends the encoding of a value to out, which
+-- is a table of string pieces that currently contains n entries.  They
+-- return the new number of entries.
+
+local CHARS = {}
+for i = 0, 255 do
+   CHARS[i] = char(i)
+end
+
+local function mismatch(expected, value)
+   error("Expected "..expected..", got "..type(value))
+end
+
+local function write_long(out, n, v)
+   if type(v) ~= "number" then mismatch("an integer", v) end
+   if v % 1 ~= 0 then error("Expected an integer, got "..v) end
+
+   -- Zig-zag encode, then write out seven bits at a time
+   local z
+   if v >= 0 then
+      z = v * 2
+   else
+      z = -v * 2 - 1
+   end
+   while z >= 128 do
+      n = n + 1
+      out[n] = CHARS[z % 128 + 128]
+      z = floor(z / 128)
+   end
+   n = n + 1
+   out[n] = CHARS[z]
+   return n
+end
+
+local function write_int(out, n, v)
+   if type(v) == "number" and (v < -2147483648 or v >= 2147483648) then
+      error("Expected a 32-bit integer, got "..v)
+   end
+   return write_long(out, n, v)
+end
+
+-- Returns the encoding of a long as a string.  We use this at compile
+-- time for union discriminants and enum indices.
+local function encode_long(v)
+   local out = {}
+   local n = write_long(out, 0, v)
+   return concat(out, "", 1, n)
+end
+
+local function write_boolean(out, n, v)
+   if type(v) ~= "boolean" then mismatch("a boolean", v) end
+   n = n + 1
+   out[n] = v and "\001" or "\000"
+   return n
+end
+
+local function write_string(out, n, v)
+   if type(v) ~= "string" then mismatch("a string", v) end
+   n = write_long(out, n, #v)
+   n = n + 1
+   out[n] = v
+   return n
+end
+
+local function write_fixed(out, n, v, size)
+   if type(v) ~= "string" then mismatch("a string", v) end
+   if #v ~= size then
+      error("Expected a fixed value of size "..size..", got "..#v)
+   end
+   n = n + 1
+   out[n] = v
+   return n
+end
+
+local write_float, write_double
+
+if ffi_present and ffi.abi("le") then
+   local float_buf = ffi.new("float[1]")
+   local double_buf = ffi.new("double[1]")
+
+   function write_float(out, n, v)
+      if type(v) ~= "number" then mismatch("a number", v) end
+      float_buf[0] = v
+      n = n + 1
+      out[n] = ffi.string(float_buf, 4)
+      return n
+   end
+
+   function write_double(out, n, v)
+      if type(v) ~= "number" then mismatch("a number", v) end
+      double_buf[0] = v
+      n = n + 1
+      out[n] = ffi.string(double_buf, 8)
+      return n
+   end
+
+else
+   function write_float(out, n, v)
+      if type(v) ~= "number" then mismatch("a number", v) end
+      local sign = 0
+      if v < 0 or (v == 0 and 1/v < 0) then
+         sign = 128
+         v = -v
+      end
+
+      local exponent, mantissa
+      if v ~= v then
+         sign, exponent, mantissa = 0, 255, 4194304
+      elseif v == huge then
+         exponent, mantissa = 255, 0
+      elseif v == 0 then
+         exponent, mantissa = 0, 0
+      else
+         local m, e = frexp(v)
+         exponent = e + 126
+         if exponent >= 255 then
+            exponent, mantissa = 255, 0
+         elseif exponent <= 0 then
+            exponent, mantissa = 0, floor(ldexp(m, e + 149) + 0.5)
+         else
+            mantissa = floor(ldexp(m, 24) + 0.5) - 8388608
+         end
+      end
+
+      -- If rounding the mantissa carried, adding the two together
+      -- moves the carry into the exponent, which is what we want.
+      local bits = exponent * 8388608 + mantissa
+      n = n + 1
+      out[n] = char(bits % 256,
+                    floor(bits / 256) % 256,
+                    floor(bits / 65536) % 256,
+                    sign + floor(bits / 16777216))
+      return n
+   end
+
+   function write_double(out, n, v)
+      if type(v) ~= "number" then mismatch("a number", v) end
+      local sign = 0
+      if v < 0 or (v == 0 and 1/v < 0) then
+         sign = 128
+         v = -v
+      end
+
+      local exponent, mantissa
+      if v ~= v then
+         sign, exponent, mantissa = 0, 2047, 2251799813685248
+      elseif v == huge then
+         exponent, mantissa = 2047, 0
+      elseif v == 0 then
+         exponent, mantissa = 0, 0
+      else
+         local m, e = frexp(v)
+         exponent = e + 1022
+         if exponent <= 0 then
+            exponent, mantissa = 0, ldexp(m, e + 1074)
+         else
+            mantissa = ldexp(m, 53) - 4503599627370496
+         end
+      end
+
+      local high = floor(mantissa / 4294967296)
+      local low = mantissa % 4294967296
+      n = n + 1
+      out[n] = char(low % 256,
+                    floor(low / 256) % 256,
+                    floor(low / 65536) % 256,
+                    floor(low / 16777216),
+                    high % 256,
+                    floor(high / 256) % 256,
+                    (exponent % 16) * 16 + floor(high / 65536),
+                    sign + floor(exponent / 16))
+      return n
+   end
+end
+
+
+------------------------------------------------------------------------
+-- Code generation
+
+-- Holds the state of a single compilation: the lines of source that
+-- we've generated so far, the constants that the generated code needs
+-- access to, and the functions that we've generated for each named
+-- record.  Constants and record functions are passed into the compiled
+-- chunk as tables (K and F) rather than as individual upvalues, since
+-- Lua limits the number of upvalues that a function can have.
+
+local Compiler = {}
+Compiler.__index = Compiler
+
+-- The helpers parameter is a table of the primitive functions that the
+-- generated code can call; each one is made available to the code as a
+-- local variable of the same name.
+
+local function new_compiler(helpers)
+   local obj = {
+      helpers = helpers,
+      lines = {},
+      definitions = {},
+      constants = {},
+      functions = {},
+      function_count = 0,
+      var_count = 0,
+   }
+   return setmetatable(obj, Compiler)
+end
+
+function Compiler:emit(...)
+   table.insert(self.lines, format(...))
+end
+
+function Compiler:var(prefix)
+   self.var_count = self.var_count + 1
+   return prefix .. self.var_count
+end
+
+function Compiler:constant(value)
+   table.insert(self.constants, value)
+   return "K[" .. #self.constants .. "]"
+end
+
+-- Each record gets its own function, which lets us handle recursive
+-- schemas.  We only generate the function for a given record once,
+-- even if it appears several times in the schema.  (A record might
+-- need a few different functions, though, such as one that decodes it
+-- and one that skips over it; variant distinguishes them.)  The
+-- definitions of these functions go at the top of the compiled chunk,
+-- before any code that calls them.
+function Compiler:record_function(schema, variant, generate)
+   local variants = self.functions[schema]
+   if not variants then
+      variants = {}
+      self.functions[schema] = variants
+   end
+
+   local name = variants[variant]
+   if name then return name end
+
+   self.function_count = self.function_count + 1
+   name = "F[" .. self.function_count .. "]"
+   variants[variant] = name
+
+   local saved_lines = self.lines
+   self.lines = {}
+   generate(self, name)
+   local body = self.lines
+   self.lines = saved_lines
+   for _, line in ipairs(body) do
+      table.insert(self.definitions, line)
+   end
+   return name
+end
+
+function Compiler:load(chunk_name, entry)
+   local K = self.constants
+   local header = { "local K, F = ..." }
+   local helper_names = {}
+   for name in pairs(self.helpers) do
+      table.insert(helper_names, name)
+   end
+   table.sort(helper_names)
+   for _, name in ipairs(helper_names) do
+      table.insert(header, format("local %s = K.%s", name, name))
+      K[name] = self.helpers[name]
+   end
+
+   local source =
+      table.concat(header, "\n") .. "\n" ..
+      table.concat(self.definitions, "\n") .. "\n" ..
+      table.concat(self.lines, "\n") .. "\n" ..
+      "return " .. entry .. "\n"
+
+   local chunk, err = loadstring(source, "=" .. chunk_name)
+   if not chunk then
+      error("Cannot compile Avro schema: " .. err)
+   end
+   return chunk(K, {})
+end
+
+
+------------------------------------------------------------------------
+-- Skipping
+
+-- Returns the number of bytes that every value of the given schema
+-- takes up, or nil if values can have different sizes.
+local function fixed_width(schema, visiting)
+   local schema_type = schema:type()
+   if schema_type == ACC.NULL then
+      return 0
+   elseif schema_type == ACC.BOOLEAN then
+      return 1
+   elseif schema_type == ACC.FLOAT then
+      return 4
+   elseif schema_type == ACC.DOUBLE then
+      return 8
+   elseif schema_type == ACC.FIXED then
+      return schema.fixed_size
+   elseif schema_type == ACC.RECORD then
+      -- Guard against recursive records, which can't be fixed width.
+      visiting = visiting or {}
+      if visiting[schema] then return nil end
+      visiting[schema] = true
+      local total = 0
+      for _, field in ipairs(schema.fields) do
+         local _, field_schema = next(field)
+         local width = fixed_width(field_schema, visiting)
+         if not width then
+            total = nil
+            break
+         end
+         total = total + width
+      end
+      visiting[schema] = nil
+      return total
+   else
+      return nil
+   end
+end
+
+local skip_over
+
+local function skip_record_function(c, schema, name)
+   c:emit("%s = function(buf, pos)", name)
+   for _, field in ipairs(schema.fields) do
+      local _, field_schema = next(field)
+      skip_over(c, field_schema)
+   end
+   c:emit("return pos")
+   c:emit("end")
+end
+
+-- Generates code that skips over a value of the given schema in buf,
+-- advancing pos past it without decoding it.  Strings and bytes are
+-- skipped using their length prefixes, and array and map blocks that
+-- include their size in bytes are skipped all at once.  Skipping past
+-- the end of buf doesn't raise an error right away; the decoder checks
+-- that it hasn't gone past the end once it's done.
+function skip_over(c, schema)
+   local schema_type = schema:type()
+   local width = fixed_width(schema)
+
+   if width then
+      if width > 0 then
+         c:emit("pos = pos + %d", width)
+      end
+
+   elseif schema_type == ACC.INT
+       or schema_type == ACC.LONG
+       or schema_type == ACC.ENUM then
+      c:emit("pos = skip_long(buf, pos)")
+
+   elseif schema_type == ACC.STRING or schema_type == ACC.BYTES then
+      c:emit("pos = skip_string(buf, pos)")
+
+   elseif schema_type == ACC.ARRAY or schema_type == ACC.MAP then
+      local child_schema = schema.item_schema or schema.value_schema
+      local child_width = fixed_width(child_schema)
+      local count = c:var("c")
+      c:emit("do")
+      c:emit("local %s", count)
+      c:emit("%s, pos = read_long(buf, pos)", count)
+      c:emit("while %s ~= 0 do", count)
+      c:emit("if %s < 0 then", count)
+      c:emit("local size; size, pos = read_long(buf, pos)")
+      c:emit("if size < 0 then error(\"Invalid block size \"..size) end")
+      c:emit("pos = pos + size")
+      if schema_type == ACC.ARRAY and child_width then
+         c:emit("else")
+         c:emit("pos = pos + %s * %d", count, child_width)
+      else
+         c:emit("else")
+         c:emit("for _ = 1, %s do", count)
+         if schema_type == ACC.MAP then
+            c:emit("pos = skip_string(buf, pos)")
+         end
+         skip_over(c, child_schema)
+         c:emit("end")
+      end
+      c:emit("end")
+      c:emit("%s, pos = read_long(buf, pos)", count)
+      c:emit("end")
+      c:emit("end")
+
+   elseif schema_type == ACC.UNION then
+      local discriminant = c:var("d")
+      c:emit("do")
+      c:emit("local %s", discriminant)
+      c:emit("%s, pos = read_long(buf, pos)", discriminant)
+      for i, branch in ipairs(schema.branches) do
+         c:emit("%s %s == %d then",
+                i == 1 and "if" or "elseif", discriminant, i-1)
+         skip_over(c, branch)
+      end
+      c:emit("else")
+      c:emit("error(\"Invalid union discriminant \"..%s)", discriminant)
+      c:emit("end")
+      c:emit("end")
+
+   elseif schema_type == ACC.RECORD then
+      local f = c:record_function(schema, "skip", function(c, name)
+         skip_record_function(c, schema, name)
+      end)
+      c:emit("pos = %s(buf, pos)", f)
+
+   else
+      error("Don't know how to compile a skipper for schema type "..
+            tostring(schema_type))
+   end
+end
+
+
+------------------------------------------------------------------------
+-- Decoders
+
+-- Decoders are compiled from a writer schema, which describes the
+-- binary data, and a reader schema, which describes the AST that we
+-- produce.  The reader schema must be a projection of the writer
+-- schema (see Schema:project): each of its records contains a subset
+-- of the fields of the corresponding writer record.  Writer fields
+-- that aren't in the reader schema are skipped over, and never
+-- decoded.
+
+local decode_into
+
+local function decode_record_function(c, wschema, rschema, name)
+   c:emit("%s = function(buf, pos)", name)
+   c:emit("local r = {}")
+   for _, field in ipairs(wschema.fields) do
+      local field_name, wfield_schema = next(field)
+      local rfield_schema = rschema:get(field_name)
+      if rfield_schema then
+         decode_into(c, wfield_schema, rfield_schema,
+                     format("r[%q]", field_name))
+      else
+         skip_over(c, wfield_schema)
+      end
+   end
+   c:emit("return r, pos")
+   c:emit("end")
+end
+
+-- Generates code that decodes a value of the given schema from buf at
+-- offset pos, assigns it to the Lua lvalue dest, and advances pos.
+function decode_into(c, wschema, rschema, dest)
+   local schema_type = wschema:type()
+   if rschema:type() ~= schema_type then
+      error("Reader schema isn't a projection of the writer schema")
+   end
+
+   if schema_type == ACC.NULL then
+      c:emit("%s = nil", dest)
+
+   elseif schema_type == ACC.BOOLEAN then
+      c:emit("%s, pos = read_boolean(buf, pos)", dest)
+
+   elseif schema_type == ACC.INT or schema_type == ACC.LONG then
+      c:emit("%s, pos = read_long(buf, pos)", dest)
+
+   elseif schema_type == ACC.FLOAT then
+      c:emit("%s, pos = read_float(buf, pos)", dest)
+
+   elseif schema_type == ACC.DOUBLE then
+      c:emit("%s, pos = read_double(buf, pos)", dest)
+
+   elseif schema_type == ACC.STRING or schema_type == ACC.BYTES then
+      c:emit("%s, pos = read_string(buf, pos)", dest)
+
+   elseif schema_type == ACC.FIXED then
+      c:emit("%s, pos = read_fixed(buf, pos, %d)", dest, wschema.fixed_size)
+
+   elseif schema_type == ACC.ENUM then
+      local symbols = {}
+      for i, symbol in ipairs(wschema.symbols) do
+         symbols[i-1] = symbol
+      end
+      local symbols_k = c:constant(symbols)
+      local index = c:var("e")
+      c:emit("do")
+      c:emit("local %s", index)
+      c:emit("%s, pos = read_long(buf, pos)", index)
+      c:emit("%s = %s[%s]", dest, symbols_k, index)
+      c:emit("if %s == nil then error(\"Invalid enum index \"..%s) end",
+             dest, index)
+      c:emit("end")
+
+   elseif schema_type == ACC.ARRAY or schema_type == ACC.MAP then
+      -- Arrays and maps are both encoded as a series of blocks, each
+      -- starting with a count.  A negative count is followed by the
+      -- size of the block in bytes, which we don't need.
+      local result = c:var("a")
+      local count = c:var("c")
+      local n = c:var("n")
+      c:emit("do")
+      c:emit("local %s, %s, %s = {}, 0", result, n, count)
+      c:emit("%s, pos = read_long(buf, pos)", count)
+      c:emit("while %s ~= 0 do", count)
+      c:emit("if %s < 0 then", count)
+      c:emit("%s = -%s", count, count)
+      c:emit("local _; _, pos = read_long(buf, pos)")
+      c:emit("end")
+      c:emit("for _ = 1, %s do", count)
+      if schema_type == ACC.ARRAY then
+         c:emit("%s = %s + 1", n, n)
+         decode_into(c, wschema.item_schema, rschema.item_schema,
+                     format("%s[%s]", result, n))
+      else
+         local key = c:var("k")
+         c:emit("local %s", key)
+         c:emit("%s, pos = read_string(buf, pos)", key)
+         decode_into(c, wschema.value_schema, rschema.value_schema,
+                     format("%s[%s]", result, key))
+      end
+      c:emit("end")
+      c:emit("%s, pos = read_long(buf, pos)", count)
+      c:emit("end")
+      c:emit("%s = %s", dest, result)
+      c:emit("end")
+
+   elseif schema_type == ACC.UNION then
+      local discriminant = c:var("d")
+      c:emit("do")
+      c:emit("local %s", discriminant)
+      c:emit("%s, pos = read_long(buf, pos)", discriminant)
+      for i, wbranch in ipairs(wschema.branches) do
+         local branch_name = wbranch:name()
+         local rindex = rschema.indices_by_name[branch_name]
+         if not rindex then
+            error("Reader schema doesn't have union branch "..branch_name)
+         end
+         local rbranch = rschema.branches[rindex]
+
+         c:emit("%s %s == %d then",
+                i == 1 and "if" or "elseif", discriminant, i-1)
+         if wbranch:type() == ACC.NULL then
+            c:emit("%s = nil", dest)
+         else
+            local result = c:var("b")
+            c:emit("local %s = {}", result)
+            decode_into(c, wbranch, rbranch,
+                        format("%s[%q]", result, branch_name))
+            c:emit("%s = %s", dest, result)
+         end
+      end
+      c:emit("else")
+      c:emit("error(\"Invalid union discriminant \"..%s)", discriminant)
+      c:emit("end")
+      c:emit("end")
+
+   elseif schema_type == ACC.RECORD then
+      local f = c:record_function(wschema, rschema, function(c, name)
+         decode_record_function(c, wschema, rschema, name)
+      end)
+      c:emit("%s, pos = %s(buf, pos)", dest, f)
+
+   else
+      error("Don't know how to compile a decoder for schema type "..
+            tostring(schema_type))
+   end
+end
+
+local DECODE_HELPERS = {
+   error = error,
+   read_boolean = read_boolean,
+   read_double = read_double,
+   read_fixed = read_fixed,
+   read_float = read_float,
+   read_long = read_long,
+   read_string = read_string,
+   skip_long = skip_long,
+   skip_string = skip_string,
+   truncated = truncated,
+}
+
+-- Compiles a decoder function for the given avro.schema writer schema.
+-- If you provide a reader schema, it must be a projection of the writer
+-- schema.
+function decoder(wschema, rschema)
+   local c = new_compiler(DECODE_HELPERS)
+   c:emit("local decode = function(buf, pos)")
+   c:emit("local result")
+   decode_into(c, wschema, rschema or wschema, "result")
+   c:emit("if pos - 1 > #buf then truncated() end")
+   c:emit("return result, pos")
+   c:emit("end")
+   c:emit("local entry = function(buf, pos)")
+   c:emit("return decode(buf, pos or 1)")
+   c:emit("end")
+   return c:load("avro.compiler.decoder", "entry")
+end
+
+
+------------------------------------------------------------------------
+-- Encoders
+
+local encode_from
+
+local function encode_record_function(c, schema, name)
+   c:emit("%s = function(out, n, r)", name)
+   c:emit("if type(r) ~= \"table\" then mismatch(\"a record\", r) end")
+   for _, field in ipairs(schema.fields) do
+      local field_name, field_schema = next(field)
+      encode_from(c, field_schema, format("r[%q]", field_name))
+   end
+   c:emit("return n")
+   c:emit("end")
+end
+
+-- Generates code that appends the encoding of the Lua value src, which
+-- must match the given schema, to out, and advances n.
+function encode_from(c, schema, src)
+   local schema_type = schema:type()
+
+   if schema_type == ACC.NULL then
+      -- Nothing to write
+
+   elseif schema_type == ACC.BOOLEAN then
+      c:emit("n = write_boolean(out, n, %s)", src)
+
+   elseif schema_type == ACC.INT then
+      c:emit("n = write_int(out, n, %s)", src)
+
+   elseif schema_type == ACC.LONG then
+      c:emit("n = write_long(out, n, %s)", src)
+
+   elseif schema_type == ACC.FLOAT then
+      c:emit("n = write_float(out, n, %s)", src)
+
+   elseif schema_type == ACC.DOUBLE then
+      c:emit("n = write_double(out, n, %s)", src)
+
+   elseif schema_type == ACC.STRING or schema_type == ACC.BYTES then
+      c:emit("n = write_string(out, n, %s)", src)
+
+   elseif schema_type == ACC.FIXED then
+      c:emit("n = write_fixed(out, n, %s, %d)", src, schema.fixed_size)
+
+   elseif schema_type == ACC.ENUM then
+      -- We precompute the encoding of each symbol's index.
+      local encodings = {}
+      for i, symbol in ipairs(schema.symbols) do
+         encodings[symbol] = encode_long(i-1)
+      end
+      local encodings_k = c:constant(encodings)
+      local encoded = c:var("e")
+      c:emit("do")
+      c:emit("local %s = %s[%s]", encoded, encodings_k, src)
+      c:emit("if %s == nil then error(\"Invalid enum symbol \"..tostring(%s)) end",
+             encoded, src)
+      c:emit("n = n + 1")
+      c:emit("out[n] = %s", encoded)
+      c:emit("end")
+
+   elseif schema_type == ACC.ARRAY then
+      -- We write arrays out as a single block.
+      local array = c:var("a")
+      local count = c:var("c")
+      local i = c:var("i")
+      c:emit("do")
+      c:emit("local %s = %s", array, src)
+      c:emit("if type(%s) ~= \"table\" then mismatch(\"an array\", %s) end",
+             array, array)
+      c:emit("local %s = #%s", count, array)
+      c:emit("if %s > 0 then", count)
+      c:emit("n = write_long(out, n, %s)", count)
+      c:emit("for %s = 1, %s do", i, count)
+      encode_from(c, schema.item_schema, format("%s[%s]", array, i))
+      c:emit("end")
+      c:emit("end")
+      c:emit("n = n + 1")
+      c:emit("out[n] = \"\\000\"")
+      c:emit("end")
+
+   elseif schema_type == ACC.MAP then
+      -- Same for maps, but we have to count the entries first.
+      local map = c:var("m")
+      local count = c:var("c")
+      local key = c:var("k")
+      local value = c:var("v")
+      c:emit("do")
+      c:emit("local %s = %s", map, src)
+      c:emit("if type(%s) ~= \"table\" then mismatch(\"a map\", %s) end",
+             map, map)
+      c:emit("local %s = 0", count)
+      c:emit("for _ in pairs(%s) do %s = %s + 1 end", map, count, count)
+      c:emit("if %s > 0 then", count)
+      c:emit("n = write_long(out, n, %s)", count)
+      c:emit("for %s, %s in pairs(%s) do", key, value, map)
+      c:emit("n = write_string(out, n, %s)", key)
+      encode_from(c, schema.value_schema, value)
+      c:emit("end")
+      c:emit("end")
+      c:emit("n = n + 1")
+      c:emit("out[n] = \"\\000\"")
+      c:emit("end")
+
+   elseif schema_type == ACC.UNION then
+      local union = c:var("u")
+      local branch = c:var("b")
+      local value = c:var("v")
+      local null_index
+      c:emit("do")
+      c:emit("local %s = %s", union, src)
+      c:emit("if %s ~= nil then", union)
+      c:emit("if type(%s) ~= \"table\" then mismatch(\"a union\", %s) end",
+             union, union)
+      c:emit("local %s, %s = next(%s)", branch, value, union)
+      local first = true
+      for i, branch_schema in ipairs(schema.branches) do
+         if branch_schema:type() == ACC.NULL then
+            null_index = i-1
+         else
+            c:emit("%s %s == %q then",
+                   first and "if" or "elseif", branch, branch_schema:name())
+            first = false
+            c:emit("n = n + 1")
+            c:emit("out[n] = %q", encode_long(i-1))
+            encode_from(c, branch_schema, value)
+         end
+      end
+      if first then
+         c:emit("error(\"Invalid union branch \"..tostring(%s))", branch)
+      else
+         c:emit("else")
+         c:emit("error(\"Invalid union branch \"..tostring(%s))", branch)
+         c:emit("end")
+      end
+      c:emit("else")
+      if null_index then
+         c:emit("n = n + 1")
+         c:emit("out[n] = %q", encode_long(null_index))
+      else
+         c:emit("error(\"Union doesn't have a null branch\")")
+      end
+      c:emit("end")
+      c:emit("end")
+
+   elseif schema_type == ACC.RECORD then
+      local f = c:record_function(schema, "encode", function(c, name)
+         encode_record_function(c, schema, name)
+      end)
+      c:emit("n = %s(out, n, %s)", f, src)
+
+   else
+      error("Don't know how to compile an encoder for schema type "..
+            tostring(schema_type))
+   end
+end
+
+local ENCODE_HELPERS = {
+   concat = concat,
+   error = error,
+   mismatch = mismatch,
+   next = next,
+   pairs = pairs,
+   tostring = tostring,
+   type = type,
+   write_boolean = write_boolean,
+   write_double = write_double,
+   write_fixed = write_fixed,
+   write_float = write_float,
+   write_int = write_int,
+   write_long = write_long,
+   write_string = write_string,
+}
+
+-- Compiles an encoder function for the given avro.schema schema.
+function encoder(schema)
+   local c = new_compiler(ENCODE_HELPERS)
+   c:emit("local out = {}")
+   c:emit("local entry = function(value)")
+   c:emit("local n = 0")
+   encode_from(c, schema, "value")
+   c:emit("return concat(out, \"\", 1, n)")
+   c:emit("end")
+   return c:load("avro.compiler.encoder", "entry")
+end
@@ -13,6 +13,7 @@
 -- and loads in this module, or avro.c.legacy, as appropriate.
 
 local ffi = require "ffi"
+local bit = require "bit"
 
 local ACC = require "avro.constants"
 
@@ -22,9 +23,12 @@ local L = require "avro.legacy.avro"
 local assert = assert
 local getmetatable = getmetatable
 local error = error
+local io = io
 local ipairs = ipairs
+local math = math
 local next = next
 local pairs = pairs
+local pcall = pcall
 local print = print
 local setmetatable = setmetatable
 local string = string
@@ -37,7 +41,9 @@ module "avro.ffi.avro"
 
 ffi.cdef [[
 void *malloc(size_t size);
+void *realloc(void *ptr, size_t size);
 void free(void *ptr);
+long long strtoll(const char *nptr, char **endptr, int base);
 
 typedef int  avro_type_t;
 typedef int  avro_class_t;
@@ -50,6 +56,22 @@ typedef struct avro_obj_t {
 
 const char *
 avro_strerror(void);
+
+void
+avro_set_error(const char *fmt, ...);
+
+int open(const char *path, int flags, ...);
+int close(int fd);
+int64_t lseek(int fd, int64_t offset, int whence);
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+           int64_t offset);
+int munmap(void *addr, size_t length);
+int madvise(void *addr, size_t length, int advice);
+void *fmemopen(void *buf, size_t size, const char *mode);
+void *open_memstream(char **ptr, size_t *size);
+int fflush(void *fp);
+int fclose(void *fp);
+int memcmp(const void *s1, const void *s2, size_t n);
 ]]
 
 local function get_avro_error()
@@ -81,7 +103,9 @@ end
 --
 -- So to get around this, we're incorporating the extra field into our
 -- own definition of avro_value_t.  The beginning of the struct still
--- matches what the library expects, so we should be okay.
+-- matches what the library expects, so we should be okay.  (We also
+-- keep the top-level value that a reused child instance belongs to in
+-- there; see child_result.)
 
 ffi.cdef [[
 typedef struct avro_value_iface  avro_value_iface_t;
@@ -90,6 +114,8 @@ typedef struct avro_value {
     avro_value_iface_t  *iface;
     void  *self;
     bool  should_decref;
+    avro_value_iface_t  *owner_iface;
+    void  *owner_self;
 } avro_value_t;
 
 typedef avro_obj_t  *avro_schema_t;
@@ -184,6 +210,12 @@ struct avro_value_iface {
 -- Forward declarations
 
 ffi.cdef [[
+typedef struct LuaAvroBuffer {
+    char  *buf;
+    size_t  used;
+    size_t  allocated;
+} LuaAvroBuffer;
+
 typedef struct LuaAvroResolvedReader {
     avro_value_iface_t  *resolver;
 } LuaAvroResolvedReader;
@@ -196,14 +228,44 @@ typedef struct LuaAvroResolvedWriter {
 typedef struct avro_file_reader_t_  *avro_file_reader_t;
 typedef struct avro_file_writer_t_  *avro_file_writer_t;
 
+typedef struct LuaAvroFileHeader {
+    char  codec[32];
+    char  sync[16];
+    int64_t  size;
+} LuaAvroFileHeader;
+
 typedef struct LuaAvroDataInputFile {
     avro_file_reader_t  reader;
     avro_schema_t  wschema;
     avro_value_iface_t  *iface;
+    avro_value_iface_t  *resolver;
+    avro_value_t  resolved;
+    LuaAvroFileHeader  header;
+    char  *path;
+    int64_t  record_index;
+    const uint8_t  *map;
+    size_t  map_size;
+    bool  map_is_copy;
+    bool  mapped_reads;
+    size_t  pos;
+    size_t  block_data;
+    size_t  block_end;
+    int64_t  block_remaining;
+    struct avro_reader_t  *block_reader;
+    avro_file_reader_t  block_file;
+    char  *block_buf;
+    int64_t  *block_offsets;
+    int64_t  *block_firsts;
+    size_t  block_count;
 } LuaAvroDataInputFile;
 
 typedef struct LuaAvroDataOutputFile {
     avro_file_writer_t  writer;
+    size_t  records_per_block;
+    size_t  block_records;
+    void  *mem_fp;
+    char  *mem_buf;
+    size_t  mem_size;
 } LuaAvroDataOutputFile;
 ]]
 
@@ -213,6 +275,7 @@ local avro_value_t = ffi.typeof([[avro_value_t]])
 local avro_value_t_ptr = ffi.typeof([[avro_value_t *]])
 local LuaAvroValue
 
+local LuaAvroBuffer
 local LuaAvroDataInputFile
 local LuaAvroDataOutputFile
 
@@ -237,6 +300,8 @@ typedef struct avro_writer_t  *avro_writer_t;
 ]]
 
 local char_p = ffi.typeof([=[ char * ]=])
+local const_uint8_t_p = ffi.typeof([=[ const uint8_t * ]=])
+local uint8_t_p = ffi.typeof([=[ uint8_t * ]=])
 local char_p_ptr = ffi.typeof([=[ char *[1] ]=])
 local const_char_p_ptr = ffi.typeof([=[ const char *[1] ]=])
 local double_ptr = ffi.typeof([=[ double[1] ]=])
@@ -279,6 +344,10 @@ avro_file_reader(const char *path, avro_file_reader_t *reader);
 int
 avro_file_reader_close(avro_file_reader_t reader);
 
+int
+avro_file_reader_fp(void *fp, const char *path, int should_close,
+                    avro_file_reader_t *reader);
+
 avro_schema_t
 avro_file_reader_get_writer_schema(avro_file_reader_t reader);
 
@@ -295,6 +364,30 @@ int
 avro_file_writer_create(const char *path, avro_schema_t schema,
                         avro_file_writer_t *writer);
 
+int
+avro_file_writer_create_with_codec(const char *path, avro_schema_t schema,
+                                   avro_file_writer_t *writer,
+                                   const char *codec, size_t block_size);
+
+int
+avro_file_writer_create_with_codec_fp(void *fp, const char *path,
+                                      int should_close, avro_schema_t schema,
+                                      avro_file_writer_t *writer,
+                                      const char *codec, size_t block_size);
+
+int
+avro_file_writer_flush(avro_file_writer_t writer);
+
+int
+avro_file_writer_open(const char *path, avro_file_writer_t *writer);
+
+int
+avro_file_writer_open_bs(const char *path, avro_file_writer_t *writer,
+                         size_t block_size);
+
+int
+avro_file_writer_sync(avro_file_writer_t writer);
+
 avro_reader_t
 avro_reader_memory(const char *buf, int64_t len);
 
@@ -386,6 +479,9 @@ avro_schema_enum_get_by_name(const avro_schema_t schema, const char *name);
 size_t
 avro_schema_enum_size(const avro_schema_t schema);
 
+int
+avro_schema_enum_number_of_symbols(const avro_schema_t enump);
+
 int
 avro_schema_enum_symbol_append(avro_schema_t schema, const char *symbol);
 
@@ -556,6 +652,123 @@ function Schema(json)
    end
 end
 
+-- Returns the CRC-64-AVRO, MD5, or SHA-256 fingerprint of a string.
+-- These don't need anything from the FFI, so we use the legacy
+-- module's implementation.
+fingerprint = L.fingerprint
+
+
+------------------------------------------------------------------------
+-- Buffers
+
+-- A growable memory buffer that we can encode Avro values into.  The
+-- memory is kept around between calls, so that encoding a stream of
+-- values only allocates when a value is larger than any that came
+-- before it.
+
+local DEFAULT_BUFFER_SIZE = 4096
+
+-- The Avro C library returns ENOSPC when a memory writer overflows.
+local ENOSPC = L.ENOSPC
+
+local buffer_size = ffi.new(size_t_ptr)
+
+local Buffer_class = {}
+local Buffer_mt = { __index = Buffer_class }
+
+function Buffer_class:reserve(size)
+   if size <= self.allocated then return end
+
+   local new_size = tonumber(self.allocated)
+   if new_size == 0 then new_size = DEFAULT_BUFFER_SIZE end
+   while new_size < size do
+      new_size = new_size * 2
+   end
+
+   local new_buf = ffi.C.realloc(self.buf, new_size)
+   if new_buf == nil then error "Out of memory" end
+   self.buf = new_buf
+   self.allocated = new_size
+end
+
+-- Gives back any memory beyond max, discarding the buffer's contents.
+-- If the smaller allocation fails, we just keep the larger one.
+function Buffer_class:shrink(max)
+   self.used = 0
+   if self.allocated > max then
+      local new_buf = ffi.C.realloc(self.buf, max)
+      if new_buf ~= nil then
+         self.buf = new_buf
+         self.allocated = max
+      end
+   end
+end
+
+-- Encodes an Avro value into the buffer, replacing its current
+-- contents.  We optimistically write into whatever space the buffer
+-- already has, so that most values only need a single traversal.  If
+-- that overflows, we find out the exact size that we need, grow the
+-- buffer, and try again.
+function Buffer_class:encode_value(value)
+   avro.avro_writer_memory_set_dest(memory_writer, self.buf, self.allocated)
+   local rc = avro.avro_value_write(memory_writer, value)
+
+   if rc == ENOSPC then
+      rc = avro.avro_value_sizeof(value, buffer_size)
+      if rc == 0 then
+         self:reserve(tonumber(buffer_size[0]))
+         avro.avro_writer_memory_set_dest(
+            memory_writer, self.buf, self.allocated
+         )
+         rc = avro.avro_value_write(memory_writer, value)
+      end
+   end
+
+   if rc == 0 then
+      self.used = avro.avro_writer_tell(memory_writer)
+   else
+      self.used = 0
+   end
+   return rc
+end
+
+function Buffer_class:tostring()
+   return ffi.string(self.buf, self.used)
+end
+
+function Buffer_class:size()
+   return tonumber(self.used)
+end
+
+-- Returns the contents of the buffer as a pointer and a size.  The
+-- pointer is only valid until the next time the buffer is encoded
+-- into, or until the buffer is garbage collected.
+function Buffer_class:pointer()
+   return self.buf, tonumber(self.used)
+end
+
+Buffer_mt.__len = Buffer_class.size
+Buffer_mt.__tostring = Buffer_class.tostring
+
+function Buffer_mt:__gc()
+   if self.buf ~= nil then
+      ffi.C.free(self.buf)
+      self.buf = nil
+   end
+   self.used = 0
+   self.allocated = 0
+end
+
+function Buffer(size)
+   size = size or 0
+   if size < 0 then error "Buffer size cannot be negative" end
+   local buffer = LuaAvroBuffer(nil, 0, 0)
+   buffer:reserve(size)
+   return buffer
+end
+
+LuaAvroBuffer = ffi.metatype([[LuaAvroBuffer]], Buffer_mt)
+
 
 ------------------------------------------------------------------------
 -- Values
@@ -588,7 +801,58 @@ end
 
 Value_class.is_raw_value = true
 
-function Value_class:get(index)
+-- Scratch values that we fetch children into, and that we use to
+-- incref and decref the top-level value that a reused child instance
+-- belongs to.  (They're created on first use, since LuaAvroValue isn't
+-- defined yet.)
+local v_child, v_owner
+
+local function child_value()
+   if not v_child then
+      v_child, v_owner = LuaAvroValue(), LuaAvroValue()
+   end
+   v_child.self = nil
+   return v_child
+end
+
+-- Returns a value instance for child, which we've just fetched from
+-- parent.  If into is given, we reuse it, instead of creating a new
+-- instance.  Reusing an instance saves an allocation (and a finalizer)
+-- for each child that you visit.
+--
+-- into might be parent itself, or the only thing keeping parent alive,
+-- as in v = v:get(k, v).  So before into lets go of whatever it pointed
+-- at, it takes its own reference to the top-level value that parent
+-- belongs to.
+local function child_result(parent, child, into)
+   local iface, self = child.iface, child.self
+   if not into then
+      local result = LuaAvroValue()
+      result.iface, result.self = iface, self
+      return result
+   end
+
+   local owner_iface, owner_self
+   if parent.should_decref then
+      owner_iface, owner_self = parent.iface, parent.self
+   else
+      owner_iface, owner_self = parent.owner_iface, parent.owner_self
+   end
+   if owner_self ~= nil then
+      v_owner.iface, v_owner.self = owner_iface, owner_self
+      avro.avro_value_incref(v_owner)
+   end
+
+   into:release()
+   into.iface, into.self = iface, self
+   into.owner_iface, into.owner_self = owner_iface, owner_self
+   return into
+end
+
+-- For arrays, maps, records, and unions, you can pass in an existing
+-- value instance as into, which we'll point at the child and return,
+-- instead of creating a new instance.
+function Value_class:get(index, into)
    local value_type = self:type()
    if value_type == BOOLEAN then
       if self.iface.get_boolean == nil then
@@ -676,25 +940,24 @@ function Value_class:get(index)
          if index < 1 or index > v_size[0] then
             error "Index out of bounds"
          end
-         local element = LuaAvroValue()
-         element.should_decref = false
+         local element = child_value()
          rc = self.iface.get_by_index(self.iface, self.self, index-1, element, nil)
          if rc ~= 0 then avro_error() end
-         return element
+         return child_result(self, element, into)
       end
 
       error "Can only get integer index from array"
 
    elseif value_type == MAP then
       if type(index) == "string" then
-         local element = LuaAvroValue()
-         element.should_decref = false
+         local element = child_value()
          local rc = self.iface.get_by_name(self.iface, self.self, index, element, v_size_t)
          if rc ~= 0 then return get_avro_error() end
          if element.self == nil then
             error("No element named "..index)
          else
-            return element, v_size_t[0]
+            local element_index = v_size_t[0]
+            return child_result(self, element, into), element_index
          end
 
       elseif type(index) == "number" then
@@ -703,30 +966,28 @@ function Value_class:get(index)
          if index < 1 or index > v_size[0] then
             error "Index out of bounds"
          end
-         local element = LuaAvroValue()
-         element.should_decref = false
+         local element = child_value()
          local rc = self.iface.get_by_index(self.iface, self.self, index-1,
                                             element, v_const_char_p)
          if rc ~= 0 then return get_avro_error() end
-         return element, ffi.string(v_const_char_p[0])
+         local key = ffi.string(v_const_char_p[0])
+         return child_result(self, element, into), key
       end
 
       error "Can only get string or integer index from map"
 
    elseif value_type == RECORD then
       if type(index) == "string" then
-         local field = LuaAvroValue()
-         field.should_decref = false
+         local field = child_value()
          local rc = self.iface.get_by_name(self.iface, self.self, index, field, nil)
          if rc ~= 0 then return get_avro_error() end
-         return field
+         return child_result(self, field, into)
 
       elseif type(index) == "number" then
-         local field = LuaAvroValue()
-         field.should_decref = false
+         local field = child_value()
          local rc = self.iface.get_by_index(self.iface, self.self, index-1, field, nil)
          if rc ~= 0 then return get_avro_error() end
-         return field
+         return child_result(self, field, into)
       end
 
       error "Can only get string index from record"
@@ -738,23 +999,22 @@ function Value_class:get(index)
             union_schema, v_int, index
          )
          if branch_schema == nil then return get_avro_error() end
-         local branch = LuaAvroValue()
+         local branch = child_value()
          local rc = self.iface.set_branch(self.iface, self.self, v_int[0], branch)
          if rc ~= 0 then return get_avro_error() end
-         return branch
+         return child_result(self, branch, into)
 
       elseif type(index) == "number" then
-         local branch = LuaAvroValue()
+         local branch = child_value()
          local rc = self.iface.set_branch(self.iface, self.self, index-1, branch)
          if rc ~= 0 then return get_avro_error() end
-         return branch
+         return child_result(self, branch, into)
 
       elseif type(index) == "nil" then
-         local branch = LuaAvroValue()
-         branch.should_decref = false
+         local branch = child_value()
          local rc = self.iface.get_current_branch(self.iface, self.self, branch)
          if rc ~= 0 then return get_avro_error() end
-         return branch
+         return child_result(self, branch, into)
       end
 
    else
@@ -887,7 +1147,9 @@ function Value_class:set(val)
    end
 end
 
-function Value_class:append()
+-- If you pass in an existing value instance, we reuse it for the new
+-- element.
+function Value_class:append(into)
    if self:type() ~= ARRAY then
       error("Can only append to an array")
    end
@@ -896,14 +1158,16 @@ function Value_class:append()
       error "No implementation for append"
    end
 
-   local element = LuaAvroValue()
+   local element = child_value()
    local rc = self.iface.append(self.iface, self.self, element, nil)
    if rc ~= 0 then avro_error() end
 
-   return element
+   return child_result(self, element, into)
 end
 
-function Value_class:add(key)
+-- If you pass in an existing value instance, we reuse it for the new
+-- element.
+function Value_class:add(key, into)
    if self:type() ~= MAP then
       error("Can only add to a map")
    end
@@ -912,11 +1176,85 @@ function Value_class:add(key)
       error "No implementation for add"
    end
 
-   local element = LuaAvroValue()
+   local element = child_value()
    local rc = self.iface.add(self.iface, self.self, key, element, nil, nil)
    if rc ~= 0 then avro_error() end
 
-   return element
+   return child_result(self, element, into)
+end
+
+-- Scratch values that we use to walk down a path, so that we don't have
+-- to create a value instance for each step.  (They're created on first
+-- use, since LuaAvroValue isn't defined yet.)
+local path_leaf, path_child
+
+-- Walks down from a value along a path of child steps.  A positive
+-- integer is the 1-based index of a record field; a negative integer
+-- is the negated 1-based index of a union branch; and a string is a map
+-- key.  When reading, a union that's in some other branch, or a map
+-- that doesn't contain the key, means that the path doesn't exist, and
+-- we return false.  When writing, we select the union branch and add
+-- the map element instead.  The leaf ends up in path_leaf.
+local function walk_value_path(value, chain, for_write)
+   if not path_leaf then
+      path_leaf, path_child = LuaAvroValue(), LuaAvroValue()
+   end
+   local leaf, child = path_leaf, path_child
+   leaf.iface, leaf.self = value.iface, value.self
+   for i = 1, #chain do
+      local step = chain[i]
+      local rc
+      child.self = nil
+      if type(step) == "string" then
+         if for_write then
+            rc = leaf.iface.add(leaf.iface, leaf.self, step, child, nil, nil)
+         else
+            rc = leaf.iface.get_by_name(leaf.iface, leaf.self, step, child, nil)
+         end
+      elseif step > 0 then
+         rc = leaf.iface.get_by_index(leaf.iface, leaf.self, step-1, child, nil)
+      elseif for_write then
+         rc = leaf.iface.set_branch(leaf.iface, leaf.self, -step-1, child)
+      else
+         rc = leaf.iface.get_discriminant(leaf.iface, leaf.self, v_int)
+         if rc == 0 and v_int[0] == -step-1 then
+            rc = leaf.iface.get_current_branch(leaf.iface, leaf.self, child)
+         end
+      end
+      if rc ~= 0 then avro_error() end
+      if child.self == nil then return false end
+      leaf.iface, leaf.self = child.iface, child.self
+   end
+   return true
+end
+
+local SCALAR_TYPES = {
+   [BOOLEAN] = true, [BYTES] = true, [DOUBLE] = true, [FLOAT] = true,
+   [INT] = true, [LONG] = true, [NULL] = true, [STRING] = true,
+   [ENUM] = true, [FIXED] = true,
+}
+
+-- Reads the value at the end of a path in a single call, without
+-- creating a value instance for each step.  If the leaf is a scalar, we
+-- return its Lua equivalent; otherwise we return a value instance for
+-- it, reusing into if it's given.  If the path doesn't exist, we return
+-- nil.
+function Value_class:get_path(chain, into)
+   if not walk_value_path(self, chain, false) then return nil end
+   if SCALAR_TYPES[path_leaf:type()] then
+      return path_leaf:get()
+   end
+   return child_result(self, path_leaf, into)
+end
+
+-- Sets the scalar at the end of a path to val, in a single call.  Any
+-- unions along the path are switched to the path's branch.
+function Value_class:set_path(chain, val)
+   walk_value_path(self, chain, true)
+   if not SCALAR_TYPES[path_leaf:type()] then
+      error "Can only set a scalar at the end of a path"
+   end
+   path_leaf:set(val)
 end
 
 function Value_class:size()
@@ -966,31 +1304,28 @@ function Value_class:discriminant()
    return ffi.string(avro.avro_schema_type_name(branch))
 end
 
-function Value_class:encode()
-   local size = self:encoded_size()
-
-   -- Use the static buffer if we can, to save on some mallocs.
-   local buf, free_buf
-   if size <= static_size then
-      buf = static_buf
-      free_buf = false
-   else
-      buf = ffi.C.malloc(size)
-      if buf == nil then return nil, "Out of memory" end
-      free_buf = true
+-- If an AvroBuffer is given, the encoded value is placed into it, and
+-- the buffer is returned.  Otherwise, we use a shared internal buffer,
+-- and return the result as a Lua string.  The shared buffer keeps up
+-- to DEFAULT_BUFFER_MAX bytes between calls.
+local default_buffer
+local DEFAULT_BUFFER_MAX = 65536
+
+function Value_class:encode(buffer)
+   if buffer == nil then
+      if default_buffer == nil then default_buffer = Buffer() end
+      if default_buffer:encode_value(self) ~= 0 then
+         return get_avro_error()
+      end
+      local result = default_buffer:tostring()
+      default_buffer:shrink(DEFAULT_BUFFER_MAX)
+      return result
    end
 
-   avro.avro_writer_memory_set_dest(memory_writer, buf, size)
-   local rc = avro.avro_value_write(memory_writer, self)
-
-   if rc ~= 0 then
-      if free_buf then ffi.C.free(buf) end
+   if buffer:encode_value(self) ~= 0 then
       return get_avro_error()
-   else
-      local result = ffi.string(buf, size)
-      if free_buf then ffi.C.free(buf) end
-      return result
    end
+   return buffer
 end
 
 function Value_class:encoded_size()
@@ -1015,7 +1350,7 @@ local function iterate_array(state, unused)
    -- Have we reached the end?
    if state.next_index >= state.length then return nil end
    -- Nope.
-   local element = LuaAvroValue()
+   local element = child_value()
    local rc = state.value.iface.get_by_index(
       state.value.iface, state.value.self,
       state.next_index, element, nil
@@ -1023,7 +1358,7 @@ local function iterate_array(state, unused)
    if rc ~= 0 then avro_error() end
    state.next_index = state.next_index + 1
    -- Result should be a 1-based index for Lua
-   return state.next_index, element
+   return state.next_index, child_result(state.parent, element, state.into)
 end
 
 local function iterate_map(state, unused)
@@ -1031,26 +1366,33 @@ local function iterate_map(state, unused)
    -- Have we reached the end?
    if state.next_index >= state.length then return nil end
    -- Nope.
-   local key = ffi.new(const_char_p_ptr)
-   local element = LuaAvroValue()
+   local element = child_value()
    local rc = state.value.iface.get_by_index(
       state.value.iface, state.value.self,
-      state.next_index, element, key
+      state.next_index, element, v_const_char_p
    )
    if rc ~= 0 then avro_error() end
    state.next_index = state.next_index + 1
-   return ffi.string(key[0]), element
+   local key = ffi.string(v_const_char_p[0])
+   return key, child_result(state.parent, element, state.into)
 end
 
-function Value_class:iterate()
+-- If into is given, every iteration reuses it for the current element,
+-- instead of creating a new value instance for each one.  We iterate
+-- through a copy of self, since into might be self.
+function Value_class:iterate(no_scalar, into)
    local value_type = self:type()
+   local value = LuaAvroValue()
+   value.iface, value.self = self.iface, self.self
 
    if value_type == ARRAY then
       local rc = self.iface.get_size(self.iface, self.self, v_size)
       if rc ~= 0 then avro_error() end
       local state = {
          no_scalar = no_scalar,
-         value = self,
+         value = value,
+         parent = self,
+         into = into,
          next_index = 0,
          length = v_size[0],
       }
@@ -1061,7 +1403,9 @@ function Value_class:iterate()
       if rc ~= 0 then avro_error() end
       local state = {
          no_scalar = no_scalar,
-         value = self,
+         value = value,
+         parent = self,
+         into = into,
          next_index = 0,
          length = v_size[0],
       }
@@ -1134,6 +1478,497 @@ function Value_class:set_from_ast(ast)
    end
 end
 
+-- Arrays of numbers can be copied to and from C arrays in a single
+-- call, without creating a value instance for each element.  The C
+-- array's elements must be int32_t, int64_t, float, or double, to match
+-- the Avro array.
+
+local NUMERIC_ARRAYS = {
+   [INT] = { ctype = ffi.typeof([[int32_t *]]),
+             array = ffi.typeof([[int32_t[?] ]]),
+             get = "get_int", set = "set_int" },
+   [LONG] = { ctype = ffi.typeof([[int64_t *]]),
+              array = ffi.typeof([[int64_t[?] ]]),
+              get = "get_long", set = "set_long" },
+   [FLOAT] = { ctype = ffi.typeof([[float *]]),
+               array = ffi.typeof([[float[?] ]]),
+               get = "get_float", set = "set_float" },
+   [DOUBLE] = { ctype = ffi.typeof([[double *]]),
+                array = ffi.typeof([[double[?] ]]),
+                get = "get_double", set = "set_double" },
+}
+
+local array_element
+
+local function numeric_array(self)
+   if self:type() == ARRAY then
+      local schema = self.iface.get_schema(self.iface, self.self)
+      local items = avro.avro_schema_array_items(schema)
+      local numeric = NUMERIC_ARRAYS[items.type]
+      if numeric then
+         if not array_element then array_element = LuaAvroValue() end
+         return numeric
+      end
+   end
+   error "Can only copy arrays of ints, longs, floats, or doubles"
+end
+
+-- Copies the first n elements of the array into ptr.  If n is nil, or
+-- is larger than the array, we copy the whole array.  Returns the
+-- number of elements copied.
+function Value_class:copy_into(ptr, n)
+   local numeric = numeric_array(self)
+   local rc = self.iface.get_size(self.iface, self.self, v_size)
+   if rc ~= 0 then avro_error() end
+   local size = tonumber(v_size[0])
+   if n then
+      if n < 0 then error "Element count cannot be negative" end
+      if n < size then size = n end
+   end
+
+   local dest = ffi.cast(numeric.ctype, ptr)
+   local element = array_element
+   for i = 0, size-1 do
+      rc = self.iface.get_by_index(self.iface, self.self, i, element, nil)
+      if rc ~= 0 then avro_error() end
+      rc = element.iface[numeric.get](element.iface, element.self, dest + i)
+      if rc ~= 0 then avro_error() end
+   end
+   return size
+end
+
+-- Returns a new C array containing the elements of the array, and its
+-- length.
+function Value_class:to_ffi_array()
+   local numeric = numeric_array(self)
+   local size = self:size()
+   local result = numeric.array(size)
+   self:copy_into(result, size)
+   return result, size
+end
+
+-- Replaces the contents of the array with the n elements of ptr.
+function Value_class:set_from_ffi_array(ptr, n)
+   local numeric = numeric_array(self)
+   if n < 0 then error "Element count cannot be negative" end
+   local src = ffi.cast(numeric.ctype, ptr)
+   local element = array_element
+   local rc = self.iface.reset(self.iface, self.self)
+   if rc ~= 0 then avro_error() end
+   for i = 0, n-1 do
+      rc = self.iface.append(self.iface, self.self, element, nil)
+      if rc ~= 0 then avro_error() end
+      rc = element.iface[numeric.set](element.iface, element.self, src[i])
+      if rc ~= 0 then avro_error() end
+   end
+end
+
+-- Converts a value into a pure-Lua AST, which is the inverse of
+-- set_from_ast.  We walk the value with one scratch child per level of
+-- nesting, so building the AST doesn't create a value instance for each
+-- node.  You can pass in a table of options:
+--
+--   unions
+--     "tagged" (the default) represents a union as a single-element
+--     table whose key is the name of the current branch, just as
+--     set_from_ast expects.  "bare" represents it as the AST of the
+--     current branch.  Either way, the null branch is nil.
+--
+--   longs
+--     "number" (the default) represents longs as Lua numbers, which
+--     lose precision outside of ±2^53.  "string" represents them as
+--     decimal strings.
+
+local ast_children = {}
+
+local function value_ast(value, depth, bare_unions, string_longs)
+   local value_type = value:type()
+
+   if value_type == LONG then
+      local rc = value.iface.get_long(value.iface, value.self, v_int64)
+      if rc ~= 0 then avro_error() end
+      if string_longs then
+         return (tostring(v_int64[0]):gsub("LL$", ""))
+      end
+      return tonumber(v_int64[0])
+
+   elseif value_type == ARRAY or value_type == MAP or value_type == RECORD then
+      local child = ast_children[depth]
+      if not child then
+         child = LuaAvroValue()
+         ast_children[depth] = child
+      end
+      local rc = value.iface.get_size(value.iface, value.self, v_size)
+      if rc ~= 0 then avro_error() end
+      local size = tonumber(v_size[0])
+      local result = {}
+      for i = 0, size-1 do
+         local name = nil
+         if value_type == ARRAY then
+            rc = value.iface.get_by_index(value.iface, value.self, i, child, nil)
+         else
+            rc = value.iface.get_by_index(
+               value.iface, value.self, i, child, v_const_char_p
+            )
+            name = ffi.string(v_const_char_p[0])
+         end
+         if rc ~= 0 then avro_error() end
+         local ast = value_ast(child, depth+1, bare_unions, string_longs)
+         if name then
+            result[name] = ast
+         else
+            result[i+1] = ast
+         end
+      end
+      return result
+
+   elseif value_type == UNION then
+      local child = ast_children[depth]
+      if not child then
+         child = LuaAvroValue()
+         ast_children[depth] = child
+      end
+      local rc = value.iface.get_discriminant(value.iface, value.self, v_int)
+      if rc ~= 0 then avro_error() end
+      local discriminant = v_int[0]
+      rc = value.iface.get_current_branch(value.iface, value.self, child)
+      if rc ~= 0 then avro_error() end
+      if child:type() == NULL then return nil end
+      local ast = value_ast(child, depth+1, bare_unions, string_longs)
+      if bare_unions then return ast end
+      local union_schema = value.iface.get_schema(value.iface, value.self)
+      local branch = avro.avro_schema_union_branch(union_schema, discriminant)
+      return { [ffi.string(avro.avro_schema_type_name(branch))] = ast }
+
+   else
+      return value:get()
+   end
+end
+
+local UNION_OPTIONS = { tagged = false, bare = true }
+local LONG_OPTIONS = { number = false, string = true }
+
+function Value_class:to_ast(options)
+   local bare_unions, string_longs = false, false
+   if options then
+      bare_unions = UNION_OPTIONS[options.unions or "tagged"]
+      string_longs = LONG_OPTIONS[options.longs or "number"]
+      if bare_unions == nil then
+         error("Invalid unions option "..tostring(options.unions))
+      end
+      if string_longs == nil then
+         error("Invalid longs option "..tostring(options.longs))
+      end
+   end
+   return value_ast(self, 1, bare_unions, string_longs)
+end
+
+-- Fills in the contents of a value from its Avro JSON encoding (as
+-- produced by to_json).  Like the legacy module, we walk the JSON text
+-- and the value together, and set each part of the value as soon as we
+-- reach it, without building a Lua table for the whole document.
+
+local byte = string.byte
+local char = string.char
+local find = string.find
+local sub = string.sub
+
+local JSON_ESCAPES = {
+   ['"'] = '"', ["\\"] = "\\", ["/"] = "/",
+   b = "\b", f = "\f", n = "\n", r = "\r", t = "\t",
+}
+
+local function json_error(pos, msg)
+   error("Invalid JSON at offset "..(pos-1)..": "..msg)
+end
+
+local function json_skip(str, pos)
+   return find(str, "[^ \t\r\n]", pos) or #str + 1
+end
+
+local function json_expect(str, pos, ch)
+   pos = json_skip(str, pos)
+   if sub(str, pos, pos) ~= ch then
+      json_error(pos, "expected '"..ch.."'")
+   end
+   return pos + 1
+end
+
+-- Returns the position after ch if it's the next character, or nil.
+local function json_accept(str, pos, ch)
+   pos = json_skip(str, pos)
+   if sub(str, pos, pos) == ch then return pos + 1 end
+   return nil
+end
+
+local function json_accept_literal(str, pos, literal)
+   pos = json_skip(str, pos)
+   if sub(str, pos, pos + #literal - 1) == literal then
+      return pos + #literal
+   end
+   return nil
+end
+
+local function utf8_char(cp)
+   if cp < 0x80 then
+      return char(cp)
+   elseif cp < 0x800 then
+      return char(0xc0 + math.floor(cp / 0x40), 0x80 + cp % 0x40)
+   elseif cp < 0x10000 then
+      return char(0xe0 + math.floor(cp / 0x1000),
+                  0x80 + math.floor(cp / 0x40) % 0x40,
+                  0x80 + cp % 0x40)
+   else
+      return char(0xf0 + math.floor(cp / 0x40000),
+                  0x80 + math.floor(cp / 0x1000) % 0x40,
+                  0x80 + math.floor(cp / 0x40) % 0x40,
+                  0x80 + cp % 0x40)
+   end
+end
+
+local function json_read_hex4(str, pos)
+   if not find(str, "^%x%x%x%x", pos) then
+      json_error(pos, "invalid \\u escape")
+   end
+   return tonumber(sub(str, pos, pos+3), 16), pos + 4
+end
+
+-- Reads a JSON string.  If as_bytes is true, the string holds bytes,
+-- which the Avro JSON encoding represents as code points 0-255; we
+-- turn each one back into a single byte.  Strings without escapes are
+-- the common case, and only need a single find and sub.
+local function json_read_string(str, pos, as_bytes)
+   pos = json_expect(str, pos, '"')
+   local special = '["\\%z\1-\31]'
+   if as_bytes then special = '["\\%z\1-\31\128-\255]' end
+   local pieces, n = nil, 0
+   while true do
+      local e = find(str, special, pos)
+      if not e then json_error(pos, "unterminated string") end
+      local ch = byte(str, e)
+      if ch == 34 then  -- closing quote
+         if not pieces then return sub(str, pos, e-1), e+1 end
+         n = n + 1
+         pieces[n] = sub(str, pos, e-1)
+         return table.concat(pieces, "", 1, n), e+1
+      end
+
+      pieces = pieces or {}
+      n = n + 1
+      pieces[n] = sub(str, pos, e-1)
+      local piece
+      if ch == 92 then  -- backslash
+         local escape = sub(str, e+1, e+1)
+         if escape == "u" then
+            local cp
+            cp, pos = json_read_hex4(str, e+2)
+            if cp >= 0xd800 and cp < 0xdc00 then
+               if sub(str, pos, pos+1) ~= "\\u" then
+                  json_error(pos, "unpaired surrogate")
+               end
+               local low
+               low, pos = json_read_hex4(str, pos+2)
+               if low < 0xdc00 or low >= 0xe000 then
+                  json_error(pos, "unpaired surrogate")
+               end
+               cp = 0x10000 + (cp - 0xd800) * 0x400 + (low - 0xdc00)
+            end
+            if as_bytes then
+               if cp > 0xff then
+                  json_error(pos, "invalid character in byte string")
+               end
+               piece = char(cp)
+            else
+               piece = utf8_char(cp)
+            end
+         else
+            piece = JSON_ESCAPES[escape]
+            if not piece then json_error(e, "invalid escape") end
+            pos = e + 2
+         end
+      elseif ch >= 0x80 then
+         -- The UTF-8 encoding of a code point 0x80-0xff
+         local ch2 = byte(str, e+1)
+         if ch > 0xc3 or ch < 0xc2 or not ch2 or ch2 < 0x80 or ch2 > 0xbf then
+            json_error(e, "invalid character in byte string")
+         end
+         piece = char((ch - 0xc0) * 0x40 + (ch2 - 0x80))
+         pos = e + 2
+      else
+         json_error(e, "control character in string")
+      end
+      n = n + 1
+      pieces[n] = piece
+   end
+end
+
+-- Reads a JSON number, returning its text, whether it's an integer, and
+-- the position after it.
+local function json_read_number(str, pos)
+   pos = json_skip(str, pos)
+   local _, e = find(str, "^-?%d+", pos)
+   if not e then json_error(pos, "expected a number") end
+   local is_integer = true
+   local _, frac_e = find(str, "^%.%d+", e+1)
+   if frac_e then e, is_integer = frac_e, false end
+   local _, exp_e = find(str, "^[eE][-+]?%d+", e+1)
+   if exp_e then e, is_integer = exp_e, false end
+   return sub(str, pos, e), is_integer, e+1
+end
+
+local json_read_value
+
+local function json_read_long(str, pos)
+   local text, is_integer, next_pos = json_read_number(str, pos)
+   if not is_integer then json_error(pos, "expected an integer") end
+   -- Lua numbers can't hold every long, so let strtoll handle the big
+   -- ones.
+   if #text < 16 then
+      return tonumber(text), next_pos
+   end
+   ffi.errno(0)
+   local result = ffi.C.strtoll(text, nil, 10)
+   if ffi.errno() ~= 0 then json_error(pos, "long out of range") end
+   return result, next_pos
+end
+
+function json_read_value(str, pos, value)
+   local value_type = value:type()
+
+   if value_type == BOOLEAN then
+      local next_pos = json_accept_literal(str, pos, "true")
+      if next_pos then value:set(true); return next_pos end
+      next_pos = json_accept_literal(str, pos, "false")
+      if next_pos then value:set(false); return next_pos end
+      json_error(json_skip(str, pos), "expected a boolean")
+
+   elseif value_type == NULL then
+      local next_pos = json_accept_literal(str, pos, "null")
+      if not next_pos then
+         json_error(json_skip(str, pos), "expected null")
+      end
+      value:set(nil)
+      return next_pos
+
+   elseif value_type == INT then
+      local v, next_pos = json_read_long(str, pos)
+      if v < -2147483648 or v > 2147483647 then
+         json_error(pos, "int out of range")
+      end
+      value:set(v)
+      return next_pos
+
+   elseif value_type == LONG then
+      local v, next_pos = json_read_long(str, pos)
+      value:set(v)
+      return next_pos
+
+   elseif value_type == FLOAT or value_type == DOUBLE then
+      local text, _, next_pos = json_read_number(str, pos)
+      value:set(tonumber(text))
+      return next_pos
+
+   elseif value_type == STRING or value_type == ENUM then
+      local v, next_pos = json_read_string(str, pos, false)
+      value:set(v)
+      return next_pos
+
+   elseif value_type == BYTES or value_type == FIXED then
+      local v, next_pos = json_read_string(str, pos, true)
+      value:set(v)
+      return next_pos
+
+   elseif value_type == ARRAY then
+      value:reset()
+      pos = json_expect(str, pos, "[")
+      local next_pos = json_accept(str, pos, "]")
+      if next_pos then return next_pos end
+      repeat
+         pos = json_read_value(str, pos, value:append())
+         next_pos = json_accept(str, pos, ",")
+         pos = next_pos or pos
+      until not next_pos
+      return json_expect(str, pos, "]")
+
+   elseif value_type == MAP then
+      value:reset()
+      pos = json_expect(str, pos, "{")
+      local next_pos = json_accept(str, pos, "}")
+      if next_pos then return next_pos end
+      repeat
+         local key
+         key, pos = json_read_string(str, pos, false)
+         pos = json_expect(str, pos, ":")
+         pos = json_read_value(str, pos, value:add(key))
+         next_pos = json_accept(str, pos, ",")
+         pos = next_pos or pos
+      until not next_pos
+      return json_expect(str, pos, "}")
+
+   elseif value_type == RECORD then
+      -- Every field must appear exactly once.
+      value:reset()
+      local rc = value.iface.get_size(value.iface, value.self, v_size)
+      if rc ~= 0 then avro_error() end
+      local field_count = tonumber(v_size[0])
+      local seen, seen_count = {}, 0
+      pos = json_expect(str, pos, "{")
+      local next_pos = json_accept(str, pos, "}")
+      if next_pos then
+         pos = next_pos
+      else
+         repeat
+            local key
+            local key_pos = json_skip(str, pos)
+            key, pos = json_read_string(str, pos, false)
+            local child = value:get(key)
+            if not child then json_error(key_pos, "unknown record field") end
+            if seen[key] then json_error(key_pos, "duplicate record field") end
+            seen[key], seen_count = true, seen_count + 1
+            pos = json_expect(str, pos, ":")
+            pos = json_read_value(str, pos, child)
+            next_pos = json_accept(str, pos, ",")
+            pos = next_pos or pos
+         until not next_pos
+         pos = json_expect(str, pos, "}")
+      end
+      if seen_count < field_count then
+         json_error(pos, "missing record field")
+      end
+      return pos
+
+   elseif value_type == UNION then
+      local next_pos = json_accept_literal(str, pos, "null")
+      if next_pos then
+         if not value:get("null") then
+            json_error(pos, "union doesn't contain null")
+         end
+         return next_pos
+      end
+      pos = json_expect(str, pos, "{")
+      local branch_pos = json_skip(str, pos)
+      local branch_name
+      branch_name, pos = json_read_string(str, pos, false)
+      local branch = value:get(branch_name)
+      if not branch then json_error(branch_pos, "unknown union branch") end
+      pos = json_expect(str, pos, ":")
+      pos = json_read_value(str, pos, branch)
+      return json_expect(str, pos, "}")
+
+   else
+      error("Don't know how to decode JSON for value type "..
+            tostring(value_type))
+   end
+end
+
+function Value_class:set_from_json(json)
+   local pos = json_read_value(json, 1, self)
+   pos = json_skip(json, pos)
+   if pos <= #json then
+      json_error(pos, "extra data after value")
+   end
+end
+
 function Value_class:type()
    return self.iface.get_type(self.iface, self.self)
 end
@@ -1204,9 +2039,15 @@ function Value_class:release()
    if self.should_decref and self.self ~= nil then
       avro.avro_value_decref(self)
    end
+   if self.owner_self ~= nil then
+      v_owner.iface, v_owner.self = self.owner_iface, self.owner_self
+      avro.avro_value_decref(v_owner)
+   end
    self.iface = nil
    self.self = nil
    self.should_decref = false
+   self.owner_iface = nil
+   self.owner_self = nil
 end
 
 --[==[
@@ -1280,24 +2121,224 @@ function raw_decode_value(resolver, buf, size, dest)
    end
 end
 
-function ResolvedWriter_class:decode(buf, dest)
-   return raw_decode_value(self, buf, #buf, dest)
+-- The Avro C memory reader doesn't tell us how many bytes it read.  To
+-- be able to report that back to the caller, we make a second pass over
+-- the encoded value, skipping over it using its writer schema.  This is
+-- much cheaper than the decode itself, since we don't have to build up
+-- any values.
+--
+-- If the buffer ends partway through the value, the skip functions
+-- raise TRUNCATED, so that callers can tell that apart from invalid
+-- data, such as a negative length or a varint longer than 10 bytes,
+-- for which they raise an error message.
+
+local TRUNCATED = {}
+
+local function skip_truncated()
+   error(TRUNCATED)
 end
 
-function ResolvedWriter_mt:__gc()
-   if self.value.self ~= nil then
-      avro.avro_value_decref(self.value)
-      self.value.iface = nil
-      self.value.self = nil
+local function skip_long(buf, size, pos)
+   local result, scale = 0, 1
+   local start = pos
+   local b
+   repeat
+      if pos >= size then skip_truncated() end
+      if pos - start >= 10 then error "Varint is too long" end
+      b = buf[pos]
+      pos = pos + 1
+      result = result + (b % 128) * scale
+      scale = scale * 128
+   until b < 128
+
+   if result % 2 == 0 then
+      return result / 2, pos
+   else
+      return -(result + 1) / 2, pos
    end
+end
 
-   if self.resolver ~= nil then
-      self.resolver.decref_iface(self.resolver)
-      self.resolver = nil
-   end
+local function skip_bytes(size, pos, len)
+   if len < 0 then error "Invalid negative length" end
+   if pos + len > size then skip_truncated() end
+   return pos + len
 end
 
-function ResolvedWriter(wschema, rschema)
+local function skip_value(buf, size, pos, schema)
+   local schema_type = schema.type
+   local len
+
+   if schema_type == NULL then
+      return pos
+
+   elseif schema_type == BOOLEAN then
+      return skip_bytes(size, pos, 1)
+
+   elseif schema_type == INT
+       or schema_type == LONG
+       or schema_type == ENUM then
+      len, pos = skip_long(buf, size, pos)
+      return pos
+
+   elseif schema_type == FLOAT then
+      return skip_bytes(size, pos, 4)
+
+   elseif schema_type == DOUBLE then
+      return skip_bytes(size, pos, 8)
+
+   elseif schema_type == STRING or schema_type == BYTES then
+      len, pos = skip_long(buf, size, pos)
+      return skip_bytes(size, pos, len)
+
+   elseif schema_type == FIXED then
+      len = tonumber(avro.avro_schema_fixed_size(schema))
+      return skip_bytes(size, pos, len)
+
+   elseif schema_type == RECORD then
+      local field_count = tonumber(avro.avro_schema_record_size(schema))
+      for i = 0, field_count-1 do
+         local field_schema =
+            avro.avro_schema_record_field_get_by_index(schema, i)
+         pos = skip_value(buf, size, pos, field_schema)
+      end
+      return pos
+
+   elseif schema_type == ARRAY or schema_type == MAP then
+      local is_map = (schema_type == MAP)
+      local child_schema
+      if is_map then
+         child_schema = avro.avro_schema_map_values(schema)
+      else
+         child_schema = avro.avro_schema_array_items(schema)
+      end
+
+      local count
+      count, pos = skip_long(buf, size, pos)
+      while count ~= 0 do
+         if count < 0 then
+            -- A negative count is followed by the size of the block
+            -- in bytes, which lets us skip it all at once.
+            len, pos = skip_long(buf, size, pos)
+            pos = skip_bytes(size, pos, len)
+         else
+            for i = 1, count do
+               if is_map then
+                  len, pos = skip_long(buf, size, pos)
+                  pos = skip_bytes(size, pos, len)
+               end
+               pos = skip_value(buf, size, pos, child_schema)
+            end
+         end
+         count, pos = skip_long(buf, size, pos)
+      end
+      return pos
+
+   elseif schema_type == UNION then
+      len, pos = skip_long(buf, size, pos)
+      local branch_schema = avro.avro_schema_union_branch(schema, len)
+      if branch_schema == nil then avro_error() end
+      return skip_value(buf, size, pos, branch_schema)
+
+   elseif schema_type == LINK then
+      return skip_value(buf, size, pos, avro.avro_schema_link_target(schema))
+
+   else
+      error "Unknown schema type"
+   end
+end
+
+-- Reads in a buffer that we're going to decode from.  buf can be a Lua
+-- string, a light userdata, or a pointer cdata.  size is the size of
+-- the entire buffer; it defaults to the length of a string, and must
+-- be given for a pointer.  offset (default 0) is where in the buffer to
+-- start.  The result is the part of the buffer starting at offset.
+local function get_decode_buffer(buf, offset, size)
+   if type(buf) == "string" then
+      if size == nil then
+         size = #buf
+      elseif size > #buf then
+         error "Size is larger than the string"
+      end
+   elseif size == nil then
+      error "Need a size when decoding from a pointer"
+   elseif size < 0 then
+      error "Size cannot be negative"
+   end
+
+   offset = offset or 0
+   if offset < 0 or offset > size then
+      error "Offset is outside of the buffer"
+   end
+
+   return ffi.cast(const_uint8_t_p, buf) + offset, size - offset
+end
+
+-- Decode an Avro value using the given resolver.
+--
+--   resolver:decode(buf, dest, [offset], [size])
+--
+-- See get_decode_buffer for the meaning of buf, offset, and size.
+-- Being able to give an offset lets you decode several values out of a
+-- larger buffer without copying them into separate strings.  Returns
+-- the number of bytes that the value took up.
+function ResolvedWriter_class:decode(buf, dest, offset, size)
+   local ptr
+   ptr, size = get_decode_buffer(buf, offset, size)
+
+   avro.avro_reader_memory_set_source(
+      memory_reader, ffi.cast(char_p, ptr), size
+   )
+   avro.avro_resolved_writer_set_dest(self.value, dest)
+   local rc = avro.avro_value_read(memory_reader, self.value)
+   if rc ~= 0 then return get_avro_error() end
+
+   local iface = self.value.iface
+   local wschema = iface.get_schema(iface, self.value.self)
+   return skip_value(ptr, size, 0, wschema)
+end
+
+-- Returns the size of the next encoded value in a buffer, without
+-- decoding it.
+--
+--   resolver:datum_size(buf, [offset], [size])
+--
+-- Returns false if the buffer ends before the value does.
+function ResolvedWriter_class:datum_size(buf, offset, size)
+   local ptr
+   ptr, size = get_decode_buffer(buf, offset, size)
+
+   local iface = self.value.iface
+   local wschema = iface.get_schema(iface, self.value.self)
+   local ok, result = pcall(skip_value, ptr, size, 0, wschema)
+   if ok then
+      return result
+   elseif result == TRUNCATED then
+      return false
+   else
+      error(result, 0)
+   end
+end
+
+-- Copies part of a memory region into a Lua string.  Like
+-- raw_decode_value, there's no safety checking here.
+function raw_string(buf, offset, size)
+   return ffi.string(ffi.cast(char_p, buf) + offset, size)
+end
+
+function ResolvedWriter_mt:__gc()
+   if self.value.self ~= nil then
+      avro.avro_value_decref(self.value)
+      self.value.iface = nil
+      self.value.self = nil
+   end
+
+   if self.resolver ~= nil then
+      self.resolver.decref_iface(self.resolver)
+      self.resolver = nil
+   end
+end
+
+function ResolvedWriter(wschema, rschema)
    local resolver = LuaAvroResolvedWriter()
    wschema = wschema:raw_schema().self
    rschema = rschema:raw_schema().self
@@ -1316,14 +2357,59 @@ LuaAvroResolvedWriter = ffi.metatype([[LuaAvroResolvedWriter]], ResolvedWriter_m
 local DataInputFile_class = {}
 local DataInputFile_mt = { __index = DataInputFile_class }
 
-local function new_input_file(reader)
+-- If the file was opened with a reader schema, iface creates values of
+-- that schema, and we read into them through resolver, which is a
+-- resolved writer from the file's writer schema.  Any writer fields
+-- that aren't in the reader schema are skipped over without being
+-- decoded, so a reader schema that contains a subset of the writer's
+-- fields acts as a projection.  Otherwise resolver is NULL, and iface
+-- creates values of the writer schema.
+local function new_input_file(reader, header, rschema, path)
+   local wschema = avro.avro_file_reader_get_writer_schema(reader)
+   local resolver = nil
+   if rschema ~= nil then
+      resolver = avro.avro_resolved_writer_new(wschema, rschema)
+      if resolver == nil then
+         avro.avro_file_reader_close(reader)
+         avro_error()
+      end
+   end
+
    local l_reader = LuaAvroDataInputFile()
    l_reader.reader = reader
-   l_reader.wschema = avro.avro_file_reader_get_writer_schema(reader)
-   l_reader.iface = avro.avro_generic_class_from_schema(l_reader.wschema)
+   l_reader.wschema = wschema
+   l_reader.resolver = resolver
+   if resolver == nil then
+      l_reader.iface = avro.avro_generic_class_from_schema(wschema)
+   else
+      l_reader.iface = avro.avro_generic_class_from_schema(rschema)
+      local rc =
+         avro.avro_resolved_writer_new_value(resolver, l_reader.resolved)
+      if rc ~= 0 then
+         -- Closing the file frees the reader and resolver, so we grab
+         -- the error message first.
+         local _, err = get_avro_error()
+         l_reader:close()
+         error(err)
+      end
+   end
+   ffi.copy(l_reader.header.codec, header.codec)
+   ffi.copy(l_reader.header.sync, header.sync, 16)
+   l_reader.header.size = header.size
+   l_reader.path = ffi.C.malloc(#path + 1)
+   ffi.copy(l_reader.path, path)
    return l_reader
 end
 
+-- Returns a table describing the header of the container file at the
+-- given path: the name of its compression codec, its sync marker, and
+-- the size of the header in bytes.
+file_header = L.file_header
+
+function DataInputFile_class:codec()
+   return ffi.string(self.header.codec)
+end
+
 function DataInputFile_class:schema_json()
    avro.avro_writer_memory_set_dest(memory_writer, static_buf, static_size)
    local rc = avro.avro_schema_to_json(self.wschema, memory_writer)
@@ -1332,6 +2418,453 @@ function DataInputFile_class:schema_json()
    return ffi.string(static_buf, length)
 end
 
+-- Constants from the C library that we need to map files into memory.
+-- Their values vary between platforms, so the legacy module exports
+-- them from the system headers.
+local EOF = L.EOF
+local EILSEQ = L.EILSEQ
+local EINVAL = L.EINVAL
+local ENOMEM = L.ENOMEM
+local O_RDONLY = L.O_RDONLY
+local SEEK_END = L.SEEK_END
+local PROT_READ = L.PROT_READ
+local MAP_PRIVATE = L.MAP_PRIVATE
+local MADV_SEQUENTIAL = L.MADV_SEQUENTIAL
+local MAP_FAILED = ffi.cast(void_p, -1)
+
+-- Maps the file at the given path into memory, with a hint that we'll
+-- mostly read it sequentially.  Returns the mapping and its size, or
+-- nil and an error message.
+local function map_file(path)
+   local fd = ffi.C.open(path, O_RDONLY)
+   if fd < 0 then return nil, "Cannot open file "..path end
+   local size = ffi.C.lseek(fd, 0, SEEK_END)
+   if size <= 0 then
+      ffi.C.close(fd)
+      return nil, "Not an Avro container file"
+   end
+   local map = ffi.C.mmap(nil, size, PROT_READ, MAP_PRIVATE, fd, 0)
+   ffi.C.close(fd)
+   if map == MAP_FAILED then return nil, "Cannot map file "..path end
+   ffi.C.madvise(map, size, MADV_SEQUENTIAL)
+   return map, size
+end
+
+-- Releases the memory that an input file reads its blocks from: either
+-- a mapping of the file, or a copy of an in-memory container file.
+local function release_map(map, size, is_copy)
+   if is_copy then
+      ffi.C.free(ffi.cast(void_p, map))
+   else
+      ffi.C.munmap(ffi.cast(void_p, map), size)
+   end
+end
+
+-- Makes sure that an input file is memory-mapped.  Files that were
+-- opened without the mmap option are mapped the first time that we
+-- need to find a block.
+local function input_file_map(self)
+   if self.map ~= nil then return 0 end
+   local map, size = map_file(ffi.string(self.path))
+   if not map then
+      avro.avro_set_error("%s", size)
+      return EINVAL
+   end
+   self.map = map
+   self.map_size = size
+   return 0
+end
+
+-- Reads the header of the block at the given offset in a memory-mapped
+-- file, and checks for the sync marker that should follow it.  Returns
+-- 0, the offsets of the start and end of the block's data, and the
+-- number of records in it; or an error code.
+local function read_block_header(self, offset)
+   local map_size = tonumber(self.map_size)
+   local count, size, pos
+   count, pos = skip_long(self.map, map_size, offset)
+   size, pos = skip_long(self.map, map_size, pos)
+   return count, size, pos
+end
+
+local function mapped_file_find_block(self, offset)
+   local ok, count, size, pos = pcall(read_block_header, self, offset)
+   if not ok or count < 0 or size < 0 or
+      pos + size + 16 > self.map_size then
+      avro.avro_set_error("Invalid block header at offset %lld",
+                          ffi.cast("long long", offset))
+      return EILSEQ
+   end
+
+   if ffi.C.memcmp(self.map + pos + size, self.header.sync, 16) ~= 0 then
+      avro.avro_set_error("Missing sync marker at offset %lld",
+                          ffi.cast("long long", pos + size))
+      return EILSEQ
+   end
+
+   return 0, pos, pos + size, count
+end
+
+-- Starts reading the block at the given offset of a memory-mapped file.
+-- Blocks that use the null codec are decoded straight from the mapping,
+-- without being copied anywhere first.  Other blocks are decompressed
+-- by block_file, a file reader that sees the file header followed by a
+-- copy of the block in block_buf.
+local function mapped_file_start_block(self, offset)
+   local rc, data, block_end, count = mapped_file_find_block(self, offset)
+   if rc ~= 0 then return rc end
+   self.block_data = data
+   self.block_end = block_end
+
+   if self.block_file ~= nil then
+      avro.avro_file_reader_close(self.block_file)
+      self.block_file = nil
+   end
+   if self.block_buf ~= nil then
+      ffi.C.free(self.block_buf)
+      self.block_buf = nil
+   end
+
+   if ffi.string(self.header.codec) == "null" then
+      if self.block_reader == nil then
+         self.block_reader = avro.avro_reader_memory(nil, 0)
+      end
+      avro.avro_reader_memory_set_source(
+         self.block_reader, ffi.cast(char_p, self.map + data),
+         block_end - data
+      )
+   else
+      local header_size = tonumber(self.header.size)
+      local block_size = block_end + 16 - offset
+      local buf = ffi.C.malloc(header_size + block_size)
+      if buf == nil then
+         avro.avro_set_error("Out of memory")
+         return ENOMEM
+      end
+      self.block_buf = buf
+      ffi.copy(buf, self.map, header_size)
+      ffi.copy(self.block_buf + header_size, self.map + offset, block_size)
+
+      local fp = ffi.C.fmemopen(buf, header_size + block_size, "rb")
+      if fp == nil then
+         avro.avro_set_error("Cannot read block")
+         return EINVAL
+      end
+      -- The reader closes the stream, even if it can't be created.
+      local reader = ffi.new(avro_file_reader_t_ptr)
+      rc = avro.avro_file_reader_fp(fp, self.path, 1, reader)
+      if rc ~= 0 then return rc end
+      self.block_file = reader[0]
+   end
+
+   self.pos = block_end + 16
+   self.block_remaining = count
+   return 0
+end
+
+local function mapped_file_read_value(self, dest)
+   while self.block_remaining == 0 do
+      if self.pos >= self.map_size then
+         avro.avro_set_error("Reached end of file")
+         return EOF
+      end
+      local rc = mapped_file_start_block(self, tonumber(self.pos))
+      if rc ~= 0 then return rc end
+   end
+
+   local rc
+   if self.block_file ~= nil then
+      rc = avro.avro_file_reader_read_value(self.block_file, dest)
+   else
+      rc = avro.avro_value_read(self.block_reader, dest)
+   end
+   if rc == 0 then
+      self.block_remaining = self.block_remaining - 1
+   end
+   return rc
+end
+
+-- Skips over the next n records in the current block of a
+-- memory-mapped file.  We can skip over uncompressed records without
+-- decoding them; compressed ones are decoded into a scratch value.
+local function skip_records(self, n)
+   local pos = tonumber(self.block_data)
+   local block_end = tonumber(self.block_end)
+   for i = 1, n do
+      pos = skip_value(self.map, block_end, pos, self.wschema)
+   end
+   return pos
+end
+
+local function mapped_file_skip(self, n)
+   local rc = 0
+   if self.block_file == nil then
+      local ok, pos = pcall(skip_records, self, n)
+      if not ok then
+         avro.avro_set_error("Truncated block at offset %lld",
+                             ffi.cast("long long", self.block_data))
+         return EILSEQ
+      end
+      avro.avro_reader_memory_set_source(
+         self.block_reader, ffi.cast(char_p, self.map + pos),
+         self.block_end - pos
+      )
+   elseif n > 0 then
+      local iface = avro.avro_generic_class_from_schema(self.wschema)
+      if iface == nil then return ENOMEM end
+      local scratch = LuaAvroValue()
+      rc = avro.avro_generic_value_new(iface, scratch)
+      if rc == 0 then
+         for i = 1, n do
+            rc = avro.avro_file_reader_read_value(self.block_file, scratch)
+            if rc ~= 0 then break end
+         end
+         avro.avro_value_decref(scratch)
+      end
+      iface.decref_iface(iface)
+   end
+
+   self.block_remaining = self.block_remaining - n
+   return rc
+end
+
+-- Reads the next record from the file into a value that must be an
+-- instance of the writer schema.
+local function input_file_read_writer_value(self, dest)
+   local rc
+   if self.mapped_reads then
+      rc = mapped_file_read_value(self, dest)
+   else
+      rc = avro.avro_file_reader_read_value(self.reader, dest)
+   end
+   if rc == 0 then
+      self.record_index = self.record_index + 1
+   end
+   return rc
+end
+
+local function input_file_read_value(self, value)
+   local dest = value
+   if self.resolver ~= nil then
+      avro.avro_resolved_writer_set_dest(self.resolved, value)
+      dest = self.resolved
+   end
+   return input_file_read_writer_value(self, dest)
+end
+
+-- Block indexes
+
+-- Stores a block index in an input file.  block_offsets[i] is the
+-- offset of block i, and block_firsts[i] is the ordinal of its first
+-- record; block_firsts[block_count] is the number of records in the
+-- file.
+local function set_block_index(self, offsets, firsts)
+   local count = #offsets
+   local c_offsets = ffi.C.malloc(math.max(count, 1) * 8)
+   local c_firsts = ffi.C.malloc((count + 1) * 8)
+   if c_offsets == nil or c_firsts == nil then
+      ffi.C.free(c_offsets)
+      ffi.C.free(c_firsts)
+      avro.avro_set_error("Out of memory")
+      return ENOMEM
+   end
+   self.block_offsets = c_offsets
+   self.block_firsts = c_firsts
+   for i = 1, count do
+      self.block_offsets[i-1] = offsets[i]
+      self.block_firsts[i-1] = firsts[i]
+   end
+   self.block_firsts[count] = firsts[count+1]
+   self.block_count = count
+   return 0
+end
+
+-- Builds the block index of an input file by walking through the block
+-- headers in its mapping.  We don't have to decode or decompress any of
+-- the blocks to do this.
+local function input_file_build_index(self)
+   local offsets, firsts = {}, {}
+   local offset = tonumber(self.header.size)
+   local map_size = tonumber(self.map_size)
+   local first = 0
+   while offset < map_size do
+      local rc, data, block_end, count = mapped_file_find_block(self, offset)
+      if rc ~= 0 then return rc end
+      offsets[#offsets+1] = offset
+      firsts[#firsts+1] = first
+      first = first + count
+      offset = block_end + 16
+   end
+   firsts[#firsts+1] = first
+   return set_block_index(self, offsets, firsts)
+end
+
+-- Makes sure that we have a block index for an input file.
+local function input_file_index(self)
+   if self.block_offsets ~= nil then return 0 end
+   local rc = input_file_map(self)
+   if rc ~= 0 then return rc end
+   return input_file_build_index(self)
+end
+
+-- Positions an input file so that the next record we read is the one
+-- with the given ordinal, counting from 0.  From now on we read blocks
+-- straight from the file's mapping, since that's the only way to jump
+-- to a block.  If there are empty blocks, we use the last block that
+-- starts at the ordinal, since that's the one that the record is
+-- actually in.
+local function input_file_seek(self, index)
+   local rc = input_file_index(self)
+   if rc ~= 0 then return rc end
+   local count = tonumber(self.block_count)
+   local total = tonumber(self.block_firsts[count])
+   if index < 0 or index > total then
+      avro.avro_set_error("Record %lld is out of range",
+                          ffi.cast("long long", index + 1))
+      return EINVAL
+   end
+
+   self.mapped_reads = true
+   self.record_index = index
+   if index == total then
+      -- Seeking to the end of the file
+      self.pos = self.map_size
+      self.block_remaining = 0
+      return 0
+   end
+
+   local lo, hi = 0, count
+   while hi - lo > 1 do
+      local mid = math.floor((lo + hi) / 2)
+      if self.block_firsts[mid] <= index then
+         lo = mid
+      else
+         hi = mid
+      end
+   end
+
+   rc = mapped_file_start_block(self, tonumber(self.block_offsets[lo]))
+   if rc ~= 0 then return rc end
+   return mapped_file_skip(self, tonumber(index - self.block_firsts[lo]))
+end
+
+-- A block index can be saved in a sidecar file, so that we don't have
+-- to rebuild it every time we open a file.  The format is the same as
+-- the legacy module's: a magic number and the container file's sync
+-- marker, followed by zig-zag varints for the size of the container
+-- file, the number of blocks, the differences between each block's
+-- offset and first record and the previous block's, and finally the
+-- number of records in the file.
+local INDEX_MAGIC = "AvI\1"
+
+local function encode_long(parts, value)
+   -- Every value in an index is non-negative, so its zig-zag encoding
+   -- is just twice its value.
+   local n = value * 2
+   repeat
+      local b = n % 128
+      n = (n - b) / 128
+      if n ~= 0 then b = b + 128 end
+      parts[#parts+1] = string.char(b)
+   until n == 0
+end
+
+local function decode_long(str, pos)
+   local buf = ffi.cast(const_uint8_t_p, str)
+   local ok, value, new_pos = pcall(skip_long, buf, #str, pos)
+   if not ok then return nil end
+   return value, new_pos
+end
+
+local function input_file_write_index(self, path)
+   local rc = input_file_index(self)
+   if rc ~= 0 then return rc end
+
+   local parts = { INDEX_MAGIC, ffi.string(self.header.sync, 16) }
+   local count = tonumber(self.block_count)
+   local prev_offset, prev_first = 0, 0
+   encode_long(parts, tonumber(self.map_size))
+   encode_long(parts, count)
+   for i = 0, count-1 do
+      local offset = tonumber(self.block_offsets[i])
+      local first = tonumber(self.block_firsts[i])
+      encode_long(parts, offset - prev_offset)
+      encode_long(parts, first - prev_first)
+      prev_offset, prev_first = offset, first
+   end
+   encode_long(parts, tonumber(self.block_firsts[count]) - prev_first)
+
+   local f = io.open(path, "wb")
+   if not f then
+      avro.avro_set_error("Cannot open file %s", path)
+      return EINVAL
+   end
+   local ok = f:write(table.concat(parts))
+   f:close()
+   if not ok then
+      avro.avro_set_error("Cannot write block index")
+      return EINVAL
+   end
+   return 0
+end
+
+-- Loads an input file's block index from a sidecar file.  If the
+-- sidecar doesn't exist, or doesn't match the file, we return an error
+-- and leave the file without an index, so that we'll build one when we
+-- need it.
+local function input_file_read_index(self, path)
+   local rc = input_file_map(self)
+   if rc ~= 0 then return rc end
+
+   local f = io.open(path, "rb")
+   if not f then
+      avro.avro_set_error("Cannot open file %s", path)
+      return EINVAL
+   end
+   local str = f:read("*a")
+   f:close()
+
+   local function invalid()
+      avro.avro_set_error("Invalid block index %s", path)
+      return EILSEQ
+   end
+
+   if not str or #str < 20 or
+      str:sub(1, 4) ~= INDEX_MAGIC or
+      str:sub(5, 20) ~= ffi.string(self.header.sync, 16) then
+      return invalid()
+   end
+
+   local pos = 20
+   local file_size, count
+   file_size, pos = decode_long(str, pos)
+   if file_size ~= tonumber(self.map_size) then return invalid() end
+   count, pos = decode_long(str, pos)
+   if not count or count < 0 or count > file_size then return invalid() end
+
+   local offsets, firsts = {}, {}
+   local offset, first, delta = 0, 0
+   for i = 1, count do
+      delta, pos = decode_long(str, pos)
+      if not delta then return invalid() end
+      -- Blocks start after the header, in increasing order, and inside
+      -- the file.
+      if delta < (i == 1 and tonumber(self.header.size) or 1) or
+         offset + delta >= file_size then
+         return invalid()
+      end
+      offset = offset + delta
+      delta, pos = decode_long(str, pos)
+      if not delta or delta < 0 then return invalid() end
+      first = first + delta
+      offsets[i], firsts[i] = offset, first
+   end
+   delta, pos = decode_long(str, pos)
+   if not delta or delta < 0 then return invalid() end
+   firsts[count+1] = first + delta
+   return set_block_index(self, offsets, firsts)
+end
+
 function DataInputFile_class:read_raw(value)
    if not value then
       value = LuaAvroValue()
@@ -1339,7 +2872,7 @@ function DataInputFile_class:read_raw(value)
       if rc ~= 0 then avro_error() end
       value.should_decref = true
 
-      local rc = avro.avro_file_reader_read_value(self.reader, value)
+      local rc = input_file_read_value(self, value)
       if rc ~= 0 then
          value:release()
          return get_avro_error()
@@ -1347,16 +2880,376 @@ function DataInputFile_class:read_raw(value)
       return value
    end
 
-   local rc = avro.avro_file_reader_read_value(self.reader, value)
+   local rc = input_file_read_value(self, value)
    if rc ~= 0 then return get_avro_error() end
    return value
 end
 
+-- Reads up to n values in a single call, into the array-like table
+-- values.  Existing values in the table are reused; empty slots are
+-- filled in with new values, which are owned by the table and must be
+-- released like any other value.  If n is nil, we fill in every slot
+-- that's already in the table.  Returns the number of values read; a
+-- short count means that we've reached the end of the file, in which
+-- case the error message is returned as a second result.  Any other
+-- error is raised.
+function DataInputFile_class:read_batch(n, values)
+   n = n or #values
+   for i = 1, n do
+      local value = values[i]
+      if not value then
+         value = LuaAvroValue()
+         local rc = avro.avro_generic_value_new(self.iface, value)
+         if rc ~= 0 then avro_error() end
+         value.should_decref = true
+         values[i] = value
+      end
+
+      local rc = input_file_read_value(self, value)
+      if rc == EOF then
+         return i-1, ffi.string(avro.avro_strerror())
+      end
+      if rc ~= 0 then avro_error() end
+   end
+   return n
+end
+
+-- Columnar reads
+
+local uint8_t_array = ffi.typeof([[uint8_t[?] ]])
+local int32_t_array = ffi.typeof([[int32_t[?] ]])
+
+local COLUMN_TYPES = {
+   [BOOLEAN] = { name = "boolean", array = uint8_t_array },
+   [INT] = { name = "int", array = int32_t_array, get = "get_int" },
+   [LONG] = { name = "long", array = ffi.typeof([[int64_t[?] ]]),
+              get = "get_long" },
+   [FLOAT] = { name = "float", array = ffi.typeof([[float[?] ]]),
+               get = "get_float" },
+   [DOUBLE] = { name = "double", array = ffi.typeof([[double[?] ]]),
+                get = "get_double" },
+   [ENUM] = { name = "enum", array = int32_t_array, get = "get_enum" },
+   [STRING] = { name = "string", varlen = true },
+   [BYTES] = { name = "bytes", varlen = true },
+}
+
+-- Works out the layout of each column of a batch from the writer
+-- schema, which must be a record whose fields are primitives, enums, or
+-- unions of null and one of those.
+local function column_layout(wschema)
+   if wschema.type ~= RECORD then
+      error "Columnar reads need a file of records"
+   end
+
+   local layout = {}
+   local field_count = tonumber(avro.avro_schema_record_size(wschema))
+   for i = 0, field_count-1 do
+      local name = ffi.string(avro.avro_schema_record_field_name(wschema, i))
+      local schema = avro.avro_schema_record_field_get_by_index(wschema, i)
+      local null_branch
+      if schema.type == UNION and avro.avro_schema_union_size(schema) == 2 then
+         local first = avro.avro_schema_union_branch(schema, 0)
+         local second = avro.avro_schema_union_branch(schema, 1)
+         if first.type == NULL then
+            null_branch, schema = 0, second
+         elseif second.type == NULL then
+            null_branch, schema = 1, first
+         end
+      end
+
+      local column_type = COLUMN_TYPES[schema.type]
+      if not column_type then
+         error("Field "..name.." can't be read as a column")
+      end
+      layout[i+1] = {
+         name = name,
+         schema = schema,
+         column_type = column_type,
+         null_branch = null_branch,
+      }
+   end
+   return layout
+end
+
+local function new_column(spec, n)
+   local column_type = spec.column_type
+   local column = { name = spec.name, type = column_type.name }
+   if column_type.varlen then
+      column.offsets = int32_t_array(n+1)
+      column.data = uint8_t_array(64)
+      column.data_capacity = 64
+      column.data_size = 0
+   else
+      column.values = column_type.array(n)
+   end
+   if spec.null_branch then
+      column.validity = uint8_t_array(math.floor((n+7) / 8))
+   end
+   return column
+end
+
+local function append_data(column, ptr, size)
+   local needed = column.data_size + size
+   -- The offsets, like Arrow's "u" and "z" formats, are 32 bits wide.
+   if needed > 0x7fffffff then
+      error("Column "..column.name.." is too large for 32-bit offsets")
+   end
+   if needed > column.data_capacity then
+      local capacity = column.data_capacity
+      while capacity < needed do capacity = capacity * 2 end
+      local data = uint8_t_array(capacity)
+      ffi.copy(data, column.data, column.data_size)
+      column.data = data
+      column.data_capacity = capacity
+   end
+   ffi.copy(column.data + column.data_size, ptr, size)
+   column.data_size = needed
+end
+
+local function read_column_value(column, column_type, value, i)
+   local rc
+   if column_type.varlen then
+      if column_type.name == "string" then
+         rc = value.iface.get_string(value.iface, value.self,
+                                     v_const_char_p, v_size)
+         -- The size includes the NUL terminator, which we don't store.
+         if rc == 0 then append_data(column, v_const_char_p[0], v_size[0]-1) end
+      else
+         rc = value.iface.get_bytes(value.iface, value.self,
+                                    v_const_void_p, v_size)
+         if rc == 0 then append_data(column, v_const_void_p[0], v_size[0]) end
+      end
+   elseif column_type.get then
+      rc = value.iface[column_type.get](value.iface, value.self,
+                                        column.values + i)
+   else
+      rc = value.iface.get_boolean(value.iface, value.self, v_int)
+      if rc == 0 then column.values[i] = v_int[0] end
+   end
+   return rc
+end
+
+local column_field, column_branch
+
+-- Adds each field of record to the ith entry of its column.
+local function read_column_row(layout, columns, record, i)
+   for c, spec in ipairs(layout) do
+      local column = columns[spec.name]
+      local rc = record.iface.get_by_index(record.iface, record.self,
+                                           c-1, column_field, nil)
+      if rc ~= 0 then return rc end
+
+      local value = column_field
+      if spec.null_branch then
+         rc = value.iface.get_discriminant(value.iface, value.self, v_int)
+         if rc ~= 0 then return rc end
+         if v_int[0] == spec.null_branch then
+            value = nil
+         else
+            rc = value.iface.get_current_branch(value.iface, value.self,
+                                                column_branch)
+            if rc ~= 0 then return rc end
+            value = column_branch
+            local byte = math.floor(i / 8)
+            column.validity[byte] =
+               bit.bor(column.validity[byte], bit.lshift(1, i % 8))
+         end
+      end
+
+      if value then
+         rc = read_column_value(column, spec.column_type, value, i)
+         if rc ~= 0 then return rc end
+      end
+      if spec.column_type.varlen then
+         column.offsets[i+1] = column.data_size
+      end
+   end
+   return 0
+end
+
+-- The largest batch that a columnar read will allocate.
+local MAX_BATCH_SIZE = 2^24
+
+-- Returns the number of records that a columnar read should read: n,
+-- or if that's nil, the rest of the current block of a memory-mapped
+-- file.  Returns 0 if we've reached the end of the file.
+local function batch_size(self, n)
+   if n then
+      if type(n) ~= "number" or n % 1 ~= 0 or
+         n <= 0 or n > MAX_BATCH_SIZE then
+         error "Batch size out of range"
+      end
+      return n
+   end
+
+   if not self.mapped_reads then
+      error "Can only read a whole block from a memory-mapped file"
+   end
+   while self.block_remaining == 0 and self.pos < self.map_size do
+      local rc = mapped_file_start_block(self, tonumber(self.pos))
+      if rc ~= 0 then avro_error() end
+   end
+   return tonumber(self.block_remaining)
+end
+
+-- Reads up to n records into a batch whose columns store their entries
+-- in C arrays indexed from 0, which is also what we export to Arrow.
+-- Numeric and enum columns store their entries in an array called
+-- values.  String and bytes columns concatenate their entries into a
+-- single array called data, with data_size bytes of content; entry i
+-- spans offsets[i] to offsets[i+1].  Boolean columns use one uint8_t
+-- per entry.  Nullable columns also have a validity bitmap, in which
+-- bit (i % 8) of byte (i / 8) is set if entry i isn't null; the values
+-- of null entries are unspecified.
+local function read_column_arrays(self, n)
+   local layout = column_layout(self.wschema)
+   n = batch_size(self, n)
+   if n == 0 then return nil, "Reached end of file" end
+
+   if not column_field then
+      column_field = LuaAvroValue()
+      column_branch = LuaAvroValue()
+   end
+
+   local iface = avro.avro_generic_class_from_schema(self.wschema)
+   if iface == nil then avro_error() end
+   local record = LuaAvroValue()
+   local rc = avro.avro_generic_value_new(iface, record)
+   iface.decref_iface(iface)
+   if rc ~= 0 then avro_error() end
+   record.should_decref = true
+   -- Filling in the columns can raise a Lua error, so the record is
+   -- freed by a finalizer until we release it ourselves.
+   ffi.gc(record, record.release)
+
+   local fields, columns = {}, {}
+   for c, spec in ipairs(layout) do
+      fields[c] = spec.name
+      columns[spec.name] = new_column(spec, n)
+   end
+
+   local count = 0
+   while count < n do
+      rc = input_file_read_writer_value(self, record)
+      if rc == EOF then break end
+      if rc == 0 then
+         rc = read_column_row(layout, columns, record, count)
+      end
+      if rc ~= 0 then
+         ffi.gc(record, nil):release()
+         avro_error()
+      end
+      count = count + 1
+   end
+   ffi.gc(record, nil):release()
+
+   if count == 0 then return get_avro_error() end
+   return { count = count, fields = fields, columns = columns }
+end
+
+-- Reads up to n records into a columnar batch.  The file's writer
+-- schema must be a record whose fields are primitives, enums, or unions
+-- of null and one of those.  The batch has the same fields in both
+-- backends:
+--
+--   batch.count     the number of records read
+--   batch.fields    the field names, in order
+--   batch.columns   maps each field name to a column
+--
+-- Each column has name and type fields; type is the name of the
+-- column's non-null schema type.  In this backend, the entries are in
+-- C arrays indexed from 0, as described for read_column_arrays, so
+-- that reading a batch doesn't create a Lua value for each entry.  (The
+-- legacy backend can't hand out C arrays, so it uses Lua tables indexed
+-- from 1 instead; see its l_input_file_read_columns.)
+--
+-- If n is nil, we read the rest of the current block.  Returns nil and
+-- an error message if there are no more records, and raises an error
+-- if a record can't be read.
+function DataInputFile_class:read_columns(n)
+   return read_column_arrays(self, n)
+end
+
+-- Positions the file so that the next value read is the nth record in
+-- the file, counting from 1.  Seeking to one past the last record
+-- positions the file at its end.
+function DataInputFile_class:seek(n)
+   if input_file_seek(self, n - 1) ~= 0 then return get_avro_error() end
+   return self
+end
+
+-- Returns the position of the next record that will be read, counting
+-- from 1.
+function DataInputFile_class:tell()
+   return tonumber(self.record_index) + 1
+end
+
+-- Positions the file at the first block that starts at or after the
+-- given byte offset, and returns the position of that block's first
+-- record.
+function DataInputFile_class:sync(offset)
+   if input_file_index(self) ~= 0 then return get_avro_error() end
+   local lo, hi = 0, tonumber(self.block_count)
+   while lo < hi do
+      local mid = math.floor((lo + hi) / 2)
+      if self.block_offsets[mid] < offset then
+         lo = mid + 1
+      else
+         hi = mid
+      end
+   end
+
+   local index = tonumber(self.block_firsts[lo])
+   if input_file_seek(self, index) ~= 0 then return get_avro_error() end
+   return index + 1
+end
+
+-- Returns the number of records in the file, and the number of blocks
+-- that they're stored in.
+function DataInputFile_class:record_count()
+   if input_file_index(self) ~= 0 then return get_avro_error() end
+   local count = tonumber(self.block_count)
+   return tonumber(self.block_firsts[count]), count
+end
+
+-- Saves the file's block index to a sidecar file, which can be passed
+-- in as the index option the next time the file is opened.
+function DataInputFile_class:write_index(path)
+   if input_file_write_index(self, path) ~= 0 then return get_avro_error() end
+   return true
+end
+
 function DataInputFile_class:close()
    if self.reader ~= nil then
       avro.avro_file_reader_close(self.reader)
       self.reader = nil
    end
+   if self.block_reader ~= nil then
+      avro.avro_reader_free(self.block_reader)
+      self.block_reader = nil
+   end
+   if self.block_file ~= nil then
+      avro.avro_file_reader_close(self.block_file)
+      self.block_file = nil
+   end
+   if self.block_buf ~= nil then
+      ffi.C.free(self.block_buf)
+      self.block_buf = nil
+   end
+   if self.map ~= nil then
+      release_map(self.map, self.map_size, self.map_is_copy)
+      self.map = nil
+   end
+   if self.block_offsets ~= nil then
+      ffi.C.free(self.block_offsets)
+      ffi.C.free(self.block_firsts)
+      self.block_offsets = nil
+      self.block_firsts = nil
+   end
+   if self.path ~= nil then
+      ffi.C.free(self.path)
+      self.path = nil
+   end
    self.wschema = nil
    if self.iface ~= nil then
       if self.iface.decref_iface ~= nil then
@@ -1364,6 +3257,15 @@ function DataInputFile_class:close()
       end
       self.iface = nil
    end
+   if self.resolved.self ~= nil then
+      avro.avro_value_decref(self.resolved)
+      self.resolved.iface = nil
+      self.resolved.self = nil
+   end
+   if self.resolver ~= nil then
+      self.resolver.decref_iface(self.resolver)
+      self.resolver = nil
+   end
 end
 
 DataInputFile_mt.__gc = DataInputFile_class.close
@@ -1375,35 +3277,851 @@ local DataOutputFile_mt = { __index = DataOutputFile_class }
 function DataOutputFile_class:write_raw(value)
    local rc = avro.avro_file_writer_append_value(self.writer, value)
    if rc ~= 0 then avro_error() end
+
+   -- End the current block if we've reached the records_per_block
+   -- limit.
+   if self.records_per_block > 0 then
+      self.block_records = self.block_records + 1
+      if self.block_records >= self.records_per_block then
+         self:sync()
+      end
+   end
+end
+
+-- Writes the first n values of an array-like table in a single call.
+-- If n is nil, we write every value in the table.
+function DataOutputFile_class:write_batch(values, n)
+   for i = 1, n or #values do
+      self:write_raw(values[i])
+   end
+end
+
+-- Ends the current block, writing it and a sync marker to the file.
+function DataOutputFile_class:sync()
+   local rc = avro.avro_file_writer_sync(self.writer)
+   if rc ~= 0 then avro_error() end
+   self.block_records = 0
 end
 
+-- Closes the writer.  The contents of an in-memory file are still
+-- available after it's closed.
 function DataOutputFile_class:close()
    if self.writer ~= nil then
       avro.avro_file_writer_close(self.writer)
       self.writer = nil
    end
+   if self.mem_fp ~= nil then
+      ffi.C.fclose(self.mem_fp)
+      self.mem_fp = nil
+   end
 end
 
-DataOutputFile_mt.__gc = DataOutputFile_class.close
+-- Returns the contents of an in-memory container file as a string.  If
+-- the file is still open, we end the current block first, so that the
+-- result is always a complete container file.
+function DataOutputFile_class:contents()
+   if self.mem_buf == nil and self.mem_fp == nil then
+      error "Not an in-memory file"
+   end
+   if self.writer ~= nil then
+      local rc = avro.avro_file_writer_flush(self.writer)
+      if rc ~= 0 then avro_error() end
+      self.block_records = 0
+   end
+   if self.mem_fp ~= nil then
+      ffi.C.fflush(self.mem_fp)
+   end
+   return ffi.string(self.mem_buf, self.mem_size)
+end
+
+function DataOutputFile_mt:__gc()
+   self:close()
+   if self.mem_buf ~= nil then
+      ffi.C.free(self.mem_buf)
+      self.mem_buf = nil
+   end
+end
 LuaAvroDataOutputFile = ffi.metatype([[LuaAvroDataOutputFile]], DataOutputFile_mt)
+local LuaAvroDataOutputFile_p = ffi.typeof([[LuaAvroDataOutputFile *]])
+
+------------------------------------------------------------------------
+-- Arrow C Data Interface
+
+-- Record batches can be exported to, and imported from, the Arrow C
+-- Data Interface.  It's a plain C ABI, so we define its structs
+-- ourselves, unless some other module has already done so.  A batch is
+-- a struct array with a child for each field of the record schema,
+-- using the same layout as read_column_arrays; enums are exported as
+-- dictionary-encoded int32 columns.  Structs can be passed in as FFI
+-- pointers or light userdata.
+
+if not pcall(ffi.typeof, [[struct ArrowSchema]]) then
+   ffi.cdef [[
+struct ArrowSchema {
+    const char  *format;
+    const char  *name;
+    const char  *metadata;
+    int64_t  flags;
+    int64_t  n_children;
+    struct ArrowSchema  **children;
+    struct ArrowSchema  *dictionary;
+    void (*release)(struct ArrowSchema *);
+    void  *private_data;
+};
+
+struct ArrowArray {
+    int64_t  length;
+    int64_t  null_count;
+    int64_t  offset;
+    int64_t  n_buffers;
+    int64_t  n_children;
+    const void  **buffers;
+    struct ArrowArray  **children;
+    struct ArrowArray  *dictionary;
+    void (*release)(struct ArrowArray *);
+    void  *private_data;
+};
+]]
+end
+
+local ArrowSchema_p = ffi.typeof([[struct ArrowSchema *]])
+local ArrowArray_p = ffi.typeof([[struct ArrowArray *]])
+local ArrowSchema_pp = ffi.typeof([[struct ArrowSchema **]])
+local ArrowArray_pp = ffi.typeof([[struct ArrowArray **]])
+local const_void_pp = ffi.typeof([[const void **]])
+local int32_t_p = ffi.typeof([[int32_t *]])
+
+local ARROW_FLAG_NULLABLE = 2
+
+-- The format strings are never freed, so we keep them here.
+local ARROW_FORMATS = {}
+for _, format in ipairs { "+s", "b", "i", "l", "f", "g", "u", "z" } do
+   ARROW_FORMATS[format] = ffi.new("char[?]", #format + 1, format)
+end
+
+local ARROW_COLUMN_FORMATS = {
+   boolean = "b", int = "i", long = "l", float = "f", double = "g",
+   enum = "i", string = "u", bytes = "z",
+}
+
+local function malloc_copy(src, size)
+   local dest = ffi.C.malloc(math.max(size, 8))
+   if dest == nil then error "Out of memory" end
+   if size > 0 then ffi.copy(dest, src, size) end
+   return dest
+end
+
+local function calloc_pointers(ctype, count)
+   local ptrs = ffi.C.malloc(math.max(count, 1) * ffi.sizeof(void_p))
+   if ptrs == nil then error "Out of memory" end
+   ffi.fill(ptrs, math.max(count, 1) * ffi.sizeof(void_p))
+   return ffi.cast(ctype, ptrs)
+end
+
+-- The release callbacks free everything that we allocated for a schema
+-- or array, including any children that the consumer hasn't moved out.
+-- Consumers can call them from any thread, or from JIT-compiled code,
+-- so they can't be Lua callbacks; we use the legacy module's C
+-- functions instead.  Those free each struct, name, buffer, and child
+-- list with free, so we allocate all of them with malloc.
+
+local release_schema, release_array = L.arrow_release_functions()
+local arrow_release_schema =
+   ffi.cast([[void (*)(struct ArrowSchema *)]], release_schema)
+local arrow_release_array =
+   ffi.cast([[void (*)(struct ArrowArray *)]], release_array)
+
+new_arrow_structs = L.new_arrow_structs
+free_arrow_structs = L.free_arrow_structs
+
+local function new_arrow_schema()
+   local schema = ffi.C.malloc(ffi.sizeof([[struct ArrowSchema]]))
+   if schema == nil then error "Out of memory" end
+   ffi.fill(schema, ffi.sizeof([[struct ArrowSchema]]))
+   return ffi.cast(ArrowSchema_p, schema)
+end
+
+local function new_arrow_array()
+   local array = ffi.C.malloc(ffi.sizeof([[struct ArrowArray]]))
+   if array == nil then error "Out of memory" end
+   ffi.fill(array, ffi.sizeof([[struct ArrowArray]]))
+   return ffi.cast(ArrowArray_p, array)
+end
+
+local function init_arrow_schema(schema, format, name, flags, n_children)
+   ffi.fill(schema, ffi.sizeof([[struct ArrowSchema]]))
+   schema.format = ARROW_FORMATS[format]
+   schema.flags = flags
+   schema.release = arrow_release_schema
+   if name then
+      schema.name = ffi.cast(char_p, malloc_copy(name, #name + 1))
+   end
+   if n_children > 0 then
+      schema.children = calloc_pointers(ArrowSchema_pp, n_children)
+      for i = 0, n_children-1 do
+         schema.children[i] = new_arrow_schema()
+         schema.n_children = i+1
+      end
+   end
+end
+
+local function init_arrow_array(array, length, n_buffers, n_children)
+   ffi.fill(array, ffi.sizeof([[struct ArrowArray]]))
+   array.length = length
+   array.release = arrow_release_array
+   array.buffers = calloc_pointers(const_void_pp, n_buffers)
+   array.n_buffers = n_buffers
+   if n_children > 0 then
+      array.children = calloc_pointers(ArrowArray_pp, n_children)
+      for i = 0, n_children-1 do
+         array.children[i] = new_arrow_array()
+         array.n_children = i+1
+      end
+   end
+end
+
+-- Exports the symbols of an enum schema as a string array.
+local function export_arrow_dictionary(enum_schema, schema, array)
+   local count = avro.avro_schema_enum_number_of_symbols(enum_schema)
+   local symbols = {}
+   local offsets = int32_t_array(count+1)
+   for i = 0, count-1 do
+      symbols[i+1] = ffi.string(avro.avro_schema_enum_get(enum_schema, i))
+      offsets[i+1] = offsets[i] + #symbols[i+1]
+   end
+   local data = table.concat(symbols)
+
+   init_arrow_schema(schema, "u", nil, 0, 0)
+   init_arrow_array(array, count, 3, 0)
+   array.buffers[1] = malloc_copy(offsets, (count+1) * 4)
+   array.buffers[2] = malloc_copy(data, #data)
+end
+
+-- Copies a column from read_column_arrays into an Arrow array.
+-- Booleans are packed into a bitmap; everything else is copied as is.
+local function export_arrow_column(spec, column, count, array)
+   local column_type = spec.column_type
+   init_arrow_array(array, count, column_type.varlen and 3 or 2, 0)
+
+   if column.validity then
+      local null_count = 0
+      for i = 0, count-1 do
+         local byte = column.validity[math.floor(i / 8)]
+         if bit.band(byte, bit.lshift(1, i % 8)) == 0 then
+            null_count = null_count + 1
+         end
+      end
+      array.null_count = null_count
+      array.buffers[0] =
+         malloc_copy(column.validity, math.floor((count+7) / 8))
+   end
+
+   if column_type.varlen then
+      array.buffers[1] = malloc_copy(column.offsets, (count+1) * 4)
+      array.buffers[2] = malloc_copy(column.data, column.data_size)
+   elseif column_type.name == "boolean" then
+      local bits = uint8_t_array(math.floor((count+7) / 8))
+      for i = 0, count-1 do
+         if column.values[i] ~= 0 then
+            local byte = math.floor(i / 8)
+            bits[byte] = bit.bor(bits[byte], bit.lshift(1, i % 8))
+         end
+      end
+      array.buffers[1] = malloc_copy(bits, ffi.sizeof(bits))
+   else
+      array.buffers[1] =
+         malloc_copy(column.values, ffi.sizeof(column_type.array, count))
+   end
+end
+
+-- Exports a batch of columns to the given ArrowSchema and ArrowArray.
+-- If anything goes wrong, we release whatever we've exported so far.
+local function export_arrow_batch(layout, columns, count,
+                                  schema_ptr, array_ptr)
+   local schema = ffi.cast(ArrowSchema_p, schema_ptr)
+   local array = ffi.cast(ArrowArray_p, array_ptr)
+   if schema == nil or array == nil then
+      error "ArrowSchema and ArrowArray must not be NULL"
+   end
+
+   local ok, err = pcall(function()
+      init_arrow_schema(schema, "+s", nil, 0, #layout)
+      init_arrow_array(array, count, 1, #layout)
+      for c, spec in ipairs(layout) do
+         local child_schema = schema.children[c-1]
+         local child_array = array.children[c-1]
+         init_arrow_schema(child_schema,
+                           ARROW_COLUMN_FORMATS[spec.column_type.name],
+                           spec.name,
+                           spec.null_branch and ARROW_FLAG_NULLABLE or 0, 0)
+         export_arrow_column(spec, columns[spec.name], count, child_array)
+         if spec.column_type.name == "enum" then
+            child_schema.dictionary = new_arrow_schema()
+            child_array.dictionary = new_arrow_array()
+            export_arrow_dictionary(spec.schema, child_schema.dictionary,
+                                    child_array.dictionary)
+         end
+      end
+   end)
+
+   if not ok then
+      if schema.release ~= nil then schema.release(schema) end
+      if array.release ~= nil then array.release(array) end
+      error(err, 0)
+   end
+end
+
+-- Reads up to n records from the file, and exports them to the
+-- ArrowSchema and ArrowArray structs at the given pointers.  If n is
+-- nil, we read the rest of the current block.  Returns the number of
+-- records read, or nil and an error message if there are no more
+-- records.  The caller is responsible for releasing the exported
+-- structs.
+function DataInputFile_class:read_arrow(n, schema_ptr, array_ptr)
+   local layout = column_layout(self.wschema)
+   local batch, err = read_column_arrays(self, n)
+   if not batch then return nil, err end
+   export_arrow_batch(layout, batch.columns, batch.count,
+                      schema_ptr, array_ptr)
+   return batch.count
+end
+
+-- Exports an array-like table of record values, which must all be
+-- instances of the same schema, to the ArrowSchema and ArrowArray
+-- structs at the given pointers.  The caller is responsible for
+-- releasing the exported structs.
+function export_arrow(values, schema_ptr, array_ptr)
+   local count = #values
+   if count == 0 then error "Can't export an empty batch" end
+
+   local first = values[1]
+   local record_schema = first.iface.get_schema(first.iface, first.self)
+   if record_schema.type ~= RECORD then
+      error "Can only export records to Arrow"
+   end
+   local layout = column_layout(record_schema)
+   if not column_field then
+      column_field = LuaAvroValue()
+      column_branch = LuaAvroValue()
+   end
+
+   local columns = {}
+   for _, spec in ipairs(layout) do
+      columns[spec.name] = new_column(spec, count)
+   end
+   for i, value in ipairs(values) do
+      local schema = value.iface.get_schema(value.iface, value.self)
+      if not avro.avro_schema_equal(schema, record_schema) then
+         error "Values in a batch must share a schema"
+      end
+      local rc = read_column_row(layout, columns, value, i-1)
+      if rc ~= 0 then avro_error() end
+   end
+
+   export_arrow_batch(layout, columns, count, schema_ptr, array_ptr)
+   return count
+end
+
+local arrow_field, arrow_branch
+
+local function arrow_bit_is_set(bitmap, i)
+   local byte = ffi.cast(uint8_t_p, bitmap)[math.floor(i / 8)]
+   return bit.band(byte, bit.lshift(1, i % 8)) ~= 0
+end
+
+-- Maps the entries of a string dictionary to the symbols of an enum
+-- schema.
+local function import_arrow_symbols(schema, array, enum_schema)
+   if ffi.string(schema.format) ~= "u" then
+      error "Enum dictionaries must contain strings"
+   end
+   local offsets = ffi.cast(int32_t_p, array.buffers[1]) + array.offset
+   local data = ffi.cast(char_p, array.buffers[2])
+   local symbols = {}
+   for i = 0, tonumber(array.length)-1 do
+      local symbol = ffi.string(data + offsets[i], offsets[i+1] - offsets[i])
+      local index = avro.avro_schema_enum_get_by_name(enum_schema, symbol)
+      if index < 0 then error("Unknown enum symbol "..symbol) end
+      symbols[i] = index
+   end
+   return symbols
+end
+
+-- Works out how to import each field of a record from the children of
+-- an Arrow struct array.  Every field must have a column with the same
+-- name and a compatible type; extra columns are ignored.
+local function import_arrow_columns(schema, array, record_schema)
+   local children = {}
+   for c = 0, tonumber(schema.n_children)-1 do
+      local child = schema.children[c]
+      if child.name ~= nil then
+         children[ffi.string(child.name)] = c
+      end
+   end
+
+   local imports = {}
+   local field_count = tonumber(avro.avro_schema_record_size(record_schema))
+   for f = 0, field_count-1 do
+      local name =
+         ffi.string(avro.avro_schema_record_field_name(record_schema, f))
+      local field_schema =
+         avro.avro_schema_record_field_get_by_index(record_schema, f)
+      local c = children[name]
+      if not c then
+         error("Arrow batch has no column for field "..name)
+      end
 
-function open(path, mode, schema)
+      local child_schema = schema.children[c]
+      local import = {
+         array = array.children[c],
+         offset = tonumber(array.offset + array.children[c].offset),
+      }
+      if field_schema.type == UNION and
+         avro.avro_schema_union_size(field_schema) == 2 then
+         local first = avro.avro_schema_union_branch(field_schema, 0)
+         local second = avro.avro_schema_union_branch(field_schema, 1)
+         if first.type == NULL then
+            import.null_branch, import.value_branch = 0, 1
+            field_schema = second
+         elseif second.type == NULL then
+            import.null_branch, import.value_branch = 1, 0
+            field_schema = first
+         end
+      end
+
+      local column_type = COLUMN_TYPES[field_schema.type]
+      local format = ffi.string(child_schema.format)
+      if not column_type or
+         ARROW_COLUMN_FORMATS[column_type.name] ~= format then
+         error("Arrow column "..name.." has format "..format..
+               ", which doesn't match the field's schema")
+      end
+      import.type = column_type.name
+      if import.type == "enum" and child_schema.dictionary ~= nil then
+         import.symbols = import_arrow_symbols(
+            child_schema.dictionary, import.array.dictionary, field_schema
+         )
+      end
+      imports[f+1] = import
+   end
+   return imports
+end
+
+local ARROW_SETTERS = {
+   int = { "set_int", int32_t_p },
+   long = { "set_long", ffi.typeof([[int64_t *]]) },
+   float = { "set_float", ffi.typeof([[float *]]) },
+   double = { "set_double", ffi.typeof([[double *]]) },
+}
+
+local function import_arrow_value(import, field, row)
+   local array = import.array
+   local i = import.offset + row
+   local value = field
+   local rc
+
+   if array.buffers[0] ~= nil and array.null_count ~= 0 and
+      not arrow_bit_is_set(array.buffers[0], i) then
+      if not import.null_branch then
+         error "Null entry in a non-nullable field"
+      end
+      rc = field.iface.set_branch(field.iface, field.self,
+                                  import.null_branch, arrow_branch)
+      if rc ~= 0 then avro_error() end
+      rc = arrow_branch.iface.set_null(arrow_branch.iface, arrow_branch.self)
+      if rc ~= 0 then avro_error() end
+      return
+   end
+
+   if import.value_branch then
+      rc = field.iface.set_branch(field.iface, field.self,
+                                  import.value_branch, arrow_branch)
+      if rc ~= 0 then avro_error() end
+      value = arrow_branch
+   end
+
+   local import_type = import.type
+   local setter = ARROW_SETTERS[import_type]
+   if setter then
+      local values = ffi.cast(setter[2], array.buffers[1])
+      rc = value.iface[setter[1]](value.iface, value.self, values[i])
+   elseif import_type == "boolean" then
+      rc = value.iface.set_boolean(value.iface, value.self,
+                                   arrow_bit_is_set(array.buffers[1], i)
+                                   and 1 or 0)
+   elseif import_type == "enum" then
+      local index = ffi.cast(int32_t_p, array.buffers[1])[i]
+      if import.symbols then
+         index = import.symbols[index]
+         if not index then error "Invalid dictionary index" end
+      end
+      rc = value.iface.set_enum(value.iface, value.self, index)
+   else
+      local offsets = ffi.cast(int32_t_p, array.buffers[1])
+      local data = ffi.cast(char_p, array.buffers[2]) + offsets[i]
+      local size = offsets[i+1] - offsets[i]
+      if import_type == "string" then
+         -- set_string_len wants the size to include a NUL terminator,
+         -- which Arrow strings don't have.
+         local str = ffi.string(data, size)
+         rc = value.iface.set_string_len(value.iface, value.self, str, size+1)
+      else
+         rc = value.iface.set_bytes(value.iface, value.self,
+                                    ffi.cast(void_p, data), size)
+      end
+   end
+   if rc ~= 0 then avro_error() end
+end
+
+-- Writes each row of an Arrow struct array to the file.  Each row is
+-- copied into value, which must be a record value of the file's
+-- schema, and then appended.  We take ownership of the ArrowSchema and
+-- ArrowArray, and release them once we're done, even if there's an
+-- error.  Returns the number of records written.
+function DataOutputFile_class:write_arrow(schema_ptr, array_ptr, value)
+   local schema = ffi.cast(ArrowSchema_p, schema_ptr)
+   local array = ffi.cast(ArrowArray_p, array_ptr)
+   if schema == nil or array == nil then
+      error "ArrowSchema and ArrowArray must not be NULL"
+   end
+   if schema.release == nil or array.release == nil then
+      error "Arrow structs have already been released"
+   end
+   if not arrow_field then
+      arrow_field = LuaAvroValue()
+      arrow_branch = LuaAvroValue()
+   end
+
+   local row = 0
+   local ok, err = pcall(function()
+      if self.writer == nil then error "File is closed" end
+      if ffi.string(schema.format) ~= "+s" then
+         error "Can only write Arrow struct arrays"
+      end
+      local record_schema = value.iface.get_schema(value.iface, value.self)
+      if record_schema.type ~= RECORD then
+         error "Can only write Arrow batches into records"
+      end
+
+      local imports = import_arrow_columns(schema, array, record_schema)
+      local length = tonumber(array.length)
+      local offset = tonumber(array.offset)
+      while row < length do
+         if array.buffers[0] ~= nil and array.null_count ~= 0 and
+            not arrow_bit_is_set(array.buffers[0], offset + row) then
+            error "Can't write a null record"
+         end
+         for f, import in ipairs(imports) do
+            local rc = value.iface.get_by_index(value.iface, value.self,
+                                                f-1, arrow_field, nil)
+            if rc ~= 0 then avro_error() end
+            import_arrow_value(import, arrow_field, row)
+         end
+         self:write_raw(value)
+         row = row + 1
+      end
+   end)
+
+   schema.release(schema)
+   array.release(array)
+   if not ok then error(err, 0) end
+   return row
+end
+
+-- Creates an input file that reads its blocks from the given memory.
+-- We find each block in memory ourselves; the file reader only ever
+-- sees the header.  We take ownership of the memory, even if we can't
+-- create the input file.
+local function new_mapped_file(path, header, map, size, is_copy, rschema)
+   -- The reader closes the stream, even if it can't be created.
+   local fp = ffi.C.fmemopen(map, header.size, "rb")
+   if fp == nil then
+      release_map(map, size, is_copy)
+      error("Cannot read file "..path)
+   end
+   local reader = ffi.new(avro_file_reader_t_ptr)
+   if avro.avro_file_reader_fp(fp, path, 1, reader) ~= 0 then
+      release_map(map, size, is_copy)
+      avro_error()
+   end
+
+   local ok, l_reader =
+      pcall(new_input_file, reader[0], header, rschema, path)
+   if not ok then
+      release_map(map, size, is_copy)
+      error(l_reader, 0)
+   end
+   l_reader.map = map
+   l_reader.map_size = size
+   l_reader.map_is_copy = is_copy
+   l_reader.mapped_reads = true
+   l_reader.pos = header.size
+   return l_reader
+end
+
+-- Opens an input file by mapping it into memory.
+local function open_mapped_file(path, rschema)
+   local header = assert(L.file_header(path))
+   local map, size = map_file(path)
+   if not map then error(size) end
+   return new_mapped_file(path, header, map, size, false, rschema)
+end
+
+-- Opens an existing container file so that we can append records to
+-- it.  The new blocks use the file's codec and sync marker.  If the
+-- file doesn't exist yet, we create it.
+local function open_appended_file(path, schema, options)
+   local block_size = options.block_size or 0
+   local records_per_block = options.records_per_block or 0
+   if block_size < 0 or records_per_block < 0 then
+      error "File options cannot be negative"
+   end
+   local writer = ffi.new(avro_file_writer_t_ptr)
+
+   local f = io.open(path, "rb")
+   if not f then
+      if not schema then error("Need a schema to create "..path) end
+      local rc = avro.avro_file_writer_create_with_codec(
+         path, schema, writer, options.codec or "null", block_size
+      )
+      if rc ~= 0 then avro_error() end
+      return LuaAvroDataOutputFile(writer[0], records_per_block, 0)
+   end
+   f:close()
+
+   local header, err = L.file_header(path)
+   if not header then return nil, err end
+   if options.codec and options.codec ~= header.codec then
+      return nil, "File "..path.." uses the "..header.codec..
+                  " codec, not "..options.codec
+   end
+
+   if schema then
+      local reader = ffi.new(avro_file_reader_t_ptr)
+      if avro.avro_file_reader(path, reader) ~= 0 then
+         return get_avro_error()
+      end
+      local equal = avro.avro_schema_equal(
+         schema, avro.avro_file_reader_get_writer_schema(reader[0])
+      )
+      avro.avro_file_reader_close(reader[0])
+      if equal == 0 then
+         return nil, "Schema doesn't match the schema of file "..path
+      end
+   end
+
+   local rc
+   if block_size > 0 then
+      rc = avro.avro_file_writer_open_bs(path, writer, block_size)
+   else
+      rc = avro.avro_file_writer_open(path, writer)
+   end
+   if rc ~= 0 then return get_avro_error() end
+   return LuaAvroDataOutputFile(writer[0], records_per_block, 0)
+end
+
+-- Opens a new input or output file.  When opening an input file, you
+-- can pass in a reader schema.  Values read from the file will be
+-- instances of the reader schema, resolved from the file's writer
+-- schema; writer fields that aren't in the reader schema are skipped
+-- without being decoded.
+--
+-- When opening an input file, you can pass in a table of options
+-- (after the reader schema, or in its place):
+--
+--   mmap
+--     If true, we map the file into memory instead of reading it
+--     through stdio.  Blocks that use the null codec are then decoded
+--     directly from the mapping, without being copied first.
+--
+--   index
+--     The path of a block index sidecar, as written by the
+--     write_index method.  If it exists and matches the file, seek
+--     uses it instead of scanning the file's block headers.
+--
+-- When opening an output file, you can pass in a table of options:
+--
+--   block_size
+--     The size of the buffer used to accumulate each block, in bytes.
+--     A block is written to the file whenever this fills up, so it's
+--     also the largest encoded record that you can write.
+--
+--   records_per_block
+--     If given, we end the current block (and write a sync marker)
+--     after this many records, even if the block buffer isn't full
+--     yet.
+--
+--   codec
+--     The name of the compression codec to use for each block: "null"
+--     (the default), "deflate", "snappy", or "lzma".  Which codecs are
+--     available depends on how the Avro C library was built.
+--
+-- Mode "a" opens an existing file for appending.  The schema is
+-- optional, but if given it must match the file's writer schema; it's
+-- required if the file doesn't exist yet, in which case we create it.
+-- The output file options are the same as for mode "w", and can be
+-- passed in place of the schema.  New blocks always use the file's own
+-- codec, so giving a different codec is an error.
+function open(path, mode, schema, options)
    mode = mode or "r"
+   options = options or {}
 
    if mode == "r" then
-      local reader = ffi.new(avro_file_reader_t_ptr)
-      local rc = avro.avro_file_reader(path, reader)
-      if rc ~= 0 then avro_error() end
-      return new_input_file(reader[0])
+      if schema and not schema.raw_schema then
+         options, schema = schema, nil
+      end
+      if schema then schema = schema:raw_schema().self end
+      local l_reader
+      if options.mmap then
+         l_reader = open_mapped_file(path, schema)
+      else
+         local reader = ffi.new(avro_file_reader_t_ptr)
+         local rc = avro.avro_file_reader(path, reader)
+         if rc ~= 0 then avro_error() end
+         local header, err = L.file_header(path)
+         if not header then
+            avro.avro_file_reader_close(reader[0])
+            error(err)
+         end
+         l_reader = new_input_file(reader[0], header, schema, path)
+      end
+
+      -- A missing or stale sidecar isn't an error; we'll build the
+      -- index ourselves the first time we need it.
+      if options.index then
+         input_file_read_index(l_reader, options.index)
+      end
+      return l_reader
 
    elseif mode == "w" then
       local writer = ffi.new(avro_file_writer_t_ptr)
+      local block_size = options.block_size or 0
+      local records_per_block = options.records_per_block or 0
+      if block_size < 0 or records_per_block < 0 then
+         error "File options cannot be negative"
+      end
       schema = schema:raw_schema().self
-      local rc = avro.avro_file_writer_create(path, schema, writer)
+      local rc = avro.avro_file_writer_create_with_codec(
+         path, schema, writer, options.codec or "null", block_size
+      )
       if rc ~= 0 then avro_error() end
-      return LuaAvroDataOutputFile(writer[0])
+      return LuaAvroDataOutputFile(writer[0], records_per_block, 0)
+
+   elseif mode == "a" then
+      if schema and not schema.raw_schema then
+         options, schema = schema, nil
+      end
+      if schema then schema = schema:raw_schema().self end
+      return open_appended_file(path, schema, options)
 
    else
       error("Invalid mode "..mode)
    end
 end
+
+-- Opens an in-memory container file.  This takes the same parameters
+-- as open, except that the first is the file's contents instead of its
+-- path.  In mode "r", we read from a copy of the given string, and all
+-- of the input file options and methods are available; the mmap option
+-- is ignored.  In mode "w", the first parameter is ignored, and the
+-- file accumulates in memory until you retrieve it with the contents
+-- method.  Mode "a" isn't supported.
+function open_memory(buf, mode, schema, options)
+   mode = mode or "r"
+   options = options or {}
+
+   if mode == "r" then
+      if schema and not schema.raw_schema then
+         options, schema = schema, nil
+      end
+      if schema then schema = schema:raw_schema().self end
+      local header, err = L.file_header(buf, true)
+      if not header then return nil, err end
+
+      local map = ffi.C.malloc(#buf)
+      if map == nil then error "Out of memory" end
+      ffi.copy(map, buf, #buf)
+      local l_reader =
+         new_mapped_file("<memory>", header, map, #buf, true, schema)
+      if options.index then
+         input_file_read_index(l_reader, options.index)
+      end
+      return l_reader
+
+   elseif mode == "w" then
+      local block_size = options.block_size or 0
+      local records_per_block = options.records_per_block or 0
+      if block_size < 0 or records_per_block < 0 then
+         error "File options cannot be negative"
+      end
+      schema = schema:raw_schema().self
+
+      -- The stream updates mem_buf and mem_size in place, so we need the
+      -- file object to exist before we open it.
+      local l_file = LuaAvroDataOutputFile(nil, records_per_block, 0)
+      local base =
+         ffi.cast(uint8_t_p, ffi.cast(LuaAvroDataOutputFile_p, l_file))
+      l_file.mem_fp = ffi.C.open_memstream(
+         ffi.cast("char **", base + ffi.offsetof(l_file, "mem_buf")),
+         ffi.cast("size_t *", base + ffi.offsetof(l_file, "mem_size"))
+      )
+      if l_file.mem_fp == nil then
+         error "Cannot create in-memory file"
+      end
+
+      local writer = ffi.new(avro_file_writer_t_ptr)
+      local rc = avro.avro_file_writer_create_with_codec_fp(
+         l_file.mem_fp, "<memory>", 0, schema, writer,
+         options.codec or "null", block_size
+      )
+      if rc ~= 0 then avro_error() end
+      l_file.writer = writer[0]
+      return l_file
+
+   else
+      error("Invalid mode "..mode)
+   end
+end
+
+------------------------------------------------------------------------
+-- Parallel scans
+
+-- The worker threads of a parallel scan are implemented in the legacy
+-- module, since they need their own Lua states.  Here we just turn the
+-- legacy values in each batch into FFI values; a legacy value starts
+-- with its avro_value_t, so we can take over its reference directly.
+
+local Scanner_class = {}
+local Scanner_mt = { __index = Scanner_class }
+
+function Scanner_class:next_batch()
+   local batch, err = self.scanner:next_batch()
+   if not batch then return nil, err end
+   for i, result in ipairs(batch) do
+      if type(result) == "userdata" then
+         batch[i] = raw_value(ffi.cast(avro_value_t_ptr, result), true)
+      end
+   end
+   return batch
+end
+
+function Scanner_class:batches()
+   return function()
+      local batch, err = self:next_batch()
+      if err then error(err) end
+      return batch
+   end
+end
+
+function Scanner_class:close()
+   self.scanner:close()
+end
+
+-- Starts a parallel scan of a container file.  See the legacy module
+-- for a description of the options.
+function scan(path, schema, options)
+   if schema then schema = schema:raw_schema().legacy end
+   local scanner, err = L.scan(path, schema, options)
+   if not scanner then return nil, err end
+   return setmetatable({ scanner = scanner }, Scanner_mt)
+end
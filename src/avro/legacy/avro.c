@@ -7,10 +7,18 @@
  * ----------------------------------------------------------------------
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <avro.h>
 #include <lauxlib.h>
@@ -65,6 +73,10 @@ typedef struct _LuaAvroValue
 {
     avro_value_t  value;
     bool  should_decref;
+    /* A reference to the top-level value that value belongs to, if the
+     * instance was reused for a child (see push_child_value); otherwise
+     * owner.self is NULL. */
+    avro_value_t  owner;
 } LuaAvroValue;
 
 
@@ -76,6 +88,8 @@ lua_avro_push_value(lua_State *L, avro_value_t *value, bool should_decref)
     l_value = lua_newuserdata(L, sizeof(LuaAvroValue));
     l_value->value = *value;
     l_value->should_decref = should_decref;
+    l_value->owner.iface = NULL;
+    l_value->owner.self = NULL;
     luaL_getmetatable(L, MT_AVRO_VALUE);
     lua_setmetatable(L, -2);
     return 1;
@@ -90,6 +104,64 @@ lua_avro_get_value(lua_State *L, int index)
 }
 
 
+/**
+ * Drops the references that a Value instance holds, and leaves it
+ * empty.
+ */
+
+static void
+value_release(LuaAvroValue *l_value)
+{
+    if (l_value->should_decref && l_value->value.self != NULL) {
+        avro_value_decref(&l_value->value);
+    }
+    if (l_value->owner.self != NULL) {
+        avro_value_decref(&l_value->owner);
+    }
+    l_value->value.iface = NULL;
+    l_value->value.self = NULL;
+    l_value->should_decref = false;
+    l_value->owner.iface = NULL;
+    l_value->owner.self = NULL;
+}
+
+
+/**
+ * Pushes a Value instance for a child of the Value at parent_index.  If
+ * the parameter at into_index is a Value instance, we point it at the
+ * child and push it, instead of creating a new instance.  Reusing an
+ * instance saves an allocation (and a finalizer) for each child that
+ * you visit.  Pass in 0 if there's no into parameter.
+ *
+ * into might be the parent itself, or the only thing keeping the parent
+ * alive, as in v = v:get(k, v).  So before into lets go of whatever it
+ * pointed at, it takes its own reference to the top-level value that
+ * the parent belongs to.
+ */
+
+static void
+push_child_value(lua_State *L, int parent_index, avro_value_t *child,
+                 int into_index)
+{
+    if (into_index != 0 && !lua_isnoneornil(L, into_index)) {
+        LuaAvroValue  *l_parent = lua_touserdata(L, parent_index);
+        LuaAvroValue  *l_into = luaL_checkudata(L, into_index, MT_AVRO_VALUE);
+        avro_value_t  child_copy = *child;
+        avro_value_t  owner = l_parent->should_decref?
+            l_parent->value: l_parent->owner;
+        if (owner.self != NULL) {
+            avro_value_incref(&owner);
+        }
+        value_release(l_into);
+        l_into->value = child_copy;
+        l_into->owner = owner;
+        lua_pushvalue(L, into_index);
+    } else {
+        lua_avro_push_value(L, child, false);
+    }
+}
+
+
 static int
 l_value_raw_value(lua_State *L)
 {
@@ -327,11 +399,13 @@ l_value_reset(lua_State *L)
 
 /**
  * Select the union branch with the given name, and push a Value wrapper
- * for the branch onto the Lua stack.
+ * for the branch onto the Lua stack, reusing the Value instance at
+ * into_index if there is one.
  */
 
 static int
-select_union_branch(lua_State *L, avro_value_t *value, int branch_index)
+select_union_branch(lua_State *L, avro_value_t *value, int branch_index,
+                    int into_index)
 {
     int  discriminant;
 
@@ -359,23 +433,18 @@ select_union_branch(lua_State *L, avro_value_t *value, int branch_index)
 
     avro_value_t  branch;
     check(avro_value_set_branch(value, discriminant, &branch));
-    lua_avro_push_value(L, &branch, false);
+    push_child_value(L, 1, &branch, into_index);
     return 1;
 }
 
 /**
- * Extract the contents of an Avro value.  For scalars, we push the
- * equivalent Lua value onto the stack.  For arrays and maps, we
- * retrieve the element the given index.  For records, we retrieve the
- * field with the given name or index.  For unions, we return the
- * current branch.
+ * Pushes the Lua equivalent of an Avro scalar onto the stack.  Returns
+ * -1, without pushing anything, if the value isn't a scalar.
  */
 
 static int
-l_value_get(lua_State *L)
+push_scalar_value(lua_State *L, avro_value_t *value)
 {
-    avro_value_t  *value = lua_avro_get_value(L, 1);
-
     switch (avro_value_get_type(value))
     {
       case AVRO_STRING:
@@ -463,6 +532,32 @@ l_value_get(lua_State *L)
             return 1;
         }
 
+      default:
+        return -1;
+    }
+}
+
+/**
+ * Extract the contents of an Avro value.  For scalars, we push the
+ * equivalent Lua value onto the stack.  For arrays and maps, we
+ * retrieve the element the given index.  For records, we retrieve the
+ * field with the given name or index.  For unions, we return the
+ * current branch.  For any of these children, you can pass in an
+ * existing Value instance as the third parameter, which we'll point at
+ * the child and return, instead of creating a new instance.
+ */
+
+static int
+l_value_get(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    int  nresults = push_scalar_value(L, value);
+    if (nresults >= 0) {
+        return nresults;
+    }
+
+    switch (avro_value_get_type(value))
+    {
       case AVRO_ARRAY:
         {
             lua_Integer  index = luaL_checkinteger(L, 2);
@@ -477,7 +572,7 @@ l_value_get(lua_State *L)
 
             avro_value_t  element_value;
             check(avro_value_get_by_index(value, index-1, &element_value, NULL));
-            lua_avro_push_value(L, &element_value, false);
+            push_child_value(L, 1, &element_value, 3);
             return 1;
         }
 
@@ -509,7 +604,7 @@ l_value_get(lua_State *L)
                     lua_pushliteral(L, "Map element doesn't exist");
                     return 2;
                 } else {
-                    lua_avro_push_value(L, &element_value, false);
+                    push_child_value(L, 1, &element_value, 3);
                     lua_pushstring(L, key);
                     return 2;
                 }
@@ -526,7 +621,7 @@ l_value_get(lua_State *L)
                     lua_pushliteral(L, "Map element doesn't exist");
                     return 2;
                 } else {
-                    lua_avro_push_value(L, &element_value, false);
+                    push_child_value(L, 1, &element_value, 3);
                     lua_pushinteger(L, index);
                     return 2;
                 }
@@ -553,7 +648,7 @@ l_value_get(lua_State *L)
                     lua_pushliteral(L, "Record field doesn't exist");
                     return 2;
                 } else {
-                    lua_avro_push_value(L, &field_value, false);
+                    push_child_value(L, 1, &field_value, 3);
                     return 1;
                 }
             }
@@ -568,7 +663,7 @@ l_value_get(lua_State *L)
                     lua_pushliteral(L, "Record field doesn't exist");
                     return 2;
                 } else {
-                    lua_avro_push_value(L, &field_value, false);
+                    push_child_value(L, 1, &field_value, 3);
                     return 1;
                 }
             }
@@ -582,10 +677,10 @@ l_value_get(lua_State *L)
             if (lua_gettop(L) < 2 || lua_isnil(L, 2)) {
                 avro_value_t  branch;
                 check(avro_value_get_current_branch(value, &branch));
-                lua_avro_push_value(L, &branch, false);
+                push_child_value(L, 1, &branch, 3);
                 return 1;
             } else {
-                select_union_branch(L, value, 2);
+                select_union_branch(L, value, 2, 3);
                 return 1;
             }
         }
@@ -612,21 +707,19 @@ l_value_hash(lua_State *L)
 
 
 /**
- * Sets the value value of an Avro scalar.  If the value is not a
- * scalar, we raise a Lua error.
+ * Sets an Avro scalar from the Lua value at the given stack index.
+ * Returns -1, without changing anything, if the value isn't a scalar.
  */
 
 static int
-l_value_set(lua_State *L)
+set_scalar_value(lua_State *L, avro_value_t *value, int index)
 {
-    avro_value_t  *value = lua_avro_get_value(L, 1);
-
     switch (avro_value_get_type(value))
     {
       case AVRO_STRING:
         {
             size_t  str_len;
-            const char  *str = luaL_checklstring(L, 2, &str_len);
+            const char  *str = luaL_checklstring(L, index, &str_len);
             /* value length must include NUL terminator */
             check(avro_value_set_string_len(value, (char *) str, str_len+1));
             return 0;
@@ -635,42 +728,42 @@ l_value_set(lua_State *L)
       case AVRO_BYTES:
         {
             size_t  len;
-            const char  *buf = luaL_checklstring(L, 2, &len);
+            const char  *buf = luaL_checklstring(L, index, &len);
             check(avro_value_set_bytes(value, (void *) buf, len));
             return 0;
         }
 
       case AVRO_INT32:
         {
-            lua_Integer  i = luaL_checkinteger(L, 2);
+            lua_Integer  i = luaL_checkinteger(L, index);
             check(avro_value_set_int(value, i));
             return 0;
         }
 
       case AVRO_INT64:
         {
-            long  l = luaL_checklong(L, 2);
+            long  l = luaL_checklong(L, index);
             check(avro_value_set_long(value, l));
             return 0;
         }
 
       case AVRO_FLOAT:
         {
-            lua_Number  n = luaL_checknumber(L, 2);
+            lua_Number  n = luaL_checknumber(L, index);
             check(avro_value_set_float(value, (float) n));
             return 0;
         }
 
       case AVRO_DOUBLE:
         {
-            lua_Number  n = luaL_checknumber(L, 2);
+            lua_Number  n = luaL_checknumber(L, index);
             check(avro_value_set_double(value, (double) n));
             return 0;
         }
 
       case AVRO_BOOLEAN:
         {
-            int  b = lua_toboolean(L, 2);
+            int  b = lua_toboolean(L, index);
             check(avro_value_set_boolean(value, b));
             return 0;
         }
@@ -685,12 +778,12 @@ l_value_set(lua_State *L)
         {
             int  symbol_value;
 
-            if (lua_isnumber(L, 2)) {
-                symbol_value = lua_tointeger(L, 2) - 1;
+            if (lua_isnumber(L, index)) {
+                symbol_value = lua_tointeger(L, index) - 1;
             }
 
             else {
-                const char  *symbol = luaL_checkstring(L, 2);
+                const char  *symbol = luaL_checkstring(L, index);
                 avro_schema_t  enum_schema = avro_value_get_schema(value);
                 symbol_value = avro_schema_enum_get_by_name(enum_schema, symbol);
                 if (symbol_value < 0) {
@@ -705,11 +798,31 @@ l_value_set(lua_State *L)
       case AVRO_FIXED:
         {
             size_t  len = 0;
-            const char  *buf = luaL_checklstring(L, 2, &len);
+            const char  *buf = luaL_checklstring(L, index, &len);
             check(avro_value_set_fixed(value, (void *) buf, len));
             return 0;
         }
 
+      default:
+        return -1;
+    }
+}
+
+/**
+ * Sets the value value of an Avro scalar.  If the value is not a
+ * scalar, we raise a Lua error.
+ */
+
+static int
+l_value_set(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    if (set_scalar_value(L, value, 2) == 0) {
+        return 0;
+    }
+
+    switch (avro_value_get_type(value))
+    {
       case AVRO_MAP:
         {
             const char  *key = luaL_checkstring(L, 2);
@@ -726,7 +839,7 @@ l_value_set(lua_State *L)
                 return lua_error(L);
             }
 
-            select_union_branch(L, value, 2);
+            select_union_branch(L, value, 2, 0);
             return 1;
         }
 
@@ -737,6 +850,110 @@ l_value_set(lua_State *L)
 }
 
 
+/**
+ * Walks down from a value along a path of child steps, which are the
+ * elements of the array-like table at chain_index.  A positive integer
+ * is the 1-based index of a record field; a negative integer is the
+ * negated 1-based index of a union branch; and a string is a map key.
+ * When reading, a union that's in some other branch, or a map that
+ * doesn't contain the key, means that the path doesn't exist, and we
+ * return false.  When writing, we select the union branch and add the
+ * map element instead.
+ */
+
+static bool
+walk_value_path(lua_State *L, avro_value_t *value, int chain_index,
+                bool for_write, avro_value_t *leaf)
+{
+    size_t  length = lua_objlen(L, chain_index);
+    size_t  i;
+
+    *leaf = *value;
+    for (i = 1; i <= length; i++) {
+        avro_value_t  child = { NULL, NULL };
+        lua_rawgeti(L, chain_index, i);
+
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            const char  *key = lua_tostring(L, -1);
+            if (for_write) {
+                check(avro_value_add(leaf, key, &child, NULL, NULL));
+            } else {
+                check(avro_value_get_by_name(leaf, key, &child, NULL));
+            }
+        } else {
+            lua_Integer  step = lua_tointeger(L, -1);
+            if (step > 0) {
+                check(avro_value_get_by_index(leaf, step-1, &child, NULL));
+            } else if (for_write) {
+                check(avro_value_set_branch(leaf, -step-1, &child));
+            } else {
+                int  discriminant;
+                check(avro_value_get_discriminant(leaf, &discriminant));
+                if (discriminant == -step-1) {
+                    check(avro_value_get_current_branch(leaf, &child));
+                }
+            }
+        }
+
+        lua_pop(L, 1);
+        if (child.self == NULL) {
+            return false;
+        }
+        *leaf = child;
+    }
+    return true;
+}
+
+/**
+ * Reads the value at the end of a path (see walk_value_path) in a
+ * single call, without creating a Value instance for each step.  If the
+ * leaf is a scalar, we return its Lua equivalent; otherwise we return a
+ * Value instance for it, reusing the one given as the third parameter if
+ * there is one.  If the path doesn't exist, we return nil.
+ */
+
+static int
+l_value_get_path(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    avro_value_t  leaf;
+    int  nresults;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (!walk_value_path(L, value, 2, false, &leaf)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    nresults = push_scalar_value(L, &leaf);
+    if (nresults < 0) {
+        push_child_value(L, 1, &leaf, 3);
+        nresults = 1;
+    }
+    return nresults;
+}
+
+/**
+ * Sets the scalar at the end of a path (see walk_value_path) to the
+ * third parameter, in a single call.  Any unions along the path are
+ * switched to the path's branch.
+ */
+
+static int
+l_value_set_path(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    avro_value_t  leaf;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    walk_value_path(L, value, 2, true, &leaf);
+    if (set_scalar_value(L, &leaf, 3) != 0) {
+        return luaL_error(L, "Can only set a scalar at the end of a path");
+    }
+    return 0;
+}
+
+
 /**
  * Fills in the contents of an Avro value from a pure-Lua AST.  For
  * scalars, we expect a compatible Lua scalar value.  For maps and
@@ -873,7 +1090,7 @@ l_value_set_from_ast(lua_State *L)
                 if (lua_isnil(L, 2)) {
                     lua_pushcfunction(L, l_value_set_from_ast);
                     lua_pushliteral(L, "null");
-                    select_union_branch(L, value, -1);
+                    select_union_branch(L, value, -1, 0);
                     lua_replace(L, -2);
                     lua_pushnil(L);
                     lua_call(L, 2, 0);
@@ -887,7 +1104,7 @@ l_value_set_from_ast(lua_State *L)
                 }
 
                 lua_pushcfunction(L, l_value_set_from_ast);
-                select_union_branch(L, value, -3);
+                select_union_branch(L, value, -3, 0);
                 lua_pushvalue(L, -3);
                 lua_call(L, 2, 0);
 
@@ -902,1008 +1119,6991 @@ l_value_set_from_ast(lua_State *L)
 
 
 /**
- * Adds a new element to an Avro map.  The first parameter is always the
- * key of the new element.  If called with two parameter, then the map
- * values must be scalars, and the parameter is used as the value of the
- * new element.  If called with one parameter, then the map can contain
- * any kind of value.  In both cases, we return the AvroValue for the
- * new element.
+ * Options that control how to_ast represents unions and longs.
+ */
+
+typedef struct _AstOptions
+{
+    /* If true, a union is represented by the AST of its current branch,
+     * instead of a single-element table keyed by the branch's name. */
+    bool  bare_unions;
+
+    /* If true, longs are represented as decimal strings, which (unlike
+     * Lua numbers) don't lose precision outside of ±2^53. */
+    bool  string_longs;
+} AstOptions;
+
+/**
+ * Pushes the pure-Lua AST for an Avro value onto the stack, using the
+ * same representation that set_from_ast accepts.
  */
 
 static int
-l_value_add(lua_State *L)
+push_value_ast(lua_State *L, avro_value_t *value, const AstOptions *opts)
 {
-    int  nargs = lua_gettop(L);
-    avro_value_t  *value = lua_avro_get_value(L, 1);
-    const char  *key = luaL_checkstring(L, 2);
+    avro_type_t  value_type = avro_value_get_type(value);
+    avro_value_t  child;
+    size_t  size;
+    size_t  i;
 
-    if (avro_value_get_type(value) != AVRO_MAP) {
-        lua_pushliteral(L, "Can only add to an map");
-        return lua_error(L);
-    }
+    luaL_checkstack(L, 4, "Value is nested too deeply");
 
-    if (nargs > 3) {
-        lua_pushliteral(L, "Bad number of arguments to AvroValue:add");
-        return lua_error(L);
-    }
+    switch (value_type)
+    {
+      case AVRO_INT64:
+        if (opts->string_longs) {
+            char  buf[32];
+            int64_t  val = 0;
+            check(avro_value_get_long(value, &val));
+            snprintf(buf, sizeof(buf), "%" PRId64, val);
+            lua_pushstring(L, buf);
+            return 1;
+        }
+        return push_scalar_value(L, value);
 
-    avro_value_t  element;
-    check(avro_value_add(value, key, &element, NULL, NULL));
-    lua_avro_push_value(L, &element, false);
+      case AVRO_ARRAY:
+        check(avro_value_get_size(value, &size));
+        lua_createtable(L, size, 0);
+        for (i = 0; i < size; i++) {
+            check(avro_value_get_by_index(value, i, &child, NULL));
+            push_value_ast(L, &child, opts);
+            lua_rawseti(L, -2, i+1);
+        }
+        return 1;
 
-    /*
-     * Otherwise just return the new element value.
-     */
+      case AVRO_MAP:
+      case AVRO_RECORD:
+        check(avro_value_get_size(value, &size));
+        lua_createtable(L, 0, size);
+        for (i = 0; i < size; i++) {
+            const char  *name = NULL;
+            check(avro_value_get_by_index(value, i, &child, &name));
+            push_value_ast(L, &child, opts);
+            lua_setfield(L, -2, name);
+        }
+        return 1;
 
-    return 1;
-}
+      case AVRO_UNION:
+        {
+            int  discriminant;
+            check(avro_value_get_discriminant(value, &discriminant));
+            check(avro_value_get_current_branch(value, &child));
+            if (avro_value_get_type(&child) == AVRO_NULL) {
+                lua_pushnil(L);
+                return 1;
+            }
+            if (opts->bare_unions) {
+                return push_value_ast(L, &child, opts);
+            }
+            avro_schema_t  union_schema = avro_value_get_schema(value);
+            avro_schema_t  branch =
+                avro_schema_union_branch(union_schema, discriminant);
+            lua_createtable(L, 0, 1);
+            push_value_ast(L, &child, opts);
+            lua_setfield(L, -2, avro_schema_type_name(branch));
+            return 1;
+        }
 
+      default:
+        if (push_scalar_value(L, value) < 0) {
+            return luaL_error(L, "Don't know how to convert value type %d",
+                              value_type);
+        }
+        return 1;
+    }
+}
 
 /**
- * Appends a new element to an Avro array.  If called with one
- * parameter, then the array must contain scalars, and the parameter is
- * used as the value of the new element.  If called with no parameters,
- * then the array can contain any kind of element.  In both cases, we
- * return the AvroValue for the new element.
+ * Converts an Avro value into a pure-Lua AST, which is the inverse of
+ * set_from_ast.  The whole AST is built in a single call.  You can pass
+ * in a table of options:
+ *
+ *   unions
+ *     "tagged" (the default) represents a union as a single-element
+ *     table whose key is the name of the current branch, just as
+ *     set_from_ast expects.  "bare" represents it as the AST of the
+ *     current branch.  Either way, the null branch is nil.
+ *
+ *   longs
+ *     "number" (the default) represents longs as Lua numbers, which
+ *     lose precision outside of ±2^53.  "string" represents them as
+ *     decimal strings.
  */
 
 static int
-l_value_append(lua_State *L)
+l_value_to_ast(lua_State *L)
 {
-    avro_value_t  *value = lua_avro_get_value(L, 1);
+    static const char  *UNIONS[] = { "tagged", "bare", NULL };
+    static const char  *LONGS[] = { "number", "string", NULL };
 
-    if (avro_value_get_type(value) != AVRO_ARRAY) {
-        lua_pushliteral(L, "Can only append to an array");
-        return lua_error(L);
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    AstOptions  opts = { false, false };
+
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "unions");
+        opts.bare_unions = (luaL_checkoption(L, -1, "tagged", UNIONS) == 1);
+        lua_getfield(L, 2, "longs");
+        opts.string_longs = (luaL_checkoption(L, -1, "number", LONGS) == 1);
+        lua_pop(L, 2);
     }
 
-    avro_value_t  element;
-    check(avro_value_append(value, &element, NULL));
-    lua_avro_push_value(L, &element, false);
-    return 1;
+    return push_value_ast(L, value, &opts);
 }
 
 
 /**
- * Iterates through the elements of an Avro array or map.  The result of
- * this function can be used as a for loop iterator.  For arrays, the
- * iterator behaves like the builtin ipairs function, returning [i,
- * element] pairs during each iteration.  For maps, it behaves like the
- * builtin pairs function, returning [key, element] pairs.  In both
- * cases, if the elements are scalars, these will be translated into the
- * Lua equivalent; if they're compound value objects, you'll get an
- * AvroValue instance.
+ * A parser for the Avro JSON encoding, which fills in an Avro value
+ * directly as it reads the JSON text, using the value's schema to
+ * decide what to expect.  Strings are unescaped into a scratch buffer
+ * that we reuse for the whole document.
  */
 
-typedef struct _Iterator
+typedef struct json_parser
 {
-    bool  no_scalar;
-    avro_value_t  *value;
-    size_t  next_index;
-} Iterator;
+    const char  *start;
+    const char  *pos;
+    const char  *end;
+    char  *scratch;
+    size_t  scratch_size;
+    size_t  scratch_used;
+} json_parser;
 
-#define MT_ITERATOR "sawmill:AvroValue:iterator"
+static int
+json_error(json_parser *p, const char *msg)
+{
+    avro_set_error("Invalid JSON at offset %lu: %s",
+                   (unsigned long) (p->pos - p->start), msg);
+    return EINVAL;
+}
 
 static void
-create_iterator(lua_State *L, avro_value_t *value, bool no_scalar)
+json_skip_whitespace(json_parser *p)
 {
-    lua_newuserdata(L, sizeof(Iterator));
-    Iterator  *state = lua_touserdata(L, -1);
-    state->no_scalar = no_scalar;
-    state->value = value;
-    state->next_index = 0;
-    luaL_getmetatable(L, MT_ITERATOR);
-    lua_setmetatable(L, -2);
+    while (p->pos < p->end &&
+           (*p->pos == ' ' || *p->pos == '\t' ||
+            *p->pos == '\n' || *p->pos == '\r')) {
+        p->pos++;
+    }
 }
 
+/* Consumes the given character, after any whitespace. */
 static int
-iterator_gc(lua_State *L)
+json_expect(json_parser *p, char ch)
 {
-    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
-    state->value = NULL;
+    json_skip_whitespace(p);
+    if (p->pos >= p->end || *p->pos != ch) {
+        char  msg[] = "expected ' '";
+        msg[10] = ch;
+        return json_error(p, msg);
+    }
+    p->pos++;
     return 0;
 }
 
-static int
-iterate_array(lua_State *L)
+/* Consumes the given character if it's next, returning whether it was. */
+static bool
+json_accept(json_parser *p, char ch)
 {
-    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
-    size_t  length;
-    check(avro_value_get_size(state->value, &length));
-
-    /*
-     * next_index is the 0-based avro index, not the 1-based Lua index.
-     */
-
-    if (state->next_index >= length) {
-        return 0;
+    json_skip_whitespace(p);
+    if (p->pos < p->end && *p->pos == ch) {
+        p->pos++;
+        return true;
     }
+    return false;
+}
 
-    avro_value_t  element;
-    check(avro_value_get_by_index(state->value, state->next_index, &element, NULL));
-    lua_pushinteger(L, state->next_index+1);
-    lua_avro_push_value(L, &element, false);
-
-    state->next_index++;
-    return 2;
+static bool
+json_accept_literal(json_parser *p, const char *literal)
+{
+    size_t  len = strlen(literal);
+    json_skip_whitespace(p);
+    if ((size_t) (p->end - p->pos) >= len &&
+        memcmp(p->pos, literal, len) == 0) {
+        p->pos += len;
+        return true;
+    }
+    return false;
 }
 
 static int
-iterate_map(lua_State *L)
+json_scratch_push(json_parser *p, unsigned char ch)
 {
-    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
-    size_t  length;
-    check(avro_value_get_size(state->value, &length));
-
-    /*
-     * next_index is the 0-based avro index, not the 1-based Lua index.
-     */
-
-    if (state->next_index >= length) {
-        return 0;
+    if (p->scratch_used == p->scratch_size) {
+        size_t  new_size = (p->scratch_size == 0)? 64: p->scratch_size * 2;
+        char  *new_scratch = realloc(p->scratch, new_size);
+        if (new_scratch == NULL) {
+            avro_set_error("Out of memory");
+            return ENOMEM;
+        }
+        p->scratch = new_scratch;
+        p->scratch_size = new_size;
     }
-
-    const char  *key = NULL;
-    avro_value_t  element;
-    check(avro_value_get_by_index(state->value, state->next_index, &element, &key));
-
-    lua_pushstring(L, key);
-    lua_avro_push_value(L, &element, false);
-
-    state->next_index++;
-    return 2;
+    p->scratch[p->scratch_used++] = ch;
+    return 0;
 }
 
 static int
-l_value_iterate(lua_State *L)
+json_push_code_point(json_parser *p, unsigned long cp)
+{
+    int  rc = 0;
+    if (cp < 0x80) {
+        rc = json_scratch_push(p, cp);
+    } else if (cp < 0x800) {
+        rc = json_scratch_push(p, 0xc0 | (cp >> 6));
+        if (rc == 0) rc = json_scratch_push(p, 0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        rc = json_scratch_push(p, 0xe0 | (cp >> 12));
+        if (rc == 0) rc = json_scratch_push(p, 0x80 | ((cp >> 6) & 0x3f));
+        if (rc == 0) rc = json_scratch_push(p, 0x80 | (cp & 0x3f));
+    } else {
+        rc = json_scratch_push(p, 0xf0 | (cp >> 18));
+        if (rc == 0) rc = json_scratch_push(p, 0x80 | ((cp >> 12) & 0x3f));
+        if (rc == 0) rc = json_scratch_push(p, 0x80 | ((cp >> 6) & 0x3f));
+        if (rc == 0) rc = json_scratch_push(p, 0x80 | (cp & 0x3f));
+    }
+    return rc;
+}
+
+static int
+json_read_hex4(json_parser *p, unsigned long *result)
+{
+    int  i;
+    *result = 0;
+    if (p->end - p->pos < 4) {
+        return json_error(p, "truncated \\u escape");
+    }
+    for (i = 0; i < 4; i++) {
+        char  ch = *p->pos++;
+        *result <<= 4;
+        if (ch >= '0' && ch <= '9') {
+            *result |= ch - '0';
+        } else if (ch >= 'a' && ch <= 'f') {
+            *result |= ch - 'a' + 10;
+        } else if (ch >= 'A' && ch <= 'F') {
+            *result |= ch - 'A' + 10;
+        } else {
+            return json_error(p, "invalid \\u escape");
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads a JSON string into the scratch buffer, followed by a NUL
+ * terminator that isn't included in scratch_used.  If as_bytes is
+ * true, the string holds bytes, which the Avro JSON encoding represents
+ * as code points 0-255; we turn each one back into a single byte.
+ */
+
+static int
+json_read_string(json_parser *p, bool as_bytes)
+{
+    int  rc;
+    p->scratch_used = 0;
+    if ((rc = json_expect(p, '"')) != 0) {
+        return rc;
+    }
+
+    while (true) {
+        unsigned long  cp;
+        if (p->pos >= p->end) {
+            return json_error(p, "unterminated string");
+        }
+
+        unsigned char  ch = *p->pos++;
+        if (ch == '"') {
+            break;
+        } else if (ch == '\\') {
+            if (p->pos >= p->end) {
+                return json_error(p, "unterminated string");
+            }
+            ch = *p->pos++;
+            switch (ch) {
+                case '"':  case '\\':  case '/':  cp = ch; break;
+                case 'b':  cp = '\b'; break;
+                case 'f':  cp = '\f'; break;
+                case 'n':  cp = '\n'; break;
+                case 'r':  cp = '\r'; break;
+                case 't':  cp = '\t'; break;
+                case 'u':
+                    if ((rc = json_read_hex4(p, &cp)) != 0) {
+                        return rc;
+                    }
+                    if (cp >= 0xd800 && cp < 0xdc00) {
+                        unsigned long  low;
+                        if (p->end - p->pos < 2 ||
+                            p->pos[0] != '\\' || p->pos[1] != 'u') {
+                            return json_error(p, "unpaired surrogate");
+                        }
+                        p->pos += 2;
+                        if ((rc = json_read_hex4(p, &low)) != 0) {
+                            return rc;
+                        }
+                        if (low < 0xdc00 || low >= 0xe000) {
+                            return json_error(p, "unpaired surrogate");
+                        }
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    break;
+                default:
+                    return json_error(p, "invalid escape");
+            }
+        } else if (ch < 0x20) {
+            return json_error(p, "control character in string");
+        } else if (as_bytes && ch >= 0x80) {
+            /* Decode the UTF-8 sequence for a code point 0x80-0xff. */
+            if ((ch & 0xe0) != 0xc0 || p->pos >= p->end ||
+                (*p->pos & 0xc0) != 0x80) {
+                return json_error(p, "invalid character in byte string");
+            }
+            cp = ((ch & 0x1f) << 6) | (*p->pos++ & 0x3f);
+        } else {
+            /* Copy everything else through as-is. */
+            if ((rc = json_scratch_push(p, ch)) != 0) {
+                return rc;
+            }
+            continue;
+        }
+
+        if (as_bytes) {
+            if (cp > 0xff) {
+                return json_error(p, "invalid character in byte string");
+            }
+            rc = json_scratch_push(p, cp);
+        } else {
+            rc = json_push_code_point(p, cp);
+        }
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    if ((rc = json_scratch_push(p, '\0')) != 0) {
+        return rc;
+    }
+    p->scratch_used--;
+    return 0;
+}
+
+/*
+ * Reads a JSON number.  Lua strings are always NUL-terminated, so
+ * strtod and strtoll can't run past the end of the buffer.  They do
+ * accept things that JSON doesn't, like leading whitespace, hex, and
+ * "inf", so we check that a number really starts here first.
+ */
+
+static bool
+json_at_number(json_parser *p)
+{
+    const char  *digits;
+    json_skip_whitespace(p);
+    digits = (p->pos < p->end && *p->pos == '-')? p->pos + 1: p->pos;
+    return digits < p->end && *digits >= '0' && *digits <= '9' &&
+        !(digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X'));
+}
+
+static int
+json_read_long(json_parser *p, int64_t *result)
+{
+    char  *end;
+    if (!json_at_number(p)) {
+        return json_error(p, "expected a number");
+    }
+    errno = 0;
+    *result = strtoll(p->pos, &end, 10);
+    if (errno != 0 || end > p->end ||
+        *end == '.' || *end == 'e' || *end == 'E') {
+        return json_error(p, "expected an integer");
+    }
+    p->pos = end;
+    return 0;
+}
+
+static int
+json_read_double(json_parser *p, double *result)
+{
+    char  *end;
+    if (!json_at_number(p)) {
+        return json_error(p, "expected a number");
+    }
+    *result = strtod(p->pos, &end);
+    if (end > p->end) {
+        return json_error(p, "expected a number");
+    }
+    p->pos = end;
+    return 0;
+}
+
+#define json_check(call) \
+    do { \
+        int __rc = call; \
+        if (__rc != 0) { \
+            return __rc; \
+        } \
+    } while (0)
+
+static int
+json_read_value(json_parser *p, avro_value_t *value)
+{
+    switch (avro_value_get_type(value)) {
+        case AVRO_BOOLEAN:
+            if (json_accept_literal(p, "true")) {
+                return avro_value_set_boolean(value, true);
+            } else if (json_accept_literal(p, "false")) {
+                return avro_value_set_boolean(value, false);
+            }
+            return json_error(p, "expected a boolean");
+
+        case AVRO_NULL:
+            if (json_accept_literal(p, "null")) {
+                return avro_value_set_null(value);
+            }
+            return json_error(p, "expected null");
+
+        case AVRO_INT32:
+        {
+            int64_t  l;
+            json_check(json_read_long(p, &l));
+            if (l < INT32_MIN || l > INT32_MAX) {
+                return json_error(p, "int out of range");
+            }
+            return avro_value_set_int(value, (int32_t) l);
+        }
+
+        case AVRO_INT64:
+        {
+            int64_t  l;
+            json_check(json_read_long(p, &l));
+            return avro_value_set_long(value, l);
+        }
+
+        case AVRO_FLOAT:
+        {
+            double  d;
+            json_check(json_read_double(p, &d));
+            return avro_value_set_float(value, (float) d);
+        }
+
+        case AVRO_DOUBLE:
+        {
+            double  d;
+            json_check(json_read_double(p, &d));
+            return avro_value_set_double(value, d);
+        }
+
+        case AVRO_STRING:
+            json_check(json_read_string(p, false));
+            return avro_value_set_string_len
+                (value, p->scratch, p->scratch_used + 1);
+
+        case AVRO_BYTES:
+            json_check(json_read_string(p, true));
+            return avro_value_set_bytes(value, p->scratch, p->scratch_used);
+
+        case AVRO_FIXED:
+            json_check(json_read_string(p, true));
+            return avro_value_set_fixed(value, p->scratch, p->scratch_used);
+
+        case AVRO_ENUM:
+        {
+            avro_schema_t  schema = avro_value_get_schema(value);
+            json_check(json_read_string(p, false));
+            int  symbol = avro_schema_enum_get_by_name(schema, p->scratch);
+            if (symbol < 0) {
+                return json_error(p, "unknown enum symbol");
+            }
+            return avro_value_set_enum(value, symbol);
+        }
+
+        case AVRO_ARRAY:
+            json_check(avro_value_reset(value));
+            json_check(json_expect(p, '['));
+            if (json_accept(p, ']')) {
+                return 0;
+            }
+            do {
+                avro_value_t  element;
+                json_check(avro_value_append(value, &element, NULL));
+                json_check(json_read_value(p, &element));
+            } while (json_accept(p, ','));
+            return json_expect(p, ']');
+
+        case AVRO_MAP:
+            json_check(avro_value_reset(value));
+            json_check(json_expect(p, '{'));
+            if (json_accept(p, '}')) {
+                return 0;
+            }
+            do {
+                avro_value_t  element;
+                json_check(json_read_string(p, false));
+                json_check(avro_value_add
+                           (value, p->scratch, &element, NULL, NULL));
+                json_check(json_expect(p, ':'));
+                json_check(json_read_value(p, &element));
+            } while (json_accept(p, ','));
+            return json_expect(p, '}');
+
+        case AVRO_RECORD:
+        {
+            /* Every field must appear exactly once. */
+            size_t  field_count;
+            size_t  seen_count = 0;
+            json_check(avro_value_reset(value));
+            json_check(avro_value_get_size(value, &field_count));
+            char  seen[field_count + 1];
+            memset(seen, 0, field_count + 1);
+            json_check(json_expect(p, '{'));
+            if (!json_accept(p, '}')) {
+                do {
+                    avro_value_t  field;
+                    size_t  index;
+                    json_check(json_read_string(p, false));
+                    if (avro_value_get_by_name
+                        (value, p->scratch, &field, &index) != 0) {
+                        return json_error(p, "unknown record field");
+                    }
+                    if (seen[index]) {
+                        return json_error(p, "duplicate record field");
+                    }
+                    seen[index] = 1;
+                    seen_count++;
+                    json_check(json_expect(p, ':'));
+                    json_check(json_read_value(p, &field));
+                } while (json_accept(p, ','));
+                json_check(json_expect(p, '}'));
+            }
+            if (seen_count < field_count) {
+                return json_error(p, "missing record field");
+            }
+            return 0;
+        }
+
+        case AVRO_UNION:
+        {
+            /* A union is either null, or an object with a single
+             * entry, whose key is the name of the branch. */
+            avro_schema_t  schema = avro_value_get_schema(value);
+            avro_value_t  branch;
+            int  discriminant;
+            if (json_accept_literal(p, "null")) {
+                if (avro_schema_union_branch_by_name
+                    (schema, &discriminant, "null") == NULL) {
+                    return json_error(p, "union doesn't contain null");
+                }
+                json_check(avro_value_set_branch
+                           (value, discriminant, &branch));
+                return avro_value_set_null(&branch);
+            }
+            json_check(json_expect(p, '{'));
+            json_check(json_read_string(p, false));
+            if (avro_schema_union_branch_by_name
+                (schema, &discriminant, p->scratch) == NULL) {
+                return json_error(p, "unknown union branch");
+            }
+            json_check(avro_value_set_branch(value, discriminant, &branch));
+            json_check(json_expect(p, ':'));
+            json_check(json_read_value(p, &branch));
+            return json_expect(p, '}');
+        }
+
+        default:
+            avro_set_error("Unknown Avro value type");
+            return EINVAL;
+    }
+}
+
+
+/**
+ * Fills in the contents of an Avro value from its Avro JSON encoding
+ * (as produced by to_json).  This parses the JSON directly into the
+ * value, without building any Lua objects along the way.
+ */
+
+static int
+l_value_set_from_json(lua_State *L)
 {
     avro_value_t  *value = lua_avro_get_value(L, 1);
-    avro_type_t  value_type = avro_value_get_type(value);
-    int  no_scalar = lua_toboolean(L, 2);
+    size_t  len;
+    const char  *json = luaL_checklstring(L, 2, &len);
+    json_parser  p = { json, json, json + len, NULL, 0, 0 };
+
+    int  rc = json_read_value(&p, value);
+    if (rc == 0) {
+        json_skip_whitespace(&p);
+        if (p.pos != p.end) {
+            rc = json_error(&p, "extra data after value");
+        }
+    }
+    free(p.scratch);
+    check(rc);
+    return 0;
+}
 
-    if (value_type == AVRO_ARRAY) {
-        lua_pushcfunction(L, iterate_array);
-        create_iterator(L, value, no_scalar);
-        lua_pushnil(L);
-        return 3;
+
+/**
+ * Adds a new element to an Avro map.  The first parameter is always the
+ * key of the new element.  If called with two parameter, then the map
+ * values must be scalars, and the parameter is used as the value of the
+ * new element.  If called with one parameter, then the map can contain
+ * any kind of value.  In both cases, we return the AvroValue for the
+ * new element.  If you pass in an existing AvroValue as the second
+ * parameter, we'll reuse it for the new element.
+ */
+
+static int
+l_value_add(lua_State *L)
+{
+    int  nargs = lua_gettop(L);
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    const char  *key = luaL_checkstring(L, 2);
+
+    if (avro_value_get_type(value) != AVRO_MAP) {
+        lua_pushliteral(L, "Can only add to an map");
+        return lua_error(L);
+    }
+
+    if (nargs > 3) {
+        lua_pushliteral(L, "Bad number of arguments to AvroValue:add");
+        return lua_error(L);
+    }
+
+    avro_value_t  element;
+    check(avro_value_add(value, key, &element, NULL, NULL));
+    push_child_value(L, 1, &element, 3);
+
+    /*
+     * Otherwise just return the new element value.
+     */
+
+    return 1;
+}
+
+
+/**
+ * Appends a new element to an Avro array.  If called with one
+ * parameter, then the array must contain scalars, and the parameter is
+ * used as the value of the new element.  If called with no parameters,
+ * then the array can contain any kind of element.  In both cases, we
+ * return the AvroValue for the new element.  If you pass in an existing
+ * AvroValue, we'll reuse it for the new element.
+ */
+
+static int
+l_value_append(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+
+    if (avro_value_get_type(value) != AVRO_ARRAY) {
+        lua_pushliteral(L, "Can only append to an array");
+        return lua_error(L);
+    }
+
+    avro_value_t  element;
+    check(avro_value_append(value, &element, NULL));
+    push_child_value(L, 1, &element, 2);
+    return 1;
+}
+
+
+/**
+ * Returns the type of the elements of an array of numbers, or raises a
+ * Lua error if the value isn't an array of ints, longs, floats, or
+ * doubles.
+ */
+
+static avro_type_t
+numeric_array_type(lua_State *L, avro_value_t *value)
+{
+    if (avro_value_get_type(value) == AVRO_ARRAY) {
+        avro_schema_t  items =
+            avro_schema_array_items(avro_value_get_schema(value));
+        avro_type_t  item_type = avro_typeof(items);
+        if (item_type == AVRO_INT32 || item_type == AVRO_INT64 ||
+            item_type == AVRO_FLOAT || item_type == AVRO_DOUBLE) {
+            return item_type;
+        }
+    }
+    luaL_error(L, "Can only copy arrays of ints, longs, floats, or doubles");
+    return AVRO_NULL;
+}
+
+/**
+ * Copies the first n elements of an array of numbers into a C array
+ * (given as a light userdata), whose elements must be int32_t, int64_t,
+ * float, or double, to match the Avro array.  If n is omitted, or is
+ * larger than the Avro array, we copy the whole array.  Returns the
+ * number of elements copied.  The whole copy happens in a single call,
+ * without creating a Value instance for each element.
+ */
+
+static int
+l_value_copy_into(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    avro_type_t  item_type = numeric_array_type(L, value);
+    void  *ptr;
+    size_t  size;
+    size_t  i;
+
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+    ptr = lua_touserdata(L, 2);
+    check(avro_value_get_size(value, &size));
+    if (!lua_isnoneornil(L, 3)) {
+        lua_Integer  n = luaL_checkinteger(L, 3);
+        if (n < 0) {
+            return luaL_error(L, "Element count cannot be negative");
+        }
+        if ((size_t) n < size) {
+            size = n;
+        }
+    }
+
+    for (i = 0; i < size; i++) {
+        avro_value_t  element;
+        check(avro_value_get_by_index(value, i, &element, NULL));
+        switch (item_type) {
+          case AVRO_INT32:
+            check(avro_value_get_int(&element, &((int32_t *) ptr)[i]));
+            break;
+          case AVRO_INT64:
+            check(avro_value_get_long(&element, &((int64_t *) ptr)[i]));
+            break;
+          case AVRO_FLOAT:
+            check(avro_value_get_float(&element, &((float *) ptr)[i]));
+            break;
+          default:
+            check(avro_value_get_double(&element, &((double *) ptr)[i]));
+            break;
+        }
+    }
+
+    lua_pushinteger(L, size);
+    return 1;
+}
+
+/**
+ * Replaces the contents of an array of numbers with the n elements of a
+ * C array (given as a light userdata), whose elements must be int32_t,
+ * int64_t, float, or double, to match the Avro array.
+ */
+
+static int
+l_value_set_from_ffi_array(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    avro_type_t  item_type = numeric_array_type(L, value);
+    const void  *ptr;
+    lua_Integer  n;
+    lua_Integer  i;
+
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+    ptr = lua_touserdata(L, 2);
+    n = luaL_checkinteger(L, 3);
+    if (n < 0) {
+        return luaL_error(L, "Element count cannot be negative");
+    }
+
+    check(avro_value_reset(value));
+    for (i = 0; i < n; i++) {
+        avro_value_t  element;
+        check(avro_value_append(value, &element, NULL));
+        switch (item_type) {
+          case AVRO_INT32:
+            check(avro_value_set_int(&element, ((const int32_t *) ptr)[i]));
+            break;
+          case AVRO_INT64:
+            check(avro_value_set_long(&element, ((const int64_t *) ptr)[i]));
+            break;
+          case AVRO_FLOAT:
+            check(avro_value_set_float(&element, ((const float *) ptr)[i]));
+            break;
+          default:
+            check(avro_value_set_double(&element, ((const double *) ptr)[i]));
+            break;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Iterates through the elements of an Avro array or map.  The result of
+ * this function can be used as a for loop iterator.  For arrays, the
+ * iterator behaves like the builtin ipairs function, returning [i,
+ * element] pairs during each iteration.  For maps, it behaves like the
+ * builtin pairs function, returning [key, element] pairs.  In both
+ * cases, if the elements are scalars, these will be translated into the
+ * Lua equivalent; if they're compound value objects, you'll get an
+ * AvroValue instance.  If you pass in an existing AvroValue as the
+ * second parameter, every iteration reuses it for the current element,
+ * instead of creating a new instance for each one.
+ */
+
+typedef struct _Iterator
+{
+    bool  no_scalar;
+    avro_value_t  value;
+    size_t  next_index;
+    int  parent_ref;
+    int  into_ref;
+} Iterator;
+
+#define MT_ITERATOR "sawmill:AvroValue:iterator"
+
+/* We copy the value that we're iterating through, since into might be
+ * the instance that points at it, and keep that instance alive. */
+
+static void
+create_iterator(lua_State *L, int value_index, bool no_scalar,
+                int into_index)
+{
+    int  parent_ref;
+    int  into_ref = LUA_NOREF;
+    if (!lua_isnoneornil(L, into_index)) {
+        luaL_checkudata(L, into_index, MT_AVRO_VALUE);
+        lua_pushvalue(L, into_index);
+        into_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_pushvalue(L, value_index);
+    parent_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_newuserdata(L, sizeof(Iterator));
+    Iterator  *state = lua_touserdata(L, -1);
+    state->no_scalar = no_scalar;
+    state->value = *lua_avro_get_value(L, value_index);
+    state->next_index = 0;
+    state->parent_ref = parent_ref;
+    state->into_ref = into_ref;
+    luaL_getmetatable(L, MT_ITERATOR);
+    lua_setmetatable(L, -2);
+}
+
+static int
+iterator_gc(lua_State *L)
+{
+    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
+    state->value.iface = NULL;
+    state->value.self = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, state->parent_ref);
+    state->parent_ref = LUA_NOREF;
+    luaL_unref(L, LUA_REGISTRYINDEX, state->into_ref);
+    state->into_ref = LUA_NOREF;
+    return 0;
+}
+
+/**
+ * Pushes the current element of an iteration, reusing the iterator's
+ * into value if it has one.
+ */
+
+static void
+push_iterator_element(lua_State *L, Iterator *state, avro_value_t *element)
+{
+    if (state->into_ref == LUA_NOREF) {
+        lua_avro_push_value(L, element, false);
+    } else {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, state->parent_ref);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, state->into_ref);
+        push_child_value(L, lua_gettop(L) - 1, element, lua_gettop(L));
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+    }
+}
+
+static int
+iterate_array(lua_State *L)
+{
+    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
+    size_t  length;
+    check(avro_value_get_size(&state->value, &length));
+
+    /*
+     * next_index is the 0-based avro index, not the 1-based Lua index.
+     */
+
+    if (state->next_index >= length) {
+        return 0;
+    }
+
+    avro_value_t  element;
+    check(avro_value_get_by_index(&state->value, state->next_index, &element, NULL));
+    lua_pushinteger(L, state->next_index+1);
+    push_iterator_element(L, state, &element);
+
+    state->next_index++;
+    return 2;
+}
+
+static int
+iterate_map(lua_State *L)
+{
+    Iterator  *state = luaL_checkudata(L, 1, MT_ITERATOR);
+    size_t  length;
+    check(avro_value_get_size(&state->value, &length));
+
+    /*
+     * next_index is the 0-based avro index, not the 1-based Lua index.
+     */
+
+    if (state->next_index >= length) {
+        return 0;
+    }
+
+    const char  *key = NULL;
+    avro_value_t  element;
+    check(avro_value_get_by_index(&state->value, state->next_index, &element, &key));
+
+    lua_pushstring(L, key);
+    push_iterator_element(L, state, &element);
+
+    state->next_index++;
+    return 2;
+}
+
+static int
+l_value_iterate(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    avro_type_t  value_type = avro_value_get_type(value);
+    int  no_scalar = lua_toboolean(L, 2);
+
+    if (value_type == AVRO_ARRAY) {
+        lua_pushcfunction(L, iterate_array);
+        create_iterator(L, 1, no_scalar, 3);
+        lua_pushnil(L);
+        return 3;
+    }
+
+    if (value_type == AVRO_MAP) {
+        lua_pushcfunction(L, iterate_map);
+        create_iterator(L, 1, no_scalar, 3);
+        lua_pushnil(L);
+        return 3;
+    }
+
+    lua_pushliteral(L, "Can only iterate through arrays and maps");
+    return lua_error(L);
+}
+
+
+/**
+ * The string used to identify the AvroBuffer class's metatable in the
+ * Lua registry.
+ */
+
+#define MT_AVRO_BUFFER "avro:AvroBuffer"
+
+/**
+ * A growable memory buffer that we can encode Avro values into.  The
+ * memory is kept around between calls, so that encoding a stream of
+ * values only allocates when a value is larger than any that came
+ * before it.
+ */
+
+typedef struct _LuaAvroBuffer
+{
+    char  *buf;
+    size_t  used;
+    size_t  allocated;
+} LuaAvroBuffer;
+
+#define DEFAULT_BUFFER_SIZE  4096
+
+static int
+buffer_reserve(LuaAvroBuffer *l_buf, size_t size)
+{
+    if (size <= l_buf->allocated) {
+        return 0;
+    }
+
+    size_t  new_size =
+        (l_buf->allocated == 0)? DEFAULT_BUFFER_SIZE: l_buf->allocated;
+    while (new_size < size) {
+        new_size *= 2;
+    }
+
+    char  *new_buf = realloc(l_buf->buf, new_size);
+    if (new_buf == NULL) {
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+
+    l_buf->buf = new_buf;
+    l_buf->allocated = new_size;
+    return 0;
+}
+
+/**
+ * Gives back any memory beyond max, discarding the buffer's contents.
+ * If the smaller allocation fails, we just keep the larger one.
+ */
+
+static void
+buffer_shrink(LuaAvroBuffer *l_buf, size_t max)
+{
+    l_buf->used = 0;
+    if (l_buf->allocated > max) {
+        char  *new_buf = realloc(l_buf->buf, max);
+        if (new_buf != NULL) {
+            l_buf->buf = new_buf;
+            l_buf->allocated = max;
+        }
+    }
+}
+
+/**
+ * Encodes an Avro value into a buffer, replacing its current contents.
+ * We optimistically write into whatever space the buffer already has,
+ * so that most values only need a single traversal.  If that overflows,
+ * we find out the exact size that we need, grow the buffer, and try
+ * again.
+ */
+
+static int
+buffer_encode_value(LuaAvroBuffer *l_buf, avro_value_t *value)
+{
+    int  rc;
+    avro_writer_t  writer = avro_writer_memory(l_buf->buf, l_buf->allocated);
+    rc = avro_value_write(writer, value);
+
+    if (rc == ENOSPC) {
+        size_t  size = 0;
+        rc = avro_value_sizeof(value, &size);
+        if (rc == 0) {
+            rc = buffer_reserve(l_buf, size);
+        }
+        if (rc == 0) {
+            avro_writer_memory_set_dest(writer, l_buf->buf, l_buf->allocated);
+            rc = avro_value_write(writer, value);
+        }
+    }
+
+    if (rc == 0) {
+        l_buf->used = avro_writer_tell(writer);
+    } else {
+        l_buf->used = 0;
+    }
+    avro_writer_free(writer);
+    return rc;
+}
+
+
+/**
+ * Creates a new AvroBuffer, with an optional initial size.
+ */
+
+static int
+l_buffer_new(lua_State *L)
+{
+    lua_Integer  size = luaL_optinteger(L, 1, 0);
+    if (size < 0) {
+        return luaL_error(L, "Buffer size cannot be negative");
+    }
+
+    LuaAvroBuffer  *l_buf = lua_newuserdata(L, sizeof(LuaAvroBuffer));
+    l_buf->buf = NULL;
+    l_buf->used = 0;
+    l_buf->allocated = 0;
+    luaL_getmetatable(L, MT_AVRO_BUFFER);
+    lua_setmetatable(L, -2);
+
+    check(buffer_reserve(l_buf, size));
+    return 1;
+}
+
+
+/**
+ * Returns the contents of the buffer as a Lua string.
+ */
+
+static int
+l_buffer_tostring(lua_State *L)
+{
+    LuaAvroBuffer  *l_buf = luaL_checkudata(L, 1, MT_AVRO_BUFFER);
+    lua_pushlstring(L, l_buf->buf, l_buf->used);
+    return 1;
+}
+
+
+/**
+ * Returns the number of bytes in the buffer.
+ */
+
+static int
+l_buffer_size(lua_State *L)
+{
+    LuaAvroBuffer  *l_buf = luaL_checkudata(L, 1, MT_AVRO_BUFFER);
+    lua_pushinteger(L, l_buf->used);
+    return 1;
+}
+
+
+/**
+ * Returns the contents of the buffer as a light userdata and a size.
+ * The pointer is only valid until the next time the buffer is encoded
+ * into, or until the buffer is garbage collected.
+ */
+
+static int
+l_buffer_pointer(lua_State *L)
+{
+    LuaAvroBuffer  *l_buf = luaL_checkudata(L, 1, MT_AVRO_BUFFER);
+    lua_pushlightuserdata(L, l_buf->buf);
+    lua_pushinteger(L, l_buf->used);
+    return 2;
+}
+
+
+/**
+ * Frees the memory used by an AvroBuffer.
+ */
+
+static int
+l_buffer_gc(lua_State *L)
+{
+    LuaAvroBuffer  *l_buf = luaL_checkudata(L, 1, MT_AVRO_BUFFER);
+    if (l_buf->buf != NULL) {
+        free(l_buf->buf);
+        l_buf->buf = NULL;
+    }
+    l_buf->used = 0;
+    l_buf->allocated = 0;
+    return 0;
+}
+
+
+/**
+ * Returns the buffer that Value:encode uses when it isn't given one.
+ * Each Lua state has its own, stored in the registry, since scan
+ * filters run in their own states on other threads.  The buffer keeps
+ * up to DEFAULT_BUFFER_MAX bytes between calls; anything more is only
+ * held onto while encoding the value that needed it.
+ */
+
+#define DEFAULT_BUFFER "avro:AvroDefaultBuffer"
+#define DEFAULT_BUFFER_MAX  65536
+
+static LuaAvroBuffer *
+get_default_buffer(lua_State *L)
+{
+    LuaAvroBuffer  *l_buf;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, DEFAULT_BUFFER);
+    l_buf = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (l_buf != NULL) {
+        return l_buf;
+    }
+
+    l_buf = lua_newuserdata(L, sizeof(LuaAvroBuffer));
+    l_buf->buf = NULL;
+    l_buf->used = 0;
+    l_buf->allocated = 0;
+    luaL_getmetatable(L, MT_AVRO_BUFFER);
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, DEFAULT_BUFFER);
+    return l_buf;
+}
+
+
+/**
+ * Encode an Avro value using the binary encoding.  If an AvroBuffer is
+ * given, the encoded value is placed into it, and the buffer is
+ * returned.  Otherwise, we use a shared internal buffer, and return the
+ * result as a Lua string.
+ */
+
+static int
+l_value_encode(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+
+    if (lua_isnoneornil(L, 2)) {
+        LuaAvroBuffer  *default_buf = get_default_buffer(L);
+        if (buffer_encode_value(default_buf, value)) {
+            return lua_return_avro_error(L);
+        }
+        lua_pushlstring(L, default_buf->buf, default_buf->used);
+        buffer_shrink(default_buf, DEFAULT_BUFFER_MAX);
+        return 1;
+    }
+
+    LuaAvroBuffer  *l_buf = luaL_checkudata(L, 2, MT_AVRO_BUFFER);
+    if (buffer_encode_value(l_buf, value)) {
+        return lua_return_avro_error(L);
+    }
+    lua_pushvalue(L, 2);
+    return 1;
+}
+
+
+/**
+ * Return the length of the binary encoding of the value.
+ */
+
+static int
+l_value_encoded_size(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+
+    size_t  size = 0;
+    check(avro_value_sizeof(value, &size));
+
+    lua_pushinteger(L, size);
+    return 1;
+}
+
+
+/**
+ * Encode an Avro value using the binary encoding.  The result is placed
+ * into the given memory region, which is provided as a light user data
+ * and a size.  There's no safety checking here; to make it easier to
+ * not include this function in sandboxes, it's exposed as a global
+ * function in the "avro" package, and not as a method of the AvroValue
+ * class.
+ */
+
+static int
+l_value_encode_raw(lua_State *L)
+{
+    avro_value_t  *value = lua_avro_get_value(L, 1);
+    if (!lua_islightuserdata(L, 2)) {
+        return luaL_error(L, "Destination buffer should be a light userdata");
+    }
+    void  *buf = lua_touserdata(L, 2);
+    size_t  size = luaL_checkinteger(L, 3);
+
+    avro_writer_t  writer = avro_writer_memory(buf, size);
+    int  result = avro_value_write(writer, value);
+    avro_writer_free(writer);
+
+    if (result) {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, avro_strerror());
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+
+/**
+ * Finalizes an AvroValue instance.
+ */
+
+static int
+l_value_release(lua_State *L)
+{
+    LuaAvroValue  *l_value = luaL_checkudata(L, 1, MT_AVRO_VALUE);
+    value_release(l_value);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — schemas
+ */
+
+/**
+ * The string used to identify the AvroSchema class's metatable in the
+ * Lua registry.
+ */
+
+#define MT_AVRO_SCHEMA "avro:AvroSchema"
+
+typedef struct _LuaAvroSchema
+{
+    avro_schema_t  schema;
+    avro_value_iface_t  *iface;
+} LuaAvroSchema;
+
+
+int
+lua_avro_push_schema(lua_State *L, avro_schema_t schema)
+{
+    LuaAvroSchema  *l_schema;
+    l_schema = lua_newuserdata(L, sizeof(LuaAvroSchema));
+    l_schema->schema = avro_schema_incref(schema);
+    l_schema->iface = NULL;
+    luaL_getmetatable(L, MT_AVRO_SCHEMA);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+int
+lua_avro_push_schema_no_link(lua_State *L, avro_schema_t schema)
+{
+    while (is_avro_link(schema)) {
+        schema = avro_schema_link_target(schema);
+    }
+    return lua_avro_push_schema(L, schema);
+}
+
+
+avro_schema_t
+lua_avro_get_schema(lua_State *L, int index)
+{
+    lua_pushliteral(L, "raw_schema");
+    lua_gettable(L, index);
+    lua_pushvalue(L, index);
+    lua_call(L, 1, 1);
+    LuaAvroSchema  *l_schema = luaL_checkudata(L, -1, MT_AVRO_SCHEMA);
+    lua_pop(L, 1);
+    return l_schema->schema;
+}
+
+avro_schema_t
+lua_avro_get_raw_schema(lua_State *L, int index)
+{
+    LuaAvroSchema  *l_schema = luaL_checkudata(L, index, MT_AVRO_SCHEMA);
+    return l_schema->schema;
+}
+
+
+static int
+l_new_raw_schema(lua_State *L)
+{
+    avro_schema_t  schema = lua_touserdata(L, 1);
+    if (schema == NULL) {
+        lua_pushliteral(L, "Cannot create NULL schema wrapper");
+        return lua_error(L);
+    }
+    lua_avro_push_schema(L, schema);
+    lua_pushlightuserdata(L, schema);
+    return 2;
+}
+
+
+/**
+ * Creates a new AvroValue for the given schema.
+ */
+
+static int
+l_schema_new_raw_value(lua_State *L)
+{
+    LuaAvroSchema  *l_schema = luaL_checkudata(L, 1, MT_AVRO_SCHEMA);
+    if (l_schema->iface == NULL) {
+        l_schema->iface = avro_generic_class_from_schema(l_schema->schema);
+        if (l_schema->iface == NULL) {
+            lua_pushstring(L, avro_strerror());
+            return lua_error(L);
+        }
+    }
+
+    if (lua_gettop(L) >= 2) {
+        LuaAvroValue  *l_value = luaL_checkudata(L, 2, MT_AVRO_VALUE);
+        value_release(l_value);
+        check(avro_generic_value_new(l_schema->iface, &l_value->value));
+        l_value->should_decref = true;
+        lua_pushvalue(L, 2);
+    } else {
+        avro_value_t  value;
+        check(avro_generic_value_new(l_schema->iface, &value));
+        lua_avro_push_value(L, &value, true);
+    }
+    return 1;
+}
+
+
+/**
+ * Returns the type of an AvroSchema instance.
+ */
+
+static int
+l_schema_type(lua_State *L)
+{
+    avro_schema_t  schema = lua_avro_get_raw_schema(L, 1);
+    lua_pushnumber(L, avro_typeof(schema));
+    return 1;
+}
+
+
+/**
+ * Returns the name of an AvroSchema instance.
+ */
+
+static int
+l_schema_name(lua_State *L)
+{
+    avro_schema_t  schema = lua_avro_get_raw_schema(L, 1);
+    lua_pushstring(L, avro_schema_type_name(schema));
+    return 1;
+}
+
+
+/**
+ * Finalizes an AvroSchema instance.
+ */
+
+static int
+l_schema_gc(lua_State *L)
+{
+    LuaAvroSchema  *l_schema = luaL_checkudata(L, 1, MT_AVRO_SCHEMA);
+    if (l_schema->schema != NULL) {
+        avro_schema_decref(l_schema->schema);
+        l_schema->schema = NULL;
+    }
+    if (l_schema->iface != NULL) {
+        avro_value_iface_decref(l_schema->iface);
+        l_schema->iface = NULL;
+    }
+    return 0;
+}
+
+
+/**
+ * Splits a full schema name into its namespace, which we push onto the
+ * stack (or nil if there isn't one), and returns the unqualified name.
+ */
+
+static const char *
+push_schema_namespace(lua_State *L, const char *full_name)
+{
+    const char  *dot = strrchr(full_name, '.');
+    if (dot == NULL) {
+        lua_pushnil(L);
+        return full_name;
+    } else {
+        lua_pushlstring(L, full_name, dot - full_name);
+        return dot + 1;
+    }
+}
+
+/**
+ * Pushes the full name of the named Lua schema at index, which is its
+ * unqualified name qualified by its namespace (if it has one).  Returns
+ * the full name, or NULL if the schema doesn't have a name.
+ */
+
+static const char *
+push_schema_full_name(lua_State *L, int index)
+{
+    const char  *name;
+    const char  *space;
+
+    lua_getfield(L, index, "schema_name");
+    name = lua_tostring(L, -1);
+    if (name == NULL) {
+        return NULL;
+    }
+
+    /* A name that contains a dot is already a full name. */
+    lua_getfield(L, index, "namespace");
+    space = lua_tostring(L, -1);
+    if (space == NULL || *space == '\0' || strchr(name, '.') != NULL) {
+        lua_pop(L, 1);
+    } else {
+        lua_pushliteral(L, ".");
+        lua_pushvalue(L, -3);
+        lua_concat(L, 3);
+        lua_remove(L, -2);
+    }
+    return lua_tostring(L, -1);
+}
+
+static avro_schema_t
+schema_from_lua(lua_State *L, int index, int links_index);
+
+/**
+ * Builds the child schema stored in the given field of the Lua schema
+ * at index, or in the given element if field is NULL.
+ */
+
+static avro_schema_t
+child_schema_from_lua(lua_State *L, int index, const char *field,
+                      int element, int links_index)
+{
+    avro_schema_t  result;
+    if (field == NULL) {
+        lua_rawgeti(L, index, element);
+    } else {
+        lua_getfield(L, index, field);
+    }
+    result = schema_from_lua(L, lua_gettop(L), links_index);
+    lua_pop(L, 1);
+    return result;
+}
+
+/**
+ * Builds an Avro C schema directly from an avro.schema Lua schema,
+ * without going through its JSON encoding.  links_index is a table
+ * mapping the name of each named schema that we've already started
+ * building to its Avro C schema, and each of those Avro C schemas back
+ * to the Lua schema it came from.  Any later schema with the same name
+ * (including a recursive reference) becomes a link, just like it would
+ * in the schema's JSON encoding, as long as it's equal to the earlier
+ * one.  Returns a new reference, or NULL and sets the Avro error.
+ */
+
+static avro_schema_t
+schema_from_lua(lua_State *L, int index, int links_index)
+{
+    avro_schema_t  schema = NULL;
+    int  schema_type;
+    size_t  i;
+
+    if (!lua_istable(L, index)) {
+        avro_set_error("Invalid Lua schema");
+        return NULL;
+    }
+
+    lua_getfield(L, index, "schema_type");
+    if (!lua_isnumber(L, -1)) {
+        lua_pop(L, 1);
+        avro_set_error("Invalid Lua schema");
+        return NULL;
+    }
+    schema_type = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    switch (schema_type) {
+        case AVRO_STRING:  return avro_schema_string();
+        case AVRO_BYTES:   return avro_schema_bytes();
+        case AVRO_INT32:   return avro_schema_int();
+        case AVRO_INT64:   return avro_schema_long();
+        case AVRO_FLOAT:   return avro_schema_float();
+        case AVRO_DOUBLE:  return avro_schema_double();
+        case AVRO_BOOLEAN: return avro_schema_boolean();
+        case AVRO_NULL:    return avro_schema_null();
+
+        case AVRO_ARRAY:
+        case AVRO_MAP:
+        {
+            avro_schema_t  child = child_schema_from_lua
+                (L, index,
+                 (schema_type == AVRO_ARRAY)? "item_schema": "value_schema",
+                 0, links_index);
+            if (child == NULL) {
+                return NULL;
+            }
+            schema = (schema_type == AVRO_ARRAY)?
+                avro_schema_array(child): avro_schema_map(child);
+            avro_schema_decref(child);
+            return schema;
+        }
+
+        case AVRO_UNION:
+        {
+            lua_getfield(L, index, "branches");
+            int  branches_index = lua_gettop(L);
+            size_t  branch_count = lua_objlen(L, branches_index);
+            schema = avro_schema_union();
+            for (i = 1; i <= branch_count; i++) {
+                avro_schema_t  branch = child_schema_from_lua
+                    (L, branches_index, NULL, i, links_index);
+                if (branch == NULL) {
+                    avro_schema_decref(schema);
+                    lua_pop(L, 1);
+                    return NULL;
+                }
+                avro_schema_union_append(schema, branch);
+                avro_schema_decref(branch);
+            }
+            lua_pop(L, 1);
+            return schema;
+        }
+
+        case AVRO_RECORD:
+        case AVRO_ENUM:
+        case AVRO_FIXED:
+            break;
+
+        default:
+            avro_set_error("Invalid Lua schema type %d", schema_type);
+            return NULL;
+    }
+
+    /* All that's left are the named types, which we link by full name. */
+    const char  *full_name = push_schema_full_name(L, index);
+    if (full_name == NULL) {
+        lua_pop(L, 1);
+        avro_set_error("Named Lua schema doesn't have a name");
+        return NULL;
+    }
+
+    lua_pushvalue(L, -1);
+    lua_rawget(L, links_index);
+    if (lua_islightuserdata(L, -1)) {
+        avro_schema_t  target = lua_touserdata(L, -1);
+        lua_rawget(L, links_index);
+        if (!lua_rawequal(L, -1, index) && !lua_equal(L, -1, index)) {
+            avro_set_error("Two mismatching schemas named %s", full_name);
+            lua_pop(L, 2);
+            return NULL;
+        }
+        lua_pop(L, 2);
+        return avro_schema_link(target);
+    }
+    lua_pop(L, 1);
+
+    const char  *name = push_schema_namespace(L, full_name);
+    const char  *space = lua_tostring(L, -1);
+
+    if (schema_type == AVRO_RECORD) {
+        schema = avro_schema_record(name, space);
+    } else if (schema_type == AVRO_ENUM) {
+        schema = avro_schema_enum_ns(name, space);
+    } else {
+        lua_getfield(L, index, "fixed_size");
+        int64_t  size = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        schema = avro_schema_fixed_ns(name, space, size);
+    }
+    lua_pop(L, 2);
+    if (schema == NULL) {
+        return NULL;
+    }
+
+    /* Register the schema before we look at its fields, so that any
+     * recursive references can find it. */
+    push_schema_full_name(L, index);
+    lua_pushlightuserdata(L, schema);
+    lua_rawset(L, links_index);
+    lua_pushlightuserdata(L, schema);
+    lua_pushvalue(L, index);
+    lua_rawset(L, links_index);
+
+    if (schema_type == AVRO_RECORD) {
+        lua_getfield(L, index, "fields");
+        int  fields_index = lua_gettop(L);
+        size_t  field_count = lua_objlen(L, fields_index);
+        for (i = 1; i <= field_count; i++) {
+            /* Each field is a table containing a single name/schema
+             * pair. */
+            lua_rawgeti(L, fields_index, i);
+            if (!lua_istable(L, -1)) {
+                lua_pop(L, 2);
+                avro_set_error("Invalid record field");
+                goto error;
+            }
+            lua_pushnil(L);
+            if (!lua_next(L, -2)) {
+                lua_pop(L, 2);
+                avro_set_error("Invalid record field");
+                goto error;
+            }
+            const char  *field_name = lua_tostring(L, -2);
+            avro_schema_t  field_schema =
+                schema_from_lua(L, lua_gettop(L), links_index);
+            if (field_schema == NULL) {
+                lua_pop(L, 4);
+                goto error;
+            }
+            int  rc = avro_schema_record_field_append
+                (schema, field_name, field_schema);
+            avro_schema_decref(field_schema);
+            lua_pop(L, 3);
+            if (rc != 0) {
+                lua_pop(L, 1);
+                goto error;
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    else if (schema_type == AVRO_ENUM) {
+        lua_getfield(L, index, "symbols");
+        int  symbols_index = lua_gettop(L);
+        size_t  symbol_count = lua_objlen(L, symbols_index);
+        for (i = 1; i <= symbol_count; i++) {
+            lua_rawgeti(L, symbols_index, i);
+            int  rc = avro_schema_enum_symbol_append
+                (schema, lua_tostring(L, -1));
+            lua_pop(L, 1);
+            if (rc != 0) {
+                lua_pop(L, 1);
+                goto error;
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    return schema;
+
+error:
+    avro_schema_decref(schema);
+    return NULL;
+}
+
+
+/**
+ * Creates a new AvroSchema instance from a JSON schema string, or from
+ * an avro.schema Lua schema.
+ */
+
+static int
+l_schema_new(lua_State *L)
+{
+    if (lua_isstring(L, 1)) {
+        size_t  json_len;
+        const char  *json_str = lua_tolstring(L, 1, &json_len);
+        avro_schema_t  schema;
+
+        /* First check for the primitive types */
+        if (strcmp(json_str, "boolean") == 0) {
+            schema = avro_schema_boolean();
+        }
+
+        else if (strcmp(json_str, "bytes") == 0) {
+            schema = avro_schema_bytes();
+        }
+
+        else if (strcmp(json_str, "double") == 0) {
+            schema = avro_schema_double();
+        }
+
+        else if (strcmp(json_str, "float") == 0) {
+            schema = avro_schema_float();
+        }
+
+        else if (strcmp(json_str, "int") == 0) {
+            schema = avro_schema_int();
+        }
+
+        else if (strcmp(json_str, "long") == 0) {
+            schema = avro_schema_long();
+        }
+
+        else if (strcmp(json_str, "null") == 0) {
+            schema = avro_schema_null();
+        }
+
+        else if (strcmp(json_str, "string") == 0) {
+            schema = avro_schema_string();
+        }
+
+        /* Otherwise assume it's JSON */
+
+        else {
+            avro_schema_error_t  schema_error;
+            check(avro_schema_from_json(json_str, json_len, &schema, &schema_error));
+        }
+
+        lua_avro_push_schema(L, schema);
+        avro_schema_decref(schema);
+        lua_pushlightuserdata(L, schema);
+        return 2;
+    }
+
+    if (lua_istable(L, 1)) {
+        avro_schema_t  schema;
+        lua_settop(L, 1);
+        lua_newtable(L);
+        schema = schema_from_lua(L, 1, 2);
+        if (schema == NULL) {
+            return lua_avro_error(L);
+        }
+        lua_avro_push_schema(L, schema);
+        avro_schema_decref(schema);
+        lua_pushlightuserdata(L, schema);
+        return 2;
+    }
+
+    if (lua_isuserdata(L, 1)) {
+        if (lua_getmetatable(L, 1)) {
+            lua_getfield(L, LUA_REGISTRYINDEX, MT_AVRO_SCHEMA);
+            if (lua_rawequal(L, -1, -2)) {
+                /* This is already a schema object, so just return it. */
+                lua_pop(L, 2);  /* remove both metatables */
+                LuaAvroSchema  *l_schema = lua_touserdata(L, 1);
+                lua_pushlightuserdata(L, l_schema->schema);
+                return 2;
+            }
+        }
+    }
+
+    lua_pushliteral(L, "Invalid input to Schema function");
+    return lua_error(L);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — resolved readers
+ */
+
+/**
+ * The string used to identify the AvroResolvedReader class's metatable
+ * in the Lua registry.
+ */
+
+#define MT_AVRO_RESOLVED_READER "avro:AvroResolvedReader"
+
+typedef struct _LuaAvroResolvedReader
+{
+    avro_value_iface_t  *resolver;
+} LuaAvroResolvedReader;
+
+
+int
+lua_avro_push_resolved_reader(lua_State *L, avro_value_iface_t *resolver)
+{
+    LuaAvroResolvedReader  *l_resolver;
+
+    l_resolver = lua_newuserdata(L, sizeof(LuaAvroResolvedReader));
+    l_resolver->resolver = resolver;
+    luaL_getmetatable(L, MT_AVRO_RESOLVED_READER);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+
+avro_value_iface_t *
+lua_avro_get_resolved_reader(lua_State *L, int index)
+{
+    LuaAvroResolvedReader  *l_resolver =
+        luaL_checkudata(L, index, MT_AVRO_RESOLVED_READER);
+    return l_resolver->resolver;
+}
+
+
+/**
+ * Creates a new AvroResolvedReader for the given schemas.
+ */
+
+static int
+l_resolved_reader_new(lua_State *L)
+{
+    avro_schema_t  writer_schema = lua_avro_get_schema(L, 1);
+    avro_schema_t  reader_schema = lua_avro_get_schema(L, 2);
+    avro_value_iface_t  *resolver =
+        avro_resolved_reader_new(writer_schema, reader_schema);
+    if (resolver == NULL) {
+        return lua_return_avro_error(L);
+    } else {
+        lua_avro_push_resolved_reader(L, resolver);
+        return 1;
+    }
+}
+
+
+/**
+ * Finalizes an AvroResolvedReader instance.
+ */
+
+static int
+l_resolved_reader_gc(lua_State *L)
+{
+    LuaAvroResolvedReader  *l_resolver =
+        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_READER);
+    if (l_resolver->resolver != NULL) {
+        avro_value_iface_decref(l_resolver->resolver);
+        l_resolver->resolver = NULL;
+    }
+    return 0;
+}
+
+
+/**
+ * Creates a new AvroValue for the given resolved reader.
+ */
+
+static int
+l_resolved_reader_new_raw_value(lua_State *L)
+{
+    avro_value_iface_t  *resolver = lua_avro_get_resolved_reader(L, 1);
+    avro_value_t  value;
+    check(avro_resolved_reader_new_value(resolver, &value));
+    lua_avro_push_value(L, &value, true);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — resolved writers
+ */
+
+/**
+ * The string used to identify the AvroResolvedWriter class's metatable
+ * in the Lua registry.
+ */
+
+#define MT_AVRO_RESOLVED_WRITER "avro:AvroResolvedWriter"
+
+typedef struct _LuaAvroResolvedWriter
+{
+    avro_value_iface_t  *resolver;
+    avro_value_t  value;
+} LuaAvroResolvedWriter;
+
+
+int
+lua_avro_push_resolved_writer(lua_State *L, avro_value_iface_t *resolver)
+{
+    LuaAvroResolvedWriter  *l_resolver;
+
+    l_resolver = lua_newuserdata(L, sizeof(LuaAvroResolvedWriter));
+    l_resolver->resolver = resolver;
+    avro_resolved_writer_new_value(resolver, &l_resolver->value);
+    luaL_getmetatable(L, MT_AVRO_RESOLVED_WRITER);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+
+avro_value_iface_t *
+lua_avro_get_resolved_writer(lua_State *L, int index)
+{
+    LuaAvroResolvedWriter  *l_resolver =
+        luaL_checkudata(L, index, MT_AVRO_RESOLVED_WRITER);
+    return l_resolver->resolver;
+}
+
+
+/**
+ * Creates a new AvroResolvedWriter for the given schemas.
+ */
+
+static int
+l_resolved_writer_new(lua_State *L)
+{
+    avro_schema_t  writer_schema = lua_avro_get_schema(L, 1);
+    avro_schema_t  reader_schema = lua_avro_get_schema(L, 2);
+    avro_value_iface_t  *resolver =
+        avro_resolved_writer_new(writer_schema, reader_schema);
+    if (resolver == NULL) {
+        return lua_return_avro_error(L);
+    } else {
+        lua_avro_push_resolved_writer(L, resolver);
+        return 1;
+    }
+}
+
+
+/**
+ * Finalizes an AvroResolvedWriter instance.
+ */
+
+static int
+l_resolved_writer_gc(lua_State *L)
+{
+    LuaAvroResolvedWriter  *l_resolver =
+        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
+    if (l_resolver->value.self != NULL) {
+        avro_value_decref(&l_resolver->value);
+        l_resolver->value.iface = NULL;
+        l_resolver->value.self = NULL;
+    }
+    if (l_resolver->resolver != NULL) {
+        avro_value_iface_decref(l_resolver->resolver);
+        l_resolver->resolver = NULL;
+    }
+    return 0;
+}
+
+
+/**
+ * Creates a new AvroValue for the given resolved writer.
+ */
+
+static int
+l_resolved_writer_new_raw_value(lua_State *L)
+{
+    avro_value_iface_t  *resolver = lua_avro_get_resolved_writer(L, 1);
+    avro_value_t  value;
+    check(avro_resolved_writer_new_value(resolver, &value));
+    lua_avro_push_value(L, &value, true);
+    return 1;
+}
+
+
+/**
+ * The Avro C memory reader doesn't tell us how many bytes it read.  To
+ * be able to report that back to the caller, we make a second pass over
+ * the encoded value, skipping over it using its writer schema.  This is
+ * much cheaper than the decode itself, since we don't have to build up
+ * any values.
+ *
+ * If the buffer ends partway through the value, the skip functions
+ * return EAGAIN, so that callers can tell that apart from invalid data,
+ * such as a negative length or a varint longer than 10 bytes, for which
+ * they return EINVAL.
+ */
+
+static int
+skip_binary_long(const char *buf, size_t size, size_t *pos, int64_t *out)
+{
+    uint64_t  value = 0;
+    int  shift = 0;
+    uint8_t  b;
+
+    do {
+        if (*pos >= size) {
+            avro_set_error("Truncated Avro binary encoding");
+            return EAGAIN;
+        }
+        if (shift >= 64) {
+            avro_set_error("Varint is too long");
+            return EINVAL;
+        }
+        b = (uint8_t) buf[(*pos)++];
+        value |= (uint64_t) (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    *out = (int64_t) ((value >> 1) ^ -(value & 1));
+    return 0;
+}
+
+static int
+skip_binary_bytes(size_t size, size_t *pos, int64_t len)
+{
+    if (len < 0) {
+        avro_set_error("Invalid negative length");
+        return EINVAL;
+    }
+    if ((uint64_t) len > size - *pos) {
+        avro_set_error("Truncated Avro binary encoding");
+        return EAGAIN;
+    }
+    *pos += len;
+    return 0;
+}
+
+static int
+skip_binary_value(const char *buf, size_t size, size_t *pos,
+                  avro_schema_t schema)
+{
+    int  rc;
+    int64_t  len;
+
+    switch (avro_typeof(schema)) {
+        case AVRO_NULL:
+            return 0;
+
+        case AVRO_BOOLEAN:
+            return skip_binary_bytes(size, pos, 1);
+
+        case AVRO_INT32:
+        case AVRO_INT64:
+        case AVRO_ENUM:
+            return skip_binary_long(buf, size, pos, &len);
+
+        case AVRO_FLOAT:
+            return skip_binary_bytes(size, pos, 4);
+
+        case AVRO_DOUBLE:
+            return skip_binary_bytes(size, pos, 8);
+
+        case AVRO_STRING:
+        case AVRO_BYTES:
+            rc = skip_binary_long(buf, size, pos, &len);
+            if (rc != 0) {
+                return rc;
+            }
+            return skip_binary_bytes(size, pos, len);
+
+        case AVRO_FIXED:
+            return skip_binary_bytes(size, pos, avro_schema_fixed_size(schema));
+
+        case AVRO_RECORD:
+        {
+            size_t  field_count = avro_schema_record_size(schema);
+            size_t  i;
+            for (i = 0; i < field_count; i++) {
+                avro_schema_t  field_schema =
+                    avro_schema_record_field_get_by_index(schema, i);
+                rc = skip_binary_value(buf, size, pos, field_schema);
+                if (rc != 0) {
+                    return rc;
+                }
+            }
+            return 0;
+        }
+
+        case AVRO_ARRAY:
+        case AVRO_MAP:
+        {
+            bool  is_map = (avro_typeof(schema) == AVRO_MAP);
+            avro_schema_t  child_schema = is_map?
+                avro_schema_map_values(schema):
+                avro_schema_array_items(schema);
+
+            for (;;) {
+                int64_t  count;
+                int64_t  i;
+
+                rc = skip_binary_long(buf, size, pos, &count);
+                if (rc != 0) {
+                    return rc;
+                }
+                if (count == 0) {
+                    return 0;
+                }
+
+                /* A negative count is followed by the size of the
+                 * block in bytes, which lets us skip it all at once. */
+                if (count < 0) {
+                    rc = skip_binary_long(buf, size, pos, &len);
+                    if (rc == 0) {
+                        rc = skip_binary_bytes(size, pos, len);
+                    }
+                    if (rc != 0) {
+                        return rc;
+                    }
+                    continue;
+                }
+
+                for (i = 0; i < count; i++) {
+                    if (is_map) {
+                        rc = skip_binary_long(buf, size, pos, &len);
+                        if (rc == 0) {
+                            rc = skip_binary_bytes(size, pos, len);
+                        }
+                        if (rc != 0) {
+                            return rc;
+                        }
+                    }
+                    rc = skip_binary_value(buf, size, pos, child_schema);
+                    if (rc != 0) {
+                        return rc;
+                    }
+                }
+            }
+        }
+
+        case AVRO_UNION:
+        {
+            avro_schema_t  branch_schema;
+            rc = skip_binary_long(buf, size, pos, &len);
+            if (rc != 0) {
+                return rc;
+            }
+            branch_schema = avro_schema_union_branch(schema, len);
+            if (branch_schema == NULL) {
+                return EINVAL;
+            }
+            return skip_binary_value(buf, size, pos, branch_schema);
+        }
+
+        case AVRO_LINK:
+            return skip_binary_value
+                (buf, size, pos, avro_schema_link_target(schema));
+
+        default:
+            avro_set_error("Unknown schema type");
+            return EINVAL;
+    }
+}
+
+
+/**
+ * Decodes an Avro value from a memory region, placing the number of
+ * bytes that it took up into consumed.
+ */
+
+static int
+resolved_writer_decode(LuaAvroResolvedWriter *l_resolver,
+                       const char *buf, size_t size,
+                       avro_value_t *dest, size_t *consumed)
+{
+    avro_reader_t  reader = avro_reader_memory(buf, size);
+    avro_resolved_writer_set_dest(&l_resolver->value, dest);
+    int rc = avro_value_read(reader, &l_resolver->value);
+    avro_reader_free(reader);
+
+    if (rc != 0) {
+        return rc;
+    }
+
+    avro_schema_t  wschema = avro_value_get_schema(&l_resolver->value);
+    *consumed = 0;
+    return skip_binary_value(buf, size, consumed, wschema);
+}
+
+
+/**
+ * Reads in a buffer that we're going to decode from.  buf can be a Lua
+ * string or a light userdata.  size is the size of the entire buffer;
+ * it defaults to the length of a string, and must be given for a light
+ * userdata.  offset (default 0) is where in the buffer to start.  The
+ * result is the part of the buffer starting at offset.
+ */
+
+static void
+get_decode_buffer(lua_State *L, int buf_index, int offset_index,
+                  int size_index, const char **buf, size_t *size)
+{
+    if (lua_islightuserdata(L, buf_index)) {
+        lua_Integer  buf_size = luaL_checkinteger(L, size_index);
+        if (buf_size < 0) {
+            luaL_error(L, "Size cannot be negative");
+        }
+        *buf = lua_touserdata(L, buf_index);
+        *size = buf_size;
+    } else {
+        size_t  str_size = 0;
+        *buf = luaL_checklstring(L, buf_index, &str_size);
+        *size = luaL_optinteger(L, size_index, str_size);
+        if (*size > str_size) {
+            luaL_error(L, "Size is larger than the string");
+        }
+    }
+
+    lua_Integer  offset = luaL_optinteger(L, offset_index, 0);
+    if (offset < 0 || (size_t) offset > *size) {
+        luaL_error(L, "Offset is outside of the buffer");
+    }
+    *buf += offset;
+    *size -= offset;
+}
+
+
+/**
+ * Decode an Avro value using the given resolver.
+ *
+ *   resolver:decode(buf, dest, [offset], [size])
+ *
+ * See get_decode_buffer for the meaning of buf, offset, and size.
+ * Being able to give an offset lets you decode several values out of a
+ * larger buffer without copying them into separate strings.  Returns
+ * the number of bytes that the value took up.
+ */
+
+static int
+l_resolved_writer_decode(lua_State *L)
+{
+    LuaAvroResolvedWriter  *l_resolver =
+        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
+    const char  *buf;
+    size_t  size;
+    get_decode_buffer(L, 2, 4, 5, &buf, &size);
+    avro_value_t  *value = lua_avro_get_value(L, 3);
+
+    size_t  consumed;
+    if (resolved_writer_decode(l_resolver, buf, size, value, &consumed)) {
+        return lua_return_avro_error(L);
+    }
+
+    lua_pushinteger(L, consumed);
+    return 1;
+}
+
+
+/**
+ * Returns the size of the next encoded value in a buffer, without
+ * decoding it.
+ *
+ *   resolver:datum_size(buf, [offset], [size])
+ *
+ * Returns false if the buffer ends before the value does.
+ */
+
+static int
+l_resolved_writer_datum_size(lua_State *L)
+{
+    LuaAvroResolvedWriter  *l_resolver =
+        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
+    const char  *buf;
+    size_t  size;
+    get_decode_buffer(L, 2, 3, 4, &buf, &size);
+
+    avro_schema_t  wschema = avro_value_get_schema(&l_resolver->value);
+    size_t  datum_size = 0;
+    int  rc = skip_binary_value(buf, size, &datum_size, wschema);
+    if (rc == EAGAIN) {
+        lua_pushboolean(L, false);
+        return 1;
+    } else if (rc != 0) {
+        return lua_avro_error(L);
+    }
+
+    lua_pushinteger(L, datum_size);
+    return 1;
+}
+
+
+/**
+ * Copies part of a memory region, which is provided as a light user
+ * data, into a Lua string.  Like raw_decode_value, there's no safety
+ * checking here.
+ *
+ *   raw_string(buf, offset, size)
+ */
+
+static int
+l_raw_string(lua_State *L)
+{
+    if (!lua_islightuserdata(L, 1)) {
+        return luaL_error(L, "Source buffer should be a light userdata");
+    }
+    const char  *buf = lua_touserdata(L, 1);
+    lua_Integer  offset = luaL_checkinteger(L, 2);
+    lua_Integer  size = luaL_checkinteger(L, 3);
+    if (offset < 0 || size < 0) {
+        return luaL_error(L, "Offset and size cannot be negative");
+    }
+    lua_pushlstring(L, buf + offset, size);
+    return 1;
+}
+
+
+/**
+ * Decode an Avro value, using the binary encoding, from the given
+ * memory region, which is provided as a light user data and a size.
+ * There's no safety checking here; to make it easier to not include
+ * this function in sandboxes, it's exposed as a global function in the
+ * "avro" package, and not as a method of the AvroValue class.
+ */
+
+static int
+l_value_decode_raw(lua_State *L)
+{
+    LuaAvroResolvedWriter  *l_resolver =
+        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
+    if (!lua_islightuserdata(L, 2)) {
+        return luaL_error(L, "Destination buffer should be a light userdata");
+    }
+    void  *buf = lua_touserdata(L, 2);
+    size_t  size = luaL_checkinteger(L, 3);
+    avro_value_t  *value = lua_avro_get_value(L, 4);
+
+    avro_reader_t  reader = avro_reader_memory(buf, size);
+    avro_resolved_writer_set_dest(&l_resolver->value, value);
+    int rc = avro_value_read(reader, &l_resolver->value);
+    avro_reader_free(reader);
+
+    if (rc != 0) {
+        return lua_return_avro_error(L);
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Data file headers
+ */
+
+/**
+ * The parts of a container file's header that the Avro C file reader
+ * doesn't give us access to.  size is the number of bytes in the
+ * header, which is also the offset of the file's first block.
+ */
+
+#define CODEC_NAME_SIZE  32
+#define SYNC_SIZE  16
+
+typedef struct _LuaAvroFileHeader
+{
+    char  codec[CODEC_NAME_SIZE];
+    char  sync[SYNC_SIZE];
+    int64_t  size;
+} LuaAvroFileHeader;
+
+
+/**
+ * Reads a zig-zag encoded varint from a stdio stream.
+ */
+
+static int
+read_file_long(FILE *fp, int64_t *out)
+{
+    uint64_t  value = 0;
+    int  shift = 0;
+    int  b;
+
+    do {
+        if (shift >= 64 || (b = getc(fp)) == EOF) {
+            avro_set_error("Cannot read long from file header");
+            return EILSEQ;
+        }
+        value |= (uint64_t) (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    *out = (int64_t) ((value >> 1) ^ -(value & 1));
+    return 0;
+}
+
+
+/**
+ * Reads the header of a container file from a stdio stream, which must
+ * be positioned at the start of the file.  We only hold on to the
+ * metadata entries that we care about; everything else is skipped.
+ */
+
+static int
+read_file_header(FILE *fp, LuaAvroFileHeader *header)
+{
+    static const char  MAGIC[4] = { 'O', 'b', 'j', 1 };
+    char  magic[sizeof(MAGIC)];
+    int64_t  start = ftell(fp);
+
+    if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+        memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+        avro_set_error("Not an Avro container file");
+        return EILSEQ;
+    }
+
+    strcpy(header->codec, "null");
+
+    for (;;) {
+        int64_t  count;
+        int  rc;
+
+        if ((rc = read_file_long(fp, &count)) != 0) {
+            return rc;
+        }
+        if (count == 0) {
+            break;
+        }
+        if (count < 0) {
+            /* The block's size in bytes follows, which we don't need. */
+            int64_t  block_size;
+            count = -count;
+            if ((rc = read_file_long(fp, &block_size)) != 0) {
+                return rc;
+            }
+        }
+
+        for (; count > 0; count--) {
+            char  key[64];
+            int64_t  key_size;
+            int64_t  value_size;
+
+            if ((rc = read_file_long(fp, &key_size)) != 0) {
+                return rc;
+            }
+            if (key_size < 0) {
+                avro_set_error("Invalid metadata key in file header");
+                return EILSEQ;
+            }
+            if (key_size < (int64_t) sizeof(key)) {
+                if (fread(key, 1, key_size, fp) != (size_t) key_size) {
+                    avro_set_error("Cannot read metadata key in file header");
+                    return EILSEQ;
+                }
+                key[key_size] = '\0';
+            } else {
+                /* Too long to be a key that we care about. */
+                if (fseek(fp, key_size, SEEK_CUR) != 0) {
+                    avro_set_error("Cannot skip metadata key in file header");
+                    return EILSEQ;
+                }
+                key[0] = '\0';
+            }
+
+            if ((rc = read_file_long(fp, &value_size)) != 0) {
+                return rc;
+            }
+            if (value_size < 0) {
+                avro_set_error("Invalid metadata value in file header");
+                return EILSEQ;
+            }
+
+            if (strcmp(key, "avro.codec") == 0 &&
+                value_size < CODEC_NAME_SIZE) {
+                if (fread(header->codec, 1, value_size, fp) !=
+                    (size_t) value_size) {
+                    avro_set_error("Cannot read codec from file header");
+                    return EILSEQ;
+                }
+                header->codec[value_size] = '\0';
+            } else if (fseek(fp, value_size, SEEK_CUR) != 0) {
+                avro_set_error("Cannot skip metadata value in file header");
+                return EILSEQ;
+            }
+        }
+    }
+
+    if (fread(header->sync, SYNC_SIZE, 1, fp) != 1) {
+        avro_set_error("Cannot read sync marker from file header");
+        return EILSEQ;
+    }
+
+    header->size = ftell(fp) - start;
+    return 0;
+}
+
+
+/**
+ * Reads the header of the container file at the given path.
+ */
+
+static int
+read_file_header_from_path(const char *path, LuaAvroFileHeader *header)
+{
+    FILE  *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        avro_set_error("Cannot open file %s: %s", path, strerror(errno));
+        return errno;
+    }
+
+    int  rc = read_file_header(fp, header);
+    fclose(fp);
+    return rc;
+}
+
+
+static void
+push_file_header(lua_State *L, LuaAvroFileHeader *header)
+{
+    lua_createtable(L, 0, 3);
+    lua_pushstring(L, header->codec);
+    lua_setfield(L, -2, "codec");
+    lua_pushlstring(L, header->sync, SYNC_SIZE);
+    lua_setfield(L, -2, "sync");
+    lua_pushnumber(L, header->size);
+    lua_setfield(L, -2, "size");
+}
+
+
+/**
+ * Returns a table describing the header of the container file at the
+ * given path: the name of its compression codec, its sync marker, and
+ * the size of the header in bytes.  If the second parameter is true,
+ * the first is the contents of an in-memory container file, rather
+ * than a path.
+ */
+
+static int
+l_file_header(lua_State *L)
+{
+    size_t  size;
+    const char  *path = luaL_checklstring(L, 1, &size);
+    LuaAvroFileHeader  header;
+
+    if (lua_toboolean(L, 2)) {
+        FILE  *fp;
+        int  rc;
+        if (size == 0 ||
+            (fp = fmemopen((void *) path, size, "rb")) == NULL) {
+            avro_set_error("Not an Avro container file");
+            return lua_return_avro_error(L);
+        }
+        rc = read_file_header(fp, &header);
+        fclose(fp);
+        if (rc != 0) {
+            return lua_return_avro_error(L);
+        }
+    } else if (read_file_header_from_path(path, &header) != 0) {
+        return lua_return_avro_error(L);
+    }
+
+    push_file_header(L, &header);
+    return 1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Lua access — data files
+ */
+
+/**
+ * The string used to identify the AvroDataInputFile class's metatable
+ * in the Lua registry.
+ */
+
+#define MT_AVRO_DATA_INPUT_FILE "avro:AvroDataInputFile"
+
+
+/**
+ * If the file was opened with a reader schema, iface creates values of
+ * that schema, and we read into them through resolver, which is a
+ * resolved writer from the file's writer schema.  Any writer fields
+ * that aren't in the reader schema are skipped over without being
+ * decoded, so a reader schema that contains a subset of the writer's
+ * fields acts as a projection.  Otherwise resolver is NULL, and iface
+ * creates values of the writer schema.
+ */
+
+typedef struct _LuaAvroDataInputFile
+{
+    avro_file_reader_t  reader;
+    avro_schema_t  wschema;
+    avro_value_iface_t  *iface;
+    avro_value_iface_t  *resolver;
+    avro_value_t  resolved;
+    LuaAvroFileHeader  header;
+    char  *path;
+
+    /* The ordinal of the next record that we'll read, counting from 0. */
+    int64_t  record_index;
+
+    /* If the file is memory-mapped, map points at the mapping.  For an
+     * in-memory container file, it points at a copy of the file's
+     * contents instead, and map_is_copy is set.  Once mapped_reads is
+     * set, reader is only used for the writer schema, and we find each
+     * block in the mapping ourselves.  pos is the offset of the next
+     * block, and block_remaining is the number of records that we
+     * haven't read from the current one.  Blocks that use the null
+     * codec are decoded in place using block_reader.  Other blocks are
+     * decompressed by block_file, a file reader that sees the file
+     * header followed by a copy of the block in block_buf. */
+    char  *map;
+    size_t  map_size;
+    bool  map_is_copy;
+    bool  mapped_reads;
+    size_t  pos;
+    size_t  block_data;
+    size_t  block_end;
+    int64_t  block_remaining;
+    avro_reader_t  block_reader;
+    avro_file_reader_t  block_file;
+    char  *block_buf;
+
+    /* The block index, once we've built or loaded it.  block_offsets[i]
+     * is the offset of block i, and block_firsts[i] is the ordinal of
+     * its first record; block_firsts[block_count] is the number of
+     * records in the file. */
+    int64_t  *block_offsets;
+    int64_t  *block_firsts;
+    size_t  block_count;
+} LuaAvroDataInputFile;
+
+int
+lua_avro_push_file_reader(lua_State *L, avro_file_reader_t reader,
+                          LuaAvroFileHeader *header, avro_schema_t rschema,
+                          const char *path)
+{
+    LuaAvroDataInputFile  *l_file;
+    avro_schema_t  wschema = avro_file_reader_get_writer_schema(reader);
+    avro_value_iface_t  *resolver = NULL;
+    avro_value_t  resolved;
+
+    if (rschema != NULL) {
+        resolver = avro_resolved_writer_new(wschema, rschema);
+        if (resolver == NULL) {
+            avro_file_reader_close(reader);
+            return lua_return_avro_error(L);
+        }
+        if (avro_resolved_writer_new_value(resolver, &resolved) != 0) {
+            avro_value_iface_decref(resolver);
+            avro_file_reader_close(reader);
+            return lua_return_avro_error(L);
+        }
+    }
+
+    l_file = lua_newuserdata(L, sizeof(LuaAvroDataInputFile));
+    memset(l_file, 0, sizeof(LuaAvroDataInputFile));
+    l_file->reader = reader;
+    l_file->header = *header;
+    l_file->path = strdup(path);
+    l_file->wschema = wschema;
+    l_file->resolver = resolver;
+    if (resolver == NULL) {
+        l_file->iface = avro_generic_class_from_schema(wschema);
+    } else {
+        l_file->iface = avro_generic_class_from_schema(rschema);
+        l_file->resolved = resolved;
+    }
+    luaL_getmetatable(L, MT_AVRO_DATA_INPUT_FILE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/**
+ * Maps the file at the given path into memory, with a hint that we'll
+ * mostly read it sequentially.
+ */
+
+static int
+map_file(const char *path, char **map, size_t *size)
+{
+    struct stat  st;
+    int  fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        avro_set_error("Cannot open file %s: %s", path, strerror(errno));
+        return EIO;
+    }
+    if (fstat(fd, &st) != 0) {
+        avro_set_error("Cannot open file %s: %s", path, strerror(errno));
+        close(fd);
+        return EIO;
+    }
+    if (st.st_size == 0) {
+        avro_set_error("Not an Avro container file");
+        close(fd);
+        return EILSEQ;
+    }
+
+    *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (*map == MAP_FAILED) {
+        *map = NULL;
+        avro_set_error("Cannot map file %s: %s", path, strerror(errno));
+        return EIO;
+    }
+    madvise(*map, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return 0;
+}
+
+/**
+ * Releases the memory that an input file reads its blocks from: either
+ * a mapping of the file, or a copy of an in-memory container file.
+ */
+
+static void
+release_map(char *map, size_t map_size, bool map_is_copy)
+{
+    if (map_is_copy) {
+        free(map);
+    } else {
+        munmap(map, map_size);
+    }
+}
+
+/**
+ * Makes sure that an input file is memory-mapped.  Files that were
+ * opened without the mmap option are mapped the first time that we
+ * need to find a block.
+ */
+
+static int
+input_file_map(LuaAvroDataInputFile *l_file)
+{
+    if (l_file->map != NULL) {
+        return 0;
+    }
+    return map_file(l_file->path, &l_file->map, &l_file->map_size);
+}
+
+/**
+ * Reads the header of the block at the given offset in a memory-mapped
+ * file, and checks for the sync marker that should follow it.  Fills in
+ * the offsets of the start and end of the block's data, and the number
+ * of records in it.
+ */
+
+static int
+mapped_file_find_block(LuaAvroDataInputFile *l_file, size_t offset,
+                       size_t *data, size_t *end, int64_t *count)
+{
+    size_t  pos = offset;
+    int64_t  size;
+
+    if (skip_binary_long(l_file->map, l_file->map_size, &pos, count) != 0 ||
+        skip_binary_long(l_file->map, l_file->map_size, &pos, &size) != 0 ||
+        *count < 0 || size < 0 ||
+        l_file->map_size - pos < SYNC_SIZE ||
+        (uint64_t) size > l_file->map_size - pos - SYNC_SIZE) {
+        avro_set_error("Invalid block header at offset %lld",
+                       (long long) offset);
+        return EILSEQ;
+    }
+
+    if (memcmp(l_file->map + pos + size,
+               l_file->header.sync, SYNC_SIZE) != 0) {
+        avro_set_error("Missing sync marker at offset %lld",
+                       (long long) (pos + size));
+        return EILSEQ;
+    }
+
+    *data = pos;
+    *end = pos + size;
+    return 0;
+}
+
+/**
+ * Starts reading the block at the given offset of a memory-mapped file.
+ * Blocks that use the null codec are decoded straight from the mapping,
+ * without being copied anywhere first.
+ */
+
+static int
+mapped_file_start_block(LuaAvroDataInputFile *l_file, size_t offset)
+{
+    int64_t  count;
+    int  rc;
+
+    if ((rc = mapped_file_find_block(l_file, offset, &l_file->block_data,
+                                     &l_file->block_end, &count)) != 0) {
+        return rc;
+    }
+
+    if (l_file->block_file != NULL) {
+        avro_file_reader_close(l_file->block_file);
+        l_file->block_file = NULL;
+    }
+    free(l_file->block_buf);
+    l_file->block_buf = NULL;
+
+    if (strcmp(l_file->header.codec, "null") == 0) {
+        if (l_file->block_reader == NULL) {
+            l_file->block_reader = avro_reader_memory(NULL, 0);
+        }
+        avro_reader_memory_set_source
+            (l_file->block_reader, l_file->map + l_file->block_data,
+             l_file->block_end - l_file->block_data);
+    } else {
+        size_t  header_size = l_file->header.size;
+        size_t  block_size = l_file->block_end + SYNC_SIZE - offset;
+        FILE  *fp;
+
+        l_file->block_buf = malloc(header_size + block_size);
+        if (l_file->block_buf == NULL) {
+            avro_set_error("Out of memory");
+            return ENOMEM;
+        }
+        memcpy(l_file->block_buf, l_file->map, header_size);
+        memcpy(l_file->block_buf + header_size,
+               l_file->map + offset, block_size);
+
+        fp = fmemopen(l_file->block_buf, header_size + block_size, "rb");
+        if (fp == NULL) {
+            avro_set_error("Cannot read block: %s", strerror(errno));
+            return errno;
+        }
+        /* The reader closes the stream, even if it can't be created. */
+        if ((rc = avro_file_reader_fp
+             (fp, l_file->path, 1, &l_file->block_file)) != 0) {
+            l_file->block_file = NULL;
+            return rc;
+        }
+    }
+
+    l_file->pos = l_file->block_end + SYNC_SIZE;
+    l_file->block_remaining = count;
+    return 0;
+}
+
+static int
+mapped_file_read_value(LuaAvroDataInputFile *l_file, avro_value_t *dest)
+{
+    int  rc;
+
+    while (l_file->block_remaining == 0) {
+        if (l_file->pos >= l_file->map_size) {
+            avro_set_error("Reached end of file");
+            return EOF;
+        }
+        if ((rc = mapped_file_start_block(l_file, l_file->pos)) != 0) {
+            return rc;
+        }
+    }
+
+    if (l_file->block_file != NULL) {
+        rc = avro_file_reader_read_value(l_file->block_file, dest);
+    } else {
+        rc = avro_value_read(l_file->block_reader, dest);
+    }
+    if (rc == 0) {
+        l_file->block_remaining--;
+    }
+    return rc;
+}
+
+/**
+ * Skips over the next n records in the current block of a
+ * memory-mapped file.  We can skip over uncompressed records without
+ * decoding them; compressed ones are decoded into a scratch value.
+ */
+
+static int
+mapped_file_skip(LuaAvroDataInputFile *l_file, int64_t n)
+{
+    int64_t  i;
+    int  rc = 0;
+
+    if (l_file->block_reader != NULL && l_file->block_file == NULL) {
+        size_t  pos = l_file->block_data;
+        for (i = 0; i < n; i++) {
+            if ((rc = skip_binary_value(l_file->map, l_file->block_end,
+                                        &pos, l_file->wschema)) != 0) {
+                return rc;
+            }
+        }
+        avro_reader_memory_set_source
+            (l_file->block_reader, l_file->map + pos,
+             l_file->block_end - pos);
+    } else if (n > 0) {
+        avro_value_iface_t  *iface =
+            avro_generic_class_from_schema(l_file->wschema);
+        avro_value_t  scratch;
+        if (iface == NULL) {
+            return ENOMEM;
+        }
+        if ((rc = avro_generic_value_new(iface, &scratch)) == 0) {
+            for (i = 0; i < n && rc == 0; i++) {
+                rc = avro_file_reader_read_value(l_file->block_file, &scratch);
+            }
+            avro_value_decref(&scratch);
+        }
+        avro_value_iface_decref(iface);
+    }
+
+    l_file->block_remaining -= n;
+    return rc;
+}
+
+/**
+ * Reads the next record from the file into a value that must be an
+ * instance of the writer schema.
+ */
+
+static int
+input_file_read_writer_value(LuaAvroDataInputFile *l_file, avro_value_t *dest)
+{
+    int  rc;
+    if (l_file->mapped_reads) {
+        rc = mapped_file_read_value(l_file, dest);
+    } else {
+        rc = avro_file_reader_read_value(l_file->reader, dest);
+    }
+    if (rc == 0) {
+        l_file->record_index++;
+    }
+    return rc;
+}
+
+static int
+input_file_read_value(LuaAvroDataInputFile *l_file, avro_value_t *value)
+{
+    avro_value_t  *dest = value;
+    if (l_file->resolver != NULL) {
+        avro_resolved_writer_set_dest(&l_file->resolved, value);
+        dest = &l_file->resolved;
+    }
+    return input_file_read_writer_value(l_file, dest);
+}
+
+
+/*
+ * Block indexes
+ */
+
+/**
+ * Builds the block index of an input file by walking through the block
+ * headers in its mapping.  We don't have to decode or decompress any of
+ * the blocks to do this.
+ */
+
+static int
+input_file_build_index(LuaAvroDataInputFile *l_file)
+{
+    size_t  capacity = 64;
+    size_t  count = 0;
+    size_t  offset = l_file->header.size;
+    int64_t  first = 0;
+    int64_t  *offsets = malloc(capacity * sizeof(int64_t));
+    int64_t  *firsts = malloc((capacity + 1) * sizeof(int64_t));
+
+    while (offsets != NULL && firsts != NULL && offset < l_file->map_size) {
+        size_t  data;
+        size_t  end;
+        int64_t  records;
+        int  rc;
+
+        if (count == capacity) {
+            int64_t  *new_offsets;
+            int64_t  *new_firsts;
+            capacity *= 2;
+            new_offsets = realloc(offsets, capacity * sizeof(int64_t));
+            if (new_offsets != NULL) {
+                offsets = new_offsets;
+            }
+            new_firsts = realloc(firsts, (capacity + 1) * sizeof(int64_t));
+            if (new_firsts != NULL) {
+                firsts = new_firsts;
+            }
+            if (new_offsets == NULL || new_firsts == NULL) {
+                break;
+            }
+        }
+
+        rc = mapped_file_find_block(l_file, offset, &data, &end, &records);
+        if (rc != 0) {
+            free(offsets);
+            free(firsts);
+            return rc;
+        }
+
+        offsets[count] = offset;
+        firsts[count] = first;
+        count++;
+        first += records;
+        offset = end + SYNC_SIZE;
+    }
+
+    if (offsets == NULL || firsts == NULL || offset < l_file->map_size) {
+        free(offsets);
+        free(firsts);
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+
+    firsts[count] = first;
+    l_file->block_offsets = offsets;
+    l_file->block_firsts = firsts;
+    l_file->block_count = count;
+    return 0;
+}
+
+/**
+ * Makes sure that we have a block index for an input file.
+ */
+
+static int
+input_file_index(LuaAvroDataInputFile *l_file)
+{
+    int  rc;
+    if (l_file->block_offsets != NULL) {
+        return 0;
+    }
+    if ((rc = input_file_map(l_file)) != 0) {
+        return rc;
+    }
+    return input_file_build_index(l_file);
+}
+
+/**
+ * Returns the block that contains the record with the given ordinal.
+ * If there are empty blocks, we return the last block that starts at
+ * that ordinal, since that's the one that the record is actually in.
+ */
+
+static size_t
+input_file_find_record(LuaAvroDataInputFile *l_file, int64_t index)
+{
+    size_t  lo = 0;
+    size_t  hi = l_file->block_count;
+    while (hi - lo > 1) {
+        size_t  mid = lo + (hi - lo) / 2;
+        if (l_file->block_firsts[mid] <= index) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Positions an input file so that the next record we read is the one
+ * with the given ordinal.  From now on we read blocks straight from the
+ * file's mapping, since that's the only way to jump to a block.
+ */
+
+static int
+input_file_seek(LuaAvroDataInputFile *l_file, int64_t index)
+{
+    size_t  block;
+    int  rc;
+
+    if ((rc = input_file_index(l_file)) != 0) {
+        return rc;
+    }
+    if (index < 0 || index > l_file->block_firsts[l_file->block_count]) {
+        avro_set_error("Record %lld is out of range", (long long) index + 1);
+        return EINVAL;
+    }
+
+    l_file->mapped_reads = true;
+    l_file->record_index = index;
+    if (index == l_file->block_firsts[l_file->block_count]) {
+        /* Seeking to the end of the file */
+        l_file->pos = l_file->map_size;
+        l_file->block_remaining = 0;
+        return 0;
+    }
+
+    block = input_file_find_record(l_file, index);
+    if ((rc = mapped_file_start_block
+         (l_file, l_file->block_offsets[block])) != 0) {
+        return rc;
+    }
+    return mapped_file_skip(l_file, index - l_file->block_firsts[block]);
+}
+
+/**
+ * Writes a zig-zag encoded varint to a stdio stream.
+ */
+
+static int
+write_file_long(FILE *fp, int64_t value)
+{
+    uint64_t  n = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+    do {
+        int  b = n & 0x7f;
+        n >>= 7;
+        if (n != 0) {
+            b |= 0x80;
+        }
+        if (putc(b, fp) == EOF) {
+            avro_set_error("Cannot write block index");
+            return EIO;
+        }
+    } while (n != 0);
+    return 0;
+}
+
+/**
+ * A block index can be saved in a sidecar file, so that we don't have
+ * to rebuild it every time we open a file.  The sidecar starts with a
+ * magic number and the container file's sync marker.  The rest is a
+ * sequence of zig-zag varints: the size of the container file, the
+ * number of blocks, and for each block, the differences between its
+ * offset and first record and the previous block's.  The last varint
+ * is the number of records in the file.
+ */
+
+static const char  INDEX_MAGIC[4] = { 'A', 'v', 'I', 1 };
+
+static int
+input_file_write_index(LuaAvroDataInputFile *l_file, const char *path)
+{
+    FILE  *fp;
+    int64_t  prev_offset = 0;
+    int64_t  prev_first = 0;
+    size_t  i;
+    int  rc;
+
+    if ((rc = input_file_index(l_file)) != 0) {
+        return rc;
+    }
+
+    if ((fp = fopen(path, "wb")) == NULL) {
+        avro_set_error("Cannot open file %s: %s", path, strerror(errno));
+        return EIO;
+    }
+
+    if (fwrite(INDEX_MAGIC, sizeof(INDEX_MAGIC), 1, fp) != 1 ||
+        fwrite(l_file->header.sync, SYNC_SIZE, 1, fp) != 1) {
+        avro_set_error("Cannot write block index");
+        rc = EIO;
+    }
+    if (rc == 0) {
+        rc = write_file_long(fp, l_file->map_size);
+    }
+    if (rc == 0) {
+        rc = write_file_long(fp, l_file->block_count);
+    }
+    for (i = 0; rc == 0 && i < l_file->block_count; i++) {
+        rc = write_file_long(fp, l_file->block_offsets[i] - prev_offset);
+        if (rc == 0) {
+            rc = write_file_long(fp, l_file->block_firsts[i] - prev_first);
+        }
+        prev_offset = l_file->block_offsets[i];
+        prev_first = l_file->block_firsts[i];
+    }
+    if (rc == 0) {
+        rc = write_file_long
+            (fp, l_file->block_firsts[l_file->block_count] - prev_first);
+    }
+
+    if (fclose(fp) != 0 && rc == 0) {
+        avro_set_error("Cannot write block index");
+        rc = EIO;
+    }
+    return rc;
+}
+
+/**
+ * Loads an input file's block index from a sidecar file.  If the
+ * sidecar doesn't exist, or doesn't match the file, we return an error
+ * and leave the file without an index, so that we'll build one when we
+ * need it.
+ */
+
+static int
+input_file_read_index(LuaAvroDataInputFile *l_file, const char *path)
+{
+    char  magic[sizeof(INDEX_MAGIC)];
+    char  sync[SYNC_SIZE];
+    int64_t  file_size;
+    int64_t  count;
+    int64_t  offset = 0;
+    int64_t  first = 0;
+    int64_t  delta;
+    int64_t  *offsets = NULL;
+    int64_t  *firsts = NULL;
+    int64_t  i;
+    FILE  *fp;
+    int  rc;
+
+    if ((rc = input_file_map(l_file)) != 0) {
+        return rc;
+    }
+    if ((fp = fopen(path, "rb")) == NULL) {
+        avro_set_error("Cannot open file %s: %s", path, strerror(errno));
+        return EIO;
+    }
+
+    if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+        memcmp(magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+        fread(sync, SYNC_SIZE, 1, fp) != 1 ||
+        memcmp(sync, l_file->header.sync, SYNC_SIZE) != 0 ||
+        read_file_long(fp, &file_size) != 0 ||
+        file_size != (int64_t) l_file->map_size ||
+        read_file_long(fp, &count) != 0 ||
+        count < 0 || (uint64_t) count > l_file->map_size) {
+        goto invalid;
+    }
+
+    offsets = malloc((count > 0? count: 1) * sizeof(int64_t));
+    firsts = malloc((count + 1) * sizeof(int64_t));
+    if (offsets == NULL || firsts == NULL) {
+        goto invalid;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (read_file_long(fp, &delta) != 0) {
+            goto invalid;
+        }
+        /* Blocks start after the header, in increasing order, and
+         * inside the file. */
+        if ((i == 0? delta < (int64_t) l_file->header.size: delta <= 0) ||
+            delta >= file_size - offset) {
+            goto invalid;
+        }
+        offset += delta;
+        if (read_file_long(fp, &delta) != 0 || delta < 0) {
+            goto invalid;
+        }
+        first += delta;
+        offsets[i] = offset;
+        firsts[i] = first;
+    }
+    if (read_file_long(fp, &delta) != 0 || delta < 0) {
+        goto invalid;
+    }
+    firsts[count] = first + delta;
+
+    fclose(fp);
+    l_file->block_offsets = offsets;
+    l_file->block_firsts = firsts;
+    l_file->block_count = count;
+    return 0;
+
+invalid:
+    fclose(fp);
+    free(offsets);
+    free(firsts);
+    avro_set_error("Invalid block index %s", path);
+    return EILSEQ;
+}
+
+avro_file_reader_t
+lua_avro_get_file_reader(lua_State *L, int index)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, index, MT_AVRO_DATA_INPUT_FILE);
+    return l_file->reader;
+}
+
+
+/**
+ * Closes a file reader.
+ */
+
+static int
+l_input_file_close(lua_State *L)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    if (l_file->reader != NULL) {
+        avro_file_reader_close(l_file->reader);
+        l_file->reader = NULL;
+    }
+    if (l_file->block_reader != NULL) {
+        avro_reader_free(l_file->block_reader);
+        l_file->block_reader = NULL;
+    }
+    if (l_file->block_file != NULL) {
+        avro_file_reader_close(l_file->block_file);
+        l_file->block_file = NULL;
+    }
+    free(l_file->block_buf);
+    l_file->block_buf = NULL;
+    if (l_file->map != NULL) {
+        release_map(l_file->map, l_file->map_size, l_file->map_is_copy);
+        l_file->map = NULL;
+    }
+    free(l_file->block_offsets);
+    l_file->block_offsets = NULL;
+    free(l_file->block_firsts);
+    l_file->block_firsts = NULL;
+    free(l_file->path);
+    l_file->path = NULL;
+    l_file->wschema = NULL;
+    if (l_file->iface != NULL) {
+        avro_value_iface_decref(l_file->iface);
+        l_file->iface = NULL;
+    }
+    if (l_file->resolved.self != NULL) {
+        avro_value_decref(&l_file->resolved);
+        l_file->resolved.iface = NULL;
+        l_file->resolved.self = NULL;
+    }
+    if (l_file->resolver != NULL) {
+        avro_value_iface_decref(l_file->resolver);
+        l_file->resolver = NULL;
+    }
+    return 0;
+}
+
+/**
+ * Returns the writer schema used to create the file.  The JSON encoding
+ * can be at most SCHEMA_JSON_SIZE bytes.
+ */
+
+#define SCHEMA_JSON_SIZE  65536
+
+static int
+l_input_file_schema_json(lua_State *L)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+
+    /* Not a static buffer, since scan filters can call us from other
+     * threads. */
+    char  *buf = malloc(SCHEMA_JSON_SIZE);
+    if (buf == NULL) {
+        return luaL_error(L, "Out of memory");
+    }
+
+    avro_writer_t  writer = avro_writer_memory(buf, SCHEMA_JSON_SIZE);
+    int  rc = avro_schema_to_json(l_file->wschema, writer);
+    int64_t  length = avro_writer_tell(writer);
+    avro_writer_free(writer);
+
+    if (rc != 0) {
+        free(buf);
+        return lua_avro_error(L);
+    }
+
+    lua_pushlstring(L, buf, length);
+    free(buf);
+    return 1;
+}
+
+/**
+ * Returns the name of the compression codec used to create the file.
+ */
+
+static int
+l_input_file_codec(lua_State *L)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    lua_pushstring(L, l_file->header.codec);
+    return 1;
+}
+
+/**
+ * Reads a value from a file reader.
+ */
+
+static int
+l_input_file_read_raw(lua_State *L)
+{
+    int  nargs = lua_gettop(L);
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+
+    if (nargs == 1) {
+        /* No Value instance given, so create one. */
+        avro_value_t  value;
+        check(avro_generic_value_new(l_file->iface, &value));
+        int  rc = input_file_read_value(l_file, &value);
+        if (rc != 0) {
+            return lua_return_avro_error(L);
+        }
+        lua_avro_push_value(L, &value, true);
+        return 1;
+    }
+
+    else {
+        /* Otherwise read into the given value. */
+        avro_value_t  *value = lua_avro_get_value(L, 2);
+        int  rc = input_file_read_value(l_file, value);
+        if (rc != 0) {
+            return lua_return_avro_error(L);
+        }
+        lua_pushvalue(L, 2);
+        return 1;
+    }
+}
+
+/**
+ * Reads up to n values from a file reader in a single call.  The values
+ * are read into the array-like table given as the second parameter.
+ * Any values already in the table are reused; empty slots are filled in
+ * with new values, which are owned by the table and must be released
+ * like any other value.  If n is omitted, we fill in every slot that's
+ * already in the table.  Returns the number of values read; a short
+ * count means that we've reached the end of the file, in which case the
+ * error message is returned as a second result.  Any other error is
+ * raised as a Lua error.
+ */
+
+static int
+l_input_file_read_batch(lua_State *L)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_Integer  count = luaL_optinteger(L, 2, lua_objlen(L, 3));
+    lua_Integer  i;
+
+    for (i = 1; i <= count; i++) {
+        lua_rawgeti(L, 3, i);
+        if (lua_isnil(L, -1)) {
+            /* Empty slot, so create a new value for it. */
+            avro_value_t  value;
+            lua_pop(L, 1);
+            check(avro_generic_value_new(l_file->iface, &value));
+            lua_avro_push_value(L, &value, true);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, 3, i);
+        }
+
+        avro_value_t  *value = lua_avro_get_value(L, -1);
+        int  rc = input_file_read_value(l_file, value);
+        lua_pop(L, 1);
+        if (rc == EOF) {
+            lua_pushinteger(L, i-1);
+            lua_pushstring(L, avro_strerror());
+            return 2;
+        }
+        if (rc != 0) {
+            return lua_avro_error(L);
+        }
+    }
+
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+/*
+ * Columnar reads
+ */
+
+/* The largest batch that a columnar read will allocate. */
+#define MAX_BATCH_SIZE  (1 << 24)
+
+/**
+ * Returns the number of records that a columnar read should read: the
+ * batch size at the given stack index, or if that's omitted, the rest
+ * of the current block of a memory-mapped file.  Returns 0 if we've
+ * reached the end of the file.
+ */
+
+static lua_Integer
+lua_batch_size(lua_State *L, LuaAvroDataInputFile *l_file, int index)
+{
+    lua_Integer  n;
+
+    if (!lua_isnoneornil(L, index)) {
+        n = luaL_checkinteger(L, index);
+        luaL_argcheck(L, n > 0 && n <= MAX_BATCH_SIZE, index,
+                      "batch size out of range");
+        return n;
+    }
+
+    if (!l_file->mapped_reads) {
+        return luaL_error
+            (L, "Can only read a whole block from a memory-mapped file");
+    }
+    while (l_file->block_remaining == 0 &&
+           l_file->pos < l_file->map_size) {
+        if (mapped_file_start_block(l_file, l_file->pos) != 0) {
+            return lua_avro_error(L);
+        }
+    }
+    return l_file->block_remaining;
+}
+
+/**
+ * A value guard owns a reference to a value while we run code that
+ * might raise a Lua error.  If that happens, the guard's finalizer
+ * frees the value; otherwise, we free it ourselves, promptly, with
+ * release_value_guard.
+ */
+
+#define MT_AVRO_VALUE_GUARD "avro:AvroValueGuard"
+
+static void
+push_value_guard(lua_State *L, avro_value_t *value)
+{
+    avro_value_t  *guarded = lua_newuserdata(L, sizeof(avro_value_t));
+    *guarded = *value;
+    luaL_getmetatable(L, MT_AVRO_VALUE_GUARD);
+    lua_setmetatable(L, -2);
+}
+
+static int
+release_value_guard(lua_State *L, int index)
+{
+    avro_value_t  *guarded = luaL_checkudata(L, index, MT_AVRO_VALUE_GUARD);
+    if (guarded->self != NULL) {
+        avro_value_decref(guarded);
+        guarded->iface = NULL;
+        guarded->self = NULL;
+    }
+    return 0;
+}
+
+static int
+value_guard_gc(lua_State *L)
+{
+    return release_value_guard(L, 1);
+}
+
+/**
+ * The state of one column of a batch.  Each column's tables are kept on
+ * the Lua stack while we fill them in: values_index is the values table
+ * (or the offsets table, for strings and bytes), and validity_index is
+ * the validity table, or 0 if the column isn't nullable.  The contents
+ * of a string or bytes column are accumulated in data, a userdata at
+ * data_index that we replace with a larger one as needed.
+ */
+
+typedef struct _Column
+{
+    avro_type_t  type;
+    int  null_branch;
+    int  values_index;
+    int  validity_index;
+    int  data_index;
+    char  *data;
+    size_t  data_size;
+    size_t  data_capacity;
+} Column;
+
+static const char *
+column_type_name(avro_type_t type)
+{
+    switch (type) {
+      case AVRO_BOOLEAN: return "boolean";
+      case AVRO_INT32:   return "int";
+      case AVRO_INT64:   return "long";
+      case AVRO_FLOAT:   return "float";
+      case AVRO_DOUBLE:  return "double";
+      case AVRO_ENUM:    return "enum";
+      case AVRO_STRING:  return "string";
+      case AVRO_BYTES:   return "bytes";
+      default:           return NULL;
+    }
+}
+
+static void
+append_column_data(lua_State *L, Column *column, const void *buf, size_t size)
+{
+    size_t  needed = column->data_size + size;
+    if (needed > column->data_capacity) {
+        size_t  capacity = column->data_capacity;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char  *data = lua_newuserdata(L, capacity);
+        memcpy(data, column->data, column->data_size);
+        lua_replace(L, column->data_index);
+        column->data = data;
+        column->data_capacity = capacity;
+    }
+    memcpy(column->data + column->data_size, buf, size);
+    column->data_size = needed;
+}
+
+static int
+read_column_value(lua_State *L, Column *column, avro_value_t *value,
+                  lua_Integer i)
+{
+    int  rc;
+    switch (column->type) {
+      case AVRO_STRING:
+        {
+            const char  *val = NULL;
+            size_t  size = 0;
+            rc = avro_value_get_string(value, &val, &size);
+            /* size contains the NUL terminator */
+            if (rc == 0) {
+                append_column_data(L, column, val, size-1);
+            }
+            return rc;
+        }
+
+      case AVRO_BYTES:
+        {
+            const void  *val = NULL;
+            size_t  size = 0;
+            rc = avro_value_get_bytes(value, &val, &size);
+            if (rc == 0) {
+                append_column_data(L, column, val, size);
+            }
+            return rc;
+        }
+
+      case AVRO_INT32:
+        {
+            int32_t  val = 0;
+            rc = avro_value_get_int(value, &val);
+            lua_pushnumber(L, val);
+            break;
+        }
+
+      case AVRO_INT64:
+        {
+            int64_t  val = 0;
+            rc = avro_value_get_long(value, &val);
+            lua_pushnumber(L, val);
+            break;
+        }
+
+      case AVRO_FLOAT:
+        {
+            float  val = 0;
+            rc = avro_value_get_float(value, &val);
+            lua_pushnumber(L, val);
+            break;
+        }
+
+      case AVRO_DOUBLE:
+        {
+            double  val = 0;
+            rc = avro_value_get_double(value, &val);
+            lua_pushnumber(L, val);
+            break;
+        }
+
+      case AVRO_BOOLEAN:
+        {
+            int  val = 0;
+            rc = avro_value_get_boolean(value, &val);
+            lua_pushboolean(L, val);
+            break;
+        }
+
+      default:
+        {
+            int  val = 0;
+            rc = avro_value_get_enum(value, &val);
+            lua_pushnumber(L, val);
+            break;
+        }
+    }
+
+    lua_rawseti(L, column->values_index, i);
+    return rc;
+}
+
+/**
+ * Adds each field of record to the ith entry of its column.
+ */
+
+static int
+read_column_row(lua_State *L, Column *columns, size_t column_count,
+                avro_value_t *record, lua_Integer i)
+{
+    size_t  c;
+    for (c = 0; c < column_count; c++) {
+        Column  *column = &columns[c];
+        avro_value_t  field;
+        avro_value_t  branch;
+        avro_value_t  *value = &field;
+        int  rc;
+
+        rc = avro_value_get_by_index(record, c, &field, NULL);
+        if (rc != 0) {
+            return rc;
+        }
+
+        if (column->validity_index != 0) {
+            int  discriminant;
+            rc = avro_value_get_discriminant(&field, &discriminant);
+            if (rc != 0) {
+                return rc;
+            }
+            if (discriminant == column->null_branch) {
+                value = NULL;
+            } else {
+                rc = avro_value_get_current_branch(&field, &branch);
+                if (rc != 0) {
+                    return rc;
+                }
+                value = &branch;
+            }
+            lua_pushboolean(L, value != NULL);
+            lua_rawseti(L, column->validity_index, i);
+        }
+
+        if (value != NULL) {
+            rc = read_column_value(L, column, value, i);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        if (column->data_index != 0) {
+            lua_pushnumber(L, column->data_size);
+            lua_rawseti(L, column->values_index, i+1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads up to n records into a columnar batch.  The file's writer
+ * schema must be a record whose fields are primitives, enums, or unions
+ * of null and one of those.  The batch has the same fields in both
+ * backends:
+ *
+ *   batch.count     the number of records read
+ *   batch.fields    the field names, in order
+ *   batch.columns   maps each field name to a column
+ *
+ * Each column has name and type fields; type is the name of the
+ * column's non-null schema type.  The columns' contents are laid out
+ * differently in each backend.  The FFI backend uses C arrays indexed
+ * from 0, with a validity bitmap for nullable columns.  We can't hand
+ * out C arrays, so we use Lua tables indexed from 1.  Numbers,
+ * booleans, and enum indexes (counting from 0) are stored in a values
+ * table.  String and bytes columns concatenate their entries into a
+ * single Lua string called data, which is data_size bytes long; entry i
+ * is data:sub(offsets[i]+1, offsets[i+1]).  Columns for unions of null
+ * and another type also have a validity table, whose entries are false
+ * for null entries; null entries have no value in the values table.
+ *
+ * If n is omitted, we read the rest of the current block.  Returns nil
+ * and an error message if there are no more records, and raises an
+ * error if a record can't be read.
+ */
+
+static int
+l_input_file_read_columns(lua_State *L)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    avro_schema_t  wschema = l_file->wschema;
+    lua_Integer  n;
+    size_t  column_count;
+    size_t  c;
+    Column  *columns;
+    int  fields_index;
+    int  columns_index;
+
+    if (!is_avro_record(wschema)) {
+        return luaL_error(L, "Columnar reads need a file of records");
+    }
+
+    n = lua_batch_size(L, l_file, 2);
+    if (n == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Reached end of file");
+        return 2;
+    }
+
+    column_count = avro_schema_record_size(wschema);
+    columns = lua_newuserdata(L, sizeof(Column) * (column_count + 1));
+    /* Each column keeps up to four slots on the stack: the column
+     * table, its values or offsets table, its validity table, and its
+     * data userdata. */
+    luaL_checkstack(L, (int) column_count * 4 + 10, "too many columns");
+
+    lua_createtable(L, column_count, 0);
+    fields_index = lua_gettop(L);
+    lua_createtable(L, 0, column_count);
+    columns_index = lua_gettop(L);
+
+    for (c = 0; c < column_count; c++) {
+        Column  *column = &columns[c];
+        const char  *name = avro_schema_record_field_name(wschema, c);
+        avro_schema_t  schema =
+            avro_schema_record_field_get_by_index(wschema, c);
+        const char  *type_name;
+
+        column->null_branch = -1;
+        if (is_avro_union(schema) && avro_schema_union_size(schema) == 2) {
+            avro_schema_t  first = avro_schema_union_branch(schema, 0);
+            avro_schema_t  second = avro_schema_union_branch(schema, 1);
+            if (is_avro_null(first)) {
+                column->null_branch = 0;
+                schema = second;
+            } else if (is_avro_null(second)) {
+                column->null_branch = 1;
+                schema = first;
+            }
+        }
+
+        column->type = avro_typeof(schema);
+        type_name = column_type_name(column->type);
+        if (type_name == NULL) {
+            return luaL_error(L, "Field %s can't be read as a column", name);
+        }
+
+        lua_pushstring(L, name);
+        lua_rawseti(L, fields_index, c+1);
+
+        lua_createtable(L, 0, 5);
+        lua_pushstring(L, name);
+        lua_setfield(L, -2, "name");
+        lua_pushstring(L, type_name);
+        lua_setfield(L, -2, "type");
+        lua_pushvalue(L, -1);
+        lua_setfield(L, columns_index, name);
+
+        /* The column table stays on the stack, so that we can add the
+         * string data to it once we're done. */
+        lua_createtable(L, n + (column->type == AVRO_STRING ||
+                                column->type == AVRO_BYTES), 0);
+        lua_pushvalue(L, -1);
+        if (column->type == AVRO_STRING || column->type == AVRO_BYTES) {
+            lua_setfield(L, -3, "offsets");
+            lua_pushnumber(L, 0);
+            lua_rawseti(L, -2, 1);
+        } else {
+            lua_setfield(L, -3, "values");
+        }
+        column->values_index = lua_gettop(L);
+
+        column->validity_index = 0;
+        if (column->null_branch >= 0) {
+            lua_createtable(L, n, 0);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, -4, "validity");
+            column->validity_index = lua_gettop(L);
+        }
+
+        column->data_index = 0;
+        column->data_size = 0;
+        if (column->type == AVRO_STRING || column->type == AVRO_BYTES) {
+            column->data_capacity = 64;
+            column->data = lua_newuserdata(L, column->data_capacity);
+            column->data_index = lua_gettop(L);
+        }
+    }
+
+    avro_value_iface_t  *iface = avro_generic_class_from_schema(wschema);
+    if (iface == NULL) {
+        return lua_avro_error(L);
+    }
+    avro_value_t  record;
+    int  rc = avro_generic_value_new(iface, &record);
+    avro_value_iface_decref(iface);
+    check(rc);
+
+    /* Filling in the columns can raise a Lua error, so the record is
+     * guarded until we're done with it. */
+    push_value_guard(L, &record);
+
+    lua_Integer  count = 0;
+    while (count < n) {
+        rc = input_file_read_writer_value(l_file, &record);
+        if (rc == EOF) {
+            break;
+        }
+        if (rc == 0) {
+            count++;
+            rc = read_column_row(L, columns, column_count, &record, count);
+        }
+        if (rc != 0) {
+            release_value_guard(L, -1);
+            return lua_avro_error(L);
+        }
+    }
+    release_value_guard(L, -1);
+    lua_pop(L, 1);
+
+    if (count == 0) {
+        return lua_return_avro_error(L);
+    }
+
+    for (c = 0; c < column_count; c++) {
+        Column  *column = &columns[c];
+        if (column->data_index != 0) {
+            /* The column table is just below its offsets table. */
+            lua_pushlstring(L, column->data, column->data_size);
+            lua_setfield(L, column->values_index - 1, "data");
+            lua_pushnumber(L, column->data_size);
+            lua_setfield(L, column->values_index - 1, "data_size");
+        }
+    }
+
+    lua_createtable(L, 0, 3);
+    lua_pushnumber(L, count);
+    lua_setfield(L, -2, "count");
+    lua_pushvalue(L, fields_index);
+    lua_setfield(L, -2, "fields");
+    lua_pushvalue(L, columns_index);
+    lua_setfield(L, -2, "columns");
+    return 1;
+}
+
+/**
+ * Positions the file so that the next value read is the nth record in
+ * the file, counting from 1.  Seeking to one past the last record
+ * positions the file at its end.  The first seek builds the file's
+ * block index (unless it was loaded from a sidecar), which only needs
+ * to read each block's header.
+ */
+
+static int
+l_input_file_seek(lua_State *L)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    lua_Integer  index = luaL_checkinteger(L, 2);
+    if (input_file_seek(l_file, index - 1) != 0) {
+        return lua_return_avro_error(L);
+    }
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * Returns the position of the next record that will be read, counting
+ * from 1.
+ */
+
+static int
+l_input_file_tell(lua_State *L)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    lua_pushinteger(L, l_file->record_index + 1);
+    return 1;
+}
+
+/**
+ * Positions the file at the first block that starts at or after the
+ * given byte offset, and returns the position of that block's first
+ * record.  This is how you'd split a file into byte ranges and read
+ * each range separately.
+ */
+
+static int
+l_input_file_sync(lua_State *L)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    lua_Integer  offset = luaL_checkinteger(L, 2);
+    int64_t  index;
+    size_t  lo = 0;
+    size_t  hi;
+
+    if (input_file_index(l_file) != 0) {
+        return lua_return_avro_error(L);
+    }
+
+    hi = l_file->block_count;
+    while (lo < hi) {
+        size_t  mid = lo + (hi - lo) / 2;
+        if (l_file->block_offsets[mid] < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    index = l_file->block_firsts[lo];
+    if (input_file_seek(l_file, index) != 0) {
+        return lua_return_avro_error(L);
+    }
+    lua_pushinteger(L, index + 1);
+    return 1;
+}
+
+/**
+ * Returns the number of records in the file, and the number of blocks
+ * that they're stored in.
+ */
+
+static int
+l_input_file_record_count(lua_State *L)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    if (input_file_index(l_file) != 0) {
+        return lua_return_avro_error(L);
+    }
+    lua_pushinteger(L, l_file->block_firsts[l_file->block_count]);
+    lua_pushinteger(L, l_file->block_count);
+    return 2;
+}
+
+/**
+ * Saves the file's block index to a sidecar file, which can be passed
+ * in as the index option the next time the file is opened.
+ */
+
+static int
+l_input_file_write_index(lua_State *L)
+{
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    const char  *path = luaL_checkstring(L, 2);
+    if (input_file_write_index(l_file, path) != 0) {
+        return lua_return_avro_error(L);
+    }
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+
+/**
+ * The string used to identify the AvroDataOutputFile class's metatable
+ * in the Lua registry.
+ */
+
+#define MT_AVRO_DATA_OUTPUT_FILE "avro:AvroDataOutputFile"
+
+
+typedef struct _LuaAvroDataOutputFile
+{
+    avro_file_writer_t  writer;
+    size_t  records_per_block;
+    size_t  block_records;
+
+    /* An in-memory container file is written to mem_fp, a stream that
+     * accumulates its contents in mem_buf. */
+    FILE  *mem_fp;
+    char  *mem_buf;
+    size_t  mem_size;
+} LuaAvroDataOutputFile;
+
+
+int
+lua_avro_push_file_writer(lua_State *L, avro_file_writer_t writer,
+                          size_t records_per_block)
+{
+    LuaAvroDataOutputFile  *l_file;
+
+    l_file = lua_newuserdata(L, sizeof(LuaAvroDataOutputFile));
+    l_file->writer = writer;
+    l_file->records_per_block = records_per_block;
+    l_file->block_records = 0;
+    l_file->mem_fp = NULL;
+    l_file->mem_buf = NULL;
+    l_file->mem_size = 0;
+    luaL_getmetatable(L, MT_AVRO_DATA_OUTPUT_FILE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+
+avro_file_writer_t
+lua_avro_get_file_writer(lua_State *L, int index)
+{
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, index, MT_AVRO_DATA_OUTPUT_FILE);
+    return l_file->writer;
+}
+
+
+/**
+ * Closes a file writer.  The contents of an in-memory file are still
+ * available after it's closed.
+ */
+
+static int
+l_output_file_close(lua_State *L)
+{
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    if (l_file->writer != NULL) {
+        avro_file_writer_close(l_file->writer);
+        l_file->writer = NULL;
+    }
+    if (l_file->mem_fp != NULL) {
+        fclose(l_file->mem_fp);
+        l_file->mem_fp = NULL;
+    }
+    return 0;
+}
+
+/**
+ * Finalizes a file writer.
+ */
+
+static int
+l_output_file_gc(lua_State *L)
+{
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    l_output_file_close(L);
+    free(l_file->mem_buf);
+    l_file->mem_buf = NULL;
+    return 0;
+}
+
+/**
+ * Returns the contents of an in-memory container file as a string.  If
+ * the file is still open, we end the current block first, so that the
+ * result is always a complete container file.
+ */
+
+static int
+l_output_file_contents(lua_State *L)
+{
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    if (l_file->mem_buf == NULL && l_file->mem_fp == NULL) {
+        return luaL_error(L, "Not an in-memory file");
+    }
+    if (l_file->writer != NULL) {
+        check(avro_file_writer_flush(l_file->writer));
+        l_file->block_records = 0;
+    }
+    if (l_file->mem_fp != NULL) {
+        fflush(l_file->mem_fp);
+    }
+    lua_pushlstring(L, l_file->mem_buf, l_file->mem_size);
+    return 1;
+}
+
+/**
+ * Appends a value to a file writer, ending the current block if we've
+ * reached the writer's records_per_block limit.
+ */
+
+static int
+output_file_append(LuaAvroDataOutputFile *l_file, avro_value_t *value)
+{
+    int  rc = avro_file_writer_append_value(l_file->writer, value);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (l_file->records_per_block > 0 &&
+        ++l_file->block_records >= l_file->records_per_block) {
+        l_file->block_records = 0;
+        return avro_file_writer_sync(l_file->writer);
+    }
+
+    return 0;
+}
+
+/**
+ * Writes a value to a file writer.
+ */
+
+static int
+l_output_file_write(lua_State *L)
+{
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    avro_value_t  *value = lua_avro_get_value(L, 2);
+    check(output_file_append(l_file, value));
+    return 0;
+}
+
+/**
+ * Writes the first n values of an array-like table to a file writer in
+ * a single call.  If n is omitted, we write every value in the table.
+ */
+
+static int
+l_output_file_write_batch(lua_State *L)
+{
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer  count = luaL_optinteger(L, 3, lua_objlen(L, 2));
+    lua_Integer  i;
+
+    for (i = 1; i <= count; i++) {
+        lua_rawgeti(L, 2, i);
+        avro_value_t  *value = lua_avro_get_value(L, -1);
+        check(output_file_append(l_file, value));
+        lua_pop(L, 1);
+    }
+
+    return 0;
+}
+
+/**
+ * Ends the current block, writing it and a sync marker to the file.
+ */
+
+static int
+l_output_file_sync(lua_State *L)
+{
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    check(avro_file_writer_sync(l_file->writer));
+    l_file->block_records = 0;
+    return 0;
+}
+
+
+/**
+ * Returns the value of an integer field from an optional table of
+ * options, or the given default if there's no options table or the
+ * field isn't present.
+ */
+
+static lua_Integer
+get_integer_option(lua_State *L, int index, const char *name,
+                   lua_Integer default_value)
+{
+    lua_Integer  result = default_value;
+    if (lua_istable(L, index)) {
+        lua_getfield(L, index, name);
+        if (!lua_isnil(L, -1)) {
+            if (!lua_isnumber(L, -1)) {
+                return luaL_error(L, "Option %s must be a number", name);
+            }
+            result = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    return result;
+}
+
+/**
+ * Returns the value of a string field from an optional table of
+ * options, or the given default if there's no options table or the
+ * field isn't present.  The result is only valid while the options
+ * table is on the stack.
+ */
+
+static const char *
+get_string_option(lua_State *L, int index, const char *name,
+                  const char *default_value)
+{
+    const char  *result = default_value;
+    if (lua_istable(L, index)) {
+        lua_getfield(L, index, name);
+        if (!lua_isnil(L, -1)) {
+            if (!lua_isstring(L, -1)) {
+                luaL_error(L, "Option %s must be a string", name);
+                return NULL;
+            }
+            result = lua_tostring(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    return result;
+}
+
+
+/**
+ * Returns the value of a boolean field from an optional table of
+ * options, or the given default if there's no options table or the
+ * field isn't present.
+ */
+
+static bool
+get_boolean_option(lua_State *L, int index, const char *name,
+                   bool default_value)
+{
+    bool  result = default_value;
+    if (lua_istable(L, index)) {
+        lua_getfield(L, index, name);
+        if (!lua_isnil(L, -1)) {
+            result = lua_toboolean(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    return result;
+}
+
+
+/**
+ * Returns whether the value at the given stack index is a table of
+ * options, rather than a schema.
+ */
+
+static bool
+is_options_table(lua_State *L, int index)
+{
+    bool  result;
+    if (!lua_istable(L, index)) {
+        return false;
+    }
+    lua_getfield(L, index, "raw_schema");
+    result = lua_isnil(L, -1);
+    lua_pop(L, 1);
+    return result;
+}
+
+
+/**
+ * Creates an input file that reads its blocks from the given memory.
+ * We find each block in memory ourselves; the file reader only ever
+ * sees the header.  We take ownership of the memory, even if we can't
+ * create the input file.
+ */
+
+static int
+push_mapped_file(lua_State *L, const char *path, char *map, size_t map_size,
+                 bool map_is_copy, avro_schema_t rschema)
+{
+    LuaAvroDataInputFile  *l_file;
+    LuaAvroFileHeader  header;
+    avro_file_reader_t  reader;
+    FILE  *fp;
+    int  nresults;
+
+    if ((fp = fmemopen(map, map_size, "rb")) == NULL) {
+        avro_set_error("Cannot read file %s: %s", path, strerror(errno));
+        release_map(map, map_size, map_is_copy);
+        return lua_return_avro_error(L);
+    }
+    if (read_file_header(fp, &header) != 0) {
+        fclose(fp);
+        release_map(map, map_size, map_is_copy);
+        return lua_return_avro_error(L);
+    }
+    fclose(fp);
+
+    /* The reader closes the stream, even if it can't be created. */
+    if ((fp = fmemopen(map, header.size, "rb")) == NULL) {
+        avro_set_error("Cannot read file %s: %s", path, strerror(errno));
+        release_map(map, map_size, map_is_copy);
+        return lua_return_avro_error(L);
+    }
+    if (avro_file_reader_fp(fp, path, 1, &reader) != 0) {
+        release_map(map, map_size, map_is_copy);
+        return lua_return_avro_error(L);
+    }
+
+    nresults = lua_avro_push_file_reader(L, reader, &header, rschema, path);
+    if (nresults != 1) {
+        release_map(map, map_size, map_is_copy);
+        return nresults;
+    }
+
+    l_file = lua_touserdata(L, -1);
+    l_file->map = map;
+    l_file->map_size = map_size;
+    l_file->map_is_copy = map_is_copy;
+    l_file->mapped_reads = true;
+    l_file->pos = header.size;
+    return 1;
+}
+
+/**
+ * Opens an input file by mapping it into memory.
+ */
+
+static int
+open_mapped_file(lua_State *L, const char *path, avro_schema_t rschema)
+{
+    char  *map;
+    size_t  map_size;
+
+    if (map_file(path, &map, &map_size) != 0) {
+        return lua_return_avro_error(L);
+    }
+    return push_mapped_file(L, path, map, map_size, false, rschema);
+}
+
+
+/**
+ * Opens an existing container file so that we can append records to
+ * it.  The new blocks use the file's codec and sync marker.  If you
+ * pass in a schema, it must match the file's writer schema, since
+ * every block in a container file has to use the same one.  If the
+ * file doesn't exist yet, we create it, in which case you must pass
+ * in a schema.
+ */
+
+static int
+open_appended_file(lua_State *L, const char *path, avro_schema_t schema,
+                   lua_Integer block_size, lua_Integer records_per_block,
+                   const char *codec)
+{
+    avro_file_reader_t  reader;
+    avro_file_writer_t  writer;
+    LuaAvroFileHeader  header;
+    struct stat  st;
+    int  rc;
+
+    if (stat(path, &st) != 0 && errno == ENOENT) {
+        if (schema == NULL) {
+            return luaL_error(L, "Need a schema to create %s", path);
+        }
+        rc = avro_file_writer_create_with_codec
+            (path, schema, &writer, codec? codec: "null", block_size);
+        if (rc != 0) {
+            return lua_return_avro_error(L);
+        }
+        lua_avro_push_file_writer(L, writer, records_per_block);
+        return 1;
+    }
+
+    if (read_file_header_from_path(path, &header) != 0) {
+        return lua_return_avro_error(L);
+    }
+    if (codec != NULL && strcmp(codec, header.codec) != 0) {
+        avro_set_error("File %s uses the %s codec, not %s",
+                       path, header.codec, codec);
+        return lua_return_avro_error(L);
+    }
+
+    if (schema != NULL) {
+        if (avro_file_reader(path, &reader) != 0) {
+            return lua_return_avro_error(L);
+        }
+        rc = avro_schema_equal
+            (schema, avro_file_reader_get_writer_schema(reader));
+        avro_file_reader_close(reader);
+        if (!rc) {
+            avro_set_error("Schema doesn't match the schema of file %s", path);
+            return lua_return_avro_error(L);
+        }
+    }
+
+    if (block_size > 0) {
+        rc = avro_file_writer_open_bs(path, &writer, block_size);
+    } else {
+        rc = avro_file_writer_open(path, &writer);
+    }
+    if (rc != 0) {
+        return lua_return_avro_error(L);
+    }
+    lua_avro_push_file_writer(L, writer, records_per_block);
+    return 1;
+}
+
+
+/**
+ * Opens a new input or output file.  When opening an input file, you
+ * can pass in a reader schema as the third parameter.  Values read from
+ * the file will be instances of the reader schema, resolved from the
+ * file's writer schema; writer fields that aren't in the reader schema
+ * are skipped without being decoded.
+ *
+ * When opening an input file, you can pass in a table of options as
+ * the fourth parameter (or the third, if you don't need a reader
+ * schema):
+ *
+ *   mmap
+ *     If true, we map the file into memory instead of reading it
+ *     through stdio.  Blocks that use the null codec are then decoded
+ *     directly from the mapping, without being copied first.
+ *
+ *   index
+ *     The path of a block index sidecar, as written by the
+ *     write_index method.  If it exists and matches the file, seek
+ *     uses it instead of scanning the file's block headers.
+ *
+ * When opening an output file, you can pass in a table of options as
+ * the fourth parameter:
+ *
+ *   block_size
+ *     The size of the buffer used to accumulate each block, in bytes.
+ *     A block is written to the file whenever this fills up, so it's
+ *     also the largest encoded record that you can write.
+ *
+ *   records_per_block
+ *     If given, we end the current block (and write a sync marker)
+ *     after this many records, even if the block buffer isn't full yet.
+ *
+ *   codec
+ *     The name of the compression codec to use for each block: "null"
+ *     (the default), "deflate", "snappy", or "lzma".  Which codecs are
+ *     available depends on how the Avro C library was built.
+ *
+ * Mode "a" opens an existing file for appending.  The schema is
+ * optional, but if given it must match the file's writer schema; it's
+ * required if the file doesn't exist yet, in which case we create it.
+ * The output file options are the same as for mode "w", and can be
+ * passed in place of the schema.  New blocks always use the file's own
+ * codec, so giving a different codec is an error.
+ */
+
+static int
+l_file_open(lua_State *L)
+{
+    static const char  *MODES[] = { "r", "w", "a", NULL };
+
+    const char  *path = luaL_checkstring(L, 1);
+    int  mode = luaL_checkoption(L, 2, "r", MODES);
+
+    if (mode == 0) {
+        /* mode == "r" */
+        avro_file_reader_t  reader;
+        LuaAvroFileHeader  header;
+        avro_schema_t  rschema = NULL;
+        int  options_index = 4;
+
+        if (is_options_table(L, 3)) {
+            options_index = 3;
+        } else if (!lua_isnoneornil(L, 3)) {
+            rschema = lua_avro_get_schema(L, 3);
+        }
+        const char  *index_path =
+            get_string_option(L, options_index, "index", NULL);
+        int  nresults;
+
+        if (get_boolean_option(L, options_index, "mmap", false)) {
+            nresults = open_mapped_file(L, path, rschema);
+        } else {
+            if (avro_file_reader(path, &reader) != 0) {
+                return lua_return_avro_error(L);
+            }
+            if (read_file_header_from_path(path, &header) != 0) {
+                avro_file_reader_close(reader);
+                return lua_return_avro_error(L);
+            }
+            nresults = lua_avro_push_file_reader
+                (L, reader, &header, rschema, path);
+        }
+
+        /* A missing or stale sidecar isn't an error; we'll build the
+         * index ourselves the first time we need it. */
+        if (nresults == 1 && index_path != NULL) {
+            input_file_read_index(lua_touserdata(L, -1), index_path);
+        }
+        return nresults;
+
+    } else if (mode == 1) {
+        /* mode == "w" */
+        avro_schema_t  schema = lua_avro_get_schema(L, 3);
+        lua_Integer  block_size = get_integer_option(L, 4, "block_size", 0);
+        lua_Integer  records_per_block =
+            get_integer_option(L, 4, "records_per_block", 0);
+        const char  *codec = get_string_option(L, 4, "codec", "null");
+        avro_file_writer_t  writer;
+
+        if (block_size < 0 || records_per_block < 0) {
+            return luaL_error(L, "File options cannot be negative");
+        }
+
+        int  rc = avro_file_writer_create_with_codec
+            (path, schema, &writer, codec, block_size);
+        if (rc != 0) {
+            return lua_return_avro_error(L);
+        }
+        lua_avro_push_file_writer(L, writer, records_per_block);
+        return 1;
+
+    } else if (mode == 2) {
+        /* mode == "a" */
+        avro_schema_t  schema = NULL;
+        int  options_index = 4;
+
+        if (is_options_table(L, 3)) {
+            options_index = 3;
+        } else if (!lua_isnoneornil(L, 3)) {
+            schema = lua_avro_get_schema(L, 3);
+        }
+
+        lua_Integer  block_size =
+            get_integer_option(L, options_index, "block_size", 0);
+        lua_Integer  records_per_block =
+            get_integer_option(L, options_index, "records_per_block", 0);
+        const char  *codec =
+            get_string_option(L, options_index, "codec", NULL);
+
+        if (block_size < 0 || records_per_block < 0) {
+            return luaL_error(L, "File options cannot be negative");
+        }
+        return open_appended_file
+            (L, path, schema, block_size, records_per_block, codec);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Opens an in-memory container file.  This takes the same parameters as
+ * open, except that the first is the file's contents instead of its
+ * path.  In mode "r", we read from a copy of the given string, and all
+ * of the input file options and methods are available; the mmap option
+ * is ignored.  In mode "w", the first parameter is ignored, and the
+ * file accumulates in memory until you retrieve it with the contents
+ * method.  Mode "a" isn't supported.
+ */
+
+static int
+l_memory_file_open(lua_State *L)
+{
+    static const char  *MODES[] = { "r", "w", NULL };
+
+    int  mode = luaL_checkoption(L, 2, "r", MODES);
+
+    if (mode == 0) {
+        /* mode == "r" */
+        size_t  size;
+        const char  *buf = luaL_checklstring(L, 1, &size);
+        avro_schema_t  rschema = NULL;
+        int  options_index = 4;
+        char  *map;
+        int  nresults;
+
+        if (is_options_table(L, 3)) {
+            options_index = 3;
+        } else if (!lua_isnoneornil(L, 3)) {
+            rschema = lua_avro_get_schema(L, 3);
+        }
+        const char  *index_path =
+            get_string_option(L, options_index, "index", NULL);
+
+        if (size == 0) {
+            avro_set_error("Not an Avro container file");
+            return lua_return_avro_error(L);
+        }
+        if ((map = malloc(size)) == NULL) {
+            return luaL_error(L, "Out of memory");
+        }
+        memcpy(map, buf, size);
+
+        nresults = push_mapped_file(L, "<memory>", map, size, true, rschema);
+        if (nresults == 1 && index_path != NULL) {
+            input_file_read_index(lua_touserdata(L, -1), index_path);
+        }
+        return nresults;
+
+    } else if (mode == 1) {
+        /* mode == "w" */
+        avro_schema_t  schema = lua_avro_get_schema(L, 3);
+        lua_Integer  block_size = get_integer_option(L, 4, "block_size", 0);
+        lua_Integer  records_per_block =
+            get_integer_option(L, 4, "records_per_block", 0);
+        const char  *codec = get_string_option(L, 4, "codec", "null");
+        LuaAvroDataOutputFile  *l_file;
+
+        if (block_size < 0 || records_per_block < 0) {
+            return luaL_error(L, "File options cannot be negative");
+        }
+
+        /* The stream updates mem_buf and mem_size in place, so we need
+         * the userdata to exist before we open it. */
+        lua_avro_push_file_writer(L, NULL, records_per_block);
+        l_file = lua_touserdata(L, -1);
+        l_file->mem_fp = open_memstream(&l_file->mem_buf, &l_file->mem_size);
+        if (l_file->mem_fp == NULL) {
+            avro_set_error("Cannot create in-memory file: %s",
+                           strerror(errno));
+            return lua_return_avro_error(L);
+        }
+
+        int  rc = avro_file_writer_create_with_codec_fp
+            (l_file->mem_fp, "<memory>", 0, schema,
+             &l_file->writer, codec, block_size);
+        if (rc != 0) {
+            l_file->writer = NULL;
+            return lua_return_avro_error(L);
+        }
+        return 1;
     }
 
-    if (value_type == AVRO_MAP) {
-        lua_pushcfunction(L, iterate_map);
-        create_iterator(L, value, no_scalar);
-        lua_pushnil(L);
-        return 3;
-    }
+    return 0;
+}
 
-    lua_pushliteral(L, "Can only iterate through arrays and maps");
-    return lua_error(L);
+
+/*-----------------------------------------------------------------------
+ * Lua access — parallel scanner
+ */
+
+/**
+ * The string used to identify the AvroScanner class's metatable in the
+ * Lua registry.
+ */
+
+#define MT_AVRO_SCANNER "avro:AvroScanner"
+
+#define SCANNER_DEFAULT_THREADS  4
+#define SCANNER_DEFAULT_CHUNK_SIZE  (4 * 1024 * 1024)
+#define SCANNER_ERROR_SIZE  256
+
+/* A block header is two varints, each of which is at most 10 bytes. */
+#define BLOCK_HEADER_MAX_SIZE  20
+
+
+int
+luaopen_avro_legacy_avro(lua_State *L);
+
+
+/**
+ * A scanner reads a container file using a pool of worker threads.  We
+ * split the file into chunks, each of which holds one or more complete
+ * blocks; we find the chunk boundaries by reading each block's header,
+ * and checking for the sync marker that should follow it.  A worker
+ * decodes a chunk by handing the file's header and the chunk's blocks
+ * to its own avro_file_reader, which reads them from memory, so we
+ * support the same codecs as any other file reader.
+ *
+ * Each finished chunk is a batch of results.  A result is either a
+ * value, which the Lua caller takes ownership of, or whatever scalar
+ * the scan's filter function returned for the value.
+ */
+
+typedef struct _ScanResult
+{
+    /* LUA_TUSERDATA for a value, otherwise the type of a scalar */
+    int  type;
+    avro_value_t  value;
+    char  *str;
+    size_t  len;
+    lua_Number  number;
+} ScanResult;
+
+typedef struct _ScanChunk
+{
+    int64_t  index;
+    int64_t  offset;
+    int64_t  size;
+    int64_t  count;
+    ScanResult  *results;
+    size_t  result_count;
+    bool  failed;
+    char  error[SCANNER_ERROR_SIZE];
+    struct _ScanChunk  *next;
+} ScanChunk;
+
+typedef struct _LuaAvroScanner
+{
+    bool  closed;
+    pthread_mutex_t  lock;
+    pthread_cond_t  changed;
+    int  fd;
+    int64_t  file_size;
+    LuaAvroFileHeader  header;
+    char  *header_data;
+    avro_schema_t  wschema;
+    avro_schema_t  rschema;
+    avro_value_iface_t  *iface;
+    char  *filter;
+    size_t  filter_size;
+    bool  ordered;
+    int64_t  chunk_size;
+    int  max_in_flight;
+    pthread_t  *threads;
+    int  thread_count;
+
+    /* The remaining fields are protected by lock. */
+    int64_t  next_offset;
+    int64_t  next_index;
+    int64_t  next_delivery;
+    int  in_flight;
+    ScanChunk  *finished;
+    bool  exhausted;
+    bool  stopping;
+    int  running;
+} LuaAvroScanner;
+
+
+static void
+scan_chunk_fail(ScanChunk *chunk, const char *msg)
+{
+    chunk->failed = true;
+    strncpy(chunk->error, msg, SCANNER_ERROR_SIZE - 1);
+    chunk->error[SCANNER_ERROR_SIZE - 1] = '\0';
+}
+
+static void
+scan_chunk_free(ScanChunk *chunk)
+{
+    size_t  i;
+    for (i = 0; i < chunk->result_count; i++) {
+        ScanResult  *result = &chunk->results[i];
+        if (result->type == LUA_TUSERDATA) {
+            avro_value_decref(&result->value);
+        } else if (result->type == LUA_TSTRING) {
+            free(result->str);
+        }
+    }
+    free(chunk->results);
+    free(chunk);
 }
 
 
 /**
- * Encode an Avro value using the binary encoding.  Returns the result
- * as a Lua string.
+ * Reads the header of the block at the given offset, and checks that
+ * it's followed by a sync marker.  Fills in the size of the block in
+ * bytes, including its header and sync marker, and the number of
+ * records in it.
  */
 
 static int
-l_value_encode(lua_State *L)
+scanner_read_block(LuaAvroScanner *scanner, int64_t offset,
+                   int64_t *size, int64_t *count)
 {
-    static char  static_buf[65536];
+    char  buf[BLOCK_HEADER_MAX_SIZE];
+    char  sync[SYNC_SIZE];
+    ssize_t  read_size;
+    size_t  pos = 0;
+    int64_t  data_size;
+    int64_t  sync_offset;
+
+    read_size = pread(scanner->fd, buf, sizeof(buf), offset);
+    if (read_size < 0) {
+        avro_set_error("Cannot read block header: %s", strerror(errno));
+        return EIO;
+    }
 
-    avro_value_t  *value = lua_avro_get_value(L, 1);
+    if (skip_binary_long(buf, read_size, &pos, count) != 0 ||
+        skip_binary_long(buf, read_size, &pos, &data_size) != 0 ||
+        *count < 0 || data_size < 0) {
+        avro_set_error("Invalid block header at offset %lld",
+                       (long long) offset);
+        return EILSEQ;
+    }
 
-    size_t  size = 0;
-    check(avro_value_sizeof(value, &size));
+    sync_offset = offset + pos + data_size;
+    if (sync_offset > scanner->file_size - SYNC_SIZE ||
+        pread(scanner->fd, sync, SYNC_SIZE, sync_offset) != SYNC_SIZE ||
+        memcmp(sync, scanner->header.sync, SYNC_SIZE) != 0) {
+        avro_set_error("Missing sync marker at offset %lld",
+                       (long long) sync_offset);
+        return EILSEQ;
+    }
 
-    int  result;
-    char  *buf;
-    bool  free_buf;
+    *size = sync_offset + SYNC_SIZE - offset;
+    return 0;
+}
 
-    if (size <= sizeof(static_buf)) {
-        buf = static_buf;
-        free_buf = false;
-    } else {
-        buf = malloc(size);
-        if (buf == NULL) {
-            lua_pushnil(L);
-            lua_pushliteral(L, "Out of memory");
-            return 2;
-        }
-        free_buf = true;
+
+/**
+ * Claims the next chunk of the file, which starts at the next unclaimed
+ * block and holds at least chunk_size bytes of blocks (or everything up
+ * to the end of the file).  Must be called with the scanner's lock
+ * held.  Returns NULL once the whole file has been claimed.
+ */
+
+static ScanChunk *
+scanner_claim_chunk(LuaAvroScanner *scanner)
+{
+    ScanChunk  *chunk;
+
+    if (scanner->exhausted) {
+        return NULL;
     }
 
-    avro_writer_t  writer = avro_writer_memory(buf, size);
-    result = avro_value_write(writer, value);
-    avro_writer_free(writer);
+    chunk = calloc(1, sizeof(ScanChunk));
+    if (chunk == NULL) {
+        return NULL;
+    }
 
-    if (result) {
-        if (free_buf) {
-            free(buf);
+    chunk->index = scanner->next_index++;
+    chunk->offset = scanner->next_offset;
+    while (scanner->next_offset < scanner->file_size &&
+           chunk->size < scanner->chunk_size) {
+        int64_t  size;
+        int64_t  count;
+        if (scanner_read_block(scanner, scanner->next_offset,
+                               &size, &count) != 0) {
+            /* We can't find any more blocks, so this chunk is the
+             * last one, and reports the error. */
+            scan_chunk_fail(chunk, avro_strerror());
+            scanner->exhausted = true;
+            break;
         }
-        return lua_return_avro_error(L);
+        scanner->next_offset += size;
+        chunk->size += size;
+        chunk->count += count;
     }
 
-    lua_pushlstring(L, buf, size);
-    if (free_buf) {
-        free(buf);
+    if (scanner->next_offset >= scanner->file_size) {
+        scanner->exhausted = true;
     }
-    return 1;
+    scanner->in_flight++;
+    return chunk;
 }
 
 
 /**
- * Return the length of the binary encoding of the value.
+ * Runs the scan's filter function on the value in result, in a
+ * worker's own Lua state.  The filter function is at index 1 of the
+ * state's stack, and index 2 holds an AvroValue that we point at each
+ * value in turn.  If the filter returns a scalar other than a boolean,
+ * we replace the value in result with it.
  */
 
 static int
-l_value_encoded_size(lua_State *L)
+scanner_filter_value(lua_State *L, ScanResult *result, bool *keep)
 {
-    avro_value_t  *value = lua_avro_get_value(L, 1);
+    LuaAvroValue  *l_value = lua_touserdata(L, 2);
+    l_value->value = result->value;
+
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    if (lua_pcall(L, 1, 1, 0) != 0) {
+        avro_set_error("Error in scan filter: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return EINVAL;
+    }
 
-    size_t  size = 0;
-    check(avro_value_sizeof(value, &size));
+    *keep = true;
+    switch (lua_type(L, -1)) {
+        case LUA_TNIL:
+            *keep = false;
+            break;
 
-    lua_pushinteger(L, size);
-    return 1;
+        case LUA_TBOOLEAN:
+            *keep = lua_toboolean(L, -1);
+            break;
+
+        case LUA_TNUMBER:
+            result->type = LUA_TNUMBER;
+            result->number = lua_tonumber(L, -1);
+            break;
+
+        case LUA_TSTRING:
+        {
+            const char  *str = lua_tolstring(L, -1, &result->len);
+            result->str = malloc(result->len > 0? result->len: 1);
+            if (result->str == NULL) {
+                lua_pop(L, 1);
+                avro_set_error("Out of memory");
+                return ENOMEM;
+            }
+            memcpy(result->str, str, result->len);
+            result->type = LUA_TSTRING;
+            break;
+        }
+
+        default:
+            lua_pop(L, 1);
+            avro_set_error
+                ("Scan filter must return a boolean, number, or string");
+            return EINVAL;
+    }
+
+    lua_pop(L, 1);
+    return 0;
 }
 
 
 /**
- * Encode an Avro value using the binary encoding.  The result is placed
- * into the given memory region, which is provided as a light user data
- * and a size.  There's no safety checking here; to make it easier to
- * not include this function in sandboxes, it's exposed as a global
- * function in the "avro" package, and not as a method of the AvroValue
- * class.
+ * Reads and decodes the blocks in a chunk.  If the worker has a
+ * resolver, we read each value through it; if it has a Lua state, we
+ * run the scan's filter function on each value.
  */
 
 static int
-l_value_encode_raw(lua_State *L)
+scanner_decode_chunk(LuaAvroScanner *scanner, ScanChunk *chunk,
+                     avro_value_t *resolved, lua_State *L)
 {
-    avro_value_t  *value = lua_avro_get_value(L, 1);
-    if (!lua_islightuserdata(L, 2)) {
-        return luaL_error(L, "Destination buffer should be a light userdata");
+    size_t  header_size = scanner->header.size;
+    size_t  size = header_size + chunk->size;
+    size_t  allocated;
+    char  *buf;
+    FILE  *fp;
+    avro_file_reader_t  reader;
+    int64_t  i;
+    int  rc;
+
+    /* The record counts come from the file, so we don't trust them to
+     * size the results array up front; we start with no more slots
+     * than there are bytes in the chunk, and grow it as needed. */
+    allocated = (chunk->count < chunk->size)? chunk->count: chunk->size;
+    if (allocated == 0) {
+        allocated = 1;
+    }
+    buf = malloc(size);
+    chunk->results = malloc(allocated * sizeof(ScanResult));
+    if (buf == NULL || chunk->results == NULL) {
+        free(buf);
+        avro_set_error("Out of memory");
+        return ENOMEM;
     }
-    void  *buf = lua_touserdata(L, 2);
-    size_t  size = luaL_checkinteger(L, 3);
 
-    avro_writer_t  writer = avro_writer_memory(buf, size);
-    int  result = avro_value_write(writer, value);
-    avro_writer_free(writer);
+    memcpy(buf, scanner->header_data, header_size);
+    if (pread(scanner->fd, buf + header_size, chunk->size, chunk->offset)
+        != (ssize_t) chunk->size) {
+        free(buf);
+        avro_set_error("Cannot read blocks at offset %lld",
+                       (long long) chunk->offset);
+        return EIO;
+    }
 
-    if (result) {
-        lua_pushboolean(L, false);
-        lua_pushstring(L, avro_strerror());
-        return 2;
+    fp = fmemopen(buf, size, "rb");
+    if (fp == NULL) {
+        free(buf);
+        avro_set_error("Cannot open chunk: %s", strerror(errno));
+        return errno;
     }
 
-    lua_pushboolean(L, true);
-    return 1;
+    /* The reader closes fp, even if it can't be created. */
+    if ((rc = avro_file_reader_fp(fp, "<chunk>", 1, &reader)) != 0) {
+        free(buf);
+        return rc;
+    }
+
+    for (i = 0; i < chunk->count; i++) {
+        ScanResult  *result;
+        bool  keep = true;
+
+        if (chunk->result_count == allocated) {
+            ScanResult  *results =
+                realloc(chunk->results, 2 * allocated * sizeof(ScanResult));
+            if (results == NULL) {
+                avro_set_error("Out of memory");
+                rc = ENOMEM;
+                break;
+            }
+            chunk->results = results;
+            allocated *= 2;
+        }
+        result = &chunk->results[chunk->result_count];
+
+        result->type = LUA_TUSERDATA;
+        if ((rc = avro_generic_value_new
+             (scanner->iface, &result->value)) != 0) {
+            break;
+        }
+
+        if (resolved == NULL) {
+            rc = avro_file_reader_read_value(reader, &result->value);
+        } else {
+            avro_resolved_writer_set_dest(resolved, &result->value);
+            rc = avro_file_reader_read_value(reader, resolved);
+        }
+
+        if (rc == 0 && L != NULL) {
+            rc = scanner_filter_value(L, result, &keep);
+            if (rc != 0 || !keep || result->type != LUA_TUSERDATA) {
+                avro_value_decref(&result->value);
+            }
+        } else if (rc != 0) {
+            avro_value_decref(&result->value);
+        }
+
+        if (rc != 0) {
+            break;
+        }
+        if (keep) {
+            chunk->result_count++;
+        }
+    }
+
+    avro_file_reader_close(reader);
+    free(buf);
+    return rc;
 }
 
 
 /**
- * Finalizes an AvroValue instance.
+ * Creates the Lua state that a worker runs the scan's filter function
+ * in.  The state has the standard libraries and this module loaded.
  */
 
-static int
-l_value_release(lua_State *L)
+static lua_State *
+scanner_new_filter_state(LuaAvroScanner *scanner)
 {
-    LuaAvroValue  *l_value = luaL_checkudata(L, 1, MT_AVRO_VALUE);
-    if (l_value->should_decref && l_value->value.self != NULL) {
-        avro_value_decref(&l_value->value);
+    LuaAvroValue  *l_value;
+    lua_State  *L = luaL_newstate();
+    if (L == NULL) {
+        avro_set_error("Cannot create Lua state for scan filter");
+        return NULL;
+    }
+
+    luaL_openlibs(L);
+    lua_pushcfunction(L, luaopen_avro_legacy_avro);
+    if (lua_pcall(L, 0, 0, 0) != 0 ||
+        luaL_loadbuffer(L, scanner->filter, scanner->filter_size,
+                        "=filter") != 0) {
+        avro_set_error("Cannot load scan filter: %s", lua_tostring(L, -1));
+        lua_close(L);
+        return NULL;
     }
+
+    l_value = lua_newuserdata(L, sizeof(LuaAvroValue));
     l_value->value.iface = NULL;
     l_value->value.self = NULL;
     l_value->should_decref = false;
-    return 0;
+    l_value->owner.iface = NULL;
+    l_value->owner.self = NULL;
+    luaL_getmetatable(L, MT_AVRO_VALUE);
+    lua_setmetatable(L, -2);
+    return L;
 }
 
 
-/*-----------------------------------------------------------------------
- * Lua access — schemas
- */
+static void *
+scanner_worker(void *vscanner)
+{
+    LuaAvroScanner  *scanner = vscanner;
+    avro_value_iface_t  *resolver = NULL;
+    avro_value_t  resolved;
+    lua_State  *L = NULL;
+    bool  setup_failed = false;
+    char  setup_error[SCANNER_ERROR_SIZE];
+
+    /* Each worker needs its own resolved writer and Lua state.  If we
+     * can't create them, every chunk that we claim reports the error. */
+    resolved.self = NULL;
+    if (scanner->rschema != NULL) {
+        resolver = avro_resolved_writer_new(scanner->wschema, scanner->rschema);
+        if (resolver == NULL ||
+            avro_resolved_writer_new_value(resolver, &resolved) != 0) {
+            setup_failed = true;
+        }
+    }
+    if (!setup_failed && scanner->filter != NULL) {
+        L = scanner_new_filter_state(scanner);
+        setup_failed = (L == NULL);
+    }
+    if (setup_failed) {
+        strncpy(setup_error, avro_strerror(), SCANNER_ERROR_SIZE - 1);
+        setup_error[SCANNER_ERROR_SIZE - 1] = '\0';
+    }
+
+    pthread_mutex_lock(&scanner->lock);
+    for (;;) {
+        ScanChunk  *chunk = NULL;
+
+        /* Don't get too far ahead of the Lua caller. */
+        while (!scanner->stopping && !scanner->exhausted &&
+               scanner->in_flight >= scanner->max_in_flight) {
+            pthread_cond_wait(&scanner->changed, &scanner->lock);
+        }
+        if (!scanner->stopping) {
+            chunk = scanner_claim_chunk(scanner);
+        }
+        if (chunk == NULL) {
+            break;
+        }
+        pthread_mutex_unlock(&scanner->lock);
+
+        if (!chunk->failed) {
+            if (setup_failed) {
+                scan_chunk_fail(chunk, setup_error);
+            } else if (scanner_decode_chunk
+                       (scanner, chunk,
+                        resolved.self == NULL? NULL: &resolved, L) != 0) {
+                scan_chunk_fail(chunk, avro_strerror());
+            }
+        }
+
+        pthread_mutex_lock(&scanner->lock);
+        chunk->next = scanner->finished;
+        scanner->finished = chunk;
+        pthread_cond_broadcast(&scanner->changed);
+    }
+    scanner->running--;
+    pthread_cond_broadcast(&scanner->changed);
+    pthread_mutex_unlock(&scanner->lock);
+
+    if (L != NULL) {
+        lua_close(L);
+    }
+    if (resolved.self != NULL) {
+        avro_value_decref(&resolved);
+    }
+    if (resolver != NULL) {
+        avro_value_iface_decref(resolver);
+    }
+    return NULL;
+}
+
 
 /**
- * The string used to identify the AvroSchema class's metatable in the
- * Lua registry.
+ * Removes the next chunk that we should deliver from the scanner's list
+ * of finished chunks.  If the scan is ordered, that's the chunk that
+ * comes next in the file; otherwise it's whichever one finished first.
+ * Must be called with the scanner's lock held.
  */
 
-#define MT_AVRO_SCHEMA "avro:AvroSchema"
-
-typedef struct _LuaAvroSchema
+static ScanChunk *
+scanner_take_chunk(LuaAvroScanner *scanner)
 {
-    avro_schema_t  schema;
-    avro_value_iface_t  *iface;
-} LuaAvroSchema;
+    ScanChunk  **prev = &scanner->finished;
+    ScanChunk  *chunk = NULL;
+
+    if (!scanner->ordered) {
+        /* The list is newest first, so take the last chunk. */
+        while (*prev != NULL && (*prev)->next != NULL) {
+            prev = &(*prev)->next;
+        }
+    } else {
+        while (*prev != NULL && (*prev)->index != scanner->next_delivery) {
+            prev = &(*prev)->next;
+        }
+    }
 
+    if (*prev != NULL) {
+        chunk = *prev;
+        *prev = chunk->next;
+        scanner->next_delivery++;
+        scanner->in_flight--;
+        pthread_cond_broadcast(&scanner->changed);
+    }
+    return chunk;
+}
 
-int
-lua_avro_push_schema(lua_State *L, avro_schema_t schema)
+
+/**
+ * A lua_Writer that appends a dumped chunk to the luaL_Buffer in ud.
+ */
+
+static int
+dump_writer(lua_State *L, const void *p, size_t size, void *ud)
 {
-    LuaAvroSchema  *l_schema;
-    l_schema = lua_newuserdata(L, sizeof(LuaAvroSchema));
-    l_schema->schema = avro_schema_incref(schema);
-    l_schema->iface = NULL;
-    luaL_getmetatable(L, MT_AVRO_SCHEMA);
-    lua_setmetatable(L, -2);
-    return 1;
+    (void) L;
+    luaL_addlstring((luaL_Buffer *) ud, p, size);
+    return 0;
 }
 
-int
-lua_avro_push_schema_no_link(lua_State *L, avro_schema_t schema)
+
+/**
+ * Starts a parallel scan of the container file at the given path.  As
+ * with open, you can pass in a reader schema as the second parameter;
+ * values are then resolved from the file's writer schema, and any
+ * writer fields that aren't in the reader schema are skipped.  You can
+ * also pass in a table of options as the third parameter:
+ *
+ *   threads
+ *     The number of worker threads that decompress and decode blocks.
+ *     Defaults to 4.
+ *
+ *   chunk_size
+ *     Each worker claims whole blocks until it has at least this many
+ *     bytes, and decodes them as one batch.  Defaults to 4MB.
+ *
+ *   ordered
+ *     If true (the default), batches are returned in the order that
+ *     they appear in the file.  Otherwise they're returned as soon as
+ *     they're decoded.
+ *
+ *   filter
+ *     A Lua function that's called with each value as it's decoded.
+ *     Each worker calls the function in its own Lua state, so it can't
+ *     have any upvalues, and it gets a raw value from this module even
+ *     if you're using the FFI bindings; it must not hold on to the
+ *     value after it returns.  If the function returns nil or false,
+ *     the value is dropped; if it returns true, the value is kept; and
+ *     if it returns a number or string, that's returned in place of the
+ *     value.
+ */
+
+static int
+l_scan(lua_State *L)
 {
-    while (is_avro_link(schema)) {
-        schema = avro_schema_link_target(schema);
+    const char  *path = luaL_checkstring(L, 1);
+    lua_Integer  threads =
+        get_integer_option(L, 3, "threads", SCANNER_DEFAULT_THREADS);
+    lua_Integer  chunk_size =
+        get_integer_option(L, 3, "chunk_size", SCANNER_DEFAULT_CHUNK_SIZE);
+    bool  ordered = get_boolean_option(L, 3, "ordered", true);
+    avro_schema_t  rschema = NULL;
+    avro_file_reader_t  reader;
+    struct stat  st;
+    FILE  *fp;
+    int  i;
+
+    if (threads < 1 || chunk_size < 1) {
+        return luaL_error(L, "Scan options must be positive");
     }
-    return lua_avro_push_schema(L, schema);
-}
+    lua_settop(L, 3);
+
+    if (!lua_isnoneornil(L, 2)) {
+        rschema = lua_isuserdata(L, 2)?
+            lua_avro_get_raw_schema(L, 2):
+            lua_avro_get_schema(L, 2);
+    }
+
+    /* From here on, the scanner's __gc metamethod cleans up after us if
+     * anything goes wrong. */
+    LuaAvroScanner  *scanner = lua_newuserdata(L, sizeof(LuaAvroScanner));
+    memset(scanner, 0, sizeof(LuaAvroScanner));
+    scanner->fd = -1;
+    pthread_mutex_init(&scanner->lock, NULL);
+    pthread_cond_init(&scanner->changed, NULL);
+    scanner->ordered = ordered;
+    scanner->chunk_size = chunk_size;
+    scanner->max_in_flight = 2 * threads;
+    luaL_getmetatable(L, MT_AVRO_SCANNER);
+    lua_setmetatable(L, -2);
+
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "filter");
+        if (!lua_isnil(L, -1)) {
+            luaL_Buffer  buf;
+            size_t  size;
+            const char  *dumped;
+
+            if (!lua_isfunction(L, -1) || lua_iscfunction(L, -1)) {
+                return luaL_error(L, "Scan filter must be a Lua function");
+            }
+            luaL_buffinit(L, &buf);
+            if (lua_dump(L, dump_writer, &buf) != 0) {
+                return luaL_error(L, "Cannot dump scan filter");
+            }
+            luaL_pushresult(&buf);
+            dumped = lua_tolstring(L, -1, &size);
+            scanner->filter = malloc(size);
+            if (scanner->filter == NULL) {
+                return luaL_error(L, "Out of memory");
+            }
+            memcpy(scanner->filter, dumped, size);
+            scanner->filter_size = size;
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    /* We use a regular file reader to get the writer schema, which also
+     * makes sure that the file is valid. */
+    if (avro_file_reader(path, &reader) != 0) {
+        return lua_return_avro_error(L);
+    }
+    scanner->wschema =
+        avro_schema_incref(avro_file_reader_get_writer_schema(reader));
+    avro_file_reader_close(reader);
+
+    if (rschema == NULL) {
+        scanner->iface = avro_generic_class_from_schema(scanner->wschema);
+    } else {
+        avro_value_iface_t  *resolver =
+            avro_resolved_writer_new(scanner->wschema, rschema);
+        if (resolver == NULL) {
+            return lua_return_avro_error(L);
+        }
+        avro_value_iface_decref(resolver);
+        scanner->rschema = avro_schema_incref(rschema);
+        scanner->iface = avro_generic_class_from_schema(rschema);
+    }
+    if (scanner->iface == NULL) {
+        return lua_return_avro_error(L);
+    }
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        avro_set_error("Cannot open file %s: %s", path, strerror(errno));
+        return lua_return_avro_error(L);
+    }
+    if (read_file_header(fp, &scanner->header) != 0) {
+        fclose(fp);
+        return lua_return_avro_error(L);
+    }
+    scanner->fd = dup(fileno(fp));
+    fclose(fp);
+    if (scanner->fd < 0 || fstat(scanner->fd, &st) != 0) {
+        avro_set_error("Cannot open file %s: %s", path, strerror(errno));
+        return lua_return_avro_error(L);
+    }
+    scanner->file_size = st.st_size;
+
+    scanner->header_data = malloc(scanner->header.size);
+    if (scanner->header_data == NULL) {
+        return luaL_error(L, "Out of memory");
+    }
+    if (pread(scanner->fd, scanner->header_data, scanner->header.size, 0)
+        != (ssize_t) scanner->header.size) {
+        avro_set_error("Cannot read header of %s", path);
+        return lua_return_avro_error(L);
+    }
+
+    scanner->next_offset = scanner->header.size;
+    scanner->exhausted = (scanner->next_offset >= scanner->file_size);
 
+    scanner->threads = malloc(threads * sizeof(pthread_t));
+    if (scanner->threads == NULL) {
+        return luaL_error(L, "Out of memory");
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_lock(&scanner->lock);
+        scanner->running++;
+        pthread_mutex_unlock(&scanner->lock);
+        if (pthread_create(&scanner->threads[i], NULL,
+                           scanner_worker, scanner) != 0) {
+            pthread_mutex_lock(&scanner->lock);
+            scanner->running--;
+            pthread_mutex_unlock(&scanner->lock);
+            break;
+        }
+        scanner->thread_count++;
+    }
+    if (scanner->thread_count == 0) {
+        return luaL_error(L, "Cannot start scan threads");
+    }
 
-avro_schema_t
-lua_avro_get_schema(lua_State *L, int index)
-{
-    lua_pushliteral(L, "raw_schema");
-    lua_gettable(L, index);
-    lua_pushvalue(L, index);
-    lua_call(L, 1, 1);
-    LuaAvroSchema  *l_schema = luaL_checkudata(L, -1, MT_AVRO_SCHEMA);
-    lua_pop(L, 1);
-    return l_schema->schema;
+    return 1;
 }
 
-avro_schema_t
-lua_avro_get_raw_schema(lua_State *L, int index)
-{
-    LuaAvroSchema  *l_schema = luaL_checkudata(L, index, MT_AVRO_SCHEMA);
-    return l_schema->schema;
-}
 
+/**
+ * Stops a scan, waiting for the worker threads to finish, and frees any
+ * batches that haven't been returned yet.
+ */
 
 static int
-l_new_raw_schema(lua_State *L)
+l_scanner_close(lua_State *L)
 {
-    avro_schema_t  schema = lua_touserdata(L, 1);
-    if (schema == NULL) {
-        lua_pushliteral(L, "Cannot create NULL schema wrapper");
-        return lua_error(L);
+    LuaAvroScanner  *scanner = luaL_checkudata(L, 1, MT_AVRO_SCANNER);
+    int  i;
+
+    if (scanner->closed) {
+        return 0;
     }
-    lua_avro_push_schema(L, schema);
-    lua_pushlightuserdata(L, schema);
-    return 2;
+    scanner->closed = true;
+
+    pthread_mutex_lock(&scanner->lock);
+    scanner->stopping = true;
+    pthread_cond_broadcast(&scanner->changed);
+    pthread_mutex_unlock(&scanner->lock);
+    for (i = 0; i < scanner->thread_count; i++) {
+        pthread_join(scanner->threads[i], NULL);
+    }
+    free(scanner->threads);
+    scanner->threads = NULL;
+
+    while (scanner->finished != NULL) {
+        ScanChunk  *chunk = scanner->finished;
+        scanner->finished = chunk->next;
+        scan_chunk_free(chunk);
+    }
+
+    if (scanner->fd >= 0) {
+        close(scanner->fd);
+        scanner->fd = -1;
+    }
+    free(scanner->header_data);
+    scanner->header_data = NULL;
+    free(scanner->filter);
+    scanner->filter = NULL;
+    if (scanner->iface != NULL) {
+        avro_value_iface_decref(scanner->iface);
+        scanner->iface = NULL;
+    }
+    if (scanner->rschema != NULL) {
+        avro_schema_decref(scanner->rschema);
+        scanner->rschema = NULL;
+    }
+    if (scanner->wschema != NULL) {
+        avro_schema_decref(scanner->wschema);
+        scanner->wschema = NULL;
+    }
+    pthread_cond_destroy(&scanner->changed);
+    pthread_mutex_destroy(&scanner->lock);
+    return 0;
 }
 
 
 /**
- * Creates a new AvroValue for the given schema.
+ * Returns the next batch of results from a scan, as an array-like
+ * table.  The values in the table are owned by the caller, and must be
+ * released like any other value.  Returns nil once we've reached the
+ * end of the file.  If a chunk can't be decoded, we return nil and an
+ * error message, and stop the scan.
  */
 
 static int
-l_schema_new_raw_value(lua_State *L)
+l_scanner_next_batch(lua_State *L)
 {
-    LuaAvroSchema  *l_schema = luaL_checkudata(L, 1, MT_AVRO_SCHEMA);
-    if (l_schema->iface == NULL) {
-        l_schema->iface = avro_generic_class_from_schema(l_schema->schema);
-        if (l_schema->iface == NULL) {
-            lua_pushstring(L, avro_strerror());
-            return lua_error(L);
+    LuaAvroScanner  *scanner = luaL_checkudata(L, 1, MT_AVRO_SCANNER);
+    ScanChunk  *chunk = NULL;
+    size_t  i;
+
+    if (scanner->closed) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    pthread_mutex_lock(&scanner->lock);
+    while (!scanner->stopping) {
+        chunk = scanner_take_chunk(scanner);
+        if (chunk != NULL || scanner->running == 0) {
+            break;
         }
+        pthread_cond_wait(&scanner->changed, &scanner->lock);
+    }
+    if (chunk != NULL && chunk->failed) {
+        scanner->stopping = true;
+        pthread_cond_broadcast(&scanner->changed);
     }
+    pthread_mutex_unlock(&scanner->lock);
 
-    if (lua_gettop(L) >= 2) {
-        LuaAvroValue  *l_value = luaL_checkudata(L, 2, MT_AVRO_VALUE);
-        if (l_value->should_decref && l_value->value.self != NULL) {
-            avro_value_decref(&l_value->value);
+    if (chunk == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (chunk->failed) {
+        lua_pushnil(L);
+        lua_pushstring(L, chunk->error);
+        scan_chunk_free(chunk);
+        return 2;
+    }
+
+    lua_createtable(L, chunk->result_count, 0);
+    for (i = 0; i < chunk->result_count; i++) {
+        ScanResult  *result = &chunk->results[i];
+        switch (result->type) {
+            case LUA_TUSERDATA:
+                lua_avro_push_value(L, &result->value, true);
+                break;
+
+            case LUA_TNUMBER:
+                lua_pushnumber(L, result->number);
+                break;
+
+            case LUA_TSTRING:
+                lua_pushlstring(L, result->str, result->len);
+                free(result->str);
+                break;
         }
-        check(avro_generic_value_new(l_schema->iface, &l_value->value));
-        l_value->should_decref = true;
-        lua_pushvalue(L, 2);
-    } else {
-        avro_value_t  value;
-        check(avro_generic_value_new(l_schema->iface, &value));
-        lua_avro_push_value(L, &value, true);
+        lua_rawseti(L, -2, i+1);
     }
+
+    /* The caller owns the values now. */
+    chunk->result_count = 0;
+    scan_chunk_free(chunk);
     return 1;
 }
 
 
-/**
- * Returns the type of an AvroSchema instance.
- */
-
 static int
-l_schema_type(lua_State *L)
+scanner_iterate_batch(lua_State *L)
 {
-    avro_schema_t  schema = lua_avro_get_raw_schema(L, 1);
-    lua_pushnumber(L, avro_typeof(schema));
+    int  nresults = l_scanner_next_batch(L);
+    if (nresults == 2) {
+        return lua_error(L);
+    }
     return 1;
 }
 
-
 /**
- * Returns the name of an AvroSchema instance.
+ * Returns an iterator over the batches of a scan, which raises an error
+ * if a chunk can't be decoded.
+ *
+ *   for batch in scanner:batches() do ... end
  */
 
 static int
-l_schema_name(lua_State *L)
+l_scanner_batches(lua_State *L)
 {
-    avro_schema_t  schema = lua_avro_get_raw_schema(L, 1);
-    lua_pushstring(L, avro_schema_type_name(schema));
-    return 1;
+    luaL_checkudata(L, 1, MT_AVRO_SCANNER);
+    lua_pushcfunction(L, scanner_iterate_batch);
+    lua_pushvalue(L, 1);
+    return 2;
 }
 
 
+/*-----------------------------------------------------------------------
+ * Lua access — Arrow C Data Interface
+ */
+
 /**
- * Finalizes an AvroSchema instance.
+ * Record batches can be exported to, and imported from, the Arrow C
+ * Data Interface, which lets us hand decoded data to Arrow-based
+ * engines without encoding it again.  The interface is a plain C ABI,
+ * so we define its two structs ourselves rather than depending on an
+ * Arrow library.  A batch is a struct array with a child for each
+ * field of the record schema.  Each field must be a primitive, an enum
+ * (which we export as a dictionary-encoded int32 column), or a union
+ * of null and one of those.  Structs are passed in from Lua as light
+ * userdata.
+ */
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char  *format;
+    const char  *name;
+    const char  *metadata;
+    int64_t  flags;
+    int64_t  n_children;
+    struct ArrowSchema  **children;
+    struct ArrowSchema  *dictionary;
+    void (*release)(struct ArrowSchema *);
+    void  *private_data;
+};
+
+struct ArrowArray {
+    int64_t  length;
+    int64_t  null_count;
+    int64_t  offset;
+    int64_t  n_buffers;
+    int64_t  n_children;
+    const void  **buffers;
+    struct ArrowArray  **children;
+    struct ArrowArray  *dictionary;
+    void (*release)(struct ArrowArray *);
+    void  *private_data;
+};
+
+#endif
+
+/**
+ * A growable, zero-filled buffer.  Once a buffer is exported, its
+ * contents are owned by the ArrowArray that it belongs to.
  */
 
+typedef struct _ArrowBuffer
+{
+    char  *buf;
+    size_t  size;
+    size_t  capacity;
+} ArrowBuffer;
+
 static int
-l_schema_gc(lua_State *L)
+arrow_buffer_reserve(ArrowBuffer *buffer, size_t size)
 {
-    LuaAvroSchema  *l_schema = luaL_checkudata(L, 1, MT_AVRO_SCHEMA);
-    if (l_schema->schema != NULL) {
-        avro_schema_decref(l_schema->schema);
-        l_schema->schema = NULL;
+    if (size > buffer->capacity) {
+        size_t  capacity = buffer->capacity == 0? 64: buffer->capacity;
+        while (capacity < size) {
+            capacity *= 2;
+        }
+        char  *buf = realloc(buffer->buf, capacity);
+        if (buf == NULL) {
+            avro_set_error("Out of memory");
+            return ENOMEM;
+        }
+        memset(buf + buffer->capacity, 0, capacity - buffer->capacity);
+        buffer->buf = buf;
+        buffer->capacity = capacity;
     }
-    if (l_schema->iface != NULL) {
-        avro_value_iface_decref(l_schema->iface);
-        l_schema->iface = NULL;
+    return 0;
+}
+
+static int
+arrow_buffer_append(ArrowBuffer *buffer, const void *src, size_t size)
+{
+    int  rc = arrow_buffer_reserve(buffer, buffer->size + size);
+    if (rc != 0) {
+        return rc;
+    }
+    memcpy(buffer->buf + buffer->size, src, size);
+    buffer->size += size;
+    return 0;
+}
+
+static int
+arrow_buffer_set_bit(ArrowBuffer *buffer, int64_t i, bool set)
+{
+    int  rc = arrow_buffer_reserve(buffer, i/8 + 1);
+    if (rc != 0) {
+        return rc;
     }
+    if (set) {
+        buffer->buf[i/8] |= (1 << (i%8));
+    }
+    buffer->size = i/8 + 1;
     return 0;
 }
 
+static bool
+arrow_bit_is_set(const void *bitmap, int64_t i)
+{
+    return (((const uint8_t *) bitmap)[i/8] & (1 << (i%8))) != 0;
+}
 
 /**
- * Creates a new AvroSchema instance from a JSON schema string.
+ * The columns of a batch that we're exporting.  schema is the column's
+ * schema, with any null branch removed; null_branch is the union
+ * branch for nulls, or -1 if the column isn't nullable.  values holds
+ * fixed-width entries, or the offsets of strings and bytes, whose
+ * contents are in data.
  */
 
-static int
-l_schema_new(lua_State *L)
+typedef struct _ArrowColumn
 {
-    if (lua_isstring(L, 1)) {
-        size_t  json_len;
-        const char  *json_str = lua_tolstring(L, 1, &json_len);
-        avro_schema_t  schema;
+    const char  *name;
+    avro_schema_t  schema;
+    int  null_branch;
+    int64_t  null_count;
+    ArrowBuffer  validity;
+    ArrowBuffer  values;
+    ArrowBuffer  data;
+} ArrowColumn;
+
+static const char *
+arrow_format(avro_type_t type)
+{
+    switch (type) {
+      case AVRO_BOOLEAN: return "b";
+      case AVRO_INT32:   return "i";
+      case AVRO_INT64:   return "l";
+      case AVRO_FLOAT:   return "f";
+      case AVRO_DOUBLE:  return "g";
+      case AVRO_ENUM:    return "i";
+      case AVRO_STRING:  return "u";
+      case AVRO_BYTES:   return "z";
+      default:           return NULL;
+    }
+}
 
-        /* First check for the primitive types */
-        if (strcmp(json_str, "boolean") == 0) {
-            schema = avro_schema_boolean();
-        }
+static size_t
+arrow_width(avro_type_t type)
+{
+    switch (type) {
+      case AVRO_INT64:   return sizeof(int64_t);
+      case AVRO_DOUBLE:  return sizeof(double);
+      case AVRO_FLOAT:   return sizeof(float);
+      default:           return sizeof(int32_t);
+    }
+}
 
-        else if (strcmp(json_str, "bytes") == 0) {
-            schema = avro_schema_bytes();
-        }
+static void
+arrow_columns_free(ArrowColumn *columns, size_t column_count)
+{
+    size_t  c;
+    for (c = 0; c < column_count; c++) {
+        free(columns[c].validity.buf);
+        free(columns[c].values.buf);
+        free(columns[c].data.buf);
+    }
+    free(columns);
+}
 
-        else if (strcmp(json_str, "double") == 0) {
-            schema = avro_schema_double();
-        }
+/**
+ * Creates the columns for a record schema.  Raises a Lua error if any
+ * of the record's fields can't be exported.
+ */
 
-        else if (strcmp(json_str, "float") == 0) {
-            schema = avro_schema_float();
-        }
+static ArrowColumn *
+arrow_columns_new(lua_State *L, avro_schema_t record_schema,
+                  size_t *column_count)
+{
+    ArrowColumn  *columns;
+    size_t  c;
 
-        else if (strcmp(json_str, "int") == 0) {
-            schema = avro_schema_int();
-        }
+    if (!is_avro_record(record_schema)) {
+        luaL_error(L, "Can only export records to Arrow");
+        return NULL;
+    }
 
-        else if (strcmp(json_str, "long") == 0) {
-            schema = avro_schema_long();
+    *column_count = avro_schema_record_size(record_schema);
+    columns = calloc(*column_count + 1, sizeof(ArrowColumn));
+    if (columns == NULL) {
+        luaL_error(L, "Out of memory");
+        return NULL;
+    }
+
+    for (c = 0; c < *column_count; c++) {
+        ArrowColumn  *column = &columns[c];
+        avro_schema_t  schema =
+            avro_schema_record_field_get_by_index(record_schema, c);
+        column->name = avro_schema_record_field_name(record_schema, c);
+        column->null_branch = -1;
+
+        if (is_avro_union(schema) && avro_schema_union_size(schema) == 2) {
+            avro_schema_t  first = avro_schema_union_branch(schema, 0);
+            avro_schema_t  second = avro_schema_union_branch(schema, 1);
+            if (is_avro_null(first)) {
+                column->null_branch = 0;
+                schema = second;
+            } else if (is_avro_null(second)) {
+                column->null_branch = 1;
+                schema = first;
+            }
         }
 
-        else if (strcmp(json_str, "null") == 0) {
-            schema = avro_schema_null();
+        column->schema = schema;
+        if (arrow_format(avro_typeof(schema)) == NULL) {
+            const char  *name = column->name;
+            arrow_columns_free(columns, c+1);
+            luaL_error(L, "Field %s can't be exported to Arrow", name);
+            return NULL;
         }
 
-        else if (strcmp(json_str, "string") == 0) {
-            schema = avro_schema_string();
+        /* Offset buffers start with a 0, and we make sure that every
+         * values buffer is allocated, even if the batch is empty. */
+        if (is_avro_string(schema) || is_avro_bytes(schema)) {
+            int32_t  zero = 0;
+            if (arrow_buffer_append(&column->values, &zero, sizeof(zero))) {
+                arrow_columns_free(columns, c+1);
+                luaL_error(L, "Out of memory");
+                return NULL;
+            }
+        } else if (arrow_buffer_reserve(&column->values, 8)) {
+            arrow_columns_free(columns, c+1);
+            luaL_error(L, "Out of memory");
+            return NULL;
         }
+    }
 
-        /* Otherwise assume it's JSON */
+    return columns;
+}
 
-        else {
-            avro_schema_error_t  schema_error;
-            check(avro_schema_from_json(json_str, json_len, &schema, &schema_error));
+static int
+arrow_append_value(ArrowColumn *column, avro_value_t *value, int64_t i)
+{
+    avro_type_t  type = avro_typeof(column->schema);
+    int  rc = 0;
+
+    if (value == NULL) {
+        /* Null entries still take up a slot. */
+        if (type == AVRO_BOOLEAN) {
+            return arrow_buffer_set_bit(&column->values, i, false);
+        } else if (type == AVRO_STRING || type == AVRO_BYTES) {
+            int32_t  offset = column->data.size;
+            return arrow_buffer_append(&column->values, &offset, sizeof(offset));
+        } else {
+            int64_t  zero = 0;
+            return arrow_buffer_append(&column->values, &zero,
+                                       arrow_width(type));
         }
-
-        lua_avro_push_schema(L, schema);
-        avro_schema_decref(schema);
-        lua_pushlightuserdata(L, schema);
-        return 2;
     }
 
-    if (lua_isuserdata(L, 1)) {
-        if (lua_getmetatable(L, 1)) {
-            lua_getfield(L, LUA_REGISTRYINDEX, MT_AVRO_SCHEMA);
-            if (lua_rawequal(L, -1, -2)) {
-                /* This is already a schema object, so just return it. */
-                lua_pop(L, 2);  /* remove both metatables */
-                LuaAvroSchema  *l_schema = lua_touserdata(L, 1);
-                lua_pushlightuserdata(L, l_schema->schema);
-                return 2;
+    switch (type) {
+      case AVRO_STRING:
+      case AVRO_BYTES:
+        {
+            const void  *buf = NULL;
+            size_t  size = 0;
+            if (type == AVRO_STRING) {
+                const char  *str = NULL;
+                rc = avro_value_get_string(value, &str, &size);
+                /* size contains the NUL terminator */
+                buf = str;
+                size--;
+            } else {
+                rc = avro_value_get_bytes(value, &buf, &size);
+            }
+            if (rc != 0) {
+                return rc;
             }
+            /* The "u" and "z" formats use 32-bit offsets. */
+            if (size > INT32_MAX - column->data.size) {
+                avro_set_error("Field %s is too large to export to Arrow",
+                               column->name);
+                return EINVAL;
+            }
+            rc = arrow_buffer_append(&column->data, buf, size);
+            if (rc != 0) {
+                return rc;
+            }
+            int32_t  offset = column->data.size;
+            return arrow_buffer_append(&column->values, &offset, sizeof(offset));
         }
-    }
 
-    lua_pushliteral(L, "Invalid input to Schema function");
-    return lua_error(L);
-}
+      case AVRO_BOOLEAN:
+        {
+            int  val = 0;
+            rc = avro_value_get_boolean(value, &val);
+            if (rc != 0) {
+                return rc;
+            }
+            return arrow_buffer_set_bit(&column->values, i, val);
+        }
 
+      case AVRO_INT32:
+        {
+            int32_t  val = 0;
+            rc = avro_value_get_int(value, &val);
+            if (rc != 0) {
+                return rc;
+            }
+            return arrow_buffer_append(&column->values, &val, sizeof(val));
+        }
 
-/*-----------------------------------------------------------------------
- * Lua access — resolved readers
- */
+      case AVRO_ENUM:
+        {
+            int  val = 0;
+            rc = avro_value_get_enum(value, &val);
+            if (rc != 0) {
+                return rc;
+            }
+            int32_t  index = val;
+            return arrow_buffer_append(&column->values, &index, sizeof(index));
+        }
 
-/**
- * The string used to identify the AvroResolvedReader class's metatable
- * in the Lua registry.
- */
+      case AVRO_INT64:
+        {
+            int64_t  val = 0;
+            rc = avro_value_get_long(value, &val);
+            if (rc != 0) {
+                return rc;
+            }
+            return arrow_buffer_append(&column->values, &val, sizeof(val));
+        }
 
-#define MT_AVRO_RESOLVED_READER "avro:AvroResolvedReader"
+      case AVRO_FLOAT:
+        {
+            float  val = 0;
+            rc = avro_value_get_float(value, &val);
+            if (rc != 0) {
+                return rc;
+            }
+            return arrow_buffer_append(&column->values, &val, sizeof(val));
+        }
 
-typedef struct _LuaAvroResolvedReader
-{
-    avro_value_iface_t  *resolver;
-} LuaAvroResolvedReader;
+      default:
+        {
+            double  val = 0;
+            rc = avro_value_get_double(value, &val);
+            if (rc != 0) {
+                return rc;
+            }
+            return arrow_buffer_append(&column->values, &val, sizeof(val));
+        }
+    }
+}
 
+/**
+ * Adds each field of record to the ith entry of its column.
+ */
 
-int
-lua_avro_push_resolved_reader(lua_State *L, avro_value_iface_t *resolver)
+static int
+arrow_append_row(ArrowColumn *columns, size_t column_count,
+                 avro_value_t *record, int64_t i)
 {
-    LuaAvroResolvedReader  *l_resolver;
+    size_t  c;
+    for (c = 0; c < column_count; c++) {
+        ArrowColumn  *column = &columns[c];
+        avro_value_t  field;
+        avro_value_t  branch;
+        avro_value_t  *value = &field;
+        int  rc;
+
+        rc = avro_value_get_by_index(record, c, &field, NULL);
+        if (rc != 0) {
+            return rc;
+        }
 
-    l_resolver = lua_newuserdata(L, sizeof(LuaAvroResolvedReader));
-    l_resolver->resolver = resolver;
-    luaL_getmetatable(L, MT_AVRO_RESOLVED_READER);
-    lua_setmetatable(L, -2);
-    return 1;
-}
+        if (column->null_branch >= 0) {
+            int  discriminant;
+            rc = avro_value_get_discriminant(&field, &discriminant);
+            if (rc != 0) {
+                return rc;
+            }
+            if (discriminant == column->null_branch) {
+                value = NULL;
+                column->null_count++;
+            } else {
+                rc = avro_value_get_current_branch(&field, &branch);
+                if (rc != 0) {
+                    return rc;
+                }
+                value = &branch;
+            }
+            rc = arrow_buffer_set_bit(&column->validity, i, value != NULL);
+            if (rc != 0) {
+                return rc;
+            }
+        }
 
+        rc = arrow_append_value(column, value, i);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
 
-avro_value_iface_t *
-lua_avro_get_resolved_reader(lua_State *L, int index)
+static void
+arrow_release_schema(struct ArrowSchema *schema)
 {
-    LuaAvroResolvedReader  *l_resolver =
-        luaL_checkudata(L, index, MT_AVRO_RESOLVED_READER);
-    return l_resolver->resolver;
+    int64_t  i;
+    for (i = 0; i < schema->n_children; i++) {
+        struct ArrowSchema  *child = schema->children[i];
+        if (child->release != NULL) {
+            child->release(child);
+        }
+        free(child);
+    }
+    free(schema->children);
+    if (schema->dictionary != NULL) {
+        if (schema->dictionary->release != NULL) {
+            schema->dictionary->release(schema->dictionary);
+        }
+        free(schema->dictionary);
+    }
+    free((char *) schema->name);
+    schema->release = NULL;
 }
 
+static void
+arrow_release_array(struct ArrowArray *array)
+{
+    int64_t  i;
+    for (i = 0; i < array->n_children; i++) {
+        struct ArrowArray  *child = array->children[i];
+        if (child->release != NULL) {
+            child->release(child);
+        }
+        free(child);
+    }
+    free(array->children);
+    if (array->dictionary != NULL) {
+        if (array->dictionary->release != NULL) {
+            array->dictionary->release(array->dictionary);
+        }
+        free(array->dictionary);
+    }
+    for (i = 0; i < array->n_buffers; i++) {
+        free((void *) array->buffers[i]);
+    }
+    free(array->buffers);
+    array->release = NULL;
+}
 
-/**
- * Creates a new AvroResolvedReader for the given schemas.
- */
+/* Fills in a schema or array whose children (if any) are allocated but
+ * not yet filled in.  Returns ENOMEM if we can't allocate them. */
 
 static int
-l_resolved_reader_new(lua_State *L)
+arrow_init_schema(struct ArrowSchema *schema, const char *format,
+                  const char *name, int64_t flags, int64_t n_children)
 {
-    avro_schema_t  writer_schema = lua_avro_get_schema(L, 1);
-    avro_schema_t  reader_schema = lua_avro_get_schema(L, 2);
-    avro_value_iface_t  *resolver =
-        avro_resolved_reader_new(writer_schema, reader_schema);
-    if (resolver == NULL) {
-        return lua_return_avro_error(L);
-    } else {
-        lua_avro_push_resolved_reader(L, resolver);
-        return 1;
+    memset(schema, 0, sizeof(struct ArrowSchema));
+    schema->format = format;
+    schema->flags = flags;
+    schema->release = arrow_release_schema;
+    if (name != NULL && (schema->name = strdup(name)) == NULL) {
+        return ENOMEM;
+    }
+    if (n_children > 0) {
+        int64_t  i;
+        schema->children = calloc(n_children, sizeof(struct ArrowSchema *));
+        if (schema->children == NULL) {
+            return ENOMEM;
+        }
+        for (i = 0; i < n_children; i++) {
+            schema->children[i] = calloc(1, sizeof(struct ArrowSchema));
+            if (schema->children[i] == NULL) {
+                return ENOMEM;
+            }
+            schema->n_children++;
+        }
     }
+    return 0;
 }
 
-
-/**
- * Finalizes an AvroResolvedReader instance.
- */
-
 static int
-l_resolved_reader_gc(lua_State *L)
+arrow_init_array(struct ArrowArray *array, int64_t length,
+                 int64_t n_buffers, int64_t n_children)
 {
-    LuaAvroResolvedReader  *l_resolver =
-        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_READER);
-    if (l_resolver->resolver != NULL) {
-        avro_value_iface_decref(l_resolver->resolver);
-        l_resolver->resolver = NULL;
+    memset(array, 0, sizeof(struct ArrowArray));
+    array->length = length;
+    array->release = arrow_release_array;
+    array->buffers = calloc(n_buffers, sizeof(void *));
+    if (array->buffers == NULL) {
+        return ENOMEM;
+    }
+    array->n_buffers = n_buffers;
+    if (n_children > 0) {
+        int64_t  i;
+        array->children = calloc(n_children, sizeof(struct ArrowArray *));
+        if (array->children == NULL) {
+            return ENOMEM;
+        }
+        for (i = 0; i < n_children; i++) {
+            array->children[i] = calloc(1, sizeof(struct ArrowArray));
+            if (array->children[i] == NULL) {
+                return ENOMEM;
+            }
+            array->n_children++;
+        }
     }
     return 0;
 }
 
-
 /**
- * Creates a new AvroValue for the given resolved reader.
+ * Exports the dictionary of an enum column, which is a string array
+ * containing each of the enum's symbols.
  */
 
 static int
-l_resolved_reader_new_raw_value(lua_State *L)
+arrow_export_dictionary(avro_schema_t enum_schema,
+                        struct ArrowSchema *schema, struct ArrowArray *array)
 {
-    avro_value_iface_t  *resolver = lua_avro_get_resolved_reader(L, 1);
-    avro_value_t  value;
-    check(avro_resolved_reader_new_value(resolver, &value));
-    lua_avro_push_value(L, &value, true);
-    return 1;
-}
+    int  symbol_count = avro_schema_enum_number_of_symbols(enum_schema);
+    ArrowBuffer  offsets = { NULL, 0, 0 };
+    ArrowBuffer  data = { NULL, 0, 0 };
+    int32_t  offset = 0;
+    int  i;
+    int  rc;
+
+    rc = arrow_init_schema(schema, "u", NULL, 0, 0);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = arrow_init_array(array, symbol_count, 3, 0);
+    if (rc != 0) {
+        return rc;
+    }
 
+    rc = arrow_buffer_append(&offsets, &offset, sizeof(offset));
+    if (rc == 0) {
+        rc = arrow_buffer_reserve(&data, 8);
+    }
+    for (i = 0; rc == 0 && i < symbol_count; i++) {
+        const char  *symbol = avro_schema_enum_get(enum_schema, i);
+        rc = arrow_buffer_append(&data, symbol, strlen(symbol));
+        if (rc == 0) {
+            offset = data.size;
+            rc = arrow_buffer_append(&offsets, &offset, sizeof(offset));
+        }
+    }
 
-/*-----------------------------------------------------------------------
- * Lua access — resolved writers
- */
+    array->buffers[1] = offsets.buf;
+    array->buffers[2] = data.buf;
+    return rc;
+}
 
 /**
- * The string used to identify the AvroResolvedWriter class's metatable
- * in the Lua registry.
+ * Moves the contents of a batch's columns into an exported schema and
+ * array.  The columns' buffers are owned by the array afterwards, even
+ * if we return an error, in which case the caller must still release
+ * the schema and array.
  */
 
-#define MT_AVRO_RESOLVED_WRITER "avro:AvroResolvedWriter"
-
-typedef struct _LuaAvroResolvedWriter
+static int
+arrow_export(ArrowColumn *columns, size_t column_count, int64_t length,
+             struct ArrowSchema *schema, struct ArrowArray *array)
 {
-    avro_value_iface_t  *resolver;
-    avro_value_t  value;
-} LuaAvroResolvedWriter;
+    size_t  c;
+    int  rc = 0;
+    int  schema_rc = arrow_init_schema(schema, "+s", NULL, 0, column_count);
+    int  array_rc = arrow_init_array(array, length, 1, column_count);
+
+    for (c = 0; c < column_count; c++) {
+        ArrowColumn  *column = &columns[c];
+        avro_type_t  type = avro_typeof(column->schema);
+        bool  varlen = (type == AVRO_STRING || type == AVRO_BYTES);
+
+        if (rc == 0 && array_rc == 0) {
+            struct ArrowArray  *child = array->children[c];
+            rc = arrow_init_array(child, length, varlen? 3: 2, 0);
+            if (child->buffers != NULL) {
+                child->null_count = column->null_count;
+                child->buffers[0] = column->validity.buf;
+                child->buffers[1] = column->values.buf;
+                if (varlen) {
+                    child->buffers[2] = column->data.buf;
+                } else {
+                    free(column->data.buf);
+                }
+                column->validity.buf = NULL;
+                column->values.buf = NULL;
+                column->data.buf = NULL;
+            }
+        }
 
+        if (rc == 0 && schema_rc == 0) {
+            rc = arrow_init_schema
+                (schema->children[c], arrow_format(type), column->name,
+                 column->null_branch >= 0? ARROW_FLAG_NULLABLE: 0, 0);
+        }
 
-int
-lua_avro_push_resolved_writer(lua_State *L, avro_value_iface_t *resolver)
-{
-    LuaAvroResolvedWriter  *l_resolver;
+        if (rc == 0 && type == AVRO_ENUM &&
+            schema_rc == 0 && array_rc == 0) {
+            schema->children[c]->dictionary =
+                calloc(1, sizeof(struct ArrowSchema));
+            array->children[c]->dictionary =
+                calloc(1, sizeof(struct ArrowArray));
+            if (schema->children[c]->dictionary == NULL ||
+                array->children[c]->dictionary == NULL) {
+                rc = ENOMEM;
+            } else {
+                rc = arrow_export_dictionary
+                    (column->schema, schema->children[c]->dictionary,
+                     array->children[c]->dictionary);
+            }
+        }
+    }
 
-    l_resolver = lua_newuserdata(L, sizeof(LuaAvroResolvedWriter));
-    l_resolver->resolver = resolver;
-    avro_resolved_writer_new_value(resolver, &l_resolver->value);
-    luaL_getmetatable(L, MT_AVRO_RESOLVED_WRITER);
-    lua_setmetatable(L, -2);
-    return 1;
+    arrow_columns_free(columns, column_count);
+    if (schema_rc != 0 || array_rc != 0 || rc != 0) {
+        avro_set_error("Out of memory");
+        return ENOMEM;
+    }
+    return 0;
 }
 
+/**
+ * Returns the functions that release the Arrow structs that we export,
+ * as light userdata.  The FFI backend installs these as the release
+ * callbacks of the structs that it exports, since Arrow consumers can
+ * call them from any thread, which a Lua callback can't handle.
+ */
 
-avro_value_iface_t *
-lua_avro_get_resolved_writer(lua_State *L, int index)
+static int
+l_arrow_release_functions(lua_State *L)
 {
-    LuaAvroResolvedWriter  *l_resolver =
-        luaL_checkudata(L, index, MT_AVRO_RESOLVED_WRITER);
-    return l_resolver->resolver;
+    lua_pushlightuserdata(L, (void *) (uintptr_t) arrow_release_schema);
+    lua_pushlightuserdata(L, (void *) (uintptr_t) arrow_release_array);
+    return 2;
 }
 
+static void *
+lua_arrow_pointer(lua_State *L, int index, const char *what)
+{
+    void  *ptr;
+    luaL_checktype(L, index, LUA_TLIGHTUSERDATA);
+    ptr = lua_touserdata(L, index);
+    if (ptr == NULL) {
+        luaL_error(L, "%s must not be NULL", what);
+    }
+    return ptr;
+}
 
 /**
- * Creates a new AvroResolvedWriter for the given schemas.
+ * Allocates an empty ArrowSchema and ArrowArray, and returns them as
+ * light userdata, for callers that can't allocate them themselves.
+ * They must be freed with free_arrow_structs.
  */
 
 static int
-l_resolved_writer_new(lua_State *L)
+l_new_arrow_structs(lua_State *L)
 {
-    avro_schema_t  writer_schema = lua_avro_get_schema(L, 1);
-    avro_schema_t  reader_schema = lua_avro_get_schema(L, 2);
-    avro_value_iface_t  *resolver =
-        avro_resolved_writer_new(writer_schema, reader_schema);
-    if (resolver == NULL) {
-        return lua_return_avro_error(L);
-    } else {
-        lua_avro_push_resolved_writer(L, resolver);
-        return 1;
+    struct ArrowSchema  *schema = calloc(1, sizeof(struct ArrowSchema));
+    struct ArrowArray  *array = calloc(1, sizeof(struct ArrowArray));
+    if (schema == NULL || array == NULL) {
+        free(schema);
+        free(array);
+        return luaL_error(L, "Out of memory");
     }
+    lua_pushlightuserdata(L, schema);
+    lua_pushlightuserdata(L, array);
+    return 2;
 }
 
-
 /**
- * Finalizes an AvroResolvedWriter instance.
+ * Frees the structs from new_arrow_structs, releasing them first if
+ * they still hold a batch.  Returns whether either of them did.
  */
 
 static int
-l_resolved_writer_gc(lua_State *L)
+l_free_arrow_structs(lua_State *L)
 {
-    LuaAvroResolvedWriter  *l_resolver =
-        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
-    if (l_resolver->value.self != NULL) {
-        avro_value_decref(&l_resolver->value);
-        l_resolver->value.iface = NULL;
-        l_resolver->value.self = NULL;
+    struct ArrowSchema  *schema = lua_arrow_pointer(L, 1, "ArrowSchema");
+    struct ArrowArray  *array = lua_arrow_pointer(L, 2, "ArrowArray");
+    bool  released = false;
+    if (schema->release != NULL) {
+        schema->release(schema);
+        released = true;
     }
-    if (l_resolver->resolver != NULL) {
-        avro_value_iface_decref(l_resolver->resolver);
-        l_resolver->resolver = NULL;
+    if (array->release != NULL) {
+        array->release(array);
+        released = true;
     }
-    return 0;
+    free(schema);
+    free(array);
+    lua_pushboolean(L, released);
+    return 1;
 }
 
-
 /**
- * Creates a new AvroValue for the given resolved writer.
+ * Exports the columns of a batch to the given ArrowSchema and
+ * ArrowArray.  On error, any partially exported structs are released,
+ * and we return a Lua error.
  */
 
 static int
-l_resolved_writer_new_raw_value(lua_State *L)
+lua_arrow_export(lua_State *L, ArrowColumn *columns, size_t column_count,
+                 int64_t length, int schema_index, int array_index)
 {
-    avro_value_iface_t  *resolver = lua_avro_get_resolved_writer(L, 1);
-    avro_value_t  value;
-    check(avro_resolved_writer_new_value(resolver, &value));
-    lua_avro_push_value(L, &value, true);
-    return 1;
+    struct ArrowSchema  *schema =
+        lua_touserdata(L, schema_index);
+    struct ArrowArray  *array =
+        lua_touserdata(L, array_index);
+    if (arrow_export(columns, column_count, length, schema, array) != 0) {
+        schema->release(schema);
+        array->release(array);
+        return lua_avro_error(L);
+    }
+    return 0;
 }
 
-
 /**
- * Decode an Avro value using the given resolver.
+ * Reads up to n records from a file, and exports them to the
+ * ArrowSchema and ArrowArray structs at the given pointers.  The batch
+ * is built from the file's writer schema.  If n is nil, we read the
+ * rest of the current block of a memory-mapped file.  Returns the
+ * number of records read, or nil and an error message if there are no
+ * more records.  The caller is responsible for releasing the exported
+ * structs.
  */
 
 static int
-l_resolved_writer_decode(lua_State *L)
+l_input_file_read_arrow(lua_State *L)
 {
-    LuaAvroResolvedWriter  *l_resolver =
-        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
-    size_t  size = 0;
-    const char  *buf = luaL_checklstring(L, 2, &size);
-    avro_value_t  *value = lua_avro_get_value(L, 3);
+    LuaAvroDataInputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    lua_Integer  n;
+    lua_arrow_pointer(L, 3, "ArrowSchema");
+    lua_arrow_pointer(L, 4, "ArrowArray");
 
-    avro_reader_t  reader = avro_reader_memory(buf, size);
-    avro_resolved_writer_set_dest(&l_resolver->value, value);
-    int rc = avro_value_read(reader, &l_resolver->value);
-    avro_reader_free(reader);
+    n = lua_batch_size(L, l_file, 2);
+    if (n == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Reached end of file");
+        return 2;
+    }
 
+    size_t  column_count;
+    ArrowColumn  *columns =
+        arrow_columns_new(L, l_file->wschema, &column_count);
+
+    avro_value_iface_t  *iface = avro_generic_class_from_schema(l_file->wschema);
+    avro_value_t  record;
+    int  rc = (iface == NULL)? ENOMEM: avro_generic_value_new(iface, &record);
+    if (iface != NULL) {
+        avro_value_iface_decref(iface);
+    }
     if (rc != 0) {
+        arrow_columns_free(columns, column_count);
+        return lua_avro_error(L);
+    }
+
+    lua_Integer  count = 0;
+    while (count < n) {
+        rc = input_file_read_writer_value(l_file, &record);
+        if (rc == EOF) {
+            break;
+        }
+        if (rc == 0) {
+            rc = arrow_append_row(columns, column_count, &record, count);
+        }
+        if (rc != 0) {
+            avro_value_decref(&record);
+            arrow_columns_free(columns, column_count);
+            return lua_avro_error(L);
+        }
+        count++;
+    }
+    avro_value_decref(&record);
+
+    if (count == 0) {
+        arrow_columns_free(columns, column_count);
         return lua_return_avro_error(L);
     }
 
-    lua_pushboolean(L, true);
+    lua_arrow_export(L, columns, column_count, count, 3, 4);
+    lua_pushinteger(L, count);
     return 1;
 }
 
-
 /**
- * Decode an Avro value, using the binary encoding, from the given
- * memory region, which is provided as a light user data and a size.
- * There's no safety checking here; to make it easier to not include
- * this function in sandboxes, it's exposed as a global function in the
- * "avro" package, and not as a method of the AvroValue class.
+ * Exports an array-like table of record values, which must all be
+ * instances of the same schema, to the ArrowSchema and ArrowArray
+ * structs at the given pointers.  The caller is responsible for
+ * releasing the exported structs.
  */
 
 static int
-l_value_decode_raw(lua_State *L)
+l_export_arrow(lua_State *L)
 {
-    LuaAvroResolvedWriter  *l_resolver =
-        luaL_checkudata(L, 1, MT_AVRO_RESOLVED_WRITER);
-    if (!lua_islightuserdata(L, 2)) {
-        return luaL_error(L, "Destination buffer should be a light userdata");
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_arrow_pointer(L, 2, "ArrowSchema");
+    lua_arrow_pointer(L, 3, "ArrowArray");
+    size_t  count = lua_objlen(L, 1);
+    size_t  i;
+
+    if (count == 0) {
+        return luaL_error(L, "Can't export an empty batch");
     }
-    void  *buf = lua_touserdata(L, 2);
-    size_t  size = luaL_checkinteger(L, 3);
-    avro_value_t  *value = lua_avro_get_value(L, 4);
 
-    avro_reader_t  reader = avro_reader_memory(buf, size);
-    avro_resolved_writer_set_dest(&l_resolver->value, value);
-    int rc = avro_value_read(reader, &l_resolver->value);
-    avro_reader_free(reader);
+    /* Check every element before we allocate the columns, since
+     * lua_avro_get_value raises a Lua error for anything that isn't a
+     * value. */
+    lua_rawgeti(L, 1, 1);
+    avro_value_t  *first = lua_avro_get_value(L, -1);
+    avro_schema_t  record_schema = avro_value_get_schema(first);
+    lua_pop(L, 1);
 
-    if (rc != 0) {
-        return lua_return_avro_error(L);
+    for (i = 1; i < count; i++) {
+        lua_rawgeti(L, 1, i+1);
+        avro_value_t  *value = lua_avro_get_value(L, -1);
+        if (!avro_schema_equal(avro_value_get_schema(value), record_schema)) {
+            return luaL_error(L, "Values in a batch must share a schema");
+        }
+        lua_pop(L, 1);
     }
 
-    lua_pushboolean(L, true);
-    return 1;
-}
-
-
-/*-----------------------------------------------------------------------
- * Lua access — data files
- */
-
-/**
- * The string used to identify the AvroDataInputFile class's metatable
- * in the Lua registry.
- */
-
-#define MT_AVRO_DATA_INPUT_FILE "avro:AvroDataInputFile"
-
-
-typedef struct _LuaAvroDataInputFile
-{
-    avro_file_reader_t  reader;
-    avro_schema_t  wschema;
-    avro_value_iface_t  *iface;
-} LuaAvroDataInputFile;
+    size_t  column_count;
+    ArrowColumn  *columns =
+        arrow_columns_new(L, record_schema, &column_count);
 
-int
-lua_avro_push_file_reader(lua_State *L, avro_file_reader_t reader)
-{
-    LuaAvroDataInputFile  *l_file;
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(L, 1, i+1);
+        avro_value_t  *value = lua_avro_get_value(L, -1);
+        int  rc = arrow_append_row(columns, column_count, value, i);
+        lua_pop(L, 1);
+        if (rc != 0) {
+            arrow_columns_free(columns, column_count);
+            return lua_avro_error(L);
+        }
+    }
 
-    l_file = lua_newuserdata(L, sizeof(LuaAvroDataInputFile));
-    l_file->reader = reader;
-    l_file->wschema = avro_file_reader_get_writer_schema(reader);
-    l_file->iface = avro_generic_class_from_schema(l_file->wschema);
-    luaL_getmetatable(L, MT_AVRO_DATA_INPUT_FILE);
-    lua_setmetatable(L, -2);
+    lua_arrow_export(L, columns, column_count, count, 2, 3);
+    lua_pushinteger(L, count);
     return 1;
 }
 
+/**
+ * An Arrow column that we're importing into a record field.  null_branch
+ * and value_branch are the field's union branches for null and non-null
+ * entries, or -1 if the field isn't a union.  symbols maps the indexes
+ * of a dictionary-encoded column to the symbols of an enum field.
+ */
 
-avro_file_reader_t
-lua_avro_get_file_reader(lua_State *L, int index)
+typedef struct _ArrowImport
 {
-    LuaAvroDataInputFile  *l_file =
-        luaL_checkudata(L, index, MT_AVRO_DATA_INPUT_FILE);
-    return l_file->reader;
+    struct ArrowArray  *array;
+    const char  *format;
+    int64_t  offset;
+    avro_type_t  type;
+    int  null_branch;
+    int  value_branch;
+    int  *symbols;
+} ArrowImport;
+
+static bool
+arrow_format_matches(const char *format, avro_type_t type)
+{
+    const char  *expected = arrow_format(type);
+    return expected != NULL && strcmp(format, expected) == 0;
 }
 
-
 /**
- * Closes a file reader.
+ * Maps the entries of a string dictionary to the symbols of an enum
+ * schema.  Returns NULL if any entry isn't one of the enum's symbols.
  */
 
+static int *
+arrow_import_symbols(struct ArrowSchema *schema, struct ArrowArray *array,
+                     avro_schema_t enum_schema)
+{
+    const int32_t  *offsets;
+    const char  *data;
+    int  *symbols;
+    int64_t  i;
+
+    if (strcmp(schema->format, "u") != 0) {
+        avro_set_error("Enum dictionaries must contain strings");
+        return NULL;
+    }
+
+    offsets = (const int32_t *) array->buffers[1] + array->offset;
+    data = array->buffers[2];
+    symbols = calloc(array->length + 1, sizeof(int));
+    if (symbols == NULL) {
+        avro_set_error("Out of memory");
+        return NULL;
+    }
+
+    for (i = 0; i < array->length; i++) {
+        size_t  size = offsets[i+1] - offsets[i];
+        char  *symbol = malloc(size + 1);
+        if (symbol == NULL) {
+            avro_set_error("Out of memory");
+            free(symbols);
+            return NULL;
+        }
+        memcpy(symbol, data + offsets[i], size);
+        symbol[size] = '\0';
+        symbols[i] = avro_schema_enum_get_by_name(enum_schema, symbol);
+        if (symbols[i] < 0) {
+            avro_set_error("Unknown enum symbol %s", symbol);
+            free(symbol);
+            free(symbols);
+            return NULL;
+        }
+        free(symbol);
+    }
+    return symbols;
+}
+
 static int
-l_input_file_close(lua_State *L)
+arrow_import_value(ArrowImport *import, avro_value_t *field, int64_t row)
 {
-    LuaAvroDataInputFile  *l_file =
-        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
-    if (l_file->reader != NULL) {
-        avro_file_reader_close(l_file->reader);
-        l_file->reader = NULL;
+    struct ArrowArray  *array = import->array;
+    int64_t  i = import->offset + row;
+    avro_value_t  branch;
+    avro_value_t  *value = field;
+    int  rc;
+
+    if (array->buffers[0] != NULL && array->null_count != 0 &&
+        !arrow_bit_is_set(array->buffers[0], i)) {
+        if (import->null_branch < 0) {
+            avro_set_error("Null entry in a non-nullable field");
+            return EINVAL;
+        }
+        rc = avro_value_set_branch(field, import->null_branch, &branch);
+        if (rc != 0) {
+            return rc;
+        }
+        return avro_value_set_null(&branch);
     }
-    l_file->wschema = NULL;
-    if (l_file->iface != NULL) {
-        avro_value_iface_decref(l_file->iface);
-        l_file->iface = NULL;
+
+    if (import->value_branch >= 0) {
+        rc = avro_value_set_branch(field, import->value_branch, &branch);
+        if (rc != 0) {
+            return rc;
+        }
+        value = &branch;
+    }
+
+    switch (import->type) {
+      case AVRO_BOOLEAN:
+        return avro_value_set_boolean
+            (value, arrow_bit_is_set(array->buffers[1], i));
+
+      case AVRO_INT32:
+        return avro_value_set_int
+            (value, ((const int32_t *) array->buffers[1])[i]);
+
+      case AVRO_INT64:
+        return avro_value_set_long
+            (value, ((const int64_t *) array->buffers[1])[i]);
+
+      case AVRO_FLOAT:
+        return avro_value_set_float
+            (value, ((const float *) array->buffers[1])[i]);
+
+      case AVRO_DOUBLE:
+        return avro_value_set_double
+            (value, ((const double *) array->buffers[1])[i]);
+
+      case AVRO_ENUM:
+        {
+            int32_t  index = ((const int32_t *) array->buffers[1])[i];
+            if (import->symbols != NULL) {
+                if (index < 0 || index >= array->dictionary->length) {
+                    avro_set_error("Invalid dictionary index %d", index);
+                    return EINVAL;
+                }
+                index = import->symbols[index];
+            }
+            return avro_value_set_enum(value, index);
+        }
+
+      default:
+        {
+            const int32_t  *offsets = array->buffers[1];
+            const char  *data = array->buffers[2];
+            size_t  size = offsets[i+1] - offsets[i];
+            if (import->type == AVRO_STRING) {
+                /* avro_value_set_string_len wants the size to include a
+                 * NUL terminator, which Arrow strings don't have. */
+                char  *str = malloc(size + 1);
+                if (str == NULL) {
+                    avro_set_error("Out of memory");
+                    return ENOMEM;
+                }
+                memcpy(str, data + offsets[i], size);
+                str[size] = '\0';
+                rc = avro_value_set_string_len(value, str, size + 1);
+                free(str);
+                return rc;
+            }
+            return avro_value_set_bytes
+                (value, (void *) (data + offsets[i]), size);
+        }
     }
-    return 0;
 }
 
 /**
- * Returns the writer schema used to create the file.
+ * Works out how to import each field of a record from the children of
+ * an Arrow struct array.  Every field must have a column with the same
+ * name and a compatible type; extra columns are ignored.
  */
 
 static int
-l_input_file_schema_json(lua_State *L)
+arrow_import_columns(struct ArrowSchema *schema, struct ArrowArray *array,
+                     avro_schema_t record_schema, ArrowImport *imports,
+                     size_t field_count)
 {
-    static char  static_buf[65536];
-    LuaAvroDataInputFile  *l_file =
-        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    size_t  f;
+    for (f = 0; f < field_count; f++) {
+        ArrowImport  *import = &imports[f];
+        const char  *name = avro_schema_record_field_name(record_schema, f);
+        avro_schema_t  field_schema =
+            avro_schema_record_field_get_by_index(record_schema, f);
+        struct ArrowSchema  *child_schema = NULL;
+        int64_t  c;
+
+        for (c = 0; c < schema->n_children; c++) {
+            const char  *child_name = schema->children[c]->name;
+            if (child_name != NULL && strcmp(child_name, name) == 0) {
+                child_schema = schema->children[c];
+                import->array = array->children[c];
+                break;
+            }
+        }
+        if (child_schema == NULL) {
+            avro_set_error("Arrow batch has no column for field %s", name);
+            return EINVAL;
+        }
 
-    avro_writer_t  writer = avro_writer_memory(static_buf, sizeof(static_buf));
-    int  rc = avro_schema_to_json(l_file->wschema, writer);
-    int64_t  length = avro_writer_tell(writer);
-    avro_writer_free(writer);
+        import->format = child_schema->format;
+        import->offset = array->offset + import->array->offset;
+        import->null_branch = -1;
+        import->value_branch = -1;
+        if (is_avro_union(field_schema) &&
+            avro_schema_union_size(field_schema) == 2) {
+            avro_schema_t  first = avro_schema_union_branch(field_schema, 0);
+            avro_schema_t  second = avro_schema_union_branch(field_schema, 1);
+            if (is_avro_null(first)) {
+                import->null_branch = 0;
+                import->value_branch = 1;
+                field_schema = second;
+            } else if (is_avro_null(second)) {
+                import->null_branch = 1;
+                import->value_branch = 0;
+                field_schema = first;
+            }
+        }
 
-    if (rc != 0) {
-        return lua_avro_error(L);
+        import->type = avro_typeof(field_schema);
+        if (!arrow_format_matches(import->format, import->type)) {
+            avro_set_error("Arrow column %s has format %s, "
+                           "which doesn't match the field's schema",
+                           name, import->format);
+            return EINVAL;
+        }
+        if (import->type == AVRO_ENUM && child_schema->dictionary != NULL) {
+            import->symbols = arrow_import_symbols
+                (child_schema->dictionary, import->array->dictionary,
+                 field_schema);
+            if (import->symbols == NULL) {
+                return EINVAL;
+            }
+        }
     }
-
-    lua_pushlstring(L, static_buf, length);
-    return 1;
+    return 0;
 }
 
 /**
- * Reads a value from a file reader.
+ * Writes each row of an Arrow struct array to a file.  Each row is
+ * copied into value, which must be a record value of the file's
+ * schema, and then appended.  We take ownership of the ArrowSchema and
+ * ArrowArray, and release them once we're done, even if there's an
+ * error.  Returns the number of records written.
  */
 
 static int
-l_input_file_read_raw(lua_State *L)
+l_output_file_write_arrow(lua_State *L)
 {
-    int  nargs = lua_gettop(L);
-    LuaAvroDataInputFile  *l_file =
-        luaL_checkudata(L, 1, MT_AVRO_DATA_INPUT_FILE);
+    LuaAvroDataOutputFile  *l_file =
+        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
+    struct ArrowSchema  *schema = lua_arrow_pointer(L, 2, "ArrowSchema");
+    struct ArrowArray  *array = lua_arrow_pointer(L, 3, "ArrowArray");
+    avro_value_t  *value = lua_avro_get_value(L, 4);
+    avro_schema_t  record_schema = avro_value_get_schema(value);
+    ArrowImport  *imports = NULL;
+    size_t  field_count = 0;
+    int64_t  row;
+    size_t  f;
+    int  rc = 0;
+
+    if (schema->release == NULL || array->release == NULL) {
+        return luaL_error(L, "Arrow structs have already been released");
+    }
+    if (l_file->writer == NULL) {
+        avro_set_error("File is closed");
+        rc = EINVAL;
+    } else if (strcmp(schema->format, "+s") != 0) {
+        avro_set_error("Can only write Arrow struct arrays");
+        rc = EINVAL;
+    } else if (!is_avro_record(record_schema)) {
+        avro_set_error("Can only write Arrow batches into records");
+        rc = EINVAL;
+    } else {
+        field_count = avro_schema_record_size(record_schema);
+        imports = calloc(field_count + 1, sizeof(ArrowImport));
+        if (imports == NULL) {
+            avro_set_error("Out of memory");
+            rc = ENOMEM;
+        }
+    }
 
-    if (nargs == 1) {
-        /* No Value instance given, so create one. */
-        avro_value_t  value;
-        check(avro_generic_value_new(l_file->iface, &value));
-        int  rc = avro_file_reader_read_value(l_file->reader, &value);
-        if (rc != 0) {
-            return lua_return_avro_error(L);
+    if (rc == 0) {
+        rc = arrow_import_columns(schema, array, record_schema,
+                                  imports, field_count);
+    }
+
+    for (row = 0; rc == 0 && row < array->length; row++) {
+        if (array->buffers[0] != NULL && array->null_count != 0 &&
+            !arrow_bit_is_set(array->buffers[0], array->offset + row)) {
+            avro_set_error("Can't write a null record");
+            rc = EINVAL;
+            break;
+        }
+        for (f = 0; rc == 0 && f < field_count; f++) {
+            avro_value_t  field;
+            rc = avro_value_get_by_index(value, f, &field, NULL);
+            if (rc == 0) {
+                rc = arrow_import_value(&imports[f], &field, row);
+            }
+        }
+        if (rc == 0) {
+            rc = output_file_append(l_file, value);
         }
-        lua_avro_push_value(L, &value, true);
-        return 1;
     }
 
-    else {
-        /* Otherwise read into the given value. */
-        avro_value_t  *value = lua_avro_get_value(L, 2);
-        int  rc = avro_file_reader_read_value(l_file->reader, value);
-        if (rc != 0) {
-            return lua_return_avro_error(L);
+    if (imports != NULL) {
+        for (f = 0; f < field_count; f++) {
+            free(imports[f].symbols);
         }
-        lua_pushvalue(L, 2);
-        return 1;
+        free(imports);
+    }
+    schema->release(schema);
+    array->release(array);
+
+    if (rc != 0) {
+        return lua_avro_error(L);
     }
+    lua_pushinteger(L, row);
+    return 1;
 }
 
 
+/*-----------------------------------------------------------------------
+ * Lua access — fingerprints
+ */
+
 /**
- * The string used to identify the AvroDataOutputFile class's metatable
- * in the Lua registry.
+ * The fingerprints defined in the Avro specification: the 64-bit Rabin
+ * fingerprint (CRC-64-AVRO), MD5, and SHA-256.  These are usually
+ * calculated from a schema's Parsing Canonical Form.
  */
 
-#define MT_AVRO_DATA_OUTPUT_FILE "avro:AvroDataOutputFile"
+#define CRC64_AVRO_EMPTY  0xc15d213aa4d7a795ULL
 
+static uint64_t  crc64_table[256];
+static pthread_once_t  crc64_table_once = PTHREAD_ONCE_INIT;
 
-typedef struct _LuaAvroDataOutputFile
+/* Scan filters can calculate fingerprints from other threads, so we
+ * build the table with pthread_once. */
+static void
+crc64_table_init(void)
 {
-    avro_file_writer_t  writer;
-} LuaAvroDataOutputFile;
-
+    size_t  i;
+    for (i = 0; i < 256; i++) {
+        uint64_t  entry = i;
+        int  j;
+        for (j = 0; j < 8; j++) {
+            entry = (entry >> 1) ^ (CRC64_AVRO_EMPTY & -(entry & 1));
+        }
+        crc64_table[i] = entry;
+    }
+}
 
-int
-lua_avro_push_file_writer(lua_State *L, avro_file_writer_t writer)
+static void
+fingerprint_crc64(const unsigned char *buf, size_t len, unsigned char *out)
 {
-    LuaAvroDataOutputFile  *l_file;
+    uint64_t  fp = CRC64_AVRO_EMPTY;
+    size_t  i;
 
-    l_file = lua_newuserdata(L, sizeof(LuaAvroDataOutputFile));
-    l_file->writer = writer;
-    luaL_getmetatable(L, MT_AVRO_DATA_OUTPUT_FILE);
-    lua_setmetatable(L, -2);
-    return 1;
-}
+    pthread_once(&crc64_table_once, crc64_table_init);
 
+    for (i = 0; i < len; i++) {
+        fp = (fp >> 8) ^ crc64_table[(fp ^ buf[i]) & 0xff];
+    }
 
-avro_file_writer_t
-lua_avro_get_file_writer(lua_State *L, int index)
-{
-    LuaAvroDataOutputFile  *l_file =
-        luaL_checkudata(L, index, MT_AVRO_DATA_OUTPUT_FILE);
-    return l_file->writer;
+    /* The specification uses the little-endian encoding of the
+     * fingerprint, for instance in single-object encoding headers. */
+    for (i = 0; i < 8; i++) {
+        out[i] = (unsigned char) (fp >> (8 * i));
+    }
 }
 
 
-/**
- * Closes a file writer.
+#define ROTL32(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR32(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+ * MD5 and SHA-256 both process 64-byte blocks, and pad the message the
+ * same way, differing only in the byte order of the length.  The block
+ * function for each algorithm updates the hash state in place.
  */
 
-static int
-l_output_file_close(lua_State *L)
+typedef void
+(*block_func)(uint32_t *state, const unsigned char *block);
+
+static void
+md_hash(block_func block, uint32_t *state, bool big_endian,
+        const unsigned char *buf, size_t len)
 {
-    LuaAvroDataOutputFile  *l_file =
-        luaL_checkudata(L, 1, MT_AVRO_DATA_OUTPUT_FILE);
-    if (l_file->writer != NULL) {
-        avro_file_writer_close(l_file->writer);
-        l_file->writer = NULL;
+    unsigned char  tail[128];
+    size_t  full = len - (len % 64);
+    size_t  tail_len = len - full;
+    size_t  padded;
+    uint64_t  bits = (uint64_t) len * 8;
+    size_t  i;
+
+    for (i = 0; i < full; i += 64) {
+        block(state, buf + i);
+    }
+
+    memcpy(tail, buf + full, tail_len);
+    tail[tail_len] = 0x80;
+    padded = (tail_len < 56)? 64: 128;
+    memset(tail + tail_len + 1, 0, padded - tail_len - 1);
+    for (i = 0; i < 8; i++) {
+        int  shift = big_endian? 8 * (7 - i): 8 * i;
+        tail[padded - 8 + i] = (unsigned char) (bits >> shift);
+    }
+
+    for (i = 0; i < padded; i += 64) {
+        block(state, tail + i);
     }
-    return 0;
 }
 
-/**
- * Writes a value to a file writer.
- */
+static const uint32_t  md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
 
-static int
-l_output_file_write(lua_State *L)
+static const int  md5_shifts[16] = {
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+};
+
+static void
+md5_block(uint32_t *state, const unsigned char *block)
 {
-    avro_file_writer_t  writer = lua_avro_get_file_writer(L, 1);
-    avro_value_t  *value = lua_avro_get_value(L, 2);
-    check(avro_file_writer_append_value(writer, value));
-    return 0;
+    uint32_t  m[16];
+    uint32_t  a = state[0], b = state[1], c = state[2], d = state[3];
+    int  i;
+
+    for (i = 0; i < 16; i++) {
+        m[i] = (uint32_t) block[4*i] |
+               ((uint32_t) block[4*i+1] << 8) |
+               ((uint32_t) block[4*i+2] << 16) |
+               ((uint32_t) block[4*i+3] << 24);
+    }
+
+    for (i = 0; i < 64; i++) {
+        uint32_t  f;
+        int  g;
+        int  round = i / 16;
+        if (round == 0) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (round == 1) {
+            f = (d & b) | (~d & c);
+            g = (5*i + 1) % 16;
+        } else if (round == 2) {
+            f = b ^ c ^ d;
+            g = (3*i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7*i) % 16;
+        }
+        f = f + a + md5_k[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b = b + ROTL32(f, md5_shifts[round*4 + i%4]);
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
 }
 
+static void
+fingerprint_md5(const unsigned char *buf, size_t len, unsigned char *out)
+{
+    uint32_t  state[4] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+    };
+    int  i;
+
+    md_hash(md5_block, state, false, buf, len);
+    for (i = 0; i < 16; i++) {
+        out[i] = (unsigned char) (state[i/4] >> (8 * (i%4)));
+    }
+}
 
-/**
- * Opens a new input or output file.
- */
+static const uint32_t  sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
 
-static int
-l_file_open(lua_State *L)
+static void
+sha256_block(uint32_t *state, const unsigned char *block)
 {
-    static const char  *MODES[] = { "r", "w", NULL };
+    uint32_t  w[64];
+    uint32_t  s[8];
+    int  i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[4*i] << 24) |
+               ((uint32_t) block[4*i+1] << 16) |
+               ((uint32_t) block[4*i+2] << 8) |
+               (uint32_t) block[4*i+3];
+    }
+    for (i = 16; i < 64; i++) {
+        uint32_t  s0 = ROTR32(w[i-15], 7) ^ ROTR32(w[i-15], 18) ^
+                       (w[i-15] >> 3);
+        uint32_t  s1 = ROTR32(w[i-2], 17) ^ ROTR32(w[i-2], 19) ^
+                       (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
 
-    const char  *path = luaL_checkstring(L, 1);
-    int  mode = luaL_checkoption(L, 2, "r", MODES);
+    memcpy(s, state, sizeof(s));
+    for (i = 0; i < 64; i++) {
+        uint32_t  e = s[4];
+        uint32_t  a = s[0];
+        uint32_t  t1 = s[7] + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+                       ((e & s[5]) ^ (~e & s[6])) + sha256_k[i] + w[i];
+        uint32_t  t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+                       ((a & s[1]) ^ (a & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(uint32_t));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
 
-    if (mode == 0) {
-        /* mode == "r" */
-        avro_file_reader_t  reader;
-        int  rc = avro_file_reader(path, &reader);
-        if (rc != 0) {
-            return lua_return_avro_error(L);
-        }
-        lua_avro_push_file_reader(L, reader);
-        return 1;
+    for (i = 0; i < 8; i++) {
+        state[i] += s[i];
+    }
+}
 
-    } else if (mode == 1) {
-        /* mode == "w" */
-        avro_schema_t  schema = lua_avro_get_schema(L, 3);
-        avro_file_writer_t  writer;
-        int  rc = avro_file_writer_create(path, schema, &writer);
-        if (rc != 0) {
-            return lua_return_avro_error(L);
-        }
-        lua_avro_push_file_writer(L, writer);
-        return 1;
+static void
+fingerprint_sha256(const unsigned char *buf, size_t len, unsigned char *out)
+{
+    uint32_t  state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    int  i;
+
+    md_hash(sha256_block, state, true, buf, len);
+    for (i = 0; i < 32; i++) {
+        out[i] = (unsigned char) (state[i/4] >> (8 * (3 - i%4)));
     }
+}
 
-    return 0;
+
+/**
+ * Returns the fingerprint of a string, as a binary string.  The second
+ * argument selects the algorithm: "crc64" (the default), "md5", or
+ * "sha256".
+ */
+
+static int
+l_fingerprint(lua_State *L)
+{
+    size_t  len;
+    const unsigned char  *buf =
+        (const unsigned char *) luaL_checklstring(L, 1, &len);
+    const char  *algorithm = luaL_optstring(L, 2, "crc64");
+    unsigned char  out[32];
+
+    if (strcmp(algorithm, "crc64") == 0) {
+        fingerprint_crc64(buf, len, out);
+        lua_pushlstring(L, (const char *) out, 8);
+    } else if (strcmp(algorithm, "md5") == 0) {
+        fingerprint_md5(buf, len, out);
+        lua_pushlstring(L, (const char *) out, 16);
+    } else if (strcmp(algorithm, "sha256") == 0) {
+        fingerprint_sha256(buf, len, out);
+        lua_pushlstring(L, (const char *) out, 32);
+    } else {
+        return luaL_error(L, "Unknown fingerprint algorithm %s", algorithm);
+    }
+    return 1;
 }
 
 
@@ -1917,11 +8117,13 @@ static const luaL_Reg  value_methods[] =
     {"append", l_value_append},
     {"cmp", l_value_cmp},
     {"copy_from", l_value_copy_from},
+    {"copy_into", l_value_copy_into},
     {"discriminant", l_value_discriminant},
     {"discriminant_index", l_value_discriminant_index},
     {"encode", l_value_encode},
     {"encoded_size", l_value_encoded_size},
     {"get", l_value_get},
+    {"get_path", l_value_get_path},
     {"hash", l_value_hash},
     {"iterate", l_value_iterate},
     {"raw_value", l_value_raw_value},
@@ -1931,14 +8133,27 @@ static const luaL_Reg  value_methods[] =
     {"set", l_value_set},
     {"set_dest", l_value_set_dest},
     {"set_from_ast", l_value_set_from_ast},
+    {"set_from_ffi_array", l_value_set_from_ffi_array},
+    {"set_from_json", l_value_set_from_json},
+    {"set_path", l_value_set_path},
     {"set_source", l_value_set_source},
     {"size", l_value_size},
+    {"to_ast", l_value_to_ast},
     {"to_json", l_value_tostring},
     {"type", l_value_type},
     {NULL, NULL}
 };
 
 
+static const luaL_Reg  buffer_methods[] =
+{
+    {"pointer", l_buffer_pointer},
+    {"size", l_buffer_size},
+    {"tostring", l_buffer_tostring},
+    {NULL, NULL}
+};
+
+
 static const luaL_Reg  schema_methods[] =
 {
     {"name", l_schema_name},
@@ -1957,6 +8172,7 @@ static const luaL_Reg  resolved_reader_methods[] =
 
 static const luaL_Reg  resolved_writer_methods[] =
 {
+    {"datum_size", l_resolved_writer_datum_size},
     {"decode", l_resolved_writer_decode},
     {"new_raw_value", l_resolved_writer_new_raw_value},
     {NULL, NULL}
@@ -1966,8 +8182,17 @@ static const luaL_Reg  resolved_writer_methods[] =
 static const luaL_Reg  input_file_methods[] =
 {
     {"close", l_input_file_close},
+    {"codec", l_input_file_codec},
+    {"read_arrow", l_input_file_read_arrow},
+    {"read_batch", l_input_file_read_batch},
+    {"read_columns", l_input_file_read_columns},
     {"read_raw", l_input_file_read_raw},
+    {"record_count", l_input_file_record_count},
     {"schema_json", l_input_file_schema_json},
+    {"seek", l_input_file_seek},
+    {"sync", l_input_file_sync},
+    {"tell", l_input_file_tell},
+    {"write_index", l_input_file_write_index},
     {NULL, NULL}
 };
 
@@ -1975,20 +8200,43 @@ static const luaL_Reg  input_file_methods[] =
 static const luaL_Reg  output_file_methods[] =
 {
     {"close", l_output_file_close},
+    {"contents", l_output_file_contents},
+    {"sync", l_output_file_sync},
+    {"write_arrow", l_output_file_write_arrow},
+    {"write_batch", l_output_file_write_batch},
     {"write_raw", l_output_file_write},
     {NULL, NULL}
 };
 
 
+static const luaL_Reg  scanner_methods[] =
+{
+    {"batches", l_scanner_batches},
+    {"close", l_scanner_close},
+    {"next_batch", l_scanner_next_batch},
+    {NULL, NULL}
+};
+
+
 static const luaL_Reg  mod_methods[] =
 {
+    {"Buffer", l_buffer_new},
     {"ResolvedReader", l_resolved_reader_new},
     {"ResolvedWriter", l_resolved_writer_new},
     {"Schema", l_schema_new},
+    {"arrow_release_functions", l_arrow_release_functions},
+    {"export_arrow", l_export_arrow},
+    {"file_header", l_file_header},
+    {"fingerprint", l_fingerprint},
+    {"free_arrow_structs", l_free_arrow_structs},
+    {"new_arrow_structs", l_new_arrow_structs},
     {"new_raw_schema", l_new_raw_schema},
     {"open", l_file_open},
+    {"open_memory", l_memory_file_open},
     {"raw_decode_value", l_value_decode_raw},
     {"raw_encode_value", l_value_encode_raw},
+    {"raw_string", l_raw_string},
+    {"scan", l_scan},
     {NULL, NULL}
 };
 
@@ -2029,6 +8277,25 @@ luaopen_avro_legacy_avro(lua_State *L)
     lua_setfield(L, -2, "__gc");
     lua_pop(L, 1);
 
+    luaL_newmetatable(L, MT_AVRO_VALUE_GUARD);
+    lua_pushcfunction(L, value_guard_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    /* AvroBuffer metatable */
+
+    luaL_newmetatable(L, MT_AVRO_BUFFER);
+    lua_createtable(L, 0, sizeof(buffer_methods) / sizeof(luaL_reg) - 1);
+    luaL_register(L, NULL, buffer_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_buffer_size);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, l_buffer_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, l_buffer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     /* AvroResolvedReader metatable */
 
     luaL_newmetatable(L, MT_AVRO_RESOLVED_READER);
@@ -2065,10 +8332,36 @@ luaopen_avro_legacy_avro(lua_State *L)
     lua_createtable(L, 0, sizeof(output_file_methods) / sizeof(luaL_reg) - 1);
     luaL_register(L, NULL, output_file_methods);
     lua_setfield(L, -2, "__index");
-    lua_pushcfunction(L, l_output_file_close);
+    lua_pushcfunction(L, l_output_file_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    /* AvroScanner metatable */
+
+    luaL_newmetatable(L, MT_AVRO_SCANNER);
+    lua_createtable(L, 0, sizeof(scanner_methods) / sizeof(luaL_reg) - 1);
+    luaL_register(L, NULL, scanner_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_scanner_close);
     lua_setfield(L, -2, "__gc");
     lua_pop(L, 1);
 
     luaL_register(L, "avro.legacy.avro", mod_methods);
+
+    /* The FFI backend needs these, and they vary between platforms. */
+#define EXPORT_CONSTANT(name) \
+    lua_pushinteger(L, name); \
+    lua_setfield(L, -2, #name)
+    EXPORT_CONSTANT(EOF);
+    EXPORT_CONSTANT(EILSEQ);
+    EXPORT_CONSTANT(EINVAL);
+    EXPORT_CONSTANT(ENOMEM);
+    EXPORT_CONSTANT(ENOSPC);
+    EXPORT_CONSTANT(O_RDONLY);
+    EXPORT_CONSTANT(SEEK_END);
+    EXPORT_CONSTANT(PROT_READ);
+    EXPORT_CONSTANT(MAP_PRIVATE);
+    EXPORT_CONSTANT(MADV_SEQUENTIAL);
+#undef EXPORT_CONSTANT
     return 1;
 }
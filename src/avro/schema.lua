@@ -8,6 +8,7 @@
 
 local AC = require "avro.c"
 local ACC = require "avro.constants"
+local ACP = require "avro.compiler"
 local json = require "avro.dkjson"
 local AW = require "avro.wrapper"
 
@@ -17,13 +18,17 @@ local getmetatable = getmetatable
 local ipairs = ipairs
 local next = next
 local pairs = pairs
+local pcall = pcall
 local print = print
+local select = select
 local setmetatable = setmetatable
 local table = table
 local tonumber = tonumber
 local tostring = tostring
 local type = type
 
+local format = string.format
+
 module "avro.schema"
 
 ------------------------------------------------------------------------
@@ -41,32 +46,84 @@ end
 
 Schema.__mt.__tostring = Schema.to_json
 
+-- Returns the Parsing Canonical Form of this schema, as defined in the
+-- Avro specification.  Two schemas with the same canonical form are
+-- interchangeable for reading and writing data.
+function Schema:canonical_form()
+   if not self.canonical then
+      self.canonical = self:build_canonical({})
+   end
+   return self.canonical
+end
+
+-- Returns a fingerprint of this schema's canonical form, as a binary
+-- string.  algorithm can be "crc64" (the default), "md5", or "sha256".
+-- The 64-bit fingerprint is little-endian, which is the byte order used
+-- in single-object encoding.
+function Schema:fingerprint(algorithm)
+   algorithm = algorithm or "crc64"
+   if not self.fingerprints then
+      self.fingerprints = {}
+   end
+   local result = self.fingerprints[algorithm]
+   if not result then
+      result = AC.fingerprint(self:canonical_form(), algorithm)
+      self.fingerprints[algorithm] = result
+   end
+   return result
+end
+
+function Schema:fingerprint64()
+   return self:fingerprint("crc64")
+end
+
+function Schema:fingerprint_md5()
+   return self:fingerprint("md5")
+end
+
+function Schema:fingerprint_sha256()
+   return self:fingerprint("sha256")
+end
+
 function Schema:check_for_existing(link_table)
    -- Verify that there's not already a schema with the same name in the
    -- link table, unless it's equivalent to ourselves.
-   local existing = link_table[self.schema_name]
+   local full_name = self:full_name()
+   local existing = link_table[full_name]
    if existing then
       if self == existing then
          -- The existing schema is the same as self, so the JSON
          -- encoding of ourselves is a link to the existing schema.
-         return [["]]..self.schema_name..[["]]
+         return [["]]..full_name..[["]]
       else
-         error("Two mismatching schemas named "..self.schema_name)
+         error("Two mismatching schemas named "..full_name)
       end
    end
 
-   link_table[self.schema_name] = self
+   link_table[full_name] = self
    return nil
 end
 
+-- Returns the JSON attribute that gives a named schema's namespace, if
+-- it's different from the namespace of the schema that encloses it.
+function Schema:namespace_json(namespace)
+   if self.schema_name:find(".", 1, true) or
+      (self.namespace or "") == (namespace or "") then
+      return ""
+   end
+   return [[, "namespace": ]]..json.quotestring(self.namespace or "")
+end
+
 function Schema.__mt:__eq(other)
    if other == nil then return false end
    return self:to_json() == other:to_json()
 end
 
+-- The raw schema is built directly from our Lua representation, without
+-- going through JSON.
 function Schema:raw_schema()
    if not self.raw then
-      self.raw = assert(AC.Schema(self:to_json()))
+      self.raw = assert(AC.Schema(self))
    end
    return self.raw
 end
@@ -76,6 +133,90 @@ function Schema:new_raw_value(...)
    return raw:new_raw_value(...)
 end
 
+-- Each schema keeps a pool of raw values that have been handed back
+-- with release_value, so that code that creates and discards a value
+-- per record can reuse the same few values instead.  We keep at most
+-- this many values in each pool.
+local MAX_POOLED_VALUES = 64
+
+-- The raw schema that each value from acquire_value was created from.
+-- If the schema is modified while a value is checked out, the value no
+-- longer matches the schema's new raw schema, and mustn't go back into
+-- the pool.
+local value_raw_schemas = setmetatable({}, { __mode="k" })
+
+-- Returns a raw value of this schema, reusing one from the schema's
+-- pool if there is one.  Pooled values are reset when they're handed
+-- back, so the result is always empty, just like a new value.
+function Schema:acquire_value()
+   local pool = self.value_pool
+   if pool and #pool > 0 then
+      local value = pool[#pool]
+      pool[#pool] = nil
+      return value
+   end
+   local value = self:new_raw_value()
+   value_raw_schemas[value] = self.raw
+   return value
+end
+
+-- Hands a value from acquire_value back to the schema's pool.  You
+-- must not use the value afterwards.  If the pool is full, or the value
+-- was created from an older version of the schema, we release the
+-- value instead.
+function Schema:release_value(value)
+   if value_raw_schemas[value] ~= self.raw then
+      value_raw_schemas[value] = nil
+      value:release()
+      return
+   end
+   local pool = self.value_pool
+   if not pool then
+      pool = {}
+      self.value_pool = pool
+   end
+   if #pool >= MAX_POOLED_VALUES then
+      value_raw_schemas[value] = nil
+      value:release()
+   else
+      value:reset()
+      pool[#pool+1] = value
+   end
+end
+
+-- Throws away everything that we've derived from a schema, after it's
+-- been modified.  Raw values aren't garbage collected by every backend,
+-- so we release any pooled values explicitly.
+local function invalidate(schema)
+   if schema.value_pool then
+      for _, value in ipairs(schema.value_pool) do
+         value_raw_schemas[value] = nil
+         value:release()
+      end
+   end
+   schema.json = nil
+   schema.raw = nil
+   schema.value_pool = nil
+   schema.canonical = nil
+   schema.fingerprints = nil
+   schema.decoders = nil
+   schema.accessors = nil
+   schema.encoder = nil
+end
+
+-- Parses the Avro JSON encoding of an instance of this schema, and
+-- returns a new raw value containing it.  Raises an error if the JSON
+-- isn't a valid instance of the schema.
+function Schema:decode_json(str)
+   local value = self:new_raw_value()
+   local ok, err = pcall(value.set_from_json, value, str)
+   if not ok then
+      value:release()
+      error(err, 0)
+   end
+   return value
+end
+
 function Schema:new_wrapped_value()
    local raw = self:new_raw_value()
    local wrapper_class = self:wrapper_class()
@@ -83,10 +224,49 @@ function Schema:new_wrapped_value()
    return wrapper, wrapper:wrap(raw)
 end
 
+-- Returns a function that decodes the Avro binary encoding of this
+-- schema directly into a Lua AST.  See avro.compiler for details.  If
+-- you give a reader schema, which must be a projection of this schema
+-- (see Schema:project), the decoder only produces the fields in the
+-- projection, and skips over the rest without decoding them.
+function Schema:compile_decoder(rschema)
+   rschema = rschema or self
+   if not self.decoders then
+      self.decoders = setmetatable({}, { __mode="k" })
+   end
+   local decoder = self.decoders[rschema]
+   if not decoder then
+      decoder = ACP.decoder(self, rschema)
+      self.decoders[rschema] = decoder
+   end
+   return decoder
+end
+
+-- Returns a function that encodes a Lua AST directly into the Avro
+-- binary encoding of this schema.  See avro.compiler for details.
+function Schema:compile_encoder()
+   if not self.encoder then
+      self.encoder = ACP.encoder(self)
+   end
+   return self.encoder
+end
+
 function Schema:name()
    return self.schema_name
 end
 
+-- Returns the full name of a named schema, which includes its namespace
+-- (if it has one).  Full names are what the Parsing Canonical Form
+-- uses, and what references to a named schema resolve against; unions,
+-- wrapper classes, and name() all use the unqualified name.
+function Schema:full_name()
+   local name, namespace = self.schema_name, self.namespace
+   if namespace == nil or namespace == "" or name:find(".", 1, true) then
+      return name
+   end
+   return namespace.."."..name
+end
+
 function Schema:type()
    return self.schema_type
 end
@@ -133,6 +313,10 @@ function PrimitiveSchema:build_json(link_table)
    return [[{"type": "]]..self.schema_name..[["}]]
 end
 
+function PrimitiveSchema:build_canonical(link_table)
+   return [["]]..self.schema_name..[["]]
+end
+
 function PrimitiveSchema:default_wrapper_class()
    return self.__default_wrapper_class
 end
@@ -179,11 +363,16 @@ end
 ArraySchema.__mt.__tostring = Schema.__mt.__tostring
 ArraySchema.__mt.__eq = Schema.__mt.__eq
 
-function ArraySchema:build_json(link_table)
-   local item_json = self.item_schema:build_json(link_table)
+function ArraySchema:build_json(link_table, namespace)
+   local item_json = self.item_schema:build_json(link_table, namespace)
    return [[{"type": "array", "items": ]]..item_json..[[}]]
 end
 
+function ArraySchema:build_canonical(link_table)
+   local item_form = self.item_schema:build_canonical(link_table)
+   return [[{"type":"array","items":]]..item_form..[[}]]
+end
+
 function ArraySchema:default_wrapper_class()
    local class = AW.ArrayValue:subclass(self.schema_name)
    self.__wrapper_class = class
@@ -215,11 +404,16 @@ end
 MapSchema.__mt.__tostring = Schema.__mt.__tostring
 MapSchema.__mt.__eq = Schema.__mt.__eq
 
-function MapSchema:build_json(link_table)
-   local value_json = self.value_schema:build_json(link_table)
+function MapSchema:build_json(link_table, namespace)
+   local value_json = self.value_schema:build_json(link_table, namespace)
    return [[{"type": "map", "values": ]]..value_json..[[}]]
 end
 
+function MapSchema:build_canonical(link_table)
+   local value_form = self.value_schema:build_canonical(link_table)
+   return [[{"type":"map","values":]]..value_form..[[}]]
+end
+
 function MapSchema:default_wrapper_class()
    local class = AW.MapValue:subclass(self.schema_name)
    self.__wrapper_class = class
@@ -242,9 +436,10 @@ EnumSchema = {}
 EnumSchema.__mt = { __index=EnumSchema }
 setmetatable(EnumSchema, { __index=Schema })
 
-function EnumSchema:new(name, symbols)
+function EnumSchema:new(name, symbols, namespace)
    local obj = {
       schema_name=name,
+      namespace=namespace,
       schema_type=ACC.ENUM,
       symbols=symbols or {},
    }
@@ -259,12 +454,12 @@ function EnumSchema:size()
 end
 
 function EnumSchema:add_symbol(symbol)
+   self:check_mutable()
    table.insert(self.symbols, symbol)
-   self.json = nil
-   self.raw = nil
+   invalidate(self)
 end
 
-function EnumSchema:build_json(link_table)
+function EnumSchema:build_json(link_table, namespace)
    local existing = self:check_for_existing(link_table)
    if existing then return existing end
 
@@ -274,8 +469,23 @@ function EnumSchema:build_json(link_table)
    end
    local all_symbols = table.concat(symbol_strs, ",")
 
-   return [[{"type": "enum", "name": "]]..self.schema_name..
-          [[", "symbols": []]..all_symbols.."]}"
+   return [[{"type": "enum", "name": "]]..self.schema_name..[["]]..
+          self:namespace_json(namespace)..
+          [[, "symbols": []]..all_symbols.."]}"
+end
+
+function EnumSchema:build_canonical(link_table)
+   local existing = self:check_for_existing(link_table)
+   if existing then return existing end
+
+   local symbol_strs = {}
+   for _, sym in ipairs(self.symbols) do
+      table.insert(symbol_strs, json.quotestring(sym))
+   end
+
+   return [[{"name":]]..json.quotestring(self:full_name())..
+          [[,"type":"enum","symbols":[]]..table.concat(symbol_strs, ",")..
+          "]}"
 end
 
 function EnumSchema:default_wrapper_class()
@@ -284,12 +494,13 @@ end
 
 function EnumSchema:clone(clones)
    clones = clones or {}
-   if clones[self.schema_name] then
-      return clones[self.schema_name]
+   local full_name = self:full_name()
+   if clones[full_name] then
+      return clones[full_name]
    end
 
-   local schema = EnumSchema:new(self.schema_name)
-   clones[self.schema_name] = schema
+   local schema = EnumSchema:new(self.schema_name, nil, self.namespace)
+   clones[full_name] = schema
    for _, sym in ipairs(self.symbols) do
       schema:add_symbol(sym)
    end
@@ -304,9 +515,10 @@ FixedSchema = {}
 FixedSchema.__mt = { __index=FixedSchema }
 setmetatable(FixedSchema, { __index=Schema })
 
-function FixedSchema:new(name, size)
+function FixedSchema:new(name, size, namespace)
    local obj = {
       schema_name=name,
+      namespace=namespace,
       schema_type=ACC.FIXED,
       fixed_size=size,
    }
@@ -316,11 +528,20 @@ end
 FixedSchema.__mt.__tostring = Schema.__mt.__tostring
 FixedSchema.__mt.__eq = Schema.__mt.__eq
 
-function FixedSchema:build_json(link_table)
+function FixedSchema:build_json(link_table, namespace)
    local existing = self:check_for_existing(link_table)
    if existing then return existing end
-   return [[{"type": "fixed", "name": "]]..self.schema_name..
-          [[", "size": ]]..self.fixed_size..[[}]]
+   return [[{"type": "fixed", "name": "]]..self.schema_name..[["]]..
+          self:namespace_json(namespace)..
+          [[, "size": ]]..self.fixed_size..[[}]]
+end
+
+function FixedSchema:build_canonical(link_table)
+   local existing = self:check_for_existing(link_table)
+   if existing then return existing end
+   return [[{"name":]]..json.quotestring(self:full_name())..
+          [[,"type":"fixed","size":]]..format("%d", self.fixed_size)..
+          "}"
 end
 
 function FixedSchema:default_wrapper_class()
@@ -329,12 +550,14 @@ end
 
 function FixedSchema:clone(clones)
    clones = clones or {}
-   if clones[self.schema_name] then
-      return clones[self.schema_name]
+   local full_name = self:full_name()
+   if clones[full_name] then
+      return clones[full_name]
    end
 
-   local schema = FixedSchema:new(self.schema_name, self.fixed_size)
-   clones[self.schema_name] = schema
+   local schema =
+      FixedSchema:new(self.schema_name, self.fixed_size, self.namespace)
+   clones[full_name] = schema
    return schema
 end
 
@@ -346,9 +569,10 @@ RecordSchema = {}
 RecordSchema.__mt = { __index=RecordSchema }
 setmetatable(RecordSchema, { __index=Schema })
 
-function RecordSchema:new(name)
+function RecordSchema:new(name, namespace)
    local obj = {
       schema_name=name,
+      namespace=namespace,
       schema_type=ACC.RECORD,
       fields={},
       fields_by_name={},
@@ -368,28 +592,49 @@ function RecordSchema:get(field_name)
 end
 
 function RecordSchema:add_field(name, schema)
+   self:check_mutable()
    table.insert(self.fields, {[name]=schema})
    self.fields_by_name[name] = schema
-   self.json = nil
-   self.raw = nil
+   invalidate(self)
 end
 
-function RecordSchema:build_json(link_table)
+function RecordSchema:build_json(link_table, namespace)
    local existing = self:check_for_existing(link_table)
    if existing then return existing end
 
    local field_strs = {}
+   local field_namespace = self:full_name():match("^(.*)%.[^.]*$")
    for _, field in ipairs(self.fields) do
       local field_name, field_schema = next(field)
-      local field_schema_str = field_schema:build_json(link_table)
+      local field_schema_str =
+         field_schema:build_json(link_table, field_namespace)
       table.insert(field_strs,
                    [[{"name": "]]..field_name..
                    [[", "type": ]]..field_schema_str..[[}]])
    end
    local all_fields = table.concat(field_strs, ", ")
 
-   return [[{"type": "record", "name": "]]..self.schema_name..
-          [[", "fields": []]..all_fields.."]}"
+   return [[{"type": "record", "name": "]]..self.schema_name..[["]]..
+          self:namespace_json(namespace)..
+          [[, "fields": []]..all_fields.."]}"
+end
+
+function RecordSchema:build_canonical(link_table)
+   local existing = self:check_for_existing(link_table)
+   if existing then return existing end
+
+   local field_strs = {}
+   for _, field in ipairs(self.fields) do
+      local field_name, field_schema = next(field)
+      table.insert(field_strs,
+                   [[{"name":]]..json.quotestring(field_name)..
+                   [[,"type":]]..field_schema:build_canonical(link_table)..
+                   "}")
+   end
+
+   return [[{"name":]]..json.quotestring(self:full_name())..
+          [[,"type":"record","fields":[]]..table.concat(field_strs, ",")..
+          "]}"
 end
 
 function RecordSchema:default_wrapper_class()
@@ -415,12 +660,13 @@ end
 
 function RecordSchema:clone(clones)
    clones = clones or {}
-   if clones[self.schema_name] then
-      return clones[self.schema_name]
+   local full_name = self:full_name()
+   if clones[full_name] then
+      return clones[full_name]
    end
 
-   local schema = RecordSchema:new(self.schema_name)
-   clones[self.schema_name] = schema
+   local schema = RecordSchema:new(self.schema_name, self.namespace)
+   clones[full_name] = schema
    for _, field in ipairs(self.fields) do
       local field_name, field_schema = next(field)
       local field_clone = field_schema:clone(clones)
@@ -464,6 +710,7 @@ function UnionSchema:size()
 end
 
 function UnionSchema:add_branch(branch_schema)
+   self:check_mutable()
    if branch_schema:type() == ACC.UNION then
       error("Can't add a union to a union")
    end
@@ -475,14 +722,13 @@ function UnionSchema:add_branch(branch_schema)
 
    table.insert(self.branches, branch_schema)
    self.indices_by_name[branch_name] = #self.branches
-   self.json = nil
-   self.raw = nil
+   invalidate(self)
 end
 
-function UnionSchema:build_json(link_table)
+function UnionSchema:build_json(link_table, namespace)
    local branch_strs = {}
    for _, branch_schema in ipairs(self.branches) do
-      local branch_schema_str = branch_schema:build_json(link_table)
+      local branch_schema_str = branch_schema:build_json(link_table, namespace)
       table.insert(branch_strs, branch_schema_str)
    end
    local all_branches = table.concat(branch_strs, ", ")
@@ -490,6 +736,14 @@ function UnionSchema:build_json(link_table)
    return "["..all_branches.."]"
 end
 
+function UnionSchema:build_canonical(link_table)
+   local branch_strs = {}
+   for _, branch_schema in ipairs(self.branches) do
+      table.insert(branch_strs, branch_schema:build_canonical(link_table))
+   end
+   return "["..table.concat(branch_strs, ",").."]"
+end
+
 function UnionSchema:default_wrapper_class()
    local class = AW.UnionValue:subclass(self.schema_name)
    self.__wrapper_class = class
@@ -521,15 +775,257 @@ function UnionSchema:clone(clones)
 end
 
 
+------------------------------------------------------------------------
+-- Projections
+
+-- Turns a list of field paths into a tree.  Each path is a string of
+-- field names separated by dots.  Each node in the tree is either a
+-- table, which maps the names of the fields that we want to keep to
+-- their subtrees, or true, which means to keep the entire value.
+local function path_tree(paths)
+   local tree = {}
+   for _, path in ipairs(paths) do
+      local node = tree
+      local names = {}
+      for name in path:gmatch("[^.]+") do
+         table.insert(names, name)
+      end
+      if #names == 0 then
+         error("Invalid field path "..tostring(path))
+      end
+      for i, name in ipairs(names) do
+         if node[name] == true then break end
+         if i == #names then
+            node[name] = true
+         else
+            node[name] = node[name] or {}
+            node = node[name]
+         end
+      end
+   end
+   return tree
+end
+
+-- Returns a copy of schema that only contains the parts of it selected
+-- by tree.  Arrays, maps, and unions are transparent; a path continues
+-- into their children.  If strict is false, we ignore fields that don't
+-- exist, since they might belong to a different branch of a union.
+local function project(schema, tree, strict, projected)
+   if tree == true then return schema end
+
+   local schema_type = schema:type()
+   if schema_type == ACC.RECORD then
+      local existing = projected[schema]
+      if existing and existing.tree == tree then
+         return existing.schema
+      elseif existing then
+         error("Can't project record "..schema.schema_name..
+               " in two different ways")
+      end
+
+      if strict then
+         for name in pairs(tree) do
+            if not schema:get(name) then
+               error("No field "..name.." in record "..schema.schema_name)
+            end
+         end
+      end
+
+      local result = RecordSchema:new(schema.schema_name, schema.namespace)
+      projected[schema] = { tree=tree, schema=result }
+      for _, field in ipairs(schema.fields) do
+         local field_name, field_schema = next(field)
+         if tree[field_name] then
+            result:add_field(field_name,
+                             project(field_schema, tree[field_name],
+                                     true, projected))
+         end
+      end
+      return result
+
+   elseif schema_type == ACC.ARRAY then
+      return ArraySchema:new(project(schema.item_schema, tree,
+                                     strict, projected))
+
+   elseif schema_type == ACC.MAP then
+      return MapSchema:new(project(schema.value_schema, tree,
+                                   strict, projected))
+
+   elseif schema_type == ACC.UNION then
+      local result = UnionSchema:new()
+      for _, branch in ipairs(schema.branches) do
+         local branch_type = branch:type()
+         if branch_type == ACC.RECORD
+         or branch_type == ACC.ARRAY
+         or branch_type == ACC.MAP then
+            result:add_branch(project(branch, tree, false, projected))
+         else
+            result:add_branch(branch)
+         end
+      end
+      return result
+
+   elseif strict then
+      error("Can't select fields from a "..schema.schema_name.." schema")
+
+   else
+      return schema
+   end
+end
+
+-- Returns a projection of this schema, which only contains the fields
+-- named in paths.  Each path is a dotted list of field names, such as
+-- "address.city".  Arrays, maps, and unions don't appear in a path;
+-- we look for the field in their items, values, or branches instead.
+-- Fields keep the same order that they have in this schema.  You can
+-- use the projection as a reader schema for ResolvedWriter, for
+-- avro.open, or for Schema:compile_decoder; in all three cases, the
+-- fields that aren't in the projection are skipped over without being
+-- decoded.
+function Schema:project(paths)
+   return project(self, path_tree(paths), true, {})
+end
+
+
+------------------------------------------------------------------------
+-- Field-path accessors
+
+-- Returns the index and schema of the first branch of a union that a
+-- path can continue into: a record with the given field, or a map.
+local function union_branch_for(schema, name)
+   for i, branch in ipairs(schema.branches) do
+      local branch_type = branch:type()
+      if (branch_type == ACC.RECORD and branch:get(name))
+      or branch_type == ACC.MAP then
+         return i, branch
+      end
+   end
+end
+
+-- Resolves a dotted field path into the chain of child steps that
+-- Value:get_path and Value:set_path expect: the 1-based index of each
+-- record field, the negated 1-based index of each union branch, and
+-- each map key as a string.  A path can name a union branch
+-- explicitly, as in "source.ipv4.address"; otherwise we step into the
+-- first branch that can contain the next name.
+local function path_chain(schema, path)
+   local chain = {}
+   for name in path:gmatch("[^.]+") do
+      local schema_type = schema:type()
+      if schema_type == ACC.UNION and not schema.indices_by_name[name] then
+         local index, branch = union_branch_for(schema, name)
+         if not index then
+            error("No branch of union can contain "..name)
+         end
+         table.insert(chain, -index)
+         schema, schema_type = branch, branch:type()
+      end
+
+      if schema_type == ACC.UNION then
+         local index = schema.indices_by_name[name]
+         table.insert(chain, -index)
+         schema = schema.branches[index]
+
+      elseif schema_type == ACC.RECORD then
+         local index
+         for i, field in ipairs(schema.fields) do
+            local field_name, field_schema = next(field)
+            if field_name == name then
+               index, schema = i, field_schema
+               break
+            end
+         end
+         if not index then
+            error("No field "..name.." in record "..schema.schema_name)
+         end
+         table.insert(chain, index)
+
+      elseif schema_type == ACC.MAP then
+         table.insert(chain, name)
+         schema = schema.value_schema
+
+      else
+         error("Can't select "..name.." from a "..schema.schema_name..
+               " schema")
+      end
+   end
+
+   if #chain == 0 then
+      error("Invalid field path "..tostring(path))
+   end
+   return chain
+end
+
+-- Returns a function that reads or writes the value at the end of a
+-- dotted field path, such as "header.source.ip".  The path is resolved
+-- into a chain of child indices once, here, so each call is a single
+-- call into the C library, which doesn't look up any field names or
+-- create a value instance for any intermediate step.
+--
+--   local get_ip = schema:accessor("header.source.ip")
+--   local ip = get_ip(value)      -- nil if a union is in another branch
+--   get_ip(value, "127.0.0.1")    -- selects union branches as needed
+--
+-- If the end of the path is a compound value, reading it returns a raw
+-- value.  You can only write scalars.  The value that you pass in can
+-- be a raw or a wrapped value.
+function Schema:accessor(path)
+   if not self.accessors then
+      self.accessors = {}
+   end
+   local accessor = self.accessors[path]
+   if not accessor then
+      local chain = path_chain(self, path)
+      accessor = function(value, ...)
+         if value.raw then value = value.raw end
+         if select("#", ...) == 0 then
+            return value:get_path(chain)
+         end
+         return value:set_path(chain, (...))
+      end
+      self.accessors[path] = accessor
+   end
+   return accessor
+end
+
+
 ------------------------------------------------------------------------
 -- Construct a schema from JSON
 
-local function parse_decoded_json(decoded, link_table)
+-- Returns the full name of a named schema, as defined in the Avro
+-- specification.  A name that contains a dot is already a full name;
+-- otherwise it's qualified by the schema's namespace attribute, if it
+-- has one, or else by the namespace of the enclosing named schema.
+local function full_name(name, namespace, enclosing)
+   if name:find(".", 1, true) then return name end
+   if namespace == nil then namespace = enclosing end
+   if type(namespace) ~= "string" then
+      error("Invalid namespace "..tostring(namespace))
+   end
+   if namespace == "" then return name end
+   return namespace.."."..name
+end
+
+-- Splits a full name into its unqualified name and its namespace, which
+-- is also the enclosing namespace for any schemas nested inside of the
+-- named schema.
+local function split_name(name)
+   local namespace, short_name = name:match("^(.*)%.([^.]*)$")
+   if namespace then return short_name, namespace end
+   return name, ""
+end
+
+local function parse_decoded_json(decoded, link_table, namespace)
    if type(decoded) == "string" then
       -- Check for primitives first, then any named types we've already
-      -- processed
+      -- processed.  A reference to a named type is relative to the
+      -- enclosing namespace, but we also accept an unqualified name
+      -- that was defined without a namespace.
+      local name = full_name(decoded, nil, namespace)
       if PRIMITIVES[decoded] then
          return PRIMITIVES[decoded]
+      elseif link_table[name] then
+         return link_table[name]
       elseif link_table[decoded] then
          return link_table[decoded]
       else
@@ -549,7 +1045,8 @@ local function parse_decoded_json(decoded, link_table)
       -- Union type
       local schema = UnionSchema:new()
       for _, branch_json in ipairs(decoded) do
-         local branch_schema = parse_decoded_json(branch_json, link_table)
+         local branch_schema =
+            parse_decoded_json(branch_json, link_table, namespace)
          schema:add_branch(branch_schema)
       end
       return schema
@@ -557,14 +1054,17 @@ local function parse_decoded_json(decoded, link_table)
    elseif decoded.type == "array" then
       -- Array type
       local items_json = assert(decoded.items, "No items schema for array")
-      local items_schema = parse_decoded_json(items_json, link_table)
+      local items_schema =
+         parse_decoded_json(items_json, link_table, namespace)
       return ArraySchema:new(items_schema)
 
    elseif decoded.type == "enum" then
-      local name = assert(decoded.name, "No name for enum")
+      local name = full_name(assert(decoded.name, "No name for enum"),
+                             decoded.namespace, namespace)
       local old_schema = link_table[name]
 
-      local schema = EnumSchema:new(name)
+      local short_name, name_space = split_name(name)
+      local schema = EnumSchema:new(short_name, nil, name_space)
       link_table[name] = schema
 
       local symbols = assert(decoded.symbols, "No symbols for enum")
@@ -586,14 +1086,16 @@ local function parse_decoded_json(decoded, link_table)
       return schema
 
    elseif decoded.type == "fixed" then
-      local name = assert(decoded.name, "No name for fixed")
+      local name = full_name(assert(decoded.name, "No name for fixed"),
+                             decoded.namespace, namespace)
       local old_schema = link_table[name]
 
       local size = assert(decoded.size, "No size for fixed")
       if type(size) ~= "number" then
          error("Fixed size must be a number")
       end
-      local schema = FixedSchema:new(name, size)
+      local short_name, name_space = split_name(name)
+      local schema = FixedSchema:new(short_name, size, name_space)
 
       if old_schema then
          if schema == old_schema then
@@ -609,14 +1111,17 @@ local function parse_decoded_json(decoded, link_table)
    elseif decoded.type == "map" then
       -- Map type
       local values_json = assert(decoded.values, "No values schema for map")
-      local values_schema = parse_decoded_json(values_json, link_table)
+      local values_schema =
+         parse_decoded_json(values_json, link_table, namespace)
       return MapSchema:new(values_schema)
 
    elseif decoded.type == "record" then
-      local name = assert(decoded.name, "No name for record")
+      local name = full_name(assert(decoded.name, "No name for record"),
+                             decoded.namespace, namespace)
       local old_schema = link_table[name]
 
-      local schema = RecordSchema:new(name)
+      local short_name, name_space = split_name(name)
+      local schema = RecordSchema:new(short_name, name_space)
       link_table[name] = schema
 
       local fields = assert(decoded.fields, "No fields for record")
@@ -627,7 +1132,8 @@ local function parse_decoded_json(decoded, link_table)
 
          local field_name = assert(field.name, "No name for record field")
          local field_type = assert(field.type, "No type for record field")
-         local field_schema = parse_decoded_json(field_type, link_table)
+         local field_schema =
+            parse_decoded_json(field_type, link_table, name_space)
          schema:add_field(field_name, field_schema)
       end
 
@@ -642,17 +1148,76 @@ local function parse_decoded_json(decoded, link_table)
       return schema
 
    elseif type(decoded.type) == "string" then
-      return parse_decoded_json(decoded.type, link_table)
+      return parse_decoded_json(decoded.type, link_table, namespace)
 
    else
       error("Invalid JSON schema")
    end
 end
 
+------------------------------------------------------------------------
+-- Interning
+
+-- Every schema that we parse from JSON is interned, so that parsing the
+-- same schema again gives you the same schema object, along with its
+-- cached raw schema, wrapper class, and compiled functions.  We look
+-- up schemas twice: first by the exact JSON text that we were given,
+-- which lets us skip parsing altogether, and then by the canonical form
+-- of the parsed schema, which catches differences in whitespace,
+-- attribute order, and attributes that don't affect parsing.  Both tables are
+-- weak, so schemas that aren't used anymore can still be collected.
+
+local interned_by_text = setmetatable({}, { __mode="v" })
+local interned = setmetatable({}, { __mode="v" })
+
+-- Marks a schema and every schema that it contains as interned.
+-- Recursive schemas refer back to themselves, so we stop at any schema
+-- that's already marked.
+local function mark_interned(schema)
+   if schema.is_interned then return end
+   schema.is_interned = true
+   if schema.item_schema then mark_interned(schema.item_schema) end
+   if schema.value_schema then mark_interned(schema.value_schema) end
+   for _, field in ipairs(schema.fields or {}) do
+      local _, field_schema = next(field)
+      mark_interned(field_schema)
+   end
+   for _, branch_schema in ipairs(schema.branches or {}) do
+      mark_interned(branch_schema)
+   end
+end
+
+-- Returns the interned schema that's equivalent to this one.  If this
+-- one becomes the interned schema, it's frozen (see check_mutable),
+-- along with every schema inside of it.  That includes any schemas that
+-- you built it from, since they're now part of a shared schema; clone
+-- them first if you still need to modify them.
+function Schema:intern()
+   local key = self:canonical_form()
+   local existing = interned[key]
+   if existing then return existing end
+   interned[key] = self
+   mark_interned(self)
+   return self
+end
+
+-- Interned schemas are shared, so they can't be modified, and neither
+-- can any of the schemas inside of them.
+function Schema:check_mutable()
+   if self.is_interned then
+      error("Cannot modify a shared schema; clone it first")
+   end
+end
+
 function Schema:new(json_str)
+   local existing = interned_by_text[json_str]
+   if existing then return existing end
+
    local decoded, _, err = json.decode(json_str)
    if decoded then
-      return parse_decoded_json(decoded, {})
+      local schema = parse_decoded_json(decoded, {}, ""):intern()
+      interned_by_text[json_str] = schema
+      return schema
    else
       error(err)
    end
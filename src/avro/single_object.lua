@@ -0,0 +1,136 @@
+-- -*- coding: utf-8 -*-
+------------------------------------------------------------------------
+-- Copyright © 2011-2015, RedJack, LLC.
+-- All rights reserved.
+--
+-- Please see the COPYING file in this distribution for license details.
+------------------------------------------------------------------------
+
+local AC = require "avro.c"
+local ARC = require "avro.cache"
+
+local pairs = pairs
+local setmetatable = setmetatable
+local string = string
+
+module "avro.single_object"
+
+-- Avro's single-object encoding prefixes the binary encoding of a value
+-- with a two-byte marker and the 64-bit fingerprint of the writer
+-- schema, so that a reader can find the schema that it needs to decode
+-- the value:
+--
+--   C3 01 <8-byte little-endian CRC-64-AVRO fingerprint> <value>
+
+local byte = string.byte
+local sub = string.sub
+
+MARKER = "\195\001"
+HEADER_SIZE = 10
+
+-- Returns the single-object encoding of value, which must be an
+-- instance of schema.  If you give a buffer, we encode the value into
+-- it (see Value:encode) before adding the header.
+function encode_single_object(value, schema, buffer)
+   local body
+   if buffer then
+      body = value:encode(buffer):tostring()
+   else
+      body = value:encode()
+   end
+   return MARKER..schema:fingerprint64()..body
+end
+
+-- Returns the writer schema fingerprint from the header of a
+-- single-object encoded message, or nil if buf isn't one.
+function fingerprint(buf)
+   if #buf < HEADER_SIZE or byte(buf, 1) ~= 0xc3 or byte(buf, 2) ~= 0x01 then
+      return nil
+   end
+   return sub(buf, 3, HEADER_SIZE)
+end
+
+-- A SingleObjectDecoder decodes single-object encoded messages into
+-- values of a reader schema.  You give it a lookup function, which
+-- takes in a fingerprint and returns the corresponding writer schema
+-- (or nil if it's unknown); usually this queries a schema registry.
+-- We keep the resolver for each fingerprint in a ResolverCache (by
+-- default, the process-wide one), so we only call lookup the first time
+-- we see each fingerprint, or after its resolver has been evicted.
+-- Resolvers are keyed by the writer fingerprint and the canonical form
+-- of the reader schema, so decoders with the same reader schema share
+-- them, even if the resolver was created by another decoder's lookup.
+--
+--   local decoder = SingleObjectDecoder:new(reader_schema, lookup)
+--   local value = decoder:decode(message)
+
+SingleObjectDecoder = {}
+SingleObjectDecoder.__mt = { __index=SingleObjectDecoder }
+
+function SingleObjectDecoder:new(rschema, lookup, cache)
+   local obj = {
+      rschema = rschema,
+      lookup = lookup,
+      cache = cache or ARC.default,
+      key_prefix = "s\0"..rschema:canonical_form().."\0",
+      seen = {},
+   }
+   -- Creates the resolver for a fingerprint that isn't in the cache.
+   function obj.new_resolver(fp, rschema)
+      local wschema = lookup(fp)
+      if not wschema then
+         return nil, "Unknown writer schema fingerprint"
+      end
+      return AC.ResolvedWriter(wschema, rschema)
+   end
+   return setmetatable(obj, self.__mt)
+end
+
+-- Returns the resolver for the writer schema with the given
+-- fingerprint.
+function SingleObjectDecoder:resolver(fp)
+   local resolver, err = self.cache:lookup(self.key_prefix..fp,
+                                           self.new_resolver,
+                                           fp, self.rschema)
+   if resolver then self.seen[fp] = true end
+   return resolver, err
+end
+
+-- Decodes a single-object encoded message into dest.  If you don't give
+-- a dest, we create a new value, which you're responsible for
+-- releasing.  Returns the value, or nil and an error message if the
+-- message is invalid or uses an unknown writer schema.
+function SingleObjectDecoder:decode(buf, dest)
+   local fp = fingerprint(buf)
+   if not fp then
+      return nil, "Not a single-object encoded message"
+   end
+
+   local resolver, err = self:resolver(fp)
+   if not resolver then return nil, err end
+
+   local created = false
+   if not dest then
+      dest = self.rschema:new_raw_value()
+      created = true
+   end
+
+   local size
+   size, err = resolver:decode(buf, dest, HEADER_SIZE)
+   if size ~= #buf - HEADER_SIZE then
+      if created then dest:release() end
+      return nil, err or "Extra data after single-object encoded value"
+   end
+   return dest
+end
+
+-- Forgets about the resolvers that we've already found, so that the
+-- next message with each fingerprint will call lookup again.  This
+-- removes them from the cache, so other decoders with the same reader
+-- schema will look them up again, too.
+function SingleObjectDecoder:reset()
+   for fp in pairs(self.seen) do
+      self.cache:remove(self.key_prefix..fp)
+   end
+   self.seen = {}
+end
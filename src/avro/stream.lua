@@ -0,0 +1,181 @@
+-- -*- coding: utf-8 -*-
+------------------------------------------------------------------------
+-- Copyright © 2011-2015, RedJack, LLC.
+-- All rights reserved.
+--
+-- Please see the COPYING file in this distribution for license details.
+------------------------------------------------------------------------
+
+local AC = require "avro.c"
+
+local assert = assert
+local error = error
+local math = math
+local setmetatable = setmetatable
+local string = string
+local type = type
+
+module "avro.stream"
+
+-- A StreamDecoder decodes a stream of back-to-back Avro values, which
+-- use the binary encoding, and which don't have any other framing
+-- between them.  The stream can arrive in chunks:
+--
+--   local decoder = StreamDecoder:new(writer_schema, reader_schema)
+--   decoder:feed(chunk)
+--   for value in decoder:values(dest) do
+--      -- process value
+--   end
+--   decoder:feed(next_chunk)
+--   ...
+--
+-- Each chunk can be a Lua string, or a pointer and size (see
+-- ResolvedWriter:decode).  We decode directly out of each chunk,
+-- without copying it.  The only exception is a value that's split
+-- across two chunks; we copy the beginning of the value when we reach
+-- the end of the first chunk, so it's safe to reuse a pointer chunk's
+-- memory once you've read all of the values out of it.
+
+local sub = string.sub
+
+StreamDecoder = {}
+StreamDecoder.__mt = { __index=StreamDecoder }
+
+-- How many bytes of the next chunk we initially try to add to a
+-- partial value left over from the previous chunk.
+local PARTIAL_STEP = 64
+
+function StreamDecoder:new(wschema, rschema)
+   rschema = rschema or wschema
+   local obj = {
+      resolver = assert(AC.ResolvedWriter(wschema, rschema)),
+      rschema = rschema,
+      -- The current chunk
+      buf = nil,
+      size = 0,
+      pos = 0,
+      -- The beginning of a value that started in an earlier chunk
+      partial = nil,
+   }
+   return setmetatable(obj, self.__mt)
+end
+
+local function slice(buf, offset, size)
+   if type(buf) == "string" then
+      return sub(buf, offset+1, offset+size)
+   else
+      return AC.raw_string(buf, offset, size)
+   end
+end
+
+-- Adds a new chunk to the stream.  You should only call this once
+-- you've read all of the complete values out of the previous chunk.
+function StreamDecoder:feed(buf, size)
+   if self.pos < self.size then
+      error "Previous chunk still contains unread values"
+   end
+   if type(buf) == "string" then
+      size = size or #buf
+   elseif size == nil then
+      error "Need a size when feeding a pointer"
+   end
+   self.buf = buf
+   self.size = size
+   self.pos = 0
+end
+
+-- Returns how far we've read into the current chunk.
+function StreamDecoder:offset()
+   return self.pos
+end
+
+-- Returns whether there's the beginning of a value that we're waiting
+-- for more data to complete.
+function StreamDecoder:has_partial()
+   return self.partial ~= nil
+end
+
+-- Decodes a value that started in an earlier chunk.  We don't know how
+-- much of the current chunk it takes up, so we try successively larger
+-- prefixes of the chunk until we have the whole value.
+function StreamDecoder:read_partial(dest)
+   local step = PARTIAL_STEP
+   while true do
+      local available = self.size - self.pos
+      local take = math.min(step, available)
+      local joined = self.partial .. slice(self.buf, self.pos, take)
+      local datum_size = self.resolver:datum_size(joined)
+
+      if datum_size then
+         assert(self.resolver:decode(joined, dest))
+         self.pos = self.pos + datum_size - #self.partial
+         self.partial = nil
+         return dest
+      end
+
+      if take == available then
+         -- The value continues into the next chunk, too.
+         self.partial = joined
+         self.pos = self.size
+         return nil
+      end
+
+      step = step * 2
+   end
+end
+
+-- Decodes the next value from the stream into dest.  If you don't give
+-- a dest, we create a new value, which you're responsible for
+-- releasing.  Returns nil if there aren't any more complete values in
+-- the current chunk.
+function StreamDecoder:read(dest)
+   if self.pos >= self.size then return nil end
+
+   local created = false
+   if not dest then
+      dest = self.rschema:new_raw_value()
+      created = true
+   end
+
+   local result
+   if self.partial then
+      result = self:read_partial(dest)
+   else
+      local datum_size, err =
+         self.resolver:decode(self.buf, dest, self.pos, self.size)
+      if datum_size == 0 then
+         if created then dest:release() end
+         error "Cannot stream values whose encoding is empty"
+      elseif datum_size then
+         self.pos = self.pos + datum_size
+         result = dest
+      else
+         local ok, complete = pcall(self.resolver.datum_size, self.resolver,
+                                    self.buf, self.pos, self.size)
+         if not ok or complete then
+            -- The value is all there, or can't even be skipped over, so
+            -- it must be invalid.
+            if created then dest:release() end
+            error(err)
+         end
+         -- The chunk ends partway through the value.  Save what we
+         -- have, since the chunk's memory might be reused once we
+         -- return.
+         self.partial = slice(self.buf, self.pos, self.size - self.pos)
+         self.pos = self.size
+      end
+   end
+
+   if not result and created then
+      dest:release()
+   end
+   return result
+end
+
+-- Returns an iterator over the remaining complete values in the
+-- current chunk.  Each value is decoded into dest.
+function StreamDecoder:values(dest)
+   return function()
+      return self:read(dest)
+   end
+end
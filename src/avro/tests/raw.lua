@@ -109,6 +109,141 @@ do
    test_map("string", { a="", b="a", c="hello", d="world!" })
 end
 
+------------------------------------------------------------------------
+-- Reusing child values
+
+do
+   local schema = A.record "reuse" {
+      {ints = A.array { A.int }},
+      {names = A.map { A.string }},
+      {maybe = A.union { A.null, A.int }},
+   }
+   local value = schema:new_raw_value()
+
+   local ints = value:get("ints")
+   local element = ints:append()
+   element:set(1)
+   for i = 2, 5 do
+      assert(ints:append(element) == element)
+      element:set(i)
+   end
+
+   local names = value:get("names", ints)
+   assert(names == ints)
+   for _, key in ipairs { "a", "b", "c" } do
+      assert(names:add(key, element) == element)
+      element:set(key)
+   end
+
+   local sum = 0
+   for i, e in value:get("ints", ints):iterate(true, element) do
+      assert(e == element)
+      sum = sum + e:get()
+   end
+   assert(sum == 15)
+   for key, e in value:get("names", ints):iterate(true, element) do
+      assert(e == element and e:get() == key)
+   end
+   assert(value:get("ints", ints):get(3, element):get() == 3)
+   assert(value:get("names", ints):get("b", element):get() == "b")
+
+   value:get("maybe", ints):get("int", element):set(7)
+   assert(value:get("maybe", ints):get(nil, element):get() == 7)
+   value:release()
+
+   -- A value can be reused for one of its own children, even if it's
+   -- the only thing that owns the parent; it keeps the parent alive
+   -- until it's released.
+   local nested = A.record "outer" {
+      {inner = A.record "inner" { {ints = A.array { A.int }} }},
+   }
+   local cur = nested:new_raw_value()
+   cur:get("inner"):get("ints"):append():set(42)
+   cur = cur:get("inner", cur)
+   cur = cur:get("ints", cur)
+   collectgarbage()
+   assert(cur:get(1):get() == 42)
+   local total = 0
+   for _, e in cur:iterate(true, cur) do
+      assert(e == cur)
+      total = total + e:get()
+   end
+   assert(total == 42)
+   cur:release()
+
+   -- Pooled values are reset before they're reused.
+   local first = schema:acquire_value()
+   first:get("ints"):append():set(1)
+   schema:release_value(first)
+   local second = schema:acquire_value()
+   assert(second:get("ints"):size() == 0)
+   schema:release_value(second)
+   assert(rawequal(schema:acquire_value(), second))
+   second:release()
+
+   -- Modifying a schema drops its pooled values, and values that were
+   -- checked out beforehand don't go back into the pool.
+   local growing = A.record "growing" { {a = A.int} }
+   local pooled = growing:acquire_value()
+   local checked_out = growing:acquire_value()
+   growing:release_value(pooled)
+   growing:add_field("b", A.string)
+   growing:release_value(checked_out)
+   local fresh = growing:acquire_value()
+   assert(not rawequal(fresh, pooled) and not rawequal(fresh, checked_out))
+   assert(fresh:get("b"))
+   growing:release_value(fresh)
+   assert(rawequal(growing:acquire_value(), fresh))
+   fresh:release()
+end
+
+------------------------------------------------------------------------
+-- Field-path accessors
+
+do
+   local address = A.record "address" {
+      {ip = A.string},
+      {port = A.int},
+   }
+   local schema = A.record "event" {
+      {id = A.long},
+      {header = A.record "header" {
+         {source = A.union { A.null, address }},
+         {tags = A.map { A.string }},
+      }},
+   }
+   local value = schema:new_raw_value()
+   local get_id = schema:accessor("id")
+   local get_ip = schema:accessor("header.source.ip")
+   local get_port = schema:accessor("header.source.address.port")
+   local get_tag = schema:accessor("header.tags.kind")
+   assert(schema:accessor("header.source.ip") == get_ip)
+
+   -- Unions that are in another branch, and missing map keys, read as
+   -- nil.
+   assert(get_ip(value) == nil)
+   assert(get_tag(value) == nil)
+
+   get_id(value, 42)
+   get_ip(value, "10.0.0.1")
+   get_port(value, 8080)
+   get_tag(value, "login")
+   assert(get_id(value) == 42)
+   assert(get_ip(value) == "10.0.0.1")
+   assert(get_port(value) == 8080)
+   assert(get_tag(value) == "login")
+   assert(value:get("header"):get("source"):get("address")
+               :get("ip"):get() == "10.0.0.1")
+
+   local source = schema:accessor("header.source")(value)
+   assert(source:get(nil):get("port"):get() == 8080)
+
+   assert(not pcall(schema.accessor, schema, "header.missing"))
+   assert(not pcall(schema.accessor, schema, "id.x"))
+   assert(not pcall(get_id, value, "not a number"))
+   value:release()
+end
+
 ------------------------------------------------------------------------
 -- set_from_ast conversions
 
@@ -129,6 +264,159 @@ do
    test(A.int, 12, 12)
 end
 
+------------------------------------------------------------------------
+-- Value:to_ast()
+
+do
+   local schema = A.record "ast" {
+      {b = A.boolean},
+      {i = A.int},
+      {l = A.long},
+      {d = A.double},
+      {s = A.string},
+      {e = A.enum "suit" { "HEARTS", "SPADES" }},
+      {f = A.fixed "pair" { size = 2 }},
+      {a = A.array { A.int }},
+      {m = A.map { A.union { A.null, A.string } }},
+      {u = A.union { A.null, A.long }},
+   }
+   local ast = {
+      b = true,
+      i = 7,
+      l = 1099511627776,
+      d = 0.5,
+      s = "hello",
+      e = "SPADES",
+      f = "xy",
+      a = { 1, 2, 3 },
+      m = { x = { string = "yes" }, y = nil },
+      u = { long = 12 },
+   }
+   local value = schema:new_raw_value()
+   value:set_from_ast(ast)
+   assert(deepcompare(value:to_ast(), ast))
+
+   -- The AST round-trips back through set_from_ast.
+   local copy = schema:new_raw_value()
+   copy:set_from_ast(value:to_ast())
+   assert(copy == value)
+   copy:release()
+
+   local bare = value:to_ast { unions = "bare", longs = "string" }
+   assert(bare.u == "12")
+   assert(bare.l == "1099511627776")
+   assert(bare.m.x == "yes")
+   assert(not pcall(value.to_ast, value, { unions = "other" }))
+
+   value:release()
+
+   -- Union branches are tagged with unqualified names, even when they
+   -- have a namespace, which is what compiled encoders and decoders
+   -- expect.
+   local namespaced = A.Schema:new [[
+      {"type": "record", "name": "holder", "namespace": "x.y", "fields": [
+         {"name": "u", "type": ["null",
+            {"type": "record", "name": "item",
+             "fields": [{"name": "a", "type": "int"}]}]}
+      ]}
+   ]]
+   value = namespaced:new_raw_value()
+   value:set_from_ast { u = { item = { a = 1 } } }
+   local tagged = value:to_ast()
+   assert(deepcompare(tagged, { u = { item = { a = 1 } } }))
+   local buf = namespaced:compile_encoder()(tagged)
+   assert(buf == value:encode())
+   assert(deepcompare(namespaced:compile_decoder()(buf), tagged))
+   value:release()
+
+   value = A.int:new_raw_value()
+   value:set(5)
+   assert(value:to_ast() == 5)
+   value:release()
+end
+
+------------------------------------------------------------------------
+-- Numeric array copies
+
+do
+   local legacy = require "avro.legacy.avro"
+
+   -- The legacy backend takes C arrays as light userdata, which plain
+   -- Lua can't create.  A Buffer can stand in for one: encoding a long
+   -- enough bytes value into it gives us scratch memory to copy into.
+   local function scratch_pointer(count)
+      local bytes = legacy.Schema("bytes"):new_raw_value()
+      bytes:set(string.rep("\0", 8 * count))
+      local buffer = bytes:encode(legacy.Buffer())
+      bytes:release()
+      return (buffer:pointer()), buffer
+   end
+
+   local function test(item_schema, ctype, data)
+      local schema = A.array { item_schema }
+
+      -- We always test the legacy backend directly, since the FFI one
+      -- doesn't use its implementation.
+      local legacy_schema = legacy.Schema(schema)
+      local value = legacy_schema:new_raw_value()
+      value:set_from_ast(data)
+      local ptr, buffer = scratch_pointer(#data)
+      assert(buffer:size() > 8 * #data)
+      assert(value:copy_into(ptr) == #data)
+      local copy = legacy_schema:new_raw_value()
+      copy:set_from_ffi_array(ptr, #data)
+      assert(copy == value)
+      assert(value:copy_into(ptr, 1) == 1)
+      copy:set_from_ffi_array(ptr, 1)
+      assert(copy:size() == 1)
+      assert(copy:get(1):get() == data[1])
+      copy:release()
+      value:release()
+
+      value = schema:new_raw_value()
+      value:set_from_ast(data)
+      if A.c.ffi_present then
+         local ffi = require "ffi"
+         local array, n = value:to_ffi_array()
+         assert(n == #data)
+         for i = 1, n do
+            assert(array[i-1] == data[i])
+         end
+
+         local partial = ffi.new(ctype, 2)
+         assert(value:copy_into(partial, 2) == 2)
+         assert(partial[0] == data[1] and partial[1] == data[2])
+
+         local copy = schema:new_raw_value()
+         copy:set_from_ffi_array(array, n)
+         assert(copy == value)
+         copy:set_from_ffi_array(array, 1)
+         assert(copy:size() == 1)
+         copy:release()
+      end
+
+      value:release()
+   end
+
+   test(A.int, "int32_t[?]", { 1, -2, 3 })
+   test(A.long, "int64_t[?]", { 4, 5, -6 })
+   test(A.float, "float[?]", { 0.5, 1.5, -2.5 })
+   test(A.double, "double[?]", { 0.25, 1e100, -3 })
+
+   local strings = A.array { A.string }
+   local point = A.record "point" { {x = A.int} }
+   for _, schema in ipairs { strings, legacy.Schema(strings) } do
+      local value = schema:new_raw_value()
+      assert(not pcall(value.copy_into, value, nil, 0))
+      value:release()
+   end
+   for _, schema in ipairs { point, legacy.Schema(point) } do
+      local value = schema:new_raw_value()
+      assert(not pcall(value.set_from_ffi_array, value, nil, 0))
+      value:release()
+   end
+end
+
 ------------------------------------------------------------------------
 -- Enums
 
@@ -395,6 +683,50 @@ do
    test_bad_prim ("string", "boolean")
 end
 
+------------------------------------------------------------------------
+-- ResolverCache
+
+do
+   local cache = A.ResolverCache:new(2)
+   local int1 = A.Schema:new([[{"type": "int"}]])
+   local int2 = A.Schema:new([[{"type": "int"}]])
+   local long = A.Schema:new([[{"type": "long"}]])
+   local str = A.Schema:new([[{"type": "string"}]])
+
+   -- Equivalent schemas share a resolver.
+   local r1 = assert(cache:writer(int1, long))
+   local r2 = assert(cache:writer(int2, long))
+   assert(r1 == r2)
+   assert(cache:reader(int1, long) ~= nil)
+   local stats = cache:stats()
+   assert(stats.hits == 1 and stats.misses == 2 and stats.size == 2)
+
+   -- Failed resolutions aren't cached.
+   assert(not cache:writer(str, long))
+   assert(cache:stats().size == 2)
+
+   -- The least recently used resolver gets evicted.
+   assert(cache:writer(int1, long) == r1)
+   assert(cache:writer(long, long))
+   stats = cache:stats()
+   assert(stats.evictions == 1 and stats.size == 2)
+   assert(cache:writer(int1, long) == r1)
+   assert(cache:stats().hits == 3)
+
+   local value = long:new_raw_value()
+   assert(r1:decode("\004", value))
+   assert(value:get() == 2)
+   value:release()
+
+   cache:set_capacity(1)
+   assert(cache:stats().size == 1)
+   cache:clear()
+   assert(cache:stats().size == 0 and cache:stats().hits == 0)
+
+   -- The process-wide cache
+   assert(A.resolved_writer(int1, long) == A.resolved_writer(int2, long))
+end
+
 ------------------------------------------------------------------------
 -- Resolver:decode()
 
@@ -425,6 +757,217 @@ do
    test_int("\002", 1)
 end
 
+do
+   local schema = A.Schema:new([[{"type": "string"}]])
+   local resolver = assert(A.ResolvedWriter(schema, schema))
+   local actual = schema:new_raw_value()
+
+   -- Decoding several values out of one buffer
+   local buf = "\006abc\004de"
+   assert(resolver:decode(buf, actual) == 4)
+   assert(actual:get() == "abc")
+   assert(resolver:decode(buf, actual, 4) == 3)
+   assert(actual:get() == "de")
+   assert(not resolver:decode(buf, actual, 4, 6))
+
+   -- Decoding from a pointer
+   local value = schema:new_raw_value()
+   value:set("hello")
+   local buffer = value:encode(A.Buffer())
+   local ptr, size = buffer:pointer()
+   assert(resolver:decode(ptr, actual, 0, size) == size)
+   assert(actual:get() == "hello")
+
+   -- The shared encoding buffer handles values larger than the memory
+   -- that it keeps between calls.
+   value:set(string.rep("x", 100000))
+   local big = assert(value:encode())
+   assert(resolver:decode(big, actual) == #big)
+   assert(actual:get() == string.rep("x", 100000))
+   value:set("hello")
+   assert(value:encode() == buffer:tostring())
+
+   value:release()
+   actual:release()
+end
+
+do
+   local schema = A.record "test" {
+      {a = A.array { A.string }},
+      {b = A.map { A.union { A.null, A.double } }},
+      {c = A.fixed "four" { size = 4 }},
+      {d = A.enum "color" { "RED", "GREEN" }},
+   }
+   local resolver = assert(A.ResolvedWriter(schema, schema))
+   local value = schema:new_raw_value()
+   value:set_from_ast {
+      a = { "x", "yy", "zzz" },
+      b = { k1 = { double = 1.5 }, k2 = { double = -2 } },
+      c = "abcd",
+      d = "GREEN",
+   }
+   local one = assert(value:encode())
+   local actual = schema:new_raw_value()
+   assert(resolver:decode("xx"..one..one, actual, 2) == #one)
+   assert(actual == value)
+   assert(resolver:decode("xx"..one..one, actual, 2 + #one) == #one)
+   assert(actual == value)
+   value:release()
+   actual:release()
+end
+
+------------------------------------------------------------------------
+-- StreamDecoder
+
+do
+   local schema = A.record "test" {
+      {a = A.long},
+      {b = A.string},
+   }
+
+   local expected = {
+      { a = 1, b = "first" },
+      { a = -1000000, b = string.rep("x", 200) },
+      { a = 42, b = "" },
+   }
+
+   local value = schema:new_raw_value()
+   local pieces = {}
+   for i, ast in ipairs(expected) do
+      value:set_from_ast(ast)
+      pieces[i] = assert(value:encode())
+   end
+   local stream = table.concat(pieces)
+
+   local function check_values(decoder, actual)
+      for v in decoder:values(value) do
+         table.insert(actual, { a = v:get("a"):get(), b = v:get("b"):get() })
+      end
+   end
+
+   -- The whole stream in one chunk
+   local decoder = A.StreamDecoder:new(schema)
+   local actual = {}
+   decoder:feed(stream)
+   check_values(decoder, actual)
+   assert(deepcompare(actual, expected))
+   assert(decoder:offset() == #stream)
+   assert(not decoder:has_partial())
+
+   -- The stream split into two chunks at every possible point
+   for split = 1, #stream-1 do
+      local decoder = A.StreamDecoder:new(schema)
+      local actual = {}
+      decoder:feed(stream:sub(1, split))
+      check_values(decoder, actual)
+      decoder:feed(stream:sub(split+1))
+      check_values(decoder, actual)
+      assert(deepcompare(actual, expected))
+      assert(not decoder:has_partial())
+   end
+
+   -- The stream fed one byte at a time
+   local decoder = A.StreamDecoder:new(schema)
+   local actual = {}
+   for i = 1, #stream do
+      decoder:feed(stream:sub(i, i))
+      check_values(decoder, actual)
+   end
+   assert(deepcompare(actual, expected))
+
+   -- A negative length or a varint longer than 10 bytes is invalid
+   -- rather than truncated, so we don't wait for more data.
+   local resolver = assert(A.ResolvedWriter(A.long, A.long))
+   assert(resolver:datum_size("\255\255") == false)
+   assert(resolver:datum_size(string.rep("\255", 9).."\001") == 10)
+   assert(not pcall(resolver.datum_size, resolver,
+                    string.rep("\255", 10).."\001"))
+   resolver = assert(A.ResolvedWriter(A.string, A.string))
+   assert(not pcall(resolver.datum_size, resolver, "\001xyz"))
+
+   local decoder = A.StreamDecoder:new(A.string)
+   decoder:feed("\001xyz")
+   assert(not pcall(decoder.read, decoder))
+   assert(not decoder:has_partial())
+
+   value:release()
+end
+
+------------------------------------------------------------------------
+-- Single-object encoding
+
+do
+   local wschema = A.record "message" { {id = A.int}, {body = A.string} }
+   local rschema = A.record "message" { {id = A.long} }
+
+   local value = wschema:new_raw_value()
+   value:set_from_ast { id = 42, body = "hello" }
+   local msg = A.encode_single_object(value, wschema)
+   assert(msg:sub(1, 2) == "\195\001")
+   assert(msg:sub(3, 10) == wschema:fingerprint64())
+   assert(msg:sub(11) == value:encode())
+   assert(A.encode_single_object(value, wschema, A.Buffer()) == msg)
+   assert(A.single_object_fingerprint(msg) == wschema:fingerprint64())
+   assert(A.single_object_fingerprint("\195\002") == nil)
+   value:release()
+
+   local lookups = 0
+   local registry = { [wschema:fingerprint64()] = wschema }
+   local decoder = A.SingleObjectDecoder:new(rschema, function(fp)
+      lookups = lookups + 1
+      return registry[fp]
+   end)
+
+   local actual = assert(decoder:decode(msg))
+   assert(actual:get("id"):get() == 42)
+   assert(decoder:decode(msg, actual) == actual)
+   actual:release()
+   assert(lookups == 1)
+
+   assert(not decoder:decode("garbage"))
+   assert(not decoder:decode(msg.."x"))
+   assert(not decoder:decode(msg:sub(1, -2)))
+   local unknown = "\195\001"..string.rep("\000", 8).."\002"
+   assert(not decoder:decode(unknown))
+
+   -- The decoder's resolvers live in its resolver cache, so they're
+   -- bounded by the cache's capacity.
+   local wschema2 = A.record "message" { {id = A.int}, {extra = A.int} }
+   value = wschema2:new_raw_value()
+   value:set_from_ast { id = 7, extra = 0 }
+   local msg2 = A.encode_single_object(value, wschema2)
+   value:release()
+   registry[wschema2:fingerprint64()] = wschema2
+
+   local cache = A.ResolverCache:new(1)
+   lookups = 0
+   decoder = A.SingleObjectDecoder:new(rschema, function(fp)
+      lookups = lookups + 1
+      return registry[fp]
+   end, cache)
+   for _ = 1, 2 do
+      assert(decoder:decode(msg)):release()
+      assert(decoder:decode(msg2)):release()
+   end
+   assert(lookups == 4)
+   assert(cache:stats().size == 1 and cache:stats().evictions == 3)
+
+   assert(decoder:decode(msg2)):release()
+   assert(lookups == 4)
+   decoder:reset()
+   assert(decoder:decode(msg2)):release()
+   assert(lookups == 5)
+
+   -- Decoders with the same reader schema share resolvers.
+   local other_lookups = 0
+   local other = A.SingleObjectDecoder:new(rschema, function(fp)
+      other_lookups = other_lookups + 1
+      return registry[fp]
+   end, cache)
+   assert(other:decode(msg2)):release()
+   assert(other_lookups == 0 and lookups == 5)
+end
+
 ------------------------------------------------------------------------
 -- Resolver:encode()
 
@@ -457,6 +1000,137 @@ do
    test_int("\002", 1)
 end
 
+------------------------------------------------------------------------
+-- Value:encode(buffer)
+
+do
+   local schema = A.Schema:new([[{"type": "string"}]])
+   local value = schema:new_raw_value()
+   local buffer = A.Buffer()
+
+   local function test_encode(str)
+      value:set(str)
+      local expected = assert(value:encode())
+      assert(value:encode(buffer) == buffer)
+      assert(buffer:tostring() == expected)
+      assert(tostring(buffer) == expected)
+      assert(buffer:size() == #expected)
+      assert(#buffer == #expected)
+      local ptr, size = buffer:pointer()
+      assert(ptr ~= nil)
+      assert(size == #expected)
+   end
+
+   -- The buffer should grow as needed, and shrinking values should
+   -- reuse the existing memory.
+   test_encode("")
+   test_encode("hello")
+   test_encode(string.rep("x", 100000))
+   test_encode("world")
+
+   value:release()
+end
+
+------------------------------------------------------------------------
+-- Value:set_from_json()
+
+do
+   local schema = A.record "json_test" {
+      {id = A.long},
+      {ratio = A.double},
+      {ok = A.boolean},
+      {name = A.string},
+      {payload = A.bytes},
+      {tags = A.array { A.string }},
+      {counts = A.map { A.int }},
+      {color = A.enum "color" { "RED", "GREEN" }},
+      {hash = A.fixed "hash" { size = 4 }},
+      {maybe = A.union { A.null, A.int }},
+   }
+
+   local value = schema:new_raw_value()
+   value:set_from_ast {
+      id = 1099511627776, ratio = 0.5, ok = true,
+      name = "caf\195\169 \"quoted\"\n",
+      payload = "\000\127\255",
+      tags = { "a", "b" },
+      counts = { x = 1, y = -2 },
+      color = "GREEN",
+      hash = "\001\002\003\004",
+   }
+   value:get("maybe"):get("int"):set(7)
+
+   local actual = schema:decode_json(value:to_json())
+   assert(actual == value)
+   assert(actual:get("payload"):get() == "\000\127\255")
+   assert(actual:get("maybe"):discriminant() == "int")
+
+   -- Arrays and maps are replaced, not appended to.
+   actual:set_from_json(value:to_json())
+   assert(actual == value)
+
+   actual:set_from_json [[
+      {"id": -1, "ratio": 1e3, "ok": false, "name": "é😀",
+       "payload": "ÿ", "tags": [], "counts": {}, "color": "RED",
+       "hash": "abcd", "maybe": null}
+   ]]
+   assert(actual:get("id"):get() == -1)
+   assert(actual:get("ratio"):get() == 1000)
+   assert(actual:get("name"):get() == "\195\169\240\159\152\128")
+   assert(actual:get("payload"):get() == "\255")
+   assert(actual:get("tags"):size() == 0)
+   assert(actual:get("maybe"):discriminant() == "null")
+
+   local function test_bad(json)
+      assert(not pcall(actual.set_from_json, actual, json))
+      assert(not pcall(schema.decode_json, schema, json))
+   end
+
+   -- Builds a valid record, except that the named field has the given
+   -- JSON instead (or is left out, if json is nil).
+   local good = {
+      id = '-1', ratio = '1e3', ok = 'false', name = '"x"', payload = '""',
+      tags = '[]', counts = '{}', color = '"RED"', hash = '"abcd"',
+      maybe = 'null',
+   }
+   local function with(name, json)
+      local pieces = {}
+      for _, field in ipairs(schema:field_names()) do
+         local field_json = good[field]
+         if field == name then field_json = json end
+         if field_json then
+            pieces[#pieces+1] = '"'..field..'": '..field_json
+         end
+      end
+      return "{"..table.concat(pieces, ", ").."}"
+   end
+
+   actual:set_from_json(with())
+   test_bad(with("id", '1.5'))
+   test_bad(with("id", '0x10'))
+   test_bad(with("payload", '"Ā"'))
+   test_bad(with("color", '"BLUE"'))
+   test_bad(with("hash", '"abc"'))
+   test_bad(with("maybe", '7'))
+   test_bad(with("maybe", '{"long": 7}'))
+   test_bad(with("name", '"unterminated'))
+   test_bad(with("missing", '1'):sub(1, -2)..', "missing": 1}')
+   test_bad(with() .. " extra")
+
+   -- Every field must appear exactly once.
+   test_bad(with("name", nil))
+   test_bad(with("id", '1, "id": 2'))
+   test_bad [[{}]]
+   local pair = A.record "pair" { {id = A.long}, {name = A.string} }
+   local pair_value = pair:new_raw_value()
+   pair_value:set_from_json [[{"id": 1, "name": "a"}]]
+   assert(not pcall(pair_value.set_from_json, pair_value, [[{"id":1}]]))
+   pair_value:release()
+
+   value:release()
+   actual:release()
+end
+
 ------------------------------------------------------------------------
 -- Files
 
@@ -503,10 +1177,985 @@ do
    value:release()
    assert(deepcompare(expected, actual))
 
+   -- Read in batches, reusing the same values each time.
+
+   reader = A.open(filename)
+   actual = {}
+   local values = {}
+   local count = reader:read_batch(4, values)
+   while count > 0 do
+      for i = 1, count do
+         table.insert(actual, values[i]:get())
+      end
+      count = reader:read_batch(4, values)
+   end
+   reader:close()
+   assert(#values == 4)
+   for _, v in ipairs(values) do v:release() end
+   assert(deepcompare(expected, actual))
+
+   -- Returns the number of records in each block of a file, straight
+   -- from the block headers.
+   local function block_counts()
+      local f = io.open(filename, "rb")
+      local contents = f:read("*a")
+      f:close()
+      local pos = A.file_header(filename).size + 1
+      -- Block counts and sizes are never negative, so we can skip the
+      -- zig-zag decoding's sign handling.
+      local function read_long()
+         local result, scale = 0, 1
+         local b
+         repeat
+            b = contents:byte(pos)
+            pos = pos + 1
+            result = result + (b % 128) * scale
+            scale = scale * 128
+         until b < 128
+         return result / 2
+      end
+      local counts = {}
+      while pos <= #contents do
+         table.insert(counts, read_long())
+         pos = pos + read_long() + 16
+      end
+      return counts
+   end
+
+   -- Write the same values in batches, with small blocks.
+
+   writer = A.open(filename, "w", schema, {
+      block_size = 1024,
+      records_per_block = 3,
+   })
+   local values = {}
+   for i, v in ipairs(expected) do
+      values[i] = schema:new_raw_value()
+      values[i]:set(v)
+   end
+   writer:write_batch(values, 5)
+   writer:sync()
+   writer:write_batch({ select(6, unpack(values)) })
+   writer:close()
+   for _, v in ipairs(values) do v:release() end
+
+   -- sync ends the second block early.
+   assert(deepcompare(block_counts(), {3, 2, 3, 2}))
+   reader = A.open(filename)
+   local record_count, block_count = reader:record_count()
+   assert(record_count == 10 and block_count == 4)
+   reader:close()
+
+   reader = A.open(filename)
+   actual = {}
+   value = reader:read_raw()
+   while value do
+      table.insert(actual, value:get())
+      value:release()
+      value = reader:read_raw()
+   end
+   reader:close()
+   assert(deepcompare(expected, actual))
+
+   -- Read the small blocks straight out of a memory mapping, in batches
+   -- and through a reader schema.
+
+   reader = A.open(filename, "r", A.long, { mmap = true })
+   actual = {}
+   values = {}
+   count = reader:read_batch(4, values)
+   while count > 0 do
+      for i = 1, count do
+         table.insert(actual, values[i]:get())
+      end
+      count = reader:read_batch(4, values)
+   end
+   reader:close()
+   for _, v in ipairs(values) do v:release() end
+   assert(deepcompare(expected, actual))
+
+   -- A truncated block is an error, not the end of the file.
+
+   local f = io.open(filename, "rb")
+   local contents = f:read("*a")
+   f:close()
+   f = io.open(filename, "wb")
+   f:write(contents:sub(1, -2))
+   f:close()
+   reader = A.open(filename, "r", A.long, { mmap = true })
+   values = {}
+   assert(not pcall(reader.read_batch, reader, #expected, values))
+   reader:close()
+   for _, v in ipairs(values) do v:release() end
+
+   -- Write the same values using each of the compression codecs.  The
+   -- Avro C library always supports null and deflate, but we don't
+   -- know whether it was built with snappy and lzma, so skip those if
+   -- it wasn't.
+
+   local optional_codecs = { snappy = true, lzma = true }
+   for _, codec in ipairs { "null", "deflate", "snappy", "lzma" } do
+      local ok, writer = pcall(A.open, filename, "w", schema, {codec=codec})
+      assert((ok and writer) or optional_codecs[codec],
+             "Can't write files with the "..codec.." codec")
+      if ok and writer then
+         value = schema:new_raw_value()
+         for _,i in ipairs(expected) do
+            value:set(i)
+            writer:write_raw(value)
+         end
+         writer:close()
+         value:release()
+
+         assert(A.file_header(filename).codec == codec)
+         reader = A.open(filename)
+         assert(reader:codec() == codec)
+         actual = {}
+         value = reader:read_raw()
+         while value do
+            table.insert(actual, value:get())
+            value:release()
+            value = reader:read_raw()
+         end
+         reader:close()
+         assert(deepcompare(expected, actual))
+
+         reader = A.open(filename, "r", { mmap = true })
+         assert(reader:codec() == codec)
+         actual = {}
+         value = reader:read_raw()
+         while value do
+            table.insert(actual, value:get())
+            value:release()
+            value = reader:read_raw()
+         end
+         reader:close()
+         assert(deepcompare(expected, actual))
+      end
+   end
+
+   -- Append to an existing file, in two sessions, and check that the
+   -- new blocks are read back after the original ones.
+
+   writer = A.open(filename, "w", schema, { records_per_block = 4 })
+   value = schema:new_raw_value()
+   for i = 1, 5 do
+      value:set(i)
+      writer:write_raw(value)
+   end
+   writer:close()
+
+   writer = assert(A.open(filename, "a", schema))
+   for i = 6, 8 do
+      value:set(i)
+      writer:write_raw(value)
+   end
+   writer:close()
+
+   writer = assert(A.open(filename, "a", { records_per_block = 1 }))
+   for i = 9, 10 do
+      value:set(i)
+      writer:write_raw(value)
+   end
+   writer:close()
+   value:release()
+   assert(deepcompare(block_counts(), {4, 1, 3, 1, 1}))
+
+   reader = A.open(filename)
+   actual = {}
+   value = reader:read_raw()
+   while value do
+      table.insert(actual, value:get())
+      value:release()
+      value = reader:read_raw()
+   end
+   reader:close()
+   assert(deepcompare(expected, actual))
+
+   -- The schema has to match the file's, and so does the codec.
+   assert(not A.open(filename, "a", A.long))
+   assert(not A.open(filename, "a", schema, { codec = "deflate" }))
+
+   -- Appending to a missing file creates it.
+   os.remove(filename)
+   writer = assert(A.open(filename, "a", schema))
+   value = schema:new_raw_value()
+   value:set(42)
+   writer:write_raw(value)
+   writer:close()
+   value:release()
+   reader = A.open(filename)
+   value = reader:read_raw()
+   assert(value:get() == 42)
+   value:release()
+   reader:close()
+
    -- And cleanup
    os.remove(filename)
 end
 
+------------------------------------------------------------------------
+-- In-memory files
+
+do
+   local schema = A.int
+   local expected = {}
+   for i = 1, 20 do expected[i] = i end
+
+   for _, codec in ipairs { "null", "deflate" } do
+      local writer = assert(A.open_memory(nil, "w", schema, {
+         codec = codec,
+         records_per_block = 6,
+      }))
+      local value = schema:new_raw_value()
+      for _, i in ipairs(expected) do
+         value:set(i)
+         writer:write_raw(value)
+      end
+      -- The contents are a complete file even before we close it.
+      local partial = writer:contents()
+      writer:close()
+      local blob = writer:contents()
+      assert(partial == blob)
+      value:release()
+
+      assert(A.file_header(blob, true).codec == codec)
+      local reader = A.open_memory(blob)
+      assert(reader:codec() == codec)
+      local actual = {}
+      value = reader:read_raw()
+      while value do
+         table.insert(actual, value:get())
+         value:release()
+         value = reader:read_raw()
+      end
+      assert(deepcompare(expected, actual))
+
+      -- Seeking works just as it does for files.
+      value = schema:new_raw_value()
+      assert(reader:record_count() == 20)
+      reader:seek(14)
+      assert(reader:read_raw(value))
+      assert(value:get() == 14)
+      value:release()
+      reader:close()
+
+      reader = A.open_memory(blob, "r", A.long)
+      local values = {}
+      assert(reader:read_batch(25, values) == 20)
+      assert(values[20]:get() == 20)
+      for _, v in ipairs(values) do v:release() end
+      reader:close()
+   end
+
+   assert(not A.open_memory("not a container file"))
+   assert(not A.open_memory(""))
+end
+
+------------------------------------------------------------------------
+-- Block indexes
+
+do
+   local filename = "test-index.avro"
+   local index_filename = "test-index.avro.idx"
+   local schema = A.int
+
+   for _, codec in ipairs { "null", "deflate" } do
+      local writer = assert(A.open(filename, "w", schema, {
+         codec = codec,
+         records_per_block = 7,
+      }))
+      local value = schema:new_raw_value()
+      for i = 1, 100 do
+         value:set(i)
+         writer:write_raw(value)
+      end
+      writer:close()
+      value:release()
+
+      -- Seeking builds the index, even if the file wasn't mapped.
+      local reader = A.open(filename)
+      assert(reader:tell() == 1)
+      value = reader:read_raw()
+      assert(value:get() == 1)
+      assert(reader:tell() == 2)
+      local count, blocks = reader:record_count()
+      assert(count == 100 and blocks == 15)
+
+      for _, n in ipairs { 50, 1, 7, 8, 100, 15, 99 } do
+         assert(reader:seek(n))
+         assert(reader:tell() == n)
+         assert(reader:read_raw(value))
+         assert(value:get() == n)
+         assert(reader:tell() == n + 1)
+      end
+
+      -- Reads carry on across block boundaries.
+      reader:seek(13)
+      for i = 13, 16 do
+         assert(reader:read_raw(value))
+         assert(value:get() == i)
+      end
+
+      assert(reader:seek(101))
+      assert(not reader:read_raw(value))
+      assert(not reader:seek(102))
+
+      -- Syncing moves to the start of the next block.
+      local header_size = A.file_header(filename).size
+      assert(reader:sync(0) == 1)
+      assert(reader:sync(header_size) == 1)
+      assert(reader:sync(header_size + 1) == 8)
+      assert(reader:read_raw(value))
+      assert(value:get() == 8)
+      assert(reader:sync(1e9) == 101)
+
+      assert(reader:write_index(index_filename))
+      reader:close()
+
+      -- Load the index back in from the sidecar.
+      local f
+      reader = A.open(filename, "r", A.long, {
+         mmap = true,
+         index = index_filename,
+      })
+      assert(reader:record_count() == 100)
+      reader:seek(64)
+      local values = {}
+      assert(reader:read_batch(3, values) == 3)
+      assert(values[1]:get() == 64 and values[3]:get() == 66)
+      for _, v in ipairs(values) do v:release() end
+      reader:close()
+
+      -- Seeks use the sidecar, rather than rebuilding the index: if
+      -- it claims that every block starts one record later than it
+      -- really does, seeks are off by one.  To get to the first
+      -- block's first record, we skip over the magic number, the
+      -- sync marker, and the file size, block count, and first block
+      -- offset varints.
+      f = io.open(index_filename, "rb")
+      local index = f:read("*a")
+      f:close()
+      local function skip_varint(pos)
+         while index:byte(pos) >= 128 do pos = pos + 1 end
+         return pos + 1
+      end
+      local first_pos = skip_varint(skip_varint(skip_varint(4 + 16 + 1)))
+      assert(index:byte(first_pos) == 0)
+      f = io.open(index_filename, "wb")
+      f:write(index:sub(1, first_pos-1), "\2", index:sub(first_pos+1))
+      f:close()
+      reader = A.open(filename, "r", { index = index_filename })
+      assert(reader:record_count() == 101)
+      assert(reader:seek(65))
+      assert(reader:read_raw(value))
+      assert(value:get() == 64)
+      reader:close()
+
+      -- A sidecar whose blocks don't start after the header is ignored.
+      local offset_pos = skip_varint(skip_varint(4 + 16 + 1))
+      f = io.open(index_filename, "wb")
+      f:write(index:sub(1, offset_pos-1), "\0", index:sub(first_pos))
+      f:close()
+      reader = A.open(filename, "r", { index = index_filename })
+      assert(reader:record_count() == 100)
+      assert(reader:seek(30))
+      assert(reader:read_raw(value))
+      assert(value:get() == 30)
+      reader:close()
+
+      -- A stale sidecar is ignored.
+      f = io.open(index_filename, "wb")
+      f:write("not an index")
+      f:close()
+      reader = A.open(filename, "r", { index = index_filename })
+      reader:seek(30)
+      assert(reader:read_raw(value))
+      assert(value:get() == 30)
+      reader:close()
+      value:release()
+   end
+
+   os.remove(filename)
+   os.remove(index_filename)
+end
+
+------------------------------------------------------------------------
+-- Columnar reads
+
+do
+   local filename = "test-columns.avro"
+   local schema = A.record "row" {
+      {id = A.long},
+      {score = A.double},
+      {ok = A.boolean},
+      {name = A.string},
+      {note = A.union { A.null, A.string }},
+      {count = A.union { A.int, A.null }},
+   }
+
+   local writer = A.open(filename, "w", schema, { records_per_block = 4 })
+   local value = schema:new_raw_value()
+   for i = 1, 10 do
+      value:set_from_ast {
+         id = i,
+         score = i / 2,
+         ok = i % 2 == 0,
+         name = string.rep("x", i),
+         note = i % 3 == 0 and { string = "n"..i } or nil,
+         count = i % 3 ~= 0 and { int = -i } or nil,
+      }
+      writer:write_raw(value)
+   end
+   writer:close()
+   value:release()
+
+   -- The FFI backend stores each column in C arrays indexed from 0;
+   -- the legacy backend uses Lua tables indexed from 1.
+   local entry
+   if A.c.ffi_present then
+      local ffi = require "ffi"
+      entry = function(column, i)
+         i = i - 1
+         if column.validity then
+            local byte = column.validity[math.floor(i / 8)]
+            if math.floor(byte / 2^(i % 8)) % 2 == 0 then return nil end
+         end
+         if column.offsets then
+            return ffi.string(column.data + column.offsets[i],
+                              column.offsets[i+1] - column.offsets[i])
+         end
+         if column.type == "boolean" then return column.values[i] ~= 0 end
+         return tonumber(column.values[i])
+      end
+   else
+      entry = function(column, i)
+         if column.validity and not column.validity[i] then
+            assert(column.values == nil or column.values[i] == nil)
+            return nil
+         end
+         if column.offsets then
+            return column.data:sub(column.offsets[i]+1, column.offsets[i+1])
+         end
+         return column.values[i]
+      end
+   end
+
+   local function check_batch(batch, first, count)
+      assert(batch.count == count)
+      assert(deepcompare(batch.fields,
+                         { "id", "score", "ok", "name", "note", "count" }))
+      local columns = batch.columns
+      assert(columns.id.type == "long" and columns.note.type == "string")
+      assert(columns.name.validity == nil and columns.note.validity ~= nil)
+      assert(columns.name.data_size == (2*first + count - 1) * count / 2)
+      for j = 1, count do
+         local i = first + j - 1
+         assert(entry(columns.id, j) == i)
+         assert(entry(columns.score, j) == i / 2)
+         assert(entry(columns.ok, j) == (i % 2 == 0))
+         assert(entry(columns.name, j) == string.rep("x", i))
+         assert(entry(columns.note, j) == (i % 3 == 0 and "n"..i or nil))
+         assert(entry(columns.count, j) == (i % 3 ~= 0 and -i or nil))
+      end
+   end
+
+   -- Explicit batch sizes can span blocks.
+   local reader = A.open(filename, "r")
+   assert(not pcall(reader.read_columns, reader, 0))
+   assert(not pcall(reader.read_columns, reader, 2^40))
+   check_batch(reader:read_columns(6), 1, 6)
+   check_batch(reader:read_columns(6), 7, 4)
+   assert(not reader:read_columns(6))
+   reader:close()
+
+   -- Without a size, we read the rest of the current block.
+   reader = A.open(filename, "r", { mmap = true })
+   check_batch(reader:read_columns(), 1, 4)
+   assert(reader:read_raw()):release()
+   check_batch(reader:read_columns(), 6, 3)
+   check_batch(reader:read_columns(), 9, 2)
+   assert(not reader:read_columns())
+   reader:close()
+   os.remove(filename)
+
+   -- Nested types can't be read as columns.
+   writer = A.open(filename, "w", A.record "nested" { {a = A.array { A.int }} })
+   writer:close()
+   reader = A.open(filename, "r")
+   assert(not pcall(reader.read_columns, reader, 1))
+   reader:close()
+   os.remove(filename)
+end
+
+------------------------------------------------------------------------
+-- Arrow C Data Interface
+
+do
+   local filename = "test-arrow.avro"
+   local copy_filename = "test-arrow-copy.avro"
+   local schema = A.record "row" {
+      {id = A.long},
+      {score = A.double},
+      {ok = A.boolean},
+      {name = A.string},
+      {note = A.union { A.null, A.string }},
+      {suit = A.enum "suit" { "HEARTS", "SPADES" }},
+   }
+
+   local function row(i)
+      return {
+         id = i,
+         score = i / 2,
+         ok = i % 2 == 0,
+         name = string.rep("x", i),
+         note = i % 3 == 0 and { string = "n"..i } or nil,
+         suit = i % 2 == 0 and "SPADES" or "HEARTS",
+      }
+   end
+
+   local writer = A.open(filename, "w", schema)
+   local value = schema:new_raw_value()
+   for i = 1, 10 do
+      value:set_from_ast(row(i))
+      writer:write_raw(value)
+   end
+   writer:close()
+
+   local function check_copy(count)
+      local reader = A.open(copy_filename, "r")
+      for i = 1, count do
+         assert(reader:read_raw(value))
+         assert(deepcompare(value:to_ast(), row(i)))
+      end
+      assert(not reader:read_raw(value))
+      reader:close()
+   end
+
+   -- Without the FFI, the structs are passed around as light userdata.
+   -- Importing a batch releases it, so there's nothing left to release
+   -- when we free the structs.
+   local arrow_schema, arrow_array = A.new_arrow_structs()
+   local reader = A.open(filename, "r")
+   assert(reader:read_arrow(10, arrow_schema, arrow_array) == 10)
+   reader:close()
+   writer = A.open(copy_filename, "w", schema)
+   assert(writer:write_arrow(arrow_schema, arrow_array, value) == 10)
+   writer:close()
+   check_copy(10)
+
+   local values = {}
+   for i = 1, 3 do
+      values[i] = schema:new_raw_value()
+      values[i]:set_from_ast(row(i))
+   end
+   assert(A.export_arrow(values, arrow_schema, arrow_array) == 3)
+   writer = A.open(copy_filename, "w", schema)
+   assert(writer:write_arrow(arrow_schema, arrow_array, value) == 3)
+   writer:close()
+   check_copy(3)
+
+   -- Anything in the batch that isn't a value of the first element's
+   -- schema is an error, and nothing is exported.
+   assert(not pcall(A.export_arrow, { values[1], "x" },
+                    arrow_schema, arrow_array))
+   local other = A.int:new_raw_value()
+   assert(not pcall(A.export_arrow, { values[1], other },
+                    arrow_schema, arrow_array))
+   other:release()
+   assert(not A.free_arrow_structs(arrow_schema, arrow_array))
+
+   arrow_schema, arrow_array = A.new_arrow_structs()
+   assert(A.export_arrow(values, arrow_schema, arrow_array) == 3)
+   assert(A.free_arrow_structs(arrow_schema, arrow_array))
+   for _, v in ipairs(values) do v:release() end
+
+   if A.c.ffi_present then
+      local ffi = require "ffi"
+      arrow_schema = ffi.new("struct ArrowSchema")
+      arrow_array = ffi.new("struct ArrowArray")
+      reader = A.open(filename, "r")
+      assert(reader:read_arrow(10, arrow_schema, arrow_array) == 10)
+      reader:close()
+
+      assert(ffi.string(arrow_schema.format) == "+s")
+      assert(arrow_schema.n_children == 6 and arrow_array.length == 10)
+      local note_schema = arrow_schema.children[4]
+      local note = arrow_array.children[4]
+      assert(ffi.string(note_schema.name) == "note")
+      assert(ffi.string(note_schema.format) == "u")
+      assert(note_schema.flags == 2 and note.null_count == 7)
+      local ids = ffi.cast("int64_t *", arrow_array.children[0].buffers[1])
+      assert(ids[0] == 1 and ids[9] == 10)
+      local ok_bits =
+         ffi.cast("uint8_t *", arrow_array.children[2].buffers[1])
+      assert(ok_bits[0] == 0xaa)
+      local suit_schema = arrow_schema.children[5]
+      assert(ffi.string(suit_schema.dictionary.format) == "u")
+      assert(arrow_array.children[5].dictionary.length == 2)
+
+      -- Importing the batch releases the Arrow structs.
+      writer = A.open(copy_filename, "w", schema)
+      assert(writer:write_arrow(arrow_schema, arrow_array, value) == 10)
+      writer:close()
+      assert(arrow_schema.release == nil and arrow_array.release == nil)
+      check_copy(10)
+
+      -- The release callbacks are C functions, which release everything
+      -- we allocated for the batch.
+      values = {}
+      for i = 1, 3 do
+         values[i] = schema:new_raw_value()
+         values[i]:set_from_ast(row(i))
+      end
+      assert(A.export_arrow(values, arrow_schema, arrow_array) == 3)
+      assert(arrow_array.length == 3)
+      assert(ffi.cast("double *",
+                      arrow_array.children[1].buffers[1])[2] == 1.5)
+      arrow_schema.release(arrow_schema)
+      arrow_array.release(arrow_array)
+      assert(arrow_schema.release == nil and arrow_array.release == nil)
+      for _, v in ipairs(values) do v:release() end
+
+      -- Fields that aren't in the Arrow batch are an error.
+      assert(A.export_arrow({ value }, arrow_schema, arrow_array))
+      local wider = A.record "row" {
+         {id = A.long},
+         {extra = A.int},
+      }
+      local wider_value = wider:new_raw_value()
+      writer = A.open(copy_filename, "w", wider)
+      assert(not pcall(writer.write_arrow, writer,
+                       arrow_schema, arrow_array, wider_value))
+      assert(arrow_schema.release == nil and arrow_array.release == nil)
+      writer:close()
+      wider_value:release()
+   end
+
+   value:release()
+   os.remove(filename)
+   os.remove(copy_filename)
+end
+
+------------------------------------------------------------------------
+-- Parallel scans
+
+do
+   local filename = "test-scan.avro"
+   local schema = A.int
+   local expected = {}
+   local writer = A.open(filename, "w", schema, { records_per_block = 10 })
+   local value = schema:new_raw_value()
+   for i = 1, 1000 do
+      expected[i] = i
+      value:set(i)
+      writer:write_raw(value)
+   end
+   writer:close()
+   value:release()
+
+   local function scan(rschema, options)
+      local scanner = assert(A.scan(filename, rschema, options))
+      local actual = {}
+      for batch in scanner:batches() do
+         for _, result in ipairs(batch) do
+            if type(result) == "number" then
+               table.insert(actual, result)
+            else
+               table.insert(actual, result:get())
+               result:release()
+            end
+         end
+      end
+      scanner:close()
+      return actual
+   end
+
+   -- Small chunks, so that every worker gets several of them.
+   assert(deepcompare(expected, scan(nil, { threads = 3, chunk_size = 64 })))
+   assert(deepcompare(expected, scan(A.long, { threads = 2 })))
+
+   local actual = scan(nil, { threads = 4, chunk_size = 1, ordered = false })
+   table.sort(actual)
+   assert(deepcompare(expected, actual))
+
+   -- The filter runs in the worker threads, and can drop values or
+   -- replace them with scalars.
+   actual = scan(nil, {
+      threads = 2,
+      chunk_size = 64,
+      filter = function(value)
+         local i = value:get()
+         if i % 2 == 0 then return i * 10 end
+      end,
+   })
+   assert(#actual == 500)
+   assert(actual[1] == 20 and actual[500] == 10000)
+
+   local scanner = assert(A.scan(filename, nil, {
+      filter = function(value) return {} end,
+   }))
+   local batch, err = scanner:next_batch()
+   assert(batch == nil and err)
+   scanner:close()
+
+   assert(not A.scan("missing-file.avro"))
+   os.remove(filename)
+end
+
+------------------------------------------------------------------------
+-- Schema:compile_decoder()
+
+do
+   local function test_decode(schema, ast)
+      local value = schema:new_raw_value()
+      value:set_from_ast(ast)
+      local buf = assert(value:encode())
+      value:release()
+
+      local decode = schema:compile_decoder()
+      local actual, next_pos = decode(buf)
+      assert(deepcompare(actual, ast))
+      assert(next_pos == #buf + 1)
+
+      -- Decoding from an offset within a larger buffer
+      actual, next_pos = decode("xyz"..buf.."xyz", 4)
+      assert(deepcompare(actual, ast))
+      assert(next_pos == #buf + 4)
+
+      -- Truncated input is an error
+      if #buf > 0 then
+         assert(not pcall(decode, buf:sub(1, -2)))
+      end
+   end
+
+   test_decode(A.boolean, true)
+   test_decode(A.boolean, false)
+   test_decode(A.int, 0)
+   test_decode(A.int, -1)
+   test_decode(A.int, 2147483647)
+   test_decode(A.long, -2147483649)
+   test_decode(A.long, 1099511627776)
+   test_decode(A.float, 1.5)
+   test_decode(A.float, -0.0078125)
+   test_decode(A.double, 3.25)
+   test_decode(A.double, -1e300)
+   test_decode(A.double, 4.9e-324)
+   test_decode(A.string, "")
+   test_decode(A.string, "hello world")
+   test_decode(A.bytes, "\000\001\002")
+   test_decode(A.null, nil)
+
+   local schema = A.record "test" {
+      {a = A.int},
+      {b = A.array { A.string }},
+      {c = A.map { A.double }},
+      {d = A.union { A.null, A.int, A.record "sub" { {x = A.long} } }},
+      {e = A.enum "color" { "RED", "GREEN", "BLUE" }},
+      {f = A.fixed "md5" { size = 4 }},
+   }
+
+   test_decode(schema, {
+      a = 1, b = {}, c = {}, d = { int = 0 }, e = "RED", f = "abcd",
+   })
+   test_decode(schema, {
+      a = -42, b = {"x", "y", "z"}, c = {pi = 3.125, e = 2.5},
+      d = { int = 10 }, e = "BLUE", f = "\000\000\000\000",
+   })
+   test_decode(schema, {
+      a = 0, b = {""}, c = {[""] = 0}, d = { sub = { x = 7 } },
+      e = "GREEN", f = "wxyz",
+   })
+
+   local list = A.record "list" {
+      {head = A.long},
+      {tail = A.union {A.null, A.link "list"}},
+   }
+
+   test_decode(A.union { A.null, A.int }, nil)
+   test_decode(A.union { A.null, A.int }, { int = 5 })
+
+   local value = list:new_raw_value()
+   value:get("head"):set(1)
+   value:get("tail"):set("list"):get("head"):set(2)
+   value:get("tail"):get():get("tail"):set("null")
+   local buf = assert(value:encode())
+   value:release()
+
+   local actual = list:compile_decoder()(buf)
+   assert(deepcompare(actual, { head = 1, tail = { list = { head = 2 } } }))
+
+   -- The compiled decoder is cached on the schema
+   assert(list:compile_decoder() == list:compile_decoder())
+end
+
+------------------------------------------------------------------------
+-- Schema:compile_encoder()
+
+do
+   local function test_encode(schema, ast)
+      local value = schema:new_raw_value()
+      value:set_from_ast(ast)
+      local expected = assert(value:encode())
+      value:release()
+
+      local encode = schema:compile_encoder()
+      local actual = encode(ast)
+      assert(actual == expected)
+
+      -- The encoder's buffer is reused, so make sure a second call
+      -- doesn't pick up anything from the first.
+      assert(encode(ast) == expected)
+      assert(deepcompare(schema:compile_decoder()(actual), ast))
+   end
+
+   local function test_bad(schema, ast)
+      local encode = schema:compile_encoder()
+      assert(not pcall(encode, ast))
+   end
+
+   test_encode(A.boolean, true)
+   test_encode(A.boolean, false)
+   test_encode(A.int, 0)
+   test_encode(A.int, -64)
+   test_encode(A.int, 64)
+   test_encode(A.int, -2147483648)
+   test_encode(A.int, 2147483647)
+   test_encode(A.long, 1099511627776)
+   test_encode(A.float, 1.5)
+   test_encode(A.float, -0.0078125)
+   test_encode(A.double, 3.25)
+   test_encode(A.double, -1e300)
+   test_encode(A.double, 4.9e-324)
+   test_encode(A.string, "")
+   test_encode(A.string, "hello world")
+   test_encode(A.bytes, "\000\001\002")
+   test_encode(A.null, nil)
+   test_encode(A.union { A.null, A.int }, nil)
+   test_encode(A.union { A.null, A.int }, { int = 5 })
+
+   local schema = A.record "test" {
+      {a = A.int},
+      {b = A.array { A.string }},
+      {c = A.map { A.double }},
+      {d = A.union { A.null, A.int, A.record "sub" { {x = A.long} } }},
+      {e = A.enum "color" { "RED", "GREEN", "BLUE" }},
+      {f = A.fixed "md5" { size = 4 }},
+   }
+
+   test_encode(schema, {
+      a = 1, b = {}, c = {}, d = { int = 0 }, e = "RED", f = "abcd",
+   })
+   test_encode(schema, {
+      a = -42, b = {"x", "y", "z"}, c = {pi = 3.125},
+      d = { sub = { x = 7 } }, e = "BLUE", f = "\000\000\000\000",
+   })
+
+   -- Union branches are keyed by unqualified names, even when the
+   -- branch has a namespace.
+   local namespaced = A.Schema:new [[
+      {"type": "record", "name": "foo", "namespace": "x.y", "fields": [
+         {"name": "u", "type": ["null",
+            {"type": "record", "name": "bar",
+             "fields": [{"name": "a", "type": "int"}]}]}
+      ]}
+   ]]
+   test_encode(namespaced, { u = { bar = { a = 1 } } })
+   test_encode(namespaced, { u = nil })
+
+   test_bad(A.int, "1")
+   test_bad(A.int, 1.5)
+   test_bad(A.int, 2147483648)
+   test_bad(A.int, -2147483649)
+   test_bad(A.string, 1)
+   test_bad(A.union { A.int, A.string }, nil)
+   test_bad(A.union { A.int, A.string }, { long = 1 })
+   test_bad(schema, {
+      a = 1, b = {}, c = {}, d = { int = 0 }, e = "PURPLE", f = "abcd",
+   })
+   test_bad(schema, {
+      a = 1, b = {}, c = {}, d = { int = 0 }, e = "RED", f = "abc",
+   })
+end
+
+------------------------------------------------------------------------
+-- Schema:project()
+
+do
+   local schema = A.record "test" {
+      {a = A.int},
+      {b = A.array { A.record "point" { {x = A.double}, {y = A.double} } }},
+      {c = A.map { A.string }},
+      {d = A.union { A.null, A.int, A.record "sub" { {x = A.long},
+                                                     {s = A.string} } }},
+      {e = A.fixed "md5" { size = 4 }},
+   }
+   local ast = {
+      a = 5,
+      b = { {x = 1, y = 2}, {x = 3, y = 4} },
+      c = { k = "v" },
+      d = { sub = { x = 7, s = "skipped" } },
+      e = "abcd",
+   }
+
+   local value = schema:new_raw_value()
+   value:set_from_ast(ast)
+   local buf = assert(value:encode())
+   value:release()
+
+   local projected = schema:project { "a", "b.y", "d.x" }
+   assert(deepcompare(projected:field_names(), { "a", "b", "d" }))
+   assert(deepcompare(projected:get("b").item_schema:field_names(), { "y" }))
+
+   -- Compiled decoders skip the fields that aren't in the projection.
+   local decode = schema:compile_decoder(projected)
+   local actual, next_pos = decode(buf)
+   assert(next_pos == #buf + 1)
+   assert(deepcompare(actual, {
+      a = 5,
+      b = { {y = 2}, {y = 4} },
+      d = { sub = { x = 7 } },
+   }))
+   assert(schema:compile_decoder(projected) == decode)
+   assert(schema:compile_decoder() ~= decode)
+   assert(not pcall(decode, buf:sub(1, -2)))
+
+   -- Skipped blocks can't have a negative size.  (a = 5, b is empty,
+   -- and c's first block has a count of -1 and a size of -2.)
+   local ok, err = pcall(decode, "\10\0\1\3")
+   assert(not ok and err:find("Invalid block size"))
+
+   -- So do resolved writers.
+   local resolver = assert(A.ResolvedWriter(schema, projected))
+   local pvalue = projected:new_raw_value()
+   assert(resolver:decode(buf, pvalue) == #buf)
+   assert(pvalue:get("a"):get() == 5)
+   assert(pvalue:get("b"):get(2):get("y"):get() == 4)
+   pvalue:release()
+
+   -- And files opened with a projection.
+   local filename = "test-project.avro"
+   local writer = A.open(filename, "w", schema)
+   value = schema:new_raw_value()
+   value:set_from_ast(ast)
+   writer:write_raw(value)
+   writer:close()
+   value:release()
+
+   local reader = A.open(filename, "r", projected)
+   value = reader:read_raw()
+   assert(value:get("d"):get():get("x"):get() == 7)
+   assert(value:get("a"):get() == 5)
+   value:release()
+   reader:close()
+   os.remove(filename)
+
+   -- Bad paths
+   assert(not pcall(schema.project, schema, { "z" }))
+   assert(not pcall(schema.project, schema, { "a.z" }))
+   assert(not pcall(schema.project, schema, { "" }))
+end
+
 ------------------------------------------------------------------------
 -- Recursive
 
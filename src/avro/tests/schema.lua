@@ -157,3 +157,213 @@ do
    assert(schema1 == clone)
    assert(schema2 == clone)
 end
+
+------------------------------------------------------------------------
+-- Interning
+
+do
+   local json1 = [[{"type": "record", "name": "interned", "fields": [
+      {"name": "a", "type": "int"}, {"name": "b", "type": "string"}
+   ]}]]
+   local json2 = [[
+      {"name": "interned", "type": "record", "fields": [
+         {"type": "int", "name": "a"},
+         {"type": "string", "name": "b"}
+      ]}
+   ]]
+
+   local schema1 = A.Schema:new(json1)
+   local schema2 = A.Schema:new(json1)
+   local schema3 = A.Schema:new(json2)
+   assert(rawequal(schema1, schema2))
+   assert(rawequal(schema1, schema3))
+   assert(rawequal(schema1:raw_schema(), schema3:raw_schema()))
+
+   -- Shared schemas can't be modified, but their clones can.
+   assert(not pcall(schema1.add_field, schema1, "c", A.long))
+   local clone = schema1:clone()
+   clone:add_field("c", A.long)
+   assert(clone:size() == 3)
+   assert(schema1:size() == 2)
+
+   -- Schemas built with the helper constructors can be interned, too.
+   local built = A.record "interned" { {a = A.int}, {b = A.string} }
+   assert(rawequal(built:intern(), schema1))
+
+   -- None of the schemas inside of a shared schema can be modified,
+   -- either.
+   local nested = A.Schema:new [[{"type": "record", "name": "outer", "fields": [
+      {"name": "inner", "type": {"type": "record", "name": "inner", "fields": [
+         {"name": "next", "type": ["null", "inner"]},
+         {"name": "tags", "type": {"type": "array", "items":
+            {"type": "enum", "name": "tag", "symbols": ["A"]}}}
+      ]}}
+   ]}]]
+   local inner = nested:get("inner")
+   local branches = inner:get("next")
+   local tag = inner:get("tags").item_schema
+   assert(not pcall(inner.add_field, inner, "c", A.long))
+   assert(not pcall(branches.add_branch, branches, A.long))
+   assert(not pcall(tag.add_symbol, tag, "B"))
+
+   -- Interning a schema also freezes the schemas that it was built from.
+   local part = A.record "part" { {a = A.int} }
+   local whole = A.record "whole" { {p = part} }
+   assert(rawequal(whole:intern(), whole))
+   assert(not pcall(part.add_field, part, "b", A.long))
+   local part_clone = part:clone()
+   part_clone:add_field("b", A.long)
+   assert(part_clone:size() == 2)
+end
+
+------------------------------------------------------------------------
+-- Duplicate names
+
+do
+   -- A name can be used again for an equal schema, which becomes a
+   -- link, but not for a different one.
+   local first = A.record "dup" { {a = A.int} }
+   local same = A.record "dup" { {a = A.int} }
+   local different = A.record "dup" { {b = A.int} }
+
+   local ok_schema = A.record "pair" { {x = first}, {y = same} }
+   assert(ok_schema:raw_schema())
+   local bad_schema = A.record "pair" { {x = first}, {y = different} }
+   local ok, err = pcall(bad_schema.raw_schema, bad_schema)
+   assert(not ok and err:find("Two mismatching schemas named dup", 1, true))
+   assert(not pcall(bad_schema.to_json, bad_schema))
+end
+
+------------------------------------------------------------------------
+-- Schema:raw_schema()
+
+do
+   local schema = A.record "tree" {
+      {label = A.string},
+      {kind = A.enum "kind" {"LEAF", "NODE"}},
+      {hash = A.fixed "hash" {size=4}},
+      {other_hash = A.fixed "hash" {size=4}},
+      {children = A.array { A.link "tree" }},
+      {parent = A.union { A.null, A.link "tree" }},
+   }
+
+   -- The raw schema is built directly from the Lua schema, and should
+   -- match what we'd get by parsing the schema's JSON.
+   local raw = schema:raw_schema()
+   assert(raw:type() == A.RECORD)
+   local value = schema:new_raw_value()
+   value:set_from_ast {
+      label = "root", kind = "NODE", hash = "abcd", other_hash = "efgh",
+      children = {
+         { label = "leaf", kind = "LEAF", hash = "ijkl",
+           other_hash = "mnop", children = {} },
+      },
+   }
+   value:get("parent"):set("null")
+   value:get("children"):get(1):get("parent"):set("null")
+   local buf = assert(value:encode())
+   value:release()
+
+   local from_json = A.Schema:new(schema:to_json())
+   local resolver = assert(A.ResolvedWriter(schema, from_json))
+   local actual = from_json:new_raw_value()
+   assert(resolver:decode(buf, actual) == #buf)
+   assert(actual:get("children"):get(1):get("label"):get() == "leaf")
+   actual:release()
+end
+
+------------------------------------------------------------------------
+-- Schema:canonical_form() and fingerprints
+
+do
+   local function hex(str)
+      return (str:gsub(".", function(c)
+         return string.format("%02x", c:byte())
+      end))
+   end
+
+   local json = [[
+      {"type": "record", "name": "test", "fields": [
+         {"name": "a", "type": {"type": "int"}},
+         {"name": "b", "type": {"type": "array", "items": "string"}},
+         {"name": "c", "type": ["null",
+            {"type": "enum", "name": "color", "symbols": ["RED", "GREEN"]}]},
+         {"name": "d", "type": {"type": "fixed", "size": 16, "name": "md5"}},
+         {"name": "e", "type": "color"}
+      ]}
+   ]]
+   local schema = A.Schema:new(json)
+   assert(schema:canonical_form() ==
+      [[{"name":"test","type":"record","fields":[]]..
+      [[{"name":"a","type":"int"},]]..
+      [[{"name":"b","type":{"type":"array","items":"string"}},]]..
+      [[{"name":"c","type":["null",{"name":"color","type":"enum",]]..
+      [["symbols":["RED","GREEN"]}]},]]..
+      [[{"name":"d","type":{"name":"md5","type":"fixed","size":16}},]]..
+      [[{"name":"e","type":"color"}]}]])
+   assert(hex(schema:fingerprint_md5()) == "f455d25d5aeef38f91aebe54e9d413f8")
+
+   -- Fingerprints from the Avro specification
+   assert(A.int:canonical_form() == [["int"]])
+   assert(hex(A.int:fingerprint64()) == "8f5c393f1ad57572")
+   assert(hex(A.int:fingerprint_md5()) == "ef524ea1b91e73173d938ade36c1db32")
+   assert(hex(A.int:fingerprint_sha256()) ==
+          "3f2b87a9fe7cc9b13835598c3981cd45e3e355309e5090aa0933d7becb6fba45")
+   assert(#schema:fingerprint64() == 8)
+   assert(schema:fingerprint64() == schema:fingerprint("crc64"))
+   assert(not pcall(schema.fingerprint, schema, "sha1"))
+
+   -- Schemas built with the helper constructors have the same form.
+   local built = A.record "test" {
+      {a = A.int},
+      {b = A.array { A.string }},
+      {c = A.union { A.null, A.enum "color" { "RED", "GREEN" } }},
+      {d = A.fixed "md5" { size = 16 }},
+      {e = A.link "color"},
+   }
+   assert(built:canonical_form() == schema:canonical_form())
+   assert(built:fingerprint64() == schema:fingerprint64())
+
+   -- Named schemas use their full names, which can come from their own
+   -- namespace or from the namespace of an enclosing schema.
+   local namespaced = A.Schema:new [[
+      {"type": "record", "name": "foo", "namespace": "x.y", "fields": [
+         {"name": "a", "type":
+            {"type": "enum", "name": "color", "symbols": ["RED"]}},
+         {"name": "b", "type": {"type": "fixed", "name": "z.md5", "size": 16}},
+         {"name": "c", "type": "color"},
+         {"name": "d", "type": "z.md5"}
+      ]}
+   ]]
+   assert(namespaced:canonical_form() ==
+      [[{"name":"x.y.foo","type":"record","fields":[]]..
+      [[{"name":"a","type":{"name":"x.y.color","type":"enum",]]..
+      [["symbols":["RED"]}},]]..
+      [[{"name":"b","type":{"name":"z.md5","type":"fixed","size":16}},]]..
+      [[{"name":"c","type":"x.y.color"},]]..
+      [[{"name":"d","type":"z.md5"}]}]])
+   assert(hex(namespaced:fingerprint64()) == "2354904fc813a04a")
+
+   -- Names stay unqualified; the namespace is kept separately, and
+   -- survives a round trip through JSON.
+   assert(namespaced:name() == "foo")
+   assert(namespaced:full_name() == "x.y.foo")
+   assert(namespaced:get("b"):name() == "md5")
+   assert(namespaced:get("b"):full_name() == "z.md5")
+   local reparsed = A.Schema:new(namespaced:to_json())
+   assert(reparsed == namespaced)
+   assert(reparsed:canonical_form() == namespaced:canonical_form())
+   assert(namespaced:clone():canonical_form() == namespaced:canonical_form())
+
+   -- The same record in a different namespace is a different schema.
+   local other = A.Schema:new [[
+      {"type": "record", "name": "foo", "namespace": "other",
+       "fields": [{"name": "a", "type": "int"}]}
+   ]]
+   local unqualified = A.Schema:new [[
+      {"type": "record", "name": "foo",
+       "fields": [{"name": "a", "type": "int"}]}
+   ]]
+   assert(other:canonical_form() ~= unqualified:canonical_form())
+   assert(other ~= unqualified)
+end